@@ -4,10 +4,13 @@
 #ifndef AZIOTSASTOKEN_H
 #define AZIOTSASTOKEN_H
 
-#include <Arduino.h>
 #include <az_iot_hub_client.h>
 #include <az_span.h>
+#include <mbedtls/md.h>
+#include <stdint.h>
 
+// Tokens are signed with a key that is base64-decoded only once. A second buffer lets the
+// next token be generated ahead of time while the current one is still in use.
 class AzIoTSasToken
 {
 public:
@@ -15,18 +18,31 @@ public:
       az_iot_hub_client* client,
       az_span deviceKey,
       az_span signatureBuffer,
-      az_span sasTokenBuffer);
+      az_span sasTokenBuffer,
+      az_span nextSasTokenBuffer);
   int Generate(unsigned int expiryTimeInMinutes);
+  int GenerateNext(unsigned int expiryTimeInMinutes); // Get() keeps returning the current token
+  bool HasNext();
+  bool UseNext(); // Makes the token from GenerateNext() current, false if there is none
   bool IsExpired();
+  uint32_t GetExpiration(); // Unix time
   az_span Get();
 
 private:
+  int prepareKey();
+  int generateInto(az_span buffer, unsigned int expiryTimeInMinutes, az_span* token, uint32_t* expiration);
+
   az_iot_hub_client* client;
   az_span deviceKey;
   az_span signatureBuffer;
   az_span sasTokenBuffer;
   az_span sasToken;
   uint32_t expirationUnixTime;
+  az_span nextSasTokenBuffer;
+  az_span nextSasToken;
+  uint32_t nextExpirationUnixTime;
+  mbedtls_md_context_t hmac;
+  bool keyReady;
 };
 
 #endif // AZIOTSASTOKEN_H
\ No newline at end of file
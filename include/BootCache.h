@@ -0,0 +1,25 @@
+#ifndef BOOTCACHE_H
+#define BOOTCACHE_H
+
+#include <Arduino.h>
+
+// What a warm boot needs to skip the slow parts of the last one: the access point (BSSID and
+// channel, so WiFi.begin() associates without a scan) and the DHCP lease it got there. Kept in
+// RTC memory, which survives software resets, watchdog resets and deep sleep, and in NVS for
+// power cycles. NVS is only written when the values change.
+
+struct WifiCache
+{
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+};
+
+bool bootCacheLoadWifi(WifiCache &cache); // false if nothing valid is stored
+void bootCacheSaveWifi(const WifiCache &cache);
+const char *bootResetReason(); // Why this boot happened, for the boot timing report
+
+#endif // BOOTCACHE_H
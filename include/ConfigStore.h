@@ -0,0 +1,14 @@
+#ifndef CONFIGSTORE_H
+#define CONFIGSTORE_H
+
+#include "DeviceConfig.h"
+
+// The settings last applied from the device twin or a "configure" command, kept in NVS so that
+// the device boots with them instead of the firmware defaults, also without a connection. A
+// store written by firmware with another DeviceConfig layout (or HAL_CHANNELS) is ignored.
+
+bool configStoreLoad(DeviceConfig &config); // false (config untouched) if nothing valid is stored
+void configStoreSave(const DeviceConfig &config);
+void configStoreClear(); // Back to the firmware defaults from the next boot on
+
+#endif // CONFIGSTORE_H
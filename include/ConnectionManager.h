@@ -0,0 +1,124 @@
+#ifndef CONNECTIONMANAGER_H
+#define CONNECTIONMANAGER_H
+
+#include <Arduino.h>
+#include <AzIoTSasToken.h>
+#include <PubSubClient.h>
+#include "BootCache.h"
+
+// millis() since boot at which each bring-up step first completed, 0 = not yet
+struct ConnectionBootTimings
+{
+  unsigned long wifiMs;
+  unsigned long timeMs;      // Wall clock valid
+  unsigned long connectedMs; // MQTT connected (WiFi and time with MQTT disabled)
+  bool wifiCached;           // Associated with the cached AP and channel, without a scan
+  bool timeRetained;         // The clock survived the reset, no SNTP wait
+};
+
+// Non-blocking WiFi -> SNTP -> SAS token -> MQTT bring-up.
+// Loop() advances the state machine by at most one step and returns; failed steps are
+// retried after an exponential backoff with full jitter, so a fleet that lost WiFi at the
+// same moment does not reconnect to IoT Hub in lockstep. The only call that can take
+// longer than a few milliseconds is the TLS + MQTT connect itself, bounded by the socket
+// timeout passed to Begin().
+//
+// IoT Hub closes the connection when the SAS token expires. Instead of waiting for that, the
+// connection is renewed at a random point 10-20 % of the token lifetime before expiry, with
+// a token generated ahead of time, so the only downtime is one MQTT connect. Transitions in
+// the meantime go to the journal as in any other outage.
+//
+// With MQTT disabled (HTTP-only telemetry) the bring-up stops after SNTP and "connected"
+// means WiFi is up and the clock is set; no IoT Hub connection is kept open.
+//
+// Warm boots are faster: the last AP's BSSID and channel (and, if enabled, the DHCP lease) come
+// from BootCache, and the clock kept by the RTC across the reset is used right away while SNTP
+// corrects it in the background.
+//
+// In the low-power modes the radio is on only while a transition is delivered: Suspend()
+// closes MQTT and switches WiFi off, Resume() starts the bring-up over without backoff.
+class ConnectionManager
+{
+public:
+  enum State
+  {
+    WIFI_CONNECT,
+    WIFI_WAIT,
+    TIME_WAIT,
+    MQTT_CONNECT,
+    CONNECTED,
+    BACKOFF,
+    SUSPENDED
+  };
+
+  ConnectionManager(PubSubClient& mqttClient, AzIoTSasToken& sasToken, unsigned int tokenDuration);
+  void Begin(
+      const char* ssid,
+      const char* pass,
+      const char* clientId,
+      const char* username,
+      const char* subscribeTopic,
+      uint16_t socketTimeoutSeconds);
+  void Loop();
+  void Suspend(); // Low-power modes: MQTT and WiFi off until Resume()
+  void Resume();
+  void SetMqttEnabled(bool enabled); // Before Begin()
+  void SetReuseIp(bool reuse);        // Before Begin(): static IP from the last lease, skips DHCP
+  void SetTokenDuration(unsigned int tokenDuration); // Minutes, from the next token on
+  void SetConnectedCallback(void (*callback)());     // After every MQTT connect, once subscribed
+
+  bool IsConnected() const;
+  State GetState() const;
+  uint32_t GetReconnectCount() const;      // Successful MQTT connects after the first one, renewals excluded
+  unsigned long GetLastOutageMs() const;   // Time from losing the connection to being back
+  uint32_t GetRenewalCount() const;        // Scheduled reconnects with a new SAS token
+  unsigned long GetLastRenewalMs() const;  // Downtime of the last one
+  unsigned long GetConnectedSince() const; // millis() of the last successful connect
+  const ConnectionBootTimings& GetBootTimings() const;
+
+private:
+  void enter(State state);
+  void retryAfterBackoff(State retryState);
+  void onConnected();
+  void onDisconnected();
+  void onWifiConnected();
+  bool connectMqtt();
+  bool ensureToken();
+  void scheduleRenewal();
+  void renew();
+
+  PubSubClient& mqttClient;
+  AzIoTSasToken& sasToken;
+  unsigned int tokenDuration;
+  const char* ssid;
+  const char* pass;
+  const char* clientId;
+  const char* username;
+  const char* subscribeTopic;
+  void (*connectedCallback)();
+  bool mqttEnabled;
+  bool reuseIp;
+  bool wifiCached; // wifiCache holds the last good AP
+  bool fastConnect; // The current attempt is a targeted one
+  WifiCache wifiCache;
+  ConnectionBootTimings bootTimings;
+
+  State state;
+  State retryState;
+  unsigned long stateSince;
+  unsigned long backoffUntil;
+  uint8_t attempt;
+  bool sntpStarted;
+  bool everConnected;
+  unsigned long disconnectedSince;
+  unsigned long connectedSince;
+  unsigned long lastOutageMs;
+  uint32_t reconnectCount;
+  uint32_t renewAt; // Unix time at which the connection is renewed with a new token
+  bool nextTokenTried;
+  bool renewing;
+  uint32_t renewalCount;
+  unsigned long lastRenewalMs;
+};
+
+#endif // CONNECTIONMANAGER_H
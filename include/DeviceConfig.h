@@ -0,0 +1,85 @@
+#ifndef DEVICECONFIG_H
+#define DEVICECONFIG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "Hal.h"
+#include "Occupancy.h"
+#include "Telemetry.h"
+#include "TelemetryTransport.h"
+#include "TelemetryUplink.h"
+
+#ifndef DEVICE_CONFIG_REPORT_SIZE
+#define DEVICE_CONFIG_REPORT_SIZE 1536 // Reported properties, must fit the MQTT buffer with the topic
+#endif
+
+#define DEVICE_CONFIG_ERROR_SIZE 64
+
+// Settings that can change without reflashing: from the IoT Hub device twin (desired properties)
+// or a "configure" cloud-to-device command, both as the same JSON object:
+//
+//   {"occupancy":{"estimator":"adaptive","minHoldMs":10000,...},   every channel
+//    "channels":{"2":{"maxHoldMs":600000}},                       one channel
+//    "heartbeatMs":0,"sensingPeriodMs":10,"batch":{"maxEvents":16,"maxBytes":1536,"maxDelayMs":10000},
+//    "encoding":"json","deviceIndex":0,"transport":"dual","tokenDurationMin":60,"logLevel":3}
+//
+// Every member is optional and null puts a setting back to the firmware default (main.cpp).
+// A document is taken as a whole or not at all: one unknown value or a value out of range
+// refuses it and leaves the settings as they were. Members this firmware does not know are
+// skipped (the twin may carry settings of newer firmware). The twin's "$version" is kept to
+// tell a new desired state from one already applied.
+//
+// The JSON is read in place, never copied or allocated; strings are compared as they are on
+// the wire, so setting names and values must not contain escapes.
+struct DeviceConfig
+{
+  OccupancyConfig occupancy[HAL_CHANNELS];
+  uint32_t heartbeatMs;     // heartbeatInterval, 0 = off
+  uint16_t sensingPeriodMs; // checkPIRSensor() period of the sensing task
+  TelemetryBatchConfig batch;
+  TelemetryEncoding encoding;
+  uint16_t deviceIndex;
+  TelemetryTransportMode transport;
+  uint16_t tokenDurationMin; // SAS token lifetime, used from the next token on
+  uint8_t logLevel;          // LOG_LEVEL_*, up to the compiled-in LOG_LEVEL
+  uint32_t desiredVersion;   // Twin desired properties this came from, 0 = none
+};
+
+// Updates config from a settings document on top of what it holds. false (config untouched)
+// with the reason in error if the document is refused.
+bool deviceConfigUpdate(
+    const char *json,
+    size_t length,
+    const DeviceConfig &defaults,
+    DeviceConfig &config,
+    char *error,
+    size_t errorSize);
+
+// Zero-copy lookup of a top-level member of a JSON object, e.g. "desired" in a twin document.
+// value points into json; false if there is no such member or the JSON is malformed.
+bool deviceConfigFindMember(const char *json, size_t length, const char *name, const char *&value, size_t &valueLength);
+
+// Hands the settings to the modules that use them: occupancy and heartbeat (taken over by the
+// sensing task at its next step, occupancyConfigure()), batching (a pending batch goes to the
+// journal first), encoding, transport mode and log level. Call from the network side. Sensing
+// period and token lifetime belong to main.cpp.
+void deviceConfigApply(const DeviceConfig &config);
+
+// Reported properties: {"config":{...all settings...},"configAck":{"version":N,"status":200,"description":"..."}}
+size_t deviceConfigReport(const DeviceConfig &config, int status, const char *description, char *buffer, size_t size);
+
+// Commands sent as cloud-to-device messages: {"command":"<name>"[,"args":<any JSON value>]}.
+// The handler gets args as it is in the message (NULL, 0 without args) and returns whether it
+// succeeded.
+typedef bool (*DeviceCommandHandler)(const char *args, size_t length);
+
+struct DeviceCommand
+{
+  const char *name;
+  DeviceCommandHandler handler;
+};
+
+// false if the message is malformed, names no known command or the handler failed
+bool deviceCommandDispatch(const DeviceCommand *commands, size_t count, const char *payload, size_t length);
+
+#endif // DEVICECONFIG_H
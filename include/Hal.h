@@ -0,0 +1,80 @@
+#ifndef HAL_H
+#define HAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef ARDUINO
+#include <esp_attr.h>
+#define HAL_ISR_ATTR IRAM_ATTR       // Interrupt handlers and everything they call must sit in IRAM
+#define HAL_RETAINED_ATTR RTC_DATA_ATTR // RTC slow memory: kept across deep sleep, zeroed at power-on
+#else
+#define HAL_ISR_ATTR
+#define HAL_RETAINED_ATTR
+#endif
+
+#ifndef HIGH
+#define HIGH 0x1
+#endif
+#ifndef LOW
+#define LOW 0x0
+#endif
+
+/* Pin definitions */
+
+#define PIR_PIN 14   // GPIO za PIR senzor
+#define RED_PIN 18   // GPIO za crvenu LED
+#define GREEN_PIN 19 // GPIO za zelenu LED
+
+// One board can watch several small rooms, or zones of a large hall: each channel is a PIR
+// sensor with its own LEDs, occupancy state and tuning, reported under its channel number.
+// The pins above are channel 0's.
+#ifndef HAL_CHANNELS
+#define HAL_CHANNELS 1
+#endif
+
+static_assert(HAL_CHANNELS >= 1 && HAL_CHANNELS <= 63, "A telemetry event has room for channels 0-62");
+
+struct HalChannelPins
+{
+  uint8_t pir;
+  uint8_t red;
+  uint8_t green;
+};
+
+// One entry per channel; defined in main.cpp, the native HAL has no pins
+extern const HalChannelPins halChannelPins[];
+
+// Thin hardware abstraction used by the occupancy logic.
+// On the ESP32 these map straight onto the Arduino core (HalArduino.cpp),
+// on the host ([env:native]) they are backed by a virtual clock and a recorded PIR trace.
+
+// Anything before 1.1.2023. means the wall clock has not been set yet (by default it's 1.1.1970.)
+#define HAL_MIN_VALID_TIME 1672531200
+
+typedef void (*HalEdgeHandler)(uint8_t channel, int level, uint64_t time);
+
+enum HalWakeCause
+{
+  HAL_WAKE_NONE,  // Not woken from sleep: power-on or any other reset
+  HAL_WAKE_PIR,   // A PIR reached the requested level
+  HAL_WAKE_TIMER  // The sleep timeout ran out
+};
+
+void halSetupPins();                                     // First HAL call after a boot
+unsigned long halMillis();                               // Monotonic milliseconds since boot
+uint64_t halMicros();                                    // Monotonic µs since power-on (deep sleep included), never wraps
+time_t halTime();                                        // Wall clock (UTC, seconds)
+int halReadPir(uint8_t channel);                         // HIGH or LOW
+void halAttachPirInterrupt(HalEdgeHandler handler);      // Called from the ISR on every edge of any channel's PIR
+void halSetOccupancyLed(uint8_t channel, bool occupied); // Red = zauzeto, green = slobodno
+
+// Sleeps until some channel's PIR reads its wakeLevels[channel] or timeoutUs has passed
+// (0 = no timeout), and reports the PIR levels after waking through the edge handler. Light
+// sleep keeps RAM and returns; deep sleep restarts the firmware and only HAL_RETAINED_ATTR
+// variables survive it.
+HalWakeCause halSleep(bool deep, const int *wakeLevels, uint64_t timeoutUs);
+HalWakeCause halWakeCause(); // Why the last sleep ended, also across a deep-sleep restart
+
+#endif // HAL_H
@@ -0,0 +1,77 @@
+#ifndef HEALTHMETRICS_H
+#define HEALTHMETRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef HEALTH_REPORT_SIZE
+#define HEALTH_REPORT_SIZE 1536 // Reported properties, must fit the MQTT buffer with the topic
+#endif
+
+#define HEALTH_BUCKETS 24 // <16 µs, then one per power of two up to 2^27 µs (134 s) and above
+
+// Where the firmware spends its time, so that slow devices stand out in the fleet. The hot
+// paths record their duration into a fixed log2 histogram: one count-leading-zeros and three
+// adds, no locks, no allocation. Each timer has a single writer (the task that runs that path);
+// readers may see a sample half-recorded, which only matters for that one sample.
+enum HealthTimer
+{
+  HEALTH_SENSING_STEP,   // One checkPIRSensor() call
+  HEALTH_NETWORK_PASS,   // One pass of the network side, including its wait for a transition
+  HEALTH_EDGE_TO_SEND,   // PIR edge to the transition handed to the transport; journaled ones not counted
+  HEALTH_MQTT_SEND,      // MQTT backend Send()
+  HEALTH_HTTP_SEND,      // Azure Function backend Send(), queueing the request
+  HEALTH_HTTP_RESPONSE,  // Azure Function request to its response
+  HEALTH_MQTT_CONNECT,   // TLS + MQTT connect attempt, failed ones included
+  HEALTH_HTTP_CONNECT,   // TLS handshake with the Azure Function
+  HEALTH_TIMER_COUNT
+};
+
+struct HealthHistogram
+{
+  uint32_t counts[HEALTH_BUCKETS];
+  uint64_t totalUs;
+  uint32_t maxUs; // Since boot
+};
+
+struct HealthTimers
+{
+  HealthHistogram timers[HEALTH_TIMER_COUNT];
+};
+
+// Gauges and counters the caller reads from the platform and the other modules; 0 where unknown
+struct HealthGauges
+{
+  uint32_t uptimeS;
+  uint32_t freeHeap;
+  uint32_t minFreeHeap;      // Lowest since boot
+  uint32_t largestFreeBlock; // Far below freeHeap = fragmented
+  uint32_t sensingStackFree; // Stack high-water marks, bytes never used
+  uint32_t networkStackFree;
+  uint32_t loggerStackFree;
+  uint32_t queueHighWater;
+  uint32_t queueDropped;
+  uint32_t journalDepth;
+  uint32_t reconnects;
+  uint32_t logDropped;
+};
+
+void healthRecord(HealthTimer timer, uint32_t us);
+const HealthHistogram &healthHistogram(HealthTimer timer); // Since boot
+const char *healthTimerName(HealthTimer timer);
+
+// The same histogram for samples of the caller's own (the host fleet simulator, one per thread)
+void healthHistogramAdd(HealthHistogram &histogram, uint32_t us);
+
+// Percentile (0-100) of a histogram, as the upper bound of its bucket (within a factor of 2)
+uint32_t healthPercentile(const HealthHistogram &histogram, uint8_t percent);
+
+// Reported properties {"health":{...}}: the gauges, and per timer count, mean, p50, p99 and max.
+// With since, the timers cover the time from that snapshot on, and since becomes the snapshot
+// this report was made from; NULL reports everything since boot. 0 if it does not fit.
+size_t healthReport(const HealthGauges &gauges, HealthTimers *since, char *buffer, size_t size);
+
+// The same, since boot, as a few log lines (the serial "health" query)
+void healthLog(const HealthGauges &gauges);
+
+#endif // HEALTHMETRICS_H
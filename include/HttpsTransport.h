@@ -0,0 +1,114 @@
+#ifndef HTTPSTRANSPORT_H
+#define HTTPSTRANSPORT_H
+
+#include <Arduino.h>
+#include <WiFiClientSecure.h>
+
+#ifndef HTTPS_TRANSPORT_QUEUE_SIZE
+#define HTTPS_TRANSPORT_QUEUE_SIZE 2 // Requests waiting, in flight or with an uncollected outcome
+#endif
+#ifndef HTTPS_TRANSPORT_BODY_SIZE
+#define HTTPS_TRANSPORT_BODY_SIZE 1536 // Largest request body, TELEMETRY_BATCH_MAX_SIZE
+#endif
+#define HTTPS_TRANSPORT_SNIPPET_SIZE 96 // Start of the response body kept for the log
+#define HTTPS_TRANSPORT_MESSAGE_ID_SIZE 32
+
+struct HttpsTransportStats
+{
+  uint32_t requests;       // Answered with a 2xx status
+  uint32_t failures;       // Other status, connection or timeout errors
+  uint32_t dropped;        // Post() calls refused because the queue was full
+  uint32_t connects;       // TLS handshakes; with keep-alive far fewer than requests
+  unsigned long lastMs;    // Time from the start of sending to the end of the response
+  unsigned long maxMs;
+  unsigned long connectMs; // Duration of the last TLS handshake
+};
+
+// HTTPS POST client for one URL that keeps its TLS connection open between requests
+// (HTTP/1.1 keep-alive), so only the first request, or the first after the server closed an
+// idle connection, pays for a handshake. Post() only queues the request; Loop() writes it
+// and reads the response as it arrives, keeping no more of the body than a short snippet.
+// The only blocking step is the TLS handshake, bounded by the timeout given to Begin().
+//
+// A request that fails (timeout, non-2xx status, connection lost) is not retried here: every
+// accepted Post() gets one outcome, in the order they were posted, that the caller collects
+// with TakeOutcome() and acts on (the telemetry uplink journals what did not arrive). Outcomes
+// take queue slots until they are collected.
+class HttpsTransport
+{
+public:
+  HttpsTransport();
+  bool Begin(const char* url, const char* caCert, uint16_t timeoutSeconds); // NULL caCert: no verification
+  bool Post(const char* contentType, const char* body, size_t length);    // false if the queue is full
+  bool Post(const char* contentType, const char* body, size_t length, const char* messageId); // Adds X-Message-Id
+  bool TakeOutcome(bool& delivered); // Oldest uncollected outcome, delivered = 2xx; false if none
+  void Loop();
+  void Close();
+
+  bool IsIdle() const;
+  bool IsReachable() const; // false while waiting to retry after a failed connect
+  int GetLastStatus() const;
+  const HttpsTransportStats& GetStats() const;
+
+private:
+  enum State
+  {
+    IDLE,
+    STATUS_LINE,
+    HEADERS,
+    BODY,
+    CHUNK_SIZE,
+    CHUNK_DATA,
+    CHUNK_END,
+    TRAILERS
+  };
+
+  struct Request
+  {
+    const char* contentType;
+    char messageId[HTTPS_TRANSPORT_MESSAGE_ID_SIZE]; // Empty: no X-Message-Id header
+    size_t length;
+    char body[HTTPS_TRANSPORT_BODY_SIZE];
+  };
+
+  bool startRequest();
+  bool connect();
+  bool sendRequest(const Request& request);
+  void consume(uint8_t c);
+  void processLine();
+  void endHeaders();
+  void finish(bool success);
+
+  WiFiClientSecure client;
+  char host[64];
+  char path[192];
+  uint16_t port;
+  uint16_t timeoutSeconds;
+  unsigned long connectFailedAt;
+  bool connectFailed;
+
+  Request queue[HTTPS_TRANSPORT_QUEUE_SIZE];
+  uint8_t queueHead;
+  uint8_t queueCount;
+  bool outcomes[HTTPS_TRANSPORT_QUEUE_SIZE]; // Of finished requests, oldest at outcomeHead
+  uint8_t outcomeHead;
+  uint8_t outcomeCount;
+
+  State state;
+  unsigned long requestStart;
+  char line[128];
+  size_t lineLength;
+  int status;
+  bool keepAlive;
+  bool chunked;
+  long remaining; // Body or chunk bytes still to read, -1 = until the connection closes
+  long bodyRead;
+  bool received;  // Any response byte yet
+  bool reused;    // Request went out on a kept-alive connection
+  bool retried;   // Already resent once after a stale keep-alive connection
+  char snippet[HTTPS_TRANSPORT_SNIPPET_SIZE];
+  size_t snippetLength;
+  HttpsTransportStats stats;
+};
+
+#endif // HTTPSTRANSPORT_H
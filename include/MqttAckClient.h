@@ -0,0 +1,37 @@
+#ifndef MQTTACKCLIENT_H
+#define MQTTACKCLIENT_H
+
+#include <Arduino.h>
+#include <Client.h>
+#include "MqttPublisher.h"
+
+// Sits between PubSubClient and the TLS client. PubSubClient keeps doing the connect,
+// keep-alive, subscriptions and C2D messages; every byte it reads also goes through the
+// publisher, which picks out the PUBACKs that PubSubClient itself ignores. The publisher's
+// QoS 1 packets are written through here to the same connection.
+class MqttAckClient : public Client, public MqttPacketWriter
+{
+public:
+  MqttAckClient(Client& client, MqttPublisher& publisher);
+
+  int connect(IPAddress ip, uint16_t port);
+  int connect(const char* host, uint16_t port);
+  size_t write(uint8_t byte);
+  size_t write(const uint8_t* buffer, size_t size);
+  int available();
+  int read();
+  int read(uint8_t* buffer, size_t size);
+  int peek();
+  void flush();
+  void stop();
+  uint8_t connected();
+  operator bool();
+
+  bool WritePacket(const uint8_t* packet, size_t length);
+
+private:
+  Client& client;
+  MqttPublisher& publisher;
+};
+
+#endif // MQTTACKCLIENT_H
@@ -0,0 +1,62 @@
+#ifndef MQTTCODEC_H
+#define MQTTCODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The few MQTT 3.1.1 packets that PubSubClient does not give us: QoS 1 PUBLISH, and
+// recognizing PUBACKs in the bytes the broker sends. Plain functions on buffers, so they
+// build for the host too.
+
+#define MQTT_PACKET_CONNECT 0x10
+#define MQTT_PACKET_CONNACK 0x20
+#define MQTT_PACKET_PUBLISH 0x30
+#define MQTT_PACKET_PUBACK 0x40
+#define MQTT_PUBLISH_DUP 0x08
+#define MQTT_PUBLISH_QOS1 0x02
+
+// CONNECT with a clean session; username and password may be NULL
+size_t mqttEncodeConnect(
+    uint8_t *buffer,
+    size_t size,
+    const char *clientId,
+    const char *username,
+    const char *password,
+    uint16_t keepAliveSeconds);
+
+// Complete QoS 1 PUBLISH packet, 0 if it does not fit. Set MQTT_PUBLISH_DUP in buffer[0]
+// to send it again.
+size_t mqttEncodePublish(
+    uint8_t *buffer,
+    size_t size,
+    const char *topic,
+    const uint8_t *payload,
+    size_t length,
+    uint16_t packetId);
+
+// Follows the packet boundaries in the byte stream from the broker without keeping the
+// packets, and picks out the PUBACKs. Reset() on every new connection.
+class MqttPacketScanner
+{
+public:
+  MqttPacketScanner();
+  void Reset();
+  uint16_t Feed(uint8_t byte); // Packet ID when this byte completes a PUBACK, otherwise 0
+
+private:
+  enum State
+  {
+    FIXED_HEADER,
+    REMAINING_LENGTH,
+    BODY
+  };
+
+  State state;
+  uint8_t type;
+  uint32_t remaining;
+  uint8_t lengthShift;
+  uint32_t position;
+  uint16_t packetId;
+};
+
+#endif // MQTTCODEC_H
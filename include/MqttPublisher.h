@@ -0,0 +1,84 @@
+#ifndef MQTTPUBLISHER_H
+#define MQTTPUBLISHER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "MqttCodec.h"
+#include "Telemetry.h"
+
+#ifndef MQTT_PUBLISH_WINDOW_MAX
+#define MQTT_PUBLISH_WINDOW_MAX 4 // Upper limit for the in-flight window, each slot holds one packet (~1.8 KB)
+#endif
+#define MQTT_PUBLISH_TOPIC_SIZE 200
+#define MQTT_PUBLISH_PACKET_SIZE (5 + 2 + MQTT_PUBLISH_TOPIC_SIZE + 2 + TELEMETRY_BATCH_MAX_SIZE)
+
+// Where encoded packets go: the broker connection, shared with whatever else talks on it
+class MqttPacketWriter
+{
+public:
+  virtual ~MqttPacketWriter() {}
+  virtual bool WritePacket(const uint8_t *packet, size_t length) = 0;
+};
+
+struct MqttPublisherStats
+{
+  uint32_t published;      // Accepted by Publish()
+  uint32_t acked;          // PUBACKs matched to an in-flight message
+  uint32_t retransmits;    // Sent again with DUP, after the timeout or a reconnect
+  uint32_t windowFull;     // Publish() calls refused because the window was full
+  uint32_t unknownAcks;    // PUBACKs for nothing in flight (late duplicates)
+  uint32_t inFlight;       // Waiting for their PUBACK right now
+  uint32_t maxInFlight;
+  unsigned long ackLastMs; // From the first send to the PUBACK
+  unsigned long ackMaxMs;
+  unsigned long ackTotalMs; // Divide by acked for the mean
+};
+
+// QoS 1 publishing with a window of unacknowledged messages. Publish() sends right away as
+// long as fewer than `window` messages are waiting for their PUBACK, so a burst (a journal
+// replay) goes out back to back instead of one round trip per message. Every message stays
+// in its slot until the broker acknowledges it; it is sent again, with the DUP flag, after
+// retryTimeoutMs and after every reconnect. Delivery is at least once: the backend may see a
+// message twice, and a retransmitted message can arrive after younger ones.
+//
+// Not thread safe; Publish(), Feed() and Loop() all belong to the network task. Times are
+// passed in, so the host build can run it on a real or a virtual clock.
+class MqttPublisher
+{
+public:
+  MqttPublisher();
+  void Begin(MqttPacketWriter &writer, uint8_t window, unsigned long retryTimeoutMs);
+  bool Publish(const char *topic, const uint8_t *payload, size_t length, unsigned long now); // false: window full or too big
+  void Feed(const uint8_t *data, size_t length, unsigned long now); // Bytes received from the broker
+  void Loop(bool connected, unsigned long now);                     // Retransmits
+  void Reset();                                                     // New connection, scan from its first byte
+
+  bool CanPublish() const;
+  MqttPublisherStats GetStats() const;
+
+private:
+  struct Slot
+  {
+    bool used;
+    uint16_t packetId;
+    unsigned long firstSent;
+    unsigned long lastSent;
+    size_t length;
+    uint8_t packet[MQTT_PUBLISH_PACKET_SIZE];
+  };
+
+  void acknowledge(uint16_t packetId, unsigned long now);
+  void send(Slot &slot, unsigned long now, bool again);
+  uint16_t nextPacketId();
+
+  MqttPacketWriter *writer;
+  MqttPacketScanner scanner;
+  Slot slots[MQTT_PUBLISH_WINDOW_MAX];
+  uint8_t window;
+  unsigned long retryTimeoutMs;
+  uint16_t packetId;
+  bool wasConnected;
+  MqttPublisherStats stats;
+};
+
+#endif // MQTTPUBLISHER_H
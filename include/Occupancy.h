@@ -0,0 +1,69 @@
+#ifndef OCCUPANCY_H
+#define OCCUPANCY_H
+
+#include "Hal.h"
+#include <stdint.h>
+
+#ifndef OCCUPANCY_WINDOW_BUCKETS
+#define OCCUPANCY_WINDOW_BUCKETS 10 // Resolution of the motion density window
+#endif
+
+// How long "no motion" has to last before the room is free. The fixed timeout (the original
+// behaviour) frees the room noMotionDelay after the motion that made it occupied, so students
+// sitting still flap it between occupied and free. The adaptive estimator counts debounced
+// motions in a sliding window. Once the room is busy, it holds the room for as long as an
+// occupied room showing motion at that rate would stay still only with probability
+// missPercent. Rooms that are not busy (a passer-by) keep the short minimum hold. Becoming
+// occupied is immediate in both, on the first rising edge.
+enum OccupancyEstimator
+{
+  OCCUPANCY_FIXED_TIMEOUT,
+  OCCUPANCY_ADAPTIVE
+};
+
+struct OccupancyConfig
+{
+  OccupancyEstimator estimator;
+  uint32_t minHoldMs;  // Vrijeme neaktivnosti prije povratka u "slobodno" stanje (the fixed timeout)
+  uint32_t maxHoldMs;  // Longest adaptive hold
+  uint32_t windowMs;   // Motion density window
+  uint16_t busyEnter;  // Motions in the window that make the room busy...
+  uint16_t busyLeave;  // ...and the count at or below which it no longer is (hysteresis)
+  uint8_t missPercent; // Accepted chance of freeing a room whose occupants are just sitting still
+  uint32_t debounceMs; // Minimalni razmak između detekcija: closer rising edges are one motion
+};
+
+#define OCCUPANCY_CONFIG_DEFAULT {OCCUPANCY_ADAPTIVE, 10000, 300000, 300000, 4, 1, 1, 1000}
+
+// Tuning of the PIR state machine, one per channel (a small room and a zone of a hall need
+// different holds). Defined in main.cpp (or by the native harness). Not const so that the host
+// replay harness can sweep it without rebuilding. Once the sensing task runs, only it may
+// write these; other tasks change them with occupancyConfigure().
+extern OccupancyConfig occupancyConfig[];
+extern unsigned long heartbeatInterval; // ms between status reports while nothing changes, 0 = off
+
+// New settings from another task (the device twin, on the network side): configs holds one
+// per channel. The sensing task takes them over, all channels and the heartbeat at once, at
+// the start of its next setupPIRSensor() or checkPIRSensor() call, never in the middle of
+// one; a later call before that replaces them. The hold follows at the next motion.
+void occupancyConfigure(const OccupancyConfig *configs, unsigned long heartbeatMs);
+
+void setupPIRSensor();
+
+// Consumes the PIR edges queued by the interrupt since the last call and runs the
+// no-motion timers of all channels. Decisions use the edge timestamps, so the result does
+// not depend on how often this is called - only how soon a transition is reported does.
+// Transitions go into the telemetry queue (TelemetryQueue.h) in time order across channels;
+// this never touches the network.
+void checkPIRSensor();
+
+// What a sleeping device has to wake up for; nothing else can change the occupancy state
+struct OccupancyWake
+{
+  int levels[HAL_CHANNELS]; // PIR level that matters next per channel, the opposite of the last one seen
+  uint64_t deadline;        // halMicros() of the first no-motion timeout or heartbeat, 0 = none
+};
+
+OccupancyWake occupancyNextWake();
+
+#endif // OCCUPANCY_H
@@ -0,0 +1,58 @@
+#ifndef OCCUPANCYSUMMARY_H
+#define OCCUPANCYSUMMARY_H
+
+#include <stdint.h>
+#include "Telemetry.h"
+
+#ifndef OCCUPANCY_SUMMARY_PENDING
+#define OCCUPANCY_SUMMARY_PENDING 16 // Closed periods of all channels waiting to be sent
+#endif
+
+#ifndef OCCUPANCY_SUMMARY_GRACE_S
+#define OCCUPANCY_SUMMARY_GRACE_S 10 // A period is closed this long after its end, for transitions still on their way
+#endif
+
+// Hourly and daily occupancy aggregates kept on the device, so that the dashboard can read
+// sessions, occupied time and the hourly histogram from one message per period instead of
+// rebuilding them from every transition.
+//
+// The uplink feeds in every transition it takes off the queue, heartbeats excepted, once its
+// timestamp is on the wall clock. Each costs O(1): the occupied time since the last one is
+// added to the open hour and day of its channel, a session is counted in the period it starts
+// in, and its length goes to the period it ends in. occupancySummaryService() closes the
+// periods that have ended even when nothing happens; an hour without any occupancy is not
+// sent, a day always is. Periods follow the local time of the JSON timestamps
+// (TELEMETRY_LOCAL_OFFSET).
+//
+// Everything, the summaries not sent yet included, is saved to a small file when a period
+// opens or closes and when a summary is queued or delivered, not on every transition (the
+// temporary file is renamed over the old one, so a reset while writing leaves the previous
+// state). In between, the open periods and sessions live in RTC memory, so a deep-sleep
+// wake-up carries on with them. After a power-on or reset the open periods go on from the
+// last save, and a session that was still open ends at that time.
+//
+// A summary stays pending until it has been delivered, over HTTP until the Function has
+// answered it with 2xx; one that failed is sent again after a pause.
+struct OccupancySummaryConfig
+{
+  bool hourly; // Send a summary for every hour with occupancy
+  bool daily;  // Send a summary for every day; both false = aggregation off
+};
+
+struct OccupancySummaryStats
+{
+  uint32_t hourly;       // Hour summaries sent
+  uint32_t daily;        // Day summaries sent
+  uint32_t sendFailures; // Not taken or not delivered, sent again 30 s later
+  uint32_t dropped;      // Oldest pending summaries overwritten while the backend was unreachable
+  uint32_t pending;      // Waiting to be sent right now
+  uint32_t saveFailures; // State file writes that failed
+};
+
+bool occupancySummaryBegin(const char *path, const OccupancySummaryConfig &config);
+void occupancySummaryRecord(const TelemetryEvent &event); // A transition off the queue
+void occupancySummaryService(bool connected);             // Closes ended periods, sends pending summaries
+void occupancySummaryOutcome(uint32_t ticket, bool delivered); // Of a summary sent over HTTP (TelemetryUplink.cpp)
+OccupancySummaryStats occupancySummaryStats();
+
+#endif // OCCUPANCYSUMMARY_H
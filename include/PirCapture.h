@@ -0,0 +1,25 @@
+#ifndef PIRCAPTURE_H
+#define PIRCAPTURE_H
+
+#include <stdint.h>
+
+#ifndef PIR_EDGE_QUEUE_SIZE
+#define PIR_EDGE_QUEUE_SIZE 64 // Must be a power of two
+#endif
+
+// One PIR level change, timestamped by the edge interrupt
+struct PirEdge
+{
+  uint64_t time;   // µs, halMicros() clock
+  int level;       // HIGH or LOW
+  uint8_t channel; // Whose PIR, see HAL_CHANNELS
+};
+
+// Attaches the edge interrupts of all channels' PIRs. Edges are queued, all channels in one
+// queue, until pirCapturePop() reads them, so the occupancy logic sees exact edge times
+// however long the caller was blocked.
+void pirCaptureBegin();
+bool pirCapturePop(PirEdge &edge);
+uint32_t pirCaptureTakeDropped(); // Edges lost to a full queue since the last call
+
+#endif // PIRCAPTURE_H
@@ -0,0 +1,67 @@
+#ifndef POWERMANAGER_H
+#define POWERMANAGER_H
+
+#include <stdint.h>
+
+#ifndef POWER_MIN_SLEEP_US
+#define POWER_MIN_SLEEP_US 50000 // Deadlines closer than this are waited for awake
+#endif
+
+// Low-power operation for battery-powered rooms. Between transitions the ESP32 sleeps with
+// the radio off and wakes only for what can change the occupancy state: any channel's PIR going to
+// the other level, the no-motion timeout or a heartbeat (occupancyNextWake()). The radio is
+// switched on for as long as it takes to deliver a transition.
+//
+// Awake, radio and sleep time are measured with halMicros() and turned into an energy
+// estimate with the board's currents from a PowerProfile. The figures are kept in RTC
+// memory, so they add up across deep sleeps.
+enum PowerMode
+{
+  POWER_MODE_ACTIVE, // Never sleeps, radio always on (default)
+  POWER_MODE_LIGHT,  // Light sleep: RAM kept, wakes in about a millisecond
+  POWER_MODE_DEEP    // Deep sleep: every wake-up is a boot, lowest current
+};
+
+// Average supply currents, only used for the estimate
+struct PowerProfile
+{
+  float activeMa;     // CPU running, radio off
+  float radioMa;      // WiFi associating, TLS and sending
+  float lightSleepMa; // PIR sensor included
+  float deepSleepMa;  // PIR sensor included
+  float volts;
+  uint32_t bootUs;    // Boot after a deep-sleep wake-up, awake but before halMicros() is restored
+};
+
+// ESP32-WROVER at 80 MHz with an HC-SR501 (~65 µA), from the datasheets; measure your own board
+#define POWER_PROFILE_ESP32 {25.0f, 120.0f, 0.9f, 0.08f, 3.3f, 250000}
+
+struct PowerStats
+{
+  uint64_t awakeUs; // Radio time included
+  uint64_t radioUs;
+  uint64_t sleepUs;
+  uint32_t sleeps;
+  uint32_t pirWakeups;
+  uint32_t timerWakeups;
+  uint32_t transmissions; // Times the radio was switched on
+  uint32_t transitions;   // Events delivered (or journaled) during those
+  double energyMj;        // Estimate from the profile
+};
+
+// After setupPIRSensor(); a deep-sleep wake-up is accounted for here
+void powerBegin(PowerMode mode, const PowerProfile &profile);
+PowerMode powerGetMode();
+const char *powerModeName(PowerMode mode);
+bool powerParseMode(const char *name, PowerMode &mode);
+
+// Sleeps until the occupancy state can change. false: the next deadline is too close to be
+// worth it (or the mode is active) and the caller stays awake. In deep sleep it only
+// "returns" through the next boot.
+bool powerSleep();
+
+void powerRadioOn();
+void powerRadioOff(uint32_t transitions);
+PowerStats powerStats(); // Time up to now included
+
+#endif // POWERMANAGER_H
@@ -0,0 +1,13 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef SASTOKEN_H
+#define SASTOKEN_H
+
+#include <stdint.h>
+
+// Unix time in the `se` field of a SAS token, 0 if it has none or it does not parse. Plain C
+// string handling without the Azure SDK, so it also builds (and is benchmarked) on the host.
+uint32_t getSasTokenExpiration(const char* sasToken);
+
+#endif // SASTOKEN_H
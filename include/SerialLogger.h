@@ -4,20 +4,85 @@
 #ifndef SERIALLOGGER_H
 #define SERIALLOGGER_H
 
+#ifdef ARDUINO
 #include <Arduino.h>
+#endif
+
+#include <stdint.h>
 
 #ifndef SERIAL_LOGGER_BAUD_RATE
 #define SERIAL_LOGGER_BAUD_RATE 115200
 #endif
 
+// Messages wait in a ring of this many slots until the drain task writes them out.
+// Must be a power of two. Longer messages are cut at SERIAL_LOGGER_MESSAGE_SIZE - 1.
+#ifndef SERIAL_LOGGER_QUEUE_SIZE
+#define SERIAL_LOGGER_QUEUE_SIZE 32
+#endif
+#ifndef SERIAL_LOGGER_MESSAGE_SIZE
+#define SERIAL_LOGGER_MESSAGE_SIZE 192
+#endif
+
+// Same numbering as CORE_DEBUG_LEVEL
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#ifdef CORE_DEBUG_LEVEL
+#define LOG_LEVEL CORE_DEBUG_LEVEL
+#else
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+#endif
+
+// printf-style logging. Levels above LOG_LEVEL compile to nothing, arguments included.
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) Logger.Log(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) ((void)0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) Logger.Log(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) ((void)0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) Logger.Log(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) ((void)0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) Logger.Log(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) ((void)0)
+#endif
+
+// Log() formats the message into a lock-free ring and returns; it never waits for the
+// serial port. If the ring is full the message is dropped and counted. On the ESP32 a
+// low-priority task started by Begin() writes the ring out; on the host there is no such
+// task and the program calls Flush() (output goes to stderr).
 class SerialLogger
 {
 public:
   SerialLogger();
+  void Begin(); // Starts the drain task, messages logged before wait in the ring
+  void Log(uint8_t level, const char* format, ...) __attribute__((format(printf, 3, 4)));
+  void Flush(); // Writes out everything queued, from the calling task
+  uint32_t GetDropped();
+  void SetLevel(uint8_t level); // Runtime threshold, levels above LOG_LEVEL stay compiled out
+  uint8_t GetLevel();
+
+#ifdef ARDUINO
   void Info(String message);
   void Error(String message);
+#endif
+  void Info(const char* message);
+  void Error(const char* message);
 };
 
 extern SerialLogger Logger;
 
-#endif // SERIALLOGGER_H
\ No newline at end of file
+#endif // SERIALLOGGER_H
@@ -0,0 +1,64 @@
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Lock-free single-producer/single-consumer ring buffer.
+// Push() may be called from an ISR while Pop() runs in a task; neither side ever blocks.
+// When the ring is full the new item is dropped and counted, the consumer can pick the
+// count up with TakeDropped() and resynchronise.
+template <typename T, size_t Capacity>
+class SpscRing
+{
+  static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+  SpscRing() : head(0), tail(0), dropped(0) {}
+
+  // Producer side
+  __attribute__((always_inline)) inline bool Push(const T &item)
+  {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) >= Capacity)
+    {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+
+    items[h & (Capacity - 1)] = item;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer side
+  inline bool Pop(T &item)
+  {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire))
+    {
+      return false;
+    }
+
+    item = items[t & (Capacity - 1)];
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  inline uint32_t TakeDropped() { return dropped.exchange(0, std::memory_order_relaxed); }
+
+  // Approximate when called concurrently with Push()/Pop()
+  inline size_t Size() const
+  {
+    return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+  }
+
+private:
+  T items[Capacity];
+  std::atomic<uint32_t> head;
+  std::atomic<uint32_t> tail;
+  std::atomic<uint32_t> dropped;
+};
+
+#endif // SPSCRING_H
@@ -0,0 +1,111 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define TELEMETRY_PAYLOAD_SIZE 256
+
+#ifndef TELEMETRY_SUMMARY_SIZE
+#define TELEMETRY_SUMMARY_SIZE 512 // A day summary with its 24 hourly figures
+#endif
+
+#define TELEMETRY_LOCAL_OFFSET 3600 // JSON timestamps and summary periods are in UTC + 1 h
+
+#ifndef TELEMETRY_BATCH_MAX_SIZE
+#define TELEMETRY_BATCH_MAX_SIZE 1536 // Must fit the MQTT buffer (2048) together with the topic
+#endif
+
+extern const char *deviceId; // Defined in secrets.h (or by the native harness)
+
+// Wire format of the payloads built below, see "Telemetry encodings" in README.md
+enum TelemetryEncoding
+{
+  TELEMETRY_ENCODING_JSON, // {"DeviceID":"...","Status":true,"Timestamp":"..."}, the default
+  TELEMETRY_ENCODING_CBOR  // [_ deviceIndex, timestamp, flags, offset, flags, ...]
+};
+
+// Flags of one event in a CBOR payload; the bits above them carry the channel
+#define TELEMETRY_CBOR_OCCUPIED 0x01
+#define TELEMETRY_CBOR_HEARTBEAT 0x02
+#define TELEMETRY_CBOR_CHANNEL_SHIFT 2
+
+// One occupancy transition on its way from the sensing side to the network
+struct TelemetryEvent
+{
+  bool status;      // True (zauzeto) ili False (slobodno)
+  bool heartbeat;   // Periodic report of an unchanged status, not a transition
+  time_t timestamp; // Time of the PIR edge that caused the transition (of the report for heartbeats)
+  uint8_t channel;  // Room or zone on this board (see HAL_CHANNELS), 0 on single-sensor boards
+  uint32_t edgeMs;  // halMicros() / 1000 of the edge, for the edge-to-send latency; 0 = unknown (journaled)
+};
+
+// Occupancy aggregated over one hour or one day, see OccupancySummary.h
+struct TelemetrySummary
+{
+  bool daily;               // Day summary (with hourly[]), otherwise an hour
+  uint8_t channel;
+  uint16_t sessions;        // Occupied periods that started in it
+  uint32_t start;           // Unix time (UTC) of the period's first second
+  uint32_t occupiedSeconds;
+  uint32_t longestSeconds;  // Longest session that ended in it, counted from its real start
+  uint16_t hourly[24];      // Day summaries: occupied seconds of each hour, local time
+};
+
+// Who the payloads are from and how they are encoded. The firmware's own follows deviceId and
+// telemetryConfigureEncoding() and is used by every function below without a context. The
+// fleet simulator keeps one per virtual device, so that its threads serialize at the same time;
+// nothing changes a context after telemetryContextInit().
+struct TelemetryContext
+{
+  TelemetryEncoding encoding;
+  uint16_t deviceIndex;                        // Stands in for deviceId in CBOR payloads
+  const char *deviceId;
+  char deviceIdPrefix[TELEMETRY_PAYLOAD_SIZE]; // {"DeviceID":"<deviceId>", escaped
+  size_t deviceIdPrefixLength;                 // 0 if deviceId is NULL or too long: JSON payloads fail
+};
+
+void telemetryContextInit(TelemetryContext &context, const char *deviceId, TelemetryEncoding encoding, uint16_t deviceIndex);
+
+// deviceIndex is the short number that stands in for deviceId in CBOR payloads; the backend
+// maps it back. Call before the first payload is built.
+void telemetryConfigureEncoding(TelemetryEncoding encoding, uint16_t deviceIndex);
+TelemetryEncoding telemetryGetEncoding();
+const char *telemetryContentType(); // "application/json" or "application/cbor"
+
+// All of these write the payload into buffer and return its length (0 on failure). JSON payloads
+// are null-terminated strings and match what ArduinoJson 6 serializes for the same fields; CBOR
+// payloads are binary. They never allocate. Channels other than 0 add "Channel":N in JSON
+// (before "Status"), so single-sensor boards send exactly what they always did.
+size_t getISO8601Timestamp(time_t timestamp, char *buffer, size_t size);
+size_t getTelemetryData(bool status, time_t timestamp, char *buffer, size_t size, uint8_t channel = 0);
+
+// Several events in one message, see "Batched telemetry" in README.md. In JSON:
+// {"DeviceID":"...","Batch":[{"Status":true,"Timestamp":"..."},{"Channel":1,"Status":true,"Timestamp":"...","Heartbeat":true}]}
+// Events of all channels share the batch.
+// Returns 0 if the batch does not fit into size.
+size_t getTelemetryBatch(const TelemetryEvent *events, size_t count, char *buffer, size_t size);
+
+// Adds one event to a batch of `length` bytes already in buffer, without rewriting it.
+// Returns the new length, or 0 (and leaves the batch untouched) if it does not fit.
+size_t appendTelemetryBatch(const TelemetryEvent &event, char *buffer, size_t length, size_t size);
+
+// {"DeviceID":"...","Summary":"day","Start":"...","Sessions":3,"OccupiedSeconds":5400,"LongestSeconds":3000,"Hourly":[...]}
+// with "Channel":N after the DeviceID as in events, and without "Hourly" for an hour. In CBOR a
+// definite-length array, see "Occupancy summaries" in README.md.
+size_t getTelemetrySummary(const TelemetrySummary &summary, char *buffer, size_t size);
+
+// The same with a context of their own instead of the firmware's
+size_t getTelemetryData(const TelemetryContext &context, bool status, time_t timestamp, char *buffer, size_t size, uint8_t channel = 0);
+size_t getTelemetryBatch(const TelemetryContext &context, const TelemetryEvent *events, size_t count, char *buffer, size_t size);
+size_t appendTelemetryBatch(const TelemetryContext &context, const TelemetryEvent &event, char *buffer, size_t length, size_t size);
+size_t getTelemetrySummary(const TelemetryContext &context, const TelemetrySummary &summary, char *buffer, size_t size);
+
+// Network side: serializes a single event and hands it to telemetryTransportSend(), which
+// also sets *ticket. Transitions use the getTelemetryData() format, heartbeats a batch of one.
+bool sendTelemetryEvent(const TelemetryEvent &event, uint32_t *ticket = NULL);
+
+bool sendTelemetrySummary(const TelemetrySummary &summary, uint32_t *ticket = NULL);
+
+#endif // TELEMETRY_H
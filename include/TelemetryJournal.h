@@ -0,0 +1,56 @@
+#ifndef TELEMETRYJOURNAL_H
+#define TELEMETRYJOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "Telemetry.h"
+
+// Persistent store-and-forward journal for transitions that could not be sent.
+//
+// The journal file is a fixed array of `capacity` 16-byte records used as a ring: record
+// n lives in slot n % capacity, so consecutive appends walk the whole file instead of
+// rewriting one block (LittleFS spreads the rest). Which records are still unsent is
+// kept in a 4-byte cursor file next to it that is only rewritten when a batch has been
+// delivered, or put back with Requeue(), always by renaming a new copy over it. Nothing else is stored: on Begin() the file is scanned, and the highest
+// valid sequence number is where appending continues after a reboot. An empty journal starts
+// at capacity + 1, which leaves a ring's worth of numbers in front of the first record.
+//
+// Plain stdio is used, which works on the host and on LittleFS through the ESP-IDF VFS.
+class TelemetryJournal
+{
+public:
+  enum OverflowPolicy
+  {
+    DROP_OLDEST, // Overwrite the oldest unsent record
+    DROP_NEWEST  // Refuse new records until there is room again
+  };
+
+  TelemetryJournal();
+  ~TelemetryJournal();
+  bool Begin(const char* path, uint32_t capacity, OverflowPolicy policy);
+  bool Append(const TelemetryEvent& event);
+  size_t Peek(TelemetryEvent* events, size_t maxEvents); // Oldest unsent first, removes nothing
+  void Consume(size_t count);                            // The first `count` peeked events were delivered
+  size_t Requeue(const TelemetryEvent* events, size_t count); // Sent but not delivered; returns how many it kept
+
+  bool IsOpen() const;
+  uint32_t GetDepth() const;   // Unsent records
+  uint32_t GetDropped() const; // Records lost to overflow or corruption since boot
+
+private:
+  bool readRecord(uint32_t sequence, TelemetryEvent& event);
+  bool writeRecord(uint32_t sequence, const TelemetryEvent& event);
+  void saveCursor();
+
+  FILE* file;
+  char cursorPath[64];
+  char cursorTempPath[68]; // cursorPath + ".tmp"
+  uint32_t capacity;
+  OverflowPolicy policy;
+  uint32_t firstPending; // Sequence number of the oldest unsent record
+  uint32_t nextSequence; // Sequence number the next Append() gets
+  uint32_t dropped;
+};
+
+#endif // TELEMETRYJOURNAL_H
@@ -0,0 +1,28 @@
+#ifndef TELEMETRYQUEUE_H
+#define TELEMETRYQUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "Telemetry.h"
+
+#ifndef TELEMETRY_QUEUE_SIZE
+#define TELEMETRY_QUEUE_SIZE 32 // Must be a power of two
+#endif
+
+// Bounded queue between the sensing side (producer) and the network side (consumer).
+// The producer never blocks: when the queue is full the event is dropped and counted.
+
+struct TelemetryQueueStats
+{
+  uint32_t depth;     // Events waiting right now
+  uint32_t highWater; // Deepest the queue has been
+  uint32_t enqueued;
+  uint32_t dropped;
+};
+
+void telemetryQueueBegin();
+bool telemetryQueuePush(const TelemetryEvent &event);
+bool telemetryQueuePop(TelemetryEvent &event, uint32_t waitMs); // Waits up to waitMs for an event
+TelemetryQueueStats telemetryQueueStats();
+
+#endif // TELEMETRYQUEUE_H
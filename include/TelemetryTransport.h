@@ -0,0 +1,70 @@
+#ifndef TELEMETRYTRANSPORT_H
+#define TELEMETRYTRANSPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TELEMETRY_MESSAGE_ID_SIZE 24 // "<boot id>-<sequence>", e.g. "9f3a01c2-4294967295"
+
+#ifndef TELEMETRY_TRANSPORT_UNCONFIRMED
+#define TELEMETRY_TRANSPORT_UNCONFIRMED 4 // Messages a backend has queued and not reported on yet
+#endif
+
+// Which paths a telemetry message takes. IoT Hub (MQTT) and the Azure Function (HTTPS) both
+// store it, so a device needs only one of them; dual sends every message both ways with the
+// same message ID (MQTT $.mid, HTTP X-Message-Id) so that the backend can drop the copy.
+enum TelemetryTransportMode
+{
+  TELEMETRY_TRANSPORT_MQTT,
+  TELEMETRY_TRANSPORT_HTTP,
+  TELEMETRY_TRANSPORT_DUAL
+};
+
+// One way of getting a serialized message off the device. Send() returning true means the
+// backend has taken care of the message (MQTT QoS 1 retransmits by itself), unless the backend
+// confirms later: then it has only been queued, and TakeOutcome() reports for every such
+// message, in the order they were sent, whether it arrived (HTTP).
+class TelemetryBackend
+{
+public:
+  virtual ~TelemetryBackend() {}
+  virtual const char *GetName() const = 0;
+  virtual bool Send(const char *payload, size_t length, const char *messageId) = 0; // messageId may be NULL
+  virtual bool ConfirmsLater() const { return false; }
+  virtual bool TakeOutcome(bool &delivered) // false while there is no outcome to report
+  {
+    (void)delivered;
+    return false;
+  }
+};
+
+struct TelemetryTransportStats
+{
+  uint32_t messages;      // telemetryTransportSend() calls that reached at least one backend
+  uint32_t failures;      // Calls that reached none, the uplink journals those
+  uint32_t undelivered;   // Messages only a backend that confirms later took, and that did not arrive
+  uint32_t sent[2];       // Per backend (MQTT, HTTP): messages accepted
+  uint32_t failed[2];     // Per backend: messages refused
+  unsigned long bytes[2]; // Per backend: payload bytes accepted, what the radio has to carry
+};
+
+// bootId makes message IDs unique across restarts (a random number on the device)
+void telemetryTransportConfigure(
+    TelemetryTransportMode mode,
+    TelemetryBackend *mqtt,
+    TelemetryBackend *http,
+    uint32_t bootId);
+void telemetryTransportSetMode(TelemetryTransportMode mode); // At runtime; backends, message IDs and stats stay
+TelemetryTransportMode telemetryTransportMode();
+const char *telemetryTransportModeName(TelemetryTransportMode mode);
+bool telemetryTransportParseMode(const char *name, TelemetryTransportMode &mode); // "mqtt", "http" or "dual"
+
+// Sends one serialized message on the configured path(s); true if any backend took it. If the
+// only one that did confirms later, *ticket (may be NULL) is set to a number that comes back
+// from telemetryTransportTakeOutcome() with the outcome, otherwise to 0: the message counts as
+// delivered, in dual mode as soon as MQTT has it.
+bool telemetryTransportSend(const char *payload, size_t length, uint32_t *ticket = NULL);
+bool telemetryTransportTakeOutcome(uint32_t &ticket, bool &delivered); // In send order; false if none yet
+TelemetryTransportStats telemetryTransportStats();
+
+#endif // TELEMETRYTRANSPORT_H
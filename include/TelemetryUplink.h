@@ -0,0 +1,77 @@
+#ifndef TELEMETRYUPLINK_H
+#define TELEMETRYUPLINK_H
+
+#include <stdint.h>
+#include "TelemetryJournal.h"
+
+#ifndef TELEMETRY_JOURNAL_CAPACITY
+#define TELEMETRY_JOURNAL_CAPACITY 1024 // Records of 16 bytes, 16 KB of flash
+#endif
+
+#ifndef TELEMETRY_DRAIN_BATCH
+#define TELEMETRY_DRAIN_BATCH 8 // Journal records replayed per service call without batching
+#endif
+
+#ifndef TELEMETRY_BATCH_MAX_EVENTS
+#define TELEMETRY_BATCH_MAX_EVENTS 32 // Upper limit for TelemetryBatchConfig::maxEvents
+#endif
+
+#ifndef TELEMETRY_UPLINK_RECENT_EVENTS
+#define TELEMETRY_UPLINK_RECENT_EVENTS 128 // Events of MQTT messages kept for the PUBACK, the QoS 1 window's worth
+#endif
+
+// Network side of the telemetry pipeline, shared by the firmware's network task and the
+// host replay harness. Takes events off the telemetry queue and sends them; whatever
+// cannot be sent right now goes to the journal and is replayed, oldest first and with
+// its original timestamp, once the connection is back. While the journal holds anything,
+// new events are appended behind it so that the backend always sees them in order.
+//
+// Over HTTP a message has only been queued when telemetryTransportSend() returns, and counts
+// as sent once the Function has answered it with 2xx. Until then its events are kept here and
+// nothing else goes out (new events are journaled); if it did not arrive, they go back in front
+// of the journal (TelemetryJournal::Requeue()) and are replayed in order.
+//
+// With batching enabled, events are gathered into one getTelemetryBatch() message that is
+// sent as soon as it holds maxEvents, would grow past maxBytes, or its oldest event has
+// waited maxDelayMs. Journal replays go out as batches of the same size.
+//
+// Every transition taken off the queue also goes into the hourly and daily aggregates
+// (OccupancySummary.h), whose summaries are sent from here as well.
+//
+// Events taken off the queue before the wall clock is set keep a since-boot timestamp, so the
+// caller should leave them in the queue until it is (see main.cpp's networkTask).
+
+struct TelemetryBatchConfig
+{
+  uint8_t maxEvents;   // 1 = no batching, one message per event (default)
+  uint16_t maxBytes;   // Payload size limit, at most TELEMETRY_BATCH_MAX_SIZE
+  uint32_t maxDelayMs; // Longest an event waits for the batch to fill up
+};
+
+struct TelemetryUplinkStats
+{
+  uint32_t messages;       // Messages delivered: sent, and over HTTP also answered with 2xx
+  uint32_t sent;           // Events delivered in those messages
+  uint32_t sendFailures;   // Messages no backend took, or that the HTTP request did not deliver
+  uint32_t journaled;      // Events written to the journal
+  uint32_t replayed;       // Journaled events sent later
+  uint32_t lost;           // Events that could neither be sent nor journaled
+  uint32_t repaired;       // Timestamps moved from time since boot onto the wall clock
+  uint32_t pending;        // Events gathered for the next batch right now
+  uint32_t unconfirmed;    // Events sent over HTTP, waiting for the answer right now
+  uint32_t journalDepth;   // Unsent events in the journal right now
+  uint32_t journalDropped; // Journal records lost to overflow or corruption
+};
+
+bool telemetryUplinkBegin(const char *journalPath, TelemetryJournal::OverflowPolicy overflowPolicy);
+void telemetryUplinkConfigureBatching(const TelemetryBatchConfig &config); // Also at runtime, from the network side
+void telemetryUplinkService(bool connected, uint32_t waitMs); // Waits up to waitMs for a new event
+
+// Before RAM is lost (deep sleep): puts the events that went out but may not have arrived back
+// in front of the journal, to be sent again after the wake-up. Those are the HTTP message still
+// waiting for its answer and the last `unacknowledged` MQTT messages (the broker acknowledges
+// QoS 1 messages in the order it got them). Returns how many events the journal kept.
+size_t telemetryUplinkRequeueUnsent(uint32_t unacknowledged);
+TelemetryUplinkStats telemetryUplinkStats();
+
+#endif // TELEMETRYUPLINK_H
@@ -0,0 +1,16 @@
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Small helpers shared by the firmware modules and the host build
+
+// snprintf() at position, false once the buffer is full
+bool appendf(char *buffer, size_t size, size_t &position, const char *format, ...) __attribute__((format(printf, 4, 5)));
+
+// FNV-1a of length bytes, the checksum of structs kept in NVS, RTC memory or files: enough to
+// tell a real entry from garbage or from a write cut short by a reset
+uint32_t fnv1a(const void *data, size_t length);
+
+#endif // UTIL_H
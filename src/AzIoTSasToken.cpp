@@ -2,12 +2,14 @@
 // SPDX-License-Identifier: MIT
 
 #include "AzIoTSasToken.h"
+#include "SasToken.h"
 #include "SerialLogger.h"
 #include <az_result.h>
 #include <mbedtls/base64.h>
 #include <mbedtls/md.h>
 #include <mbedtls/sha256.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #define INDEFINITE_TIME ((time_t)-1)
@@ -15,72 +17,22 @@
 #define az_span_is_content_equal(x, AZ_SPAN_EMPTY) \
   (az_span_size(x) == az_span_size(AZ_SPAN_EMPTY) && az_span_ptr(x) == az_span_ptr(AZ_SPAN_EMPTY))
 
-static uint32_t getSasTokenExpiration(const char* sasToken)
+// The context already holds the decoded key (see AzIoTSasToken::prepareKey()), so signing
+// only has to reset it instead of decoding the key and setting up HMAC every time.
+static void mbedtls_hmac_sha256(mbedtls_md_context_t* ctx, az_span payload, az_span signed_payload)
 {
-  const char SE[] = { '&', 's', 'e', '=' };
-  uint32_t se_as_unix_time = 0;
-
-  int i, j;
-  for (i = 0, j = 0; sasToken[i] != '\0'; i++)
-  {
-    if (sasToken[i] == SE[j])
-    {
-      j++;
-      if (j == sizeof(SE))
-      {
-        // i is still at the '=' position. We must advance it by 1.
-        i++;
-        break;
-      }
-    }
-    else
-    {
-      j = 0;
-    }
-  }
-
-  if (j != sizeof(SE))
-  {
-    Logger.Error("Failed finding `se` field in SAS token");
-  }
-  else
-  {
-    int k = i;
-    while (sasToken[k] != '\0' && sasToken[k] != '&')
-    {
-      k++;
-    }
-
-    if (az_result_failed(
-            az_span_atou32(az_span_create((uint8_t*)sasToken + i, k - i), &se_as_unix_time)))
-    {
-      Logger.Error("Failed parsing SAS token expiration timestamp");
-    }
-  }
-
-  return se_as_unix_time;
-}
-
-static void mbedtls_hmac_sha256(az_span key, az_span payload, az_span signed_payload)
-{
-  mbedtls_md_context_t ctx;
-  mbedtls_md_type_t md_type = MBEDTLS_MD_SHA256;
-
-  mbedtls_md_init(&ctx);
-  mbedtls_md_setup(&ctx, mbedtls_md_info_from_type(md_type), 1);
-  mbedtls_md_hmac_starts(&ctx, (const unsigned char*)az_span_ptr(key), az_span_size(key));
-  mbedtls_md_hmac_update(&ctx, (const unsigned char*)az_span_ptr(payload), az_span_size(payload));
-  mbedtls_md_hmac_finish(&ctx, (byte*)az_span_ptr(signed_payload));
-  mbedtls_md_free(&ctx);
+  mbedtls_md_hmac_reset(ctx);
+  mbedtls_md_hmac_update(ctx, (const unsigned char*)az_span_ptr(payload), az_span_size(payload));
+  mbedtls_md_hmac_finish(ctx, (unsigned char*)az_span_ptr(signed_payload));
 }
 
 static void hmac_sha256_sign_signature(
-    az_span decoded_key,
+    mbedtls_md_context_t* hmac,
     az_span signature,
     az_span signed_signature,
     az_span* out_signed_signature)
 {
-  mbedtls_hmac_sha256(decoded_key, signature, signed_signature);
+  mbedtls_hmac_sha256(hmac, signature, signed_signature);
   *out_signed_signature = az_span_slice(signed_signature, 0, 32);
 }
 
@@ -98,7 +50,7 @@ static void base64_encode_bytes(
           (size_t)az_span_size(decoded_bytes))
       != 0)
   {
-    Logger.Error("mbedtls_base64_encode fail");
+    LOG_ERROR("mbedtls_base64_encode fail");
   }
 
   *out_base64_encoded_bytes = az_span_create(az_span_ptr(base64_encoded_bytes), (int32_t)len);
@@ -120,7 +72,7 @@ static int decode_base64_bytes(
           (size_t)az_span_size(base64_encoded_bytes))
       != 0)
   {
-    Logger.Error("mbedtls_base64_decode fail");
+    LOG_ERROR("mbedtls_base64_decode fail");
     return 1;
   }
   else
@@ -131,26 +83,16 @@ static int decode_base64_bytes(
 }
 
 static int iot_sample_generate_sas_base64_encoded_signed_signature(
-    az_span sas_base64_encoded_key,
+    mbedtls_md_context_t* hmac,
     az_span sas_signature,
     az_span sas_base64_encoded_signed_signature,
     az_span* out_sas_base64_encoded_signed_signature)
 {
-  // Decode the sas base64 encoded key to use for HMAC signing.
-  char sas_decoded_key_buffer[32];
-  az_span sas_decoded_key = AZ_SPAN_FROM_BUFFER(sas_decoded_key_buffer);
-
-  if (decode_base64_bytes(sas_base64_encoded_key, sas_decoded_key, &sas_decoded_key) != 0)
-  {
-    Logger.Error("Failed generating encoded signed signature");
-    return 1;
-  }
-
   // HMAC-SHA256 sign the signature with the decoded key.
   char sas_hmac256_signed_signature_buffer[32];
   az_span sas_hmac256_signed_signature = AZ_SPAN_FROM_BUFFER(sas_hmac256_signed_signature_buffer);
   hmac_sha256_sign_signature(
-      sas_decoded_key, sas_signature, sas_hmac256_signed_signature, &sas_hmac256_signed_signature);
+      hmac, sas_signature, sas_hmac256_signed_signature, &sas_hmac256_signed_signature);
 
   // Base64 encode the result of the HMAC signing.
   base64_encode_bytes(
@@ -169,7 +111,7 @@ int64_t iot_sample_get_epoch_expiration_time_from_minutes(uint32_t minutes)
 
 az_span generate_sas_token(
     az_iot_hub_client* hub_client,
-    az_span device_key,
+    mbedtls_md_context_t* hmac,
     az_span sas_signature,
     unsigned int expiryTimeInMinutes,
     az_span sas_token)
@@ -183,7 +125,7 @@ az_span generate_sas_token(
   rc = az_iot_hub_client_sas_get_signature(hub_client, sas_duration, sas_signature, &sas_signature);
   if (az_result_failed(rc))
   {
-    Logger.Error("Could not get the signature for SAS key: az_result return code " + rc);
+    LOG_ERROR("Could not get the signature for SAS key: az_result return code %d", (int)rc);
     return AZ_SPAN_EMPTY;
   }
 
@@ -192,13 +134,13 @@ az_span generate_sas_token(
   az_span sas_base64_encoded_signed_signature = AZ_SPAN_FROM_BUFFER(b64enc_hmacsha256_signature);
 
   if (iot_sample_generate_sas_base64_encoded_signed_signature(
-          device_key,
+          hmac,
           sas_signature,
           sas_base64_encoded_signed_signature,
           &sas_base64_encoded_signed_signature)
       != 0)
   {
-    Logger.Error("Failed generating SAS token signed signature");
+    LOG_ERROR("Failed generating SAS token signed signature");
     return AZ_SPAN_EMPTY;
   }
 
@@ -216,7 +158,7 @@ az_span generate_sas_token(
 
   if (az_result_failed(rc))
   {
-    Logger.Error("Could not get the password: az_result return code " + rc);
+    LOG_ERROR("Could not get the password: az_result return code %d", (int)rc);
     return AZ_SPAN_EMPTY;
   }
   else
@@ -229,38 +171,75 @@ AzIoTSasToken::AzIoTSasToken(
     az_iot_hub_client* client,
     az_span deviceKey,
     az_span signatureBuffer,
-    az_span sasTokenBuffer)
+    az_span sasTokenBuffer,
+    az_span nextSasTokenBuffer)
 {
   this->client = client;
   this->deviceKey = deviceKey;
   this->signatureBuffer = signatureBuffer;
   this->sasTokenBuffer = sasTokenBuffer;
+  this->nextSasTokenBuffer = nextSasTokenBuffer;
   this->expirationUnixTime = 0;
+  this->nextExpirationUnixTime = 0;
   this->sasToken = AZ_SPAN_EMPTY;
+  this->nextSasToken = AZ_SPAN_EMPTY;
+  this->keyReady = false;
+  mbedtls_md_init(&this->hmac);
 }
 
-int AzIoTSasToken::Generate(unsigned int expiryTimeInMinutes)
+// Decodes the device key once and keeps it in an HMAC context for all later tokens
+int AzIoTSasToken::prepareKey()
+{
+  if (this->keyReady)
+  {
+    return 0;
+  }
+
+  uint8_t decodedKeyBuffer[32];
+  az_span decodedKey = AZ_SPAN_FROM_BUFFER(decodedKeyBuffer);
+  if (decode_base64_bytes(this->deviceKey, decodedKey, &decodedKey) != 0)
+  {
+    LOG_ERROR("Failed generating encoded signed signature");
+    return 1;
+  }
+
+  if (mbedtls_md_setup(&this->hmac, mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), 1) != 0
+      || mbedtls_md_hmac_starts(&this->hmac, az_span_ptr(decodedKey), az_span_size(decodedKey)) != 0)
+  {
+    LOG_ERROR("Failed setting up HMAC-SHA256 for the device key");
+    mbedtls_md_free(&this->hmac);
+    mbedtls_md_init(&this->hmac);
+    return 1;
+  }
+
+  memset(decodedKeyBuffer, 0, sizeof(decodedKeyBuffer));
+  this->keyReady = true;
+  return 0;
+}
+
+int AzIoTSasToken::generateInto(
+    az_span buffer,
+    unsigned int expiryTimeInMinutes,
+    az_span* token,
+    uint32_t* expiration)
 {
-  this->sasToken = generate_sas_token(
-      this->client,
-      this->deviceKey,
-      this->signatureBuffer,
-      expiryTimeInMinutes,
-      this->sasTokenBuffer);
-
-  if (az_span_is_content_equal(this->sasToken, AZ_SPAN_EMPTY))
+  *token = prepareKey() != 0
+      ? AZ_SPAN_EMPTY
+      : generate_sas_token(this->client, &this->hmac, this->signatureBuffer, expiryTimeInMinutes, buffer);
+
+  if (az_span_is_content_equal(*token, AZ_SPAN_EMPTY))
   {
-    Logger.Error("Failed generating SAS token");
+    LOG_ERROR("Failed generating SAS token");
     return 1;
   }
   else
   {
-    this->expirationUnixTime = getSasTokenExpiration((const char*)az_span_ptr(this->sasToken));
+    *expiration = getSasTokenExpiration((const char*)az_span_ptr(*token));
 
-    if (this->expirationUnixTime == 0)
+    if (*expiration == 0)
     {
-      Logger.Error("Failed getting the SAS token expiration time");
-      this->sasToken = AZ_SPAN_EMPTY;
+      LOG_ERROR("Failed getting the SAS token expiration time");
+      *token = AZ_SPAN_EMPTY;
       return 1;
     }
     else
@@ -270,13 +249,44 @@ int AzIoTSasToken::Generate(unsigned int expiryTimeInMinutes)
   }
 }
 
+int AzIoTSasToken::Generate(unsigned int expiryTimeInMinutes)
+{
+  this->nextSasToken = AZ_SPAN_EMPTY;
+  return generateInto(this->sasTokenBuffer, expiryTimeInMinutes, &this->sasToken, &this->expirationUnixTime);
+}
+
+int AzIoTSasToken::GenerateNext(unsigned int expiryTimeInMinutes)
+{
+  return generateInto(
+      this->nextSasTokenBuffer, expiryTimeInMinutes, &this->nextSasToken, &this->nextExpirationUnixTime);
+}
+
+bool AzIoTSasToken::HasNext() { return !az_span_is_content_equal(this->nextSasToken, AZ_SPAN_EMPTY); }
+
+bool AzIoTSasToken::UseNext()
+{
+  if (!HasNext())
+  {
+    return false;
+  }
+
+  // Swap the buffers, the old token's buffer takes the one after this
+  az_span buffer = this->sasTokenBuffer;
+  this->sasTokenBuffer = this->nextSasTokenBuffer;
+  this->nextSasTokenBuffer = buffer;
+  this->sasToken = this->nextSasToken;
+  this->expirationUnixTime = this->nextExpirationUnixTime;
+  this->nextSasToken = AZ_SPAN_EMPTY;
+  return true;
+}
+
 bool AzIoTSasToken::IsExpired()
 {
   time_t now = time(NULL);
 
   if (now == INDEFINITE_TIME)
   {
-    Logger.Error("Failed getting current time");
+    LOG_ERROR("Failed getting current time");
     return true;
   }
   else
@@ -285,4 +295,6 @@ bool AzIoTSasToken::IsExpired()
   }
 }
 
-az_span AzIoTSasToken::Get() { return this->sasToken; }
\ No newline at end of file
+uint32_t AzIoTSasToken::GetExpiration() { return this->expirationUnixTime; }
+
+az_span AzIoTSasToken::Get() { return this->sasToken; }
@@ -0,0 +1,97 @@
+#include "BootCache.h"
+#include "Util.h"
+#include <Preferences.h>
+#include <esp_attr.h>
+#include <esp_system.h>
+#include <string.h>
+
+#define WIFI_CACHE_MAGIC 0x57494649 // "WIFI"
+#define NVS_NAMESPACE "boot"
+#define NVS_WIFI_KEY "wifi"
+
+struct StoredWifiCache
+{
+  uint32_t magic;
+  WifiCache cache;
+  uint32_t checksum;
+};
+
+RTC_NOINIT_ATTR static StoredWifiCache rtcWifiCache; // Not cleared on reset, garbage after power-on
+
+// FNV-1a, enough to tell RTC memory that was never written from a real entry
+static uint32_t checksumOf(const WifiCache &cache)
+{
+  return fnv1a(&cache, sizeof(cache));
+}
+
+static bool isValid(const StoredWifiCache &stored)
+{
+  return stored.magic == WIFI_CACHE_MAGIC && stored.checksum == checksumOf(stored.cache) && stored.cache.channel > 0;
+}
+
+bool bootCacheLoadWifi(WifiCache &cache)
+{
+  if (!isValid(rtcWifiCache))
+  {
+    Preferences preferences;
+    StoredWifiCache stored;
+    bool found = preferences.begin(NVS_NAMESPACE, true)
+                 && preferences.getBytes(NVS_WIFI_KEY, &stored, sizeof(stored)) == sizeof(stored) && isValid(stored);
+    preferences.end();
+    if (!found)
+    {
+      return false;
+    }
+    rtcWifiCache = stored;
+  }
+
+  cache = rtcWifiCache.cache;
+  return true;
+}
+
+void bootCacheSaveWifi(const WifiCache &cache)
+{
+  StoredWifiCache stored;
+  memset(&stored, 0, sizeof(stored)); // Padding included, it goes into the checksum
+  stored.magic = WIFI_CACHE_MAGIC;
+  stored.cache = cache;
+  stored.checksum = checksumOf(stored.cache);
+
+  rtcWifiCache = stored;
+
+  // Flash wears out; most connects find the same AP and lease as last time
+  Preferences preferences;
+  if (preferences.begin(NVS_NAMESPACE, false))
+  {
+    StoredWifiCache inFlash;
+    if (preferences.getBytes(NVS_WIFI_KEY, &inFlash, sizeof(inFlash)) != sizeof(inFlash)
+        || memcmp(&inFlash, &stored, sizeof(stored)) != 0)
+    {
+      preferences.putBytes(NVS_WIFI_KEY, &stored, sizeof(stored));
+    }
+    preferences.end();
+  }
+}
+
+const char *bootResetReason()
+{
+  switch (esp_reset_reason())
+  {
+    case ESP_RST_POWERON:
+      return "power-on";
+    case ESP_RST_SW:
+      return "software";
+    case ESP_RST_PANIC:
+      return "panic";
+    case ESP_RST_INT_WDT:
+    case ESP_RST_TASK_WDT:
+    case ESP_RST_WDT:
+      return "watchdog";
+    case ESP_RST_DEEPSLEEP:
+      return "deep sleep";
+    case ESP_RST_BROWNOUT:
+      return "brownout";
+    default:
+      return "other";
+  }
+}
@@ -0,0 +1,72 @@
+#include "ConfigStore.h"
+#include "Util.h"
+#include <Preferences.h>
+#include <string.h>
+
+#define CONFIG_STORE_MAGIC 0x31474643 // "CFG1"
+#define NVS_NAMESPACE "config"
+#define NVS_CONFIG_KEY "device"
+
+struct StoredConfig
+{
+  uint32_t magic;
+  uint32_t size; // sizeof(StoredConfig), another layout reads as invalid
+  DeviceConfig config;
+  uint32_t checksum;
+};
+
+// FNV-1a, catches a write cut short by a reset
+static uint32_t checksumOf(const DeviceConfig &config)
+{
+  return fnv1a(&config, sizeof(config));
+}
+
+bool configStoreLoad(DeviceConfig &config)
+{
+  Preferences preferences;
+  StoredConfig stored;
+  bool found = preferences.begin(NVS_NAMESPACE, true)
+               && preferences.getBytes(NVS_CONFIG_KEY, &stored, sizeof(stored)) == sizeof(stored)
+               && stored.magic == CONFIG_STORE_MAGIC && stored.size == sizeof(stored)
+               && stored.checksum == checksumOf(stored.config);
+  preferences.end();
+
+  if (found)
+  {
+    config = stored.config;
+  }
+  return found;
+}
+
+void configStoreSave(const DeviceConfig &config)
+{
+  StoredConfig stored;
+  memset(&stored, 0, sizeof(stored)); // Padding included, it goes into the checksum
+  stored.magic = CONFIG_STORE_MAGIC;
+  stored.size = sizeof(stored);
+  memcpy(&stored.config, &config, sizeof(config));
+  stored.checksum = checksumOf(stored.config);
+
+  // A twin GET after every reconnect brings the same settings again; write only what changed
+  Preferences preferences;
+  if (preferences.begin(NVS_NAMESPACE, false))
+  {
+    StoredConfig inFlash;
+    if (preferences.getBytes(NVS_CONFIG_KEY, &inFlash, sizeof(inFlash)) != sizeof(inFlash)
+        || memcmp(&inFlash, &stored, sizeof(stored)) != 0)
+    {
+      preferences.putBytes(NVS_CONFIG_KEY, &stored, sizeof(stored));
+    }
+    preferences.end();
+  }
+}
+
+void configStoreClear()
+{
+  Preferences preferences;
+  if (preferences.begin(NVS_NAMESPACE, false))
+  {
+    preferences.remove(NVS_CONFIG_KEY);
+    preferences.end();
+  }
+}
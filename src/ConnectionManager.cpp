@@ -0,0 +1,440 @@
+#include "ConnectionManager.h"
+#include "Hal.h"
+#include "HealthMetrics.h"
+#include "SerialLogger.h"
+#include <WiFi.h>
+#include <esp_system.h>
+#include <string.h>
+#include <time.h>
+
+#define WIFI_CONNECT_TIMEOUT_MS 15000
+#define TIME_SYNC_TIMEOUT_MS 15000
+#define BACKOFF_BASE_MS 1000UL
+#define BACKOFF_MAX_MS 300000UL
+#define TOKEN_RENEW_MARGIN_PERCENT 10 // Renew at least this much of the token lifetime before expiry
+#define TOKEN_RENEW_JITTER_PERCENT 10 // plus up to this much more, random per renewal
+#define TOKEN_PREPARE_LEAD_S 30       // Generate the next token this long before renewing
+
+#define FAST_CONNECT_TIMEOUT_MS 4000 // Targeted connect to the cached AP, then fall back to a scan
+
+static bool isTimeValid() { return time(NULL) >= HAL_MIN_VALID_TIME; }
+
+ConnectionManager::ConnectionManager(
+    PubSubClient& mqttClient,
+    AzIoTSasToken& sasToken,
+    unsigned int tokenDuration)
+    : mqttClient(mqttClient), sasToken(sasToken), tokenDuration(tokenDuration)
+{
+  this->state = WIFI_CONNECT;
+  this->retryState = WIFI_CONNECT;
+  this->stateSince = 0;
+  this->backoffUntil = 0;
+  this->attempt = 0;
+  this->sntpStarted = false;
+  this->everConnected = false;
+  this->disconnectedSince = 0;
+  this->connectedSince = 0;
+  this->lastOutageMs = 0;
+  this->reconnectCount = 0;
+  this->renewAt = 0;
+  this->nextTokenTried = false;
+  this->renewing = false;
+  this->renewalCount = 0;
+  this->lastRenewalMs = 0;
+  this->connectedCallback = NULL;
+  this->mqttEnabled = true;
+  this->reuseIp = false;
+  this->wifiCached = false;
+  this->fastConnect = false;
+  memset(&this->bootTimings, 0, sizeof(this->bootTimings));
+}
+
+void ConnectionManager::SetMqttEnabled(bool enabled) { this->mqttEnabled = enabled; }
+
+void ConnectionManager::SetReuseIp(bool reuse) { this->reuseIp = reuse; }
+
+// The token in use and one already signed for the next renewal keep their lifetime
+void ConnectionManager::SetTokenDuration(unsigned int tokenDuration) { this->tokenDuration = tokenDuration; }
+
+void ConnectionManager::SetConnectedCallback(void (*callback)()) { this->connectedCallback = callback; }
+
+void ConnectionManager::Begin(
+    const char* ssid,
+    const char* pass,
+    const char* clientId,
+    const char* username,
+    const char* subscribeTopic,
+    uint16_t socketTimeoutSeconds)
+{
+  this->ssid = ssid;
+  this->pass = pass;
+  this->clientId = clientId;
+  this->username = username;
+  this->subscribeTopic = subscribeTopic;
+  this->mqttClient.setSocketTimeout(socketTimeoutSeconds);
+  this->disconnectedSince = millis();
+
+  // The RTC keeps the clock across every reset but a power-on one; SNTP then only corrects it
+  this->bootTimings.timeRetained = isTimeValid();
+  this->wifiCached = bootCacheLoadWifi(this->wifiCache);
+
+  WiFi.persistent(false); // We keep our own cache, don't rewrite the WiFi config in flash on every begin()
+  WiFi.mode(WIFI_STA);
+  WiFi.setAutoReconnect(true);
+  enter(WIFI_CONNECT);
+}
+
+void ConnectionManager::Suspend()
+{
+  if (this->mqttClient.connected())
+  {
+    this->mqttClient.disconnect();
+  }
+  WiFi.disconnect(true);
+  WiFi.mode(WIFI_OFF);
+  enter(SUSPENDED);
+}
+
+void ConnectionManager::Resume()
+{
+  if (this->state != SUSPENDED)
+  {
+    return;
+  }
+
+  this->attempt = 0;
+  this->disconnectedSince = millis();
+  WiFi.mode(WIFI_STA);
+  enter(WIFI_CONNECT);
+}
+
+void ConnectionManager::enter(State state)
+{
+  this->state = state;
+  this->stateSince = millis();
+}
+
+void ConnectionManager::retryAfterBackoff(State retryState)
+{
+  // Full jitter: uniformly random in [0, min(max, base * 2^attempt))
+  unsigned long window = BACKOFF_BASE_MS << (this->attempt < 16 ? this->attempt : 16);
+  if (window > BACKOFF_MAX_MS)
+  {
+    window = BACKOFF_MAX_MS;
+  }
+  unsigned long wait = esp_random() % window;
+
+  if (this->attempt < 255)
+  {
+    this->attempt++;
+  }
+
+  LOG_INFO("Retrying in %lu ms (attempt %u)", wait, (unsigned)this->attempt);
+  this->retryState = retryState;
+  this->backoffUntil = millis() + wait;
+  enter(BACKOFF);
+}
+
+void ConnectionManager::onConnected()
+{
+  unsigned long now = millis();
+  unsigned long downtime = now - this->disconnectedSince;
+
+  this->connectedSince = now;
+  this->attempt = 0;
+  if (this->bootTimings.connectedMs == 0)
+  {
+    this->bootTimings.connectedMs = now;
+  }
+
+  if (this->renewing)
+  {
+    this->renewalCount++;
+    this->lastRenewalMs = downtime;
+    LOG_INFO("MQTT reconnected with a new SAS token after %lu ms", downtime);
+  }
+  else
+  {
+    if (this->everConnected)
+    {
+      this->reconnectCount++;
+    }
+    this->lastOutageMs = downtime;
+    LOG_INFO("%s connected after %lu ms", this->mqttEnabled ? "MQTT" : "WiFi", downtime);
+  }
+  this->everConnected = true;
+  this->renewing = false;
+
+  if (this->mqttEnabled)
+  {
+    this->mqttClient.subscribe(this->subscribeTopic);
+  }
+  enter(CONNECTED);
+
+  if (this->mqttEnabled && this->connectedCallback != NULL)
+  {
+    this->connectedCallback();
+  }
+}
+
+// Remembers the AP and lease for a targeted connect after the next reset
+void ConnectionManager::onWifiConnected()
+{
+  WifiCache cache;
+  memset(&cache, 0, sizeof(cache)); // Padding too, BootCache compares whole entries
+  memcpy(cache.bssid, WiFi.BSSID(), sizeof(cache.bssid));
+  cache.channel = (uint8_t)WiFi.channel();
+  cache.ip = (uint32_t)WiFi.localIP();
+  cache.gateway = (uint32_t)WiFi.gatewayIP();
+  cache.subnet = (uint32_t)WiFi.subnetMask();
+  cache.dns = (uint32_t)WiFi.dnsIP();
+
+  bootCacheSaveWifi(cache);
+  this->wifiCache = cache;
+  this->wifiCached = true;
+
+  if (this->bootTimings.wifiMs == 0)
+  {
+    this->bootTimings.wifiMs = millis();
+    this->bootTimings.wifiCached = this->fastConnect;
+  }
+}
+
+void ConnectionManager::onDisconnected()
+{
+  unsigned long now = millis();
+
+  if (this->mqttEnabled)
+  {
+    LOG_ERROR(
+        "Connection lost after %lu s (MQTT state %d)", (now - this->connectedSince) / 1000, this->mqttClient.state());
+  }
+  else
+  {
+    LOG_ERROR("WiFi lost after %lu s", (now - this->connectedSince) / 1000);
+  }
+  this->disconnectedSince = now;
+
+  // Even the first retry is jittered so that devices dropped together spread out
+  retryAfterBackoff(WiFi.status() == WL_CONNECTED ? MQTT_CONNECT : WIFI_WAIT);
+}
+
+// The blocking TLS + MQTT connect, bounded by the socket timeout
+bool ConnectionManager::connectMqtt()
+{
+  uint64_t start = halMicros();
+  bool connected = this->mqttClient.connect(this->clientId, this->username, (const char*)az_span_ptr(this->sasToken.Get()));
+  healthRecord(HEALTH_MQTT_CONNECT, (uint32_t)(halMicros() - start));
+  return connected;
+}
+
+// A token that is due for renewal is not worth connecting with; generate a fresh one
+bool ConnectionManager::ensureToken()
+{
+  if ((uint32_t)time(NULL) < this->renewAt)
+  {
+    return true;
+  }
+
+  if (this->sasToken.Generate(this->tokenDuration) != 0)
+  {
+    return false;
+  }
+
+  scheduleRenewal();
+  return true;
+}
+
+// Random point 10-20 % of the lifetime before expiry, so that devices do not renew together
+void ConnectionManager::scheduleRenewal()
+{
+  uint32_t lifetime = this->tokenDuration * 60;
+  uint32_t margin = lifetime * TOKEN_RENEW_MARGIN_PERCENT / 100 + esp_random() % (lifetime * TOKEN_RENEW_JITTER_PERCENT / 100 + 1);
+
+  this->renewAt = this->sasToken.GetExpiration() - margin;
+  this->nextTokenTried = false;
+}
+
+void ConnectionManager::renew()
+{
+  LOG_INFO("Renewing the SAS token, reconnecting MQTT");
+  this->mqttClient.disconnect();
+  this->disconnectedSince = millis();
+  this->renewing = true;
+
+  if (this->sasToken.UseNext())
+  {
+    scheduleRenewal();
+  } // Otherwise MQTT_CONNECT generates one
+
+  enter(MQTT_CONNECT);
+}
+
+void ConnectionManager::Loop()
+{
+  unsigned long now = millis();
+
+  switch (this->state)
+  {
+    case WIFI_CONNECT:
+      WiFi.disconnect();
+      this->fastConnect = this->wifiCached;
+      if (this->fastConnect)
+      {
+        // No scan: straight to the AP and channel of the last connection, optionally without DHCP
+        LOG_INFO("Connecting to WiFi on channel %u (cached)", (unsigned)this->wifiCache.channel);
+        if (this->reuseIp)
+        {
+          WiFi.config(
+              IPAddress(this->wifiCache.ip),
+              IPAddress(this->wifiCache.gateway),
+              IPAddress(this->wifiCache.subnet),
+              IPAddress(this->wifiCache.dns));
+        }
+        WiFi.begin(this->ssid, this->pass, this->wifiCache.channel, this->wifiCache.bssid);
+      }
+      else
+      {
+        LOG_INFO("Connecting to WiFi");
+        if (this->reuseIp)
+        {
+          WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE); // Back to DHCP
+        }
+        WiFi.begin(this->ssid, this->pass);
+      }
+      enter(WIFI_WAIT);
+      break;
+
+    case WIFI_WAIT:
+      if (WiFi.status() == WL_CONNECTED)
+      {
+        LOG_INFO("WiFi connected in %lu ms", now - this->stateSince);
+        onWifiConnected();
+        enter(TIME_WAIT);
+      }
+      else if (this->fastConnect && now - this->stateSince >= FAST_CONNECT_TIMEOUT_MS)
+      {
+        LOG_WARN("Cached access point not reachable, scanning");
+        this->wifiCached = false; // Until the next successful connect stores a new one
+        enter(WIFI_CONNECT);
+      }
+      else if (now - this->stateSince >= WIFI_CONNECT_TIMEOUT_MS)
+      {
+        LOG_ERROR("WiFi connection timed out");
+        retryAfterBackoff(WIFI_CONNECT);
+      }
+      break;
+
+    case TIME_WAIT:
+      if (!this->sntpStarted)
+      { // MANDATORY or SAS tokens won't generate
+        LOG_INFO("Setting time using SNTP");
+        configTime(0, 0, "pool.ntp.org", "time.nist.gov");
+        this->sntpStarted = true;
+      }
+
+      if (isTimeValid() && this->bootTimings.timeMs == 0)
+      {
+        this->bootTimings.timeMs = now;
+      }
+
+      if (isTimeValid() && !this->mqttEnabled)
+      {
+        onConnected(); // HTTP-only: nothing more to bring up
+      }
+      else if (isTimeValid())
+      {
+        enter(MQTT_CONNECT);
+      }
+      else if (WiFi.status() != WL_CONNECTED)
+      {
+        enter(WIFI_WAIT);
+      }
+      else if (now - this->stateSince >= TIME_SYNC_TIMEOUT_MS)
+      {
+        LOG_ERROR("SNTP sync timed out");
+        retryAfterBackoff(TIME_WAIT);
+      }
+      break;
+
+    case MQTT_CONNECT:
+      if (WiFi.status() != WL_CONNECTED)
+      {
+        enter(WIFI_WAIT);
+        break;
+      }
+
+      LOG_INFO("Attempting MQTT connection...");
+      if (!ensureToken())
+      {
+        LOG_ERROR("Failed generating SAS token");
+        this->renewing = false;
+        retryAfterBackoff(TIME_WAIT); // Usually a clock problem
+      }
+      else if (connectMqtt())
+      {
+        onConnected();
+      }
+      else
+      {
+        LOG_ERROR("MQTT connection failed, state %d", this->mqttClient.state());
+        this->renewing = false; // From here on it counts as an outage
+        retryAfterBackoff(MQTT_CONNECT);
+      }
+      break;
+
+    case CONNECTED:
+      if (!this->mqttEnabled)
+      {
+        if (WiFi.status() != WL_CONNECTED)
+        {
+          onDisconnected();
+        }
+        break;
+      }
+
+      if (!this->mqttClient.loop()) // Drži MQTT vezu aktivnom
+      {
+        onDisconnected();
+        break;
+      }
+
+      // Sign the next token early, so renewing costs no more than the reconnect itself
+      if (!this->nextTokenTried && (uint32_t)time(NULL) + TOKEN_PREPARE_LEAD_S >= this->renewAt)
+      {
+        this->nextTokenTried = true;
+        this->sasToken.GenerateNext(this->tokenDuration);
+      }
+      if ((uint32_t)time(NULL) >= this->renewAt)
+      {
+        renew();
+      }
+      break;
+
+    case BACKOFF:
+      if ((long)(now - this->backoffUntil) >= 0)
+      {
+        enter(this->retryState);
+      }
+      break;
+
+    case SUSPENDED:
+      break;
+  }
+}
+
+bool ConnectionManager::IsConnected() const { return this->state == CONNECTED; }
+
+ConnectionManager::State ConnectionManager::GetState() const { return this->state; }
+
+uint32_t ConnectionManager::GetReconnectCount() const { return this->reconnectCount; }
+
+unsigned long ConnectionManager::GetLastOutageMs() const { return this->lastOutageMs; }
+
+unsigned long ConnectionManager::GetConnectedSince() const { return this->connectedSince; }
+
+uint32_t ConnectionManager::GetRenewalCount() const { return this->renewalCount; }
+
+unsigned long ConnectionManager::GetLastRenewalMs() const { return this->lastRenewalMs; }
+
+const ConnectionBootTimings& ConnectionManager::GetBootTimings() const { return this->bootTimings; }
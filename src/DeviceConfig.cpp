@@ -0,0 +1,611 @@
+#include "DeviceConfig.h"
+#include "SerialLogger.h"
+#include "Util.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#define JSON_MAX_DEPTH 8 // Deeper nesting is refused, the stack stays bounded
+
+// Read position in a JSON text that is not null-terminated
+struct JsonCursor
+{
+  const char *at;
+  const char *end;
+};
+
+static void skipSpace(JsonCursor &cursor)
+{
+  while (cursor.at < cursor.end && (*cursor.at == ' ' || *cursor.at == '\t' || *cursor.at == '\n' || *cursor.at == '\r'))
+  {
+    cursor.at++;
+  }
+}
+
+static bool consume(JsonCursor &cursor, char c)
+{
+  skipSpace(cursor);
+  if (cursor.at < cursor.end && *cursor.at == c)
+  {
+    cursor.at++;
+    return true;
+  }
+  return false;
+}
+
+static bool consumeLiteral(JsonCursor &cursor, const char *literal)
+{
+  skipSpace(cursor);
+  size_t length = strlen(literal);
+  if ((size_t)(cursor.end - cursor.at) >= length && memcmp(cursor.at, literal, length) == 0)
+  {
+    cursor.at += length;
+    return true;
+  }
+  return false;
+}
+
+// The contents of a string as they are on the wire, escapes included
+static bool readString(JsonCursor &cursor, const char *&text, size_t &length)
+{
+  if (!consume(cursor, '"'))
+  {
+    return false;
+  }
+
+  text = cursor.at;
+  while (cursor.at < cursor.end && *cursor.at != '"')
+  {
+    cursor.at += *cursor.at == '\\' ? 2 : 1;
+  }
+  if (cursor.at >= cursor.end)
+  {
+    return false;
+  }
+
+  length = (size_t)(cursor.at - text);
+  cursor.at++;
+  return true;
+}
+
+static bool readUnsigned(JsonCursor &cursor, uint32_t &value)
+{
+  skipSpace(cursor);
+  const char *start = cursor.at;
+  uint64_t result = 0;
+  while (cursor.at < cursor.end && *cursor.at >= '0' && *cursor.at <= '9' && result <= 0xffffffff)
+  {
+    result = result * 10 + (uint64_t)(*cursor.at++ - '0');
+  }
+
+  // Fractions, exponents and negative numbers are not settings
+  bool integer = cursor.at > start && result <= 0xffffffff
+                 && (cursor.at >= cursor.end || (*cursor.at != '.' && *cursor.at != 'e' && *cursor.at != 'E'));
+  value = (uint32_t)result;
+  return integer;
+}
+
+static bool isName(const char *name, size_t length, const char *expected)
+{
+  return strlen(expected) == length && memcmp(name, expected, length) == 0;
+}
+
+// Calls visit(name, nameLength, cursor) for each member of the object at the cursor; visit
+// has to read the member's value
+template <typename Visitor>
+static bool forEachMember(JsonCursor &cursor, Visitor visit)
+{
+  if (!consume(cursor, '{'))
+  {
+    return false;
+  }
+  if (consume(cursor, '}'))
+  {
+    return true;
+  }
+
+  do
+  {
+    const char *name;
+    size_t nameLength;
+    if (!readString(cursor, name, nameLength) || !consume(cursor, ':') || !visit(name, nameLength, cursor))
+    {
+      return false;
+    }
+  } while (consume(cursor, ','));
+
+  return consume(cursor, '}');
+}
+
+static bool skipValue(JsonCursor &cursor, int depth)
+{
+  skipSpace(cursor);
+  if (cursor.at >= cursor.end || depth > JSON_MAX_DEPTH)
+  {
+    return false;
+  }
+
+  const char *text;
+  size_t length;
+  switch (*cursor.at)
+  {
+  case '"':
+    return readString(cursor, text, length);
+  case '{':
+    return forEachMember(cursor, [depth](const char *, size_t, JsonCursor &value) { return skipValue(value, depth + 1); });
+  case '[':
+    cursor.at++;
+    if (consume(cursor, ']'))
+    {
+      return true;
+    }
+    do
+    {
+      if (!skipValue(cursor, depth + 1))
+      {
+        return false;
+      }
+    } while (consume(cursor, ','));
+    return consume(cursor, ']');
+  default:
+  {
+    // Number, true, false or null
+    const char *start = cursor.at;
+    while (cursor.at < cursor.end && strchr("0123456789+-.eEtruefalsn", *cursor.at) != NULL)
+    {
+      cursor.at++;
+    }
+    return cursor.at > start;
+  }
+  }
+}
+
+bool deviceConfigFindMember(const char *json, size_t length, const char *name, const char *&value, size_t &valueLength)
+{
+  JsonCursor cursor = {json, json + length};
+  bool found = false;
+  bool valid = forEachMember(cursor, [&](const char *member, size_t memberLength, JsonCursor &memberValue) {
+    skipSpace(memberValue);
+    const char *start = memberValue.at;
+    if (!skipValue(memberValue, 0))
+    {
+      return false;
+    }
+    if (!found && isName(member, memberLength, name))
+    {
+      found = true;
+      value = start;
+      valueLength = (size_t)(memberValue.at - start);
+    }
+    return true;
+  });
+  return valid && found;
+}
+
+/* Settings */
+
+struct IntegerSetting
+{
+  const char *name;
+  size_t offset; // In the struct it belongs to
+  uint8_t size;  // 1, 2 or 4 bytes
+  uint32_t min;
+  uint32_t max;
+};
+
+static const IntegerSetting occupancySettings[] = {
+    {"minHoldMs", offsetof(OccupancyConfig, minHoldMs), 4, 100, 3600000},
+    {"maxHoldMs", offsetof(OccupancyConfig, maxHoldMs), 4, 100, 3600000},
+    {"windowMs", offsetof(OccupancyConfig, windowMs), 4, 1000, 3600000},
+    {"busyEnter", offsetof(OccupancyConfig, busyEnter), 2, 1, 1000},
+    {"busyLeave", offsetof(OccupancyConfig, busyLeave), 2, 0, 1000},
+    {"missPercent", offsetof(OccupancyConfig, missPercent), 1, 1, 99},
+    {"debounceMs", offsetof(OccupancyConfig, debounceMs), 4, 0, 60000},
+};
+
+static const IntegerSetting batchSettings[] = {
+    {"maxEvents", offsetof(TelemetryBatchConfig, maxEvents), 1, 1, TELEMETRY_BATCH_MAX_EVENTS},
+    {"maxBytes", offsetof(TelemetryBatchConfig, maxBytes), 2, 64, TELEMETRY_BATCH_MAX_SIZE},
+    {"maxDelayMs", offsetof(TelemetryBatchConfig, maxDelayMs), 4, 0, 3600000},
+};
+
+static const IntegerSetting deviceSettings[] = {
+    {"heartbeatMs", offsetof(DeviceConfig, heartbeatMs), 4, 0, 86400000},
+    {"sensingPeriodMs", offsetof(DeviceConfig, sensingPeriodMs), 2, 1, 1000},
+    {"deviceIndex", offsetof(DeviceConfig, deviceIndex), 2, 0, 65535},
+    {"tokenDurationMin", offsetof(DeviceConfig, tokenDurationMin), 2, 5, 1440},
+    {"logLevel", offsetof(DeviceConfig, logLevel), 1, LOG_LEVEL_NONE, LOG_LEVEL_DEBUG},
+};
+
+template <size_t N>
+static const IntegerSetting *findSetting(const IntegerSetting (&table)[N], const char *name, size_t length)
+{
+  for (const IntegerSetting &setting : table)
+  {
+    if (isName(name, length, setting.name))
+    {
+      return &setting;
+    }
+  }
+  return NULL;
+}
+
+static void copyInteger(const IntegerSetting &setting, void *target, const void *source)
+{
+  memcpy((uint8_t *)target + setting.offset, (const uint8_t *)source + setting.offset, setting.size);
+}
+
+static void storeInteger(const IntegerSetting &setting, void *target, uint32_t value)
+{
+  uint8_t *field = (uint8_t *)target + setting.offset;
+  if (setting.size == 1)
+  {
+    *field = (uint8_t)value;
+  }
+  else if (setting.size == 2)
+  {
+    uint16_t narrow = (uint16_t)value;
+    memcpy(field, &narrow, sizeof(narrow));
+  }
+  else
+  {
+    memcpy(field, &value, sizeof(value));
+  }
+}
+
+// One document being taken into a copy of the settings
+struct ConfigUpdate
+{
+  DeviceConfig next;
+  const DeviceConfig &defaults;
+  char *error;
+  size_t errorSize;
+};
+
+static bool refuse(ConfigUpdate &update, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static bool refuse(ConfigUpdate &update, const char *format, ...)
+{
+  if (update.errorSize > 0)
+  {
+    va_list arguments;
+    va_start(arguments, format);
+    vsnprintf(update.error, update.errorSize, format, arguments);
+    va_end(arguments);
+  }
+  return false;
+}
+
+// A number within the setting's range, or null for the default (*isDefault)
+static bool readSetting(ConfigUpdate &update, const IntegerSetting &setting, JsonCursor &value, uint32_t &number, bool &isDefault)
+{
+  isDefault = consumeLiteral(value, "null");
+  if (isDefault)
+  {
+    return true;
+  }
+  if (!readUnsigned(value, number) || number < setting.min || number > setting.max)
+  {
+    return refuse(update, "%s must be %lu..%lu", setting.name, (unsigned long)setting.min, (unsigned long)setting.max);
+  }
+  return true;
+}
+
+// A string out of names[] (its index in choice), or null for the default (*isDefault)
+template <size_t N>
+static bool readChoice(ConfigUpdate &update, const char *setting, const char *const (&names)[N], JsonCursor &value, int &choice, bool &isDefault)
+{
+  const char *text;
+  size_t length;
+  isDefault = consumeLiteral(value, "null");
+  if (isDefault)
+  {
+    return true;
+  }
+  if (readString(value, text, length))
+  {
+    for (size_t i = 0; i < N; i++)
+    {
+      if (isName(text, length, names[i]))
+      {
+        choice = (int)i;
+        return true;
+      }
+    }
+  }
+  return refuse(update, "unknown %s", setting);
+}
+
+static const char *const estimatorNames[] = {"fixed", "adaptive"};   // OccupancyEstimator order
+static const char *const encodingNames[] = {"json", "cbor"};         // TelemetryEncoding order
+static const char *const transportNames[] = {"mqtt", "http", "dual"}; // TelemetryTransportMode order
+
+// One member of an occupancy object, for channels first..last
+static bool updateOccupancy(ConfigUpdate &update, const char *name, size_t length, JsonCursor &value, uint8_t first, uint8_t last)
+{
+  bool isDefault;
+  if (isName(name, length, "estimator"))
+  {
+    int estimator = 0;
+    if (!readChoice(update, "estimator", estimatorNames, value, estimator, isDefault))
+    {
+      return false;
+    }
+    for (uint8_t channel = first; channel <= last; channel++)
+    {
+      update.next.occupancy[channel].estimator = isDefault ? update.defaults.occupancy[channel].estimator : (OccupancyEstimator)estimator;
+    }
+    return true;
+  }
+
+  const IntegerSetting *setting = findSetting(occupancySettings, name, length);
+  if (setting == NULL)
+  {
+    return skipValue(value, 0); // For newer firmware
+  }
+
+  uint32_t number = 0;
+  if (!readSetting(update, *setting, value, number, isDefault))
+  {
+    return false;
+  }
+  for (uint8_t channel = first; channel <= last; channel++)
+  {
+    if (isDefault)
+    {
+      copyInteger(*setting, &update.next.occupancy[channel], &update.defaults.occupancy[channel]);
+    }
+    else
+    {
+      storeInteger(*setting, &update.next.occupancy[channel], number);
+    }
+  }
+  return true;
+}
+
+static bool updateChannels(ConfigUpdate &update, JsonCursor &value)
+{
+  return forEachMember(value, [&update](const char *name, size_t length, JsonCursor &channelValue) {
+    JsonCursor number = {name, name + length};
+    uint32_t channel;
+    if (!readUnsigned(number, channel) || number.at != number.end || channel >= HAL_CHANNELS)
+    {
+      return refuse(update, "no channel %.*s on this board", (int)(length < 8 ? length : 8), name);
+    }
+    return forEachMember(channelValue, [&update, channel](const char *member, size_t memberLength, JsonCursor &memberValue) {
+      return updateOccupancy(update, member, memberLength, memberValue, (uint8_t)channel, (uint8_t)channel);
+    });
+  });
+}
+
+static bool updateBatch(ConfigUpdate &update, JsonCursor &value)
+{
+  return forEachMember(value, [&update](const char *name, size_t length, JsonCursor &memberValue) {
+    const IntegerSetting *setting = findSetting(batchSettings, name, length);
+    if (setting == NULL)
+    {
+      return skipValue(memberValue, 0);
+    }
+
+    uint32_t number = 0;
+    bool isDefault;
+    if (!readSetting(update, *setting, memberValue, number, isDefault))
+    {
+      return false;
+    }
+    if (isDefault)
+    {
+      copyInteger(*setting, &update.next.batch, &update.defaults.batch);
+    }
+    else
+    {
+      storeInteger(*setting, &update.next.batch, number);
+    }
+    return true;
+  });
+}
+
+static bool updateMember(ConfigUpdate &update, const char *name, size_t length, JsonCursor &value)
+{
+  bool isDefault;
+  int choice = 0;
+
+  if (isName(name, length, "occupancy"))
+  {
+    return forEachMember(value, [&update](const char *member, size_t memberLength, JsonCursor &memberValue) {
+      return updateOccupancy(update, member, memberLength, memberValue, 0, HAL_CHANNELS - 1);
+    });
+  }
+  if (isName(name, length, "channels"))
+  {
+    return updateChannels(update, value);
+  }
+  if (isName(name, length, "batch"))
+  {
+    return updateBatch(update, value);
+  }
+  if (isName(name, length, "encoding"))
+  {
+    bool valid = readChoice(update, "encoding", encodingNames, value, choice, isDefault);
+    update.next.encoding = isDefault ? update.defaults.encoding : (TelemetryEncoding)choice;
+    return valid;
+  }
+  if (isName(name, length, "transport"))
+  {
+    bool valid = readChoice(update, "transport", transportNames, value, choice, isDefault);
+    update.next.transport = isDefault ? update.defaults.transport : (TelemetryTransportMode)choice;
+    return valid;
+  }
+  if (isName(name, length, "$version"))
+  {
+    return readUnsigned(value, update.next.desiredVersion) || refuse(update, "malformed $version");
+  }
+
+  const IntegerSetting *setting = findSetting(deviceSettings, name, length);
+  if (setting == NULL)
+  {
+    return skipValue(value, 0); // Other twin properties, or settings of newer firmware
+  }
+
+  uint32_t number = 0;
+  if (!readSetting(update, *setting, value, number, isDefault))
+  {
+    return false;
+  }
+  if (isDefault)
+  {
+    copyInteger(*setting, &update.next, &update.defaults);
+  }
+  else
+  {
+    storeInteger(*setting, &update.next, number);
+  }
+  return true;
+}
+
+bool deviceConfigUpdate(
+    const char *json,
+    size_t length,
+    const DeviceConfig &defaults,
+    DeviceConfig &config,
+    char *error,
+    size_t errorSize)
+{
+  ConfigUpdate update = {config, defaults, error, errorSize};
+  if (errorSize > 0)
+  {
+    error[0] = '\0';
+  }
+
+  JsonCursor cursor = {json, json + length};
+  bool valid = forEachMember(cursor, [&update](const char *name, size_t nameLength, JsonCursor &value) {
+    return updateMember(update, name, nameLength, value);
+  });
+  if (!valid)
+  {
+    return errorSize > 0 && error[0] != '\0' ? false : refuse(update, "malformed JSON");
+  }
+
+  // Settings that only make sense together
+  for (uint8_t channel = 0; channel < HAL_CHANNELS; channel++)
+  {
+    const OccupancyConfig &occupancy = update.next.occupancy[channel];
+    if (occupancy.minHoldMs > occupancy.maxHoldMs)
+    {
+      return refuse(update, "channel %u: minHoldMs above maxHoldMs", (unsigned)channel);
+    }
+    if (occupancy.busyLeave >= occupancy.busyEnter)
+    {
+      return refuse(update, "channel %u: busyLeave must be below busyEnter", (unsigned)channel);
+    }
+  }
+
+  config = update.next;
+  return true;
+}
+
+void deviceConfigApply(const DeviceConfig &config)
+{
+  // Never written from here: the sensing task is reading them
+  occupancyConfigure(config.occupancy, config.heartbeatMs);
+
+  telemetryUplinkConfigureBatching(config.batch);
+  telemetryConfigureEncoding(config.encoding, config.deviceIndex);
+  telemetryTransportSetMode(config.transport);
+  Logger.SetLevel(config.logLevel);
+}
+
+size_t deviceConfigReport(const DeviceConfig &config, int status, const char *description, char *buffer, size_t size)
+{
+  size_t position = 0;
+  bool fits = appendf(buffer, size, position, "{\"config\":{\"channels\":{");
+  for (uint8_t channel = 0; channel < HAL_CHANNELS; channel++)
+  {
+    const OccupancyConfig &occupancy = config.occupancy[channel];
+    fits = fits
+           && appendf(
+               buffer,
+               size,
+               position,
+               "%s\"%u\":{\"estimator\":\"%s\",\"minHoldMs\":%lu,\"maxHoldMs\":%lu,\"windowMs\":%lu,\"busyEnter\":%u,"
+               "\"busyLeave\":%u,\"missPercent\":%u,\"debounceMs\":%lu}",
+               channel > 0 ? "," : "",
+               (unsigned)channel,
+               estimatorNames[occupancy.estimator == OCCUPANCY_FIXED_TIMEOUT ? 0 : 1],
+               (unsigned long)occupancy.minHoldMs,
+               (unsigned long)occupancy.maxHoldMs,
+               (unsigned long)occupancy.windowMs,
+               (unsigned)occupancy.busyEnter,
+               (unsigned)occupancy.busyLeave,
+               (unsigned)occupancy.missPercent,
+               (unsigned long)occupancy.debounceMs);
+  }
+
+  fits = fits
+         && appendf(
+             buffer,
+             size,
+             position,
+             "},\"heartbeatMs\":%lu,\"sensingPeriodMs\":%u,\"batch\":{\"maxEvents\":%u,\"maxBytes\":%u,\"maxDelayMs\":%lu},"
+             "\"encoding\":\"%s\",\"deviceIndex\":%u,\"transport\":\"%s\",\"tokenDurationMin\":%u,\"logLevel\":%u},"
+             "\"configAck\":{\"version\":%lu,\"status\":%d,\"description\":\"%s\"}}",
+             (unsigned long)config.heartbeatMs,
+             (unsigned)config.sensingPeriodMs,
+             (unsigned)config.batch.maxEvents,
+             (unsigned)config.batch.maxBytes,
+             (unsigned long)config.batch.maxDelayMs,
+             encodingNames[config.encoding == TELEMETRY_ENCODING_CBOR ? 1 : 0],
+             (unsigned)config.deviceIndex,
+             telemetryTransportModeName(config.transport),
+             (unsigned)config.tokenDurationMin,
+             (unsigned)config.logLevel,
+             (unsigned long)config.desiredVersion,
+             status,
+             description);
+  return fits ? position : 0;
+}
+
+bool deviceCommandDispatch(const DeviceCommand *commands, size_t count, const char *payload, size_t length)
+{
+  const char *name = NULL;
+  const char *args = NULL;
+  size_t nameLength = 0, argsLength = 0;
+
+  JsonCursor cursor = {payload, payload + length};
+  bool valid = forEachMember(cursor, [&](const char *member, size_t memberLength, JsonCursor &value) {
+    if (isName(member, memberLength, "command"))
+    {
+      return readString(value, name, nameLength);
+    }
+    skipSpace(value);
+    const char *start = value.at;
+    if (!skipValue(value, 0))
+    {
+      return false;
+    }
+    if (isName(member, memberLength, "args"))
+    {
+      args = start;
+      argsLength = (size_t)(value.at - start);
+    }
+    return true;
+  });
+
+  if (!valid || name == NULL)
+  {
+    LOG_WARN("Cloud-to-device message is not a command (%u bytes)", (unsigned)length);
+    return false;
+  }
+
+  for (size_t i = 0; i < count; i++)
+  {
+    if (isName(name, nameLength, commands[i].name))
+    {
+      LOG_INFO("Command \"%s\"", commands[i].name);
+      return commands[i].handler(args, argsLength);
+    }
+  }
+
+  LOG_WARN("Unknown command \"%.*s\"", (int)(nameLength < 32 ? nameLength : 32), name);
+  return false;
+}
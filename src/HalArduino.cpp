@@ -0,0 +1,179 @@
+#include <Arduino.h>
+#include <driver/gpio.h>
+#include <esp_sleep.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <sys/time.h>
+#include "Hal.h"
+
+// The network side is not part of the HAL: telemetry goes through TelemetryTransport, whose
+// MQTT and HTTP backends live in main.cpp next to the clients they use.
+
+// esp_timer starts from 0 after deep sleep; the offset keeps halMicros() counting across it,
+// so that the retained occupancy timestamps stay comparable with new ones
+HAL_RETAINED_ATTR static int64_t microsOffset = 0;
+HAL_RETAINED_ATTR static uint64_t sleepStartMicros = 0;
+HAL_RETAINED_ATTR static int64_t sleepStartRtcUs = 0;
+static HalWakeCause wakeCause = HAL_WAKE_NONE;
+
+// The ISR reads the PIR pins from here: internal RAM, reachable while the flash cache is off
+DRAM_ATTR static gpio_num_t pirPins[HAL_CHANNELS];
+
+#ifndef HAL_DEEP_SLEEP_POLL_US
+#define HAL_DEEP_SLEEP_POLL_US 1000000 // See halSleep()
+#endif
+
+// Wall clock in µs; the RTC keeps it running in deep sleep
+static int64_t rtcMicros()
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+void halSetupPins()
+{
+  esp_sleep_wakeup_cause_t cause = esp_sleep_get_wakeup_cause();
+  if (esp_reset_reason() == ESP_RST_DEEPSLEEP && sleepStartRtcUs != 0)
+  {
+    microsOffset = (int64_t)sleepStartMicros + (rtcMicros() - sleepStartRtcUs) - esp_timer_get_time();
+    wakeCause = cause == ESP_SLEEP_WAKEUP_TIMER ? HAL_WAKE_TIMER : HAL_WAKE_PIR;
+  }
+  else
+  {
+    microsOffset = 0;
+    wakeCause = HAL_WAKE_NONE;
+  }
+  sleepStartRtcUs = 0;
+
+  for (uint8_t channel = 0; channel < HAL_CHANNELS; channel++)
+  {
+    const HalChannelPins &pins = halChannelPins[channel];
+    pirPins[channel] = (gpio_num_t)pins.pir;
+    pinMode(pins.pir, INPUT);
+    pinMode(pins.red, OUTPUT);
+    pinMode(pins.green, OUTPUT);
+  }
+}
+
+unsigned long halMillis() { return millis(); }
+
+uint64_t IRAM_ATTR halMicros() { return (uint64_t)(esp_timer_get_time() + microsOffset); }
+
+time_t halTime() { return time(NULL); }
+
+int halReadPir(uint8_t channel) { return gpio_get_level(pirPins[channel]); }
+
+static HalEdgeHandler pirEdgeHandler = NULL;
+
+// All channels' handlers run from the one GPIO interrupt, so the edges of different
+// channels never race each other into the capture queue
+static void IRAM_ATTR onPirInterrupt(void *arg)
+{
+  uint8_t channel = (uint8_t)(uintptr_t)arg;
+  pirEdgeHandler(channel, gpio_get_level(pirPins[channel]), halMicros());
+}
+
+void halAttachPirInterrupt(HalEdgeHandler handler)
+{
+  pirEdgeHandler = handler;
+  for (uint8_t channel = 0; channel < HAL_CHANNELS; channel++)
+  {
+    attachInterruptArg(digitalPinToInterrupt(halChannelPins[channel].pir), onPirInterrupt, (void *)(uintptr_t)channel, CHANGE);
+  }
+}
+
+void halSetOccupancyLed(uint8_t channel, bool occupied)
+{
+  digitalWrite(halChannelPins[channel].red, occupied ? HIGH : LOW);
+  digitalWrite(halChannelPins[channel].green, occupied ? LOW : HIGH);
+}
+
+HalWakeCause halSleep(bool deep, const int *wakeLevels, uint64_t timeoutUs)
+{
+  for (uint8_t channel = 0; channel < HAL_CHANNELS; channel++)
+  {
+    if (gpio_get_level(pirPins[channel]) == wakeLevels[channel])
+    {
+      wakeCause = HAL_WAKE_PIR; // Changed just now, the interrupt has it
+      return wakeCause;
+    }
+  }
+
+  esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_ALL);
+
+  if (deep)
+  {
+    if (HAL_CHANNELS == 1)
+    {
+      // ext0 keeps the RTC peripherals powered, the price of waking on a single pin's level
+      esp_sleep_enable_ext0_wakeup(pirPins[0], wakeLevels[0]);
+    }
+    else
+    {
+      // ext1 wakes on any of several pins going high, but cannot wait for one of them to go
+      // low. Channels whose PIR is still high are polled instead: their falling edge is seen
+      // up to HAL_DEEP_SLEEP_POLL_US late, which only delays when the room can become free.
+      uint64_t mask = 0;
+      for (uint8_t channel = 0; channel < HAL_CHANNELS; channel++)
+      {
+        if (wakeLevels[channel] == HIGH)
+        {
+          mask |= 1ULL << pirPins[channel];
+        }
+        else if (timeoutUs == 0 || timeoutUs > HAL_DEEP_SLEEP_POLL_US)
+        {
+          timeoutUs = HAL_DEEP_SLEEP_POLL_US;
+        }
+      }
+      if (mask != 0)
+      {
+        esp_sleep_enable_ext1_wakeup(mask, ESP_EXT1_WAKEUP_ANY_HIGH);
+      }
+    }
+    if (timeoutUs > 0)
+    {
+      esp_sleep_enable_timer_wakeup(timeoutUs);
+    }
+    sleepStartMicros = halMicros();
+    sleepStartRtcUs = rtcMicros();
+    esp_deep_sleep_start(); // Never returns, the next boot goes through setup() again
+  }
+
+  if (timeoutUs > 0)
+  {
+    esp_sleep_enable_timer_wakeup(timeoutUs);
+  }
+
+  // The GPIO wake-up needs a level interrupt type; the edge interrupts stay off meanwhile
+  for (uint8_t channel = 0; channel < HAL_CHANNELS; channel++)
+  {
+    gpio_intr_disable(pirPins[channel]);
+    gpio_wakeup_enable(pirPins[channel], wakeLevels[channel] == HIGH ? GPIO_INTR_HIGH_LEVEL : GPIO_INTR_LOW_LEVEL);
+  }
+  esp_sleep_enable_gpio_wakeup();
+
+  esp_light_sleep_start();
+
+  wakeCause = esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER ? HAL_WAKE_TIMER : HAL_WAKE_PIR;
+  esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_ALL);
+
+  // The edges that woke us came while the interrupts were off. All are reported before any
+  // interrupt is back on, the capture queue takes one producer at a time.
+  for (uint8_t channel = 0; channel < HAL_CHANNELS; channel++)
+  {
+    gpio_wakeup_disable(pirPins[channel]);
+    gpio_set_intr_type(pirPins[channel], GPIO_INTR_ANYEDGE);
+    if (pirEdgeHandler != NULL)
+    {
+      pirEdgeHandler(channel, gpio_get_level(pirPins[channel]), halMicros());
+    }
+  }
+  for (uint8_t channel = 0; channel < HAL_CHANNELS; channel++)
+  {
+    gpio_intr_enable(pirPins[channel]);
+  }
+  return wakeCause;
+}
+
+HalWakeCause halWakeCause() { return wakeCause; }
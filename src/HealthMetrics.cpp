@@ -0,0 +1,154 @@
+#include "HealthMetrics.h"
+#include "SerialLogger.h"
+#include "Util.h"
+#include <string.h>
+
+static HealthTimers health;
+
+static const char *const timerNames[HEALTH_TIMER_COUNT] = {
+    "sensingStep",
+    "networkPass",
+    "edgeToSend",
+    "mqttSend",
+    "httpSend",
+    "httpResponse",
+    "mqttConnect",
+    "httpConnect",
+};
+
+void healthRecord(HealthTimer timer, uint32_t us) { healthHistogramAdd(health.timers[timer], us); }
+
+void healthHistogramAdd(HealthHistogram &histogram, uint32_t us)
+{
+  int bucket = us < 16 ? 0 : 32 - __builtin_clz(us) - 4;
+  histogram.counts[bucket < HEALTH_BUCKETS ? bucket : HEALTH_BUCKETS - 1]++;
+  histogram.totalUs += us;
+  if (us > histogram.maxUs)
+  {
+    histogram.maxUs = us;
+  }
+}
+
+const HealthHistogram &healthHistogram(HealthTimer timer) { return health.timers[timer]; }
+
+const char *healthTimerName(HealthTimer timer) { return timerNames[timer]; }
+
+static uint32_t countOf(const HealthHistogram &histogram)
+{
+  uint32_t count = 0;
+  for (uint32_t bucketCount : histogram.counts)
+  {
+    count += bucketCount;
+  }
+  return count;
+}
+
+uint32_t healthPercentile(const HealthHistogram &histogram, uint8_t percent)
+{
+  uint32_t count = countOf(histogram);
+  if (count == 0)
+  {
+    return 0;
+  }
+
+  uint64_t rank = ((uint64_t)count * percent + 99) / 100; // The sample at or below which percent of them are
+  uint64_t seen = 0;
+  for (int bucket = 0; bucket < HEALTH_BUCKETS - 1; bucket++)
+  {
+    seen += histogram.counts[bucket];
+    if (seen >= rank && seen > 0)
+    {
+      uint32_t upper = 16UL << bucket;
+      return upper < histogram.maxUs ? upper : histogram.maxUs;
+    }
+  }
+  return histogram.maxUs; // The open-ended last bucket
+}
+
+// What was recorded after since; since becomes the current state
+static HealthHistogram interval(HealthHistogram &since, const HealthHistogram &now)
+{
+  HealthHistogram delta = now;
+  for (int bucket = 0; bucket < HEALTH_BUCKETS; bucket++)
+  {
+    delta.counts[bucket] -= since.counts[bucket];
+  }
+  delta.totalUs -= since.totalUs;
+  since = now;
+  return delta;
+}
+
+size_t healthReport(const HealthGauges &gauges, HealthTimers *since, char *buffer, size_t size)
+{
+  HealthTimers now = health; // One copy, so that each timer's figures belong together
+
+  size_t position = 0;
+  bool fits = appendf(
+      buffer,
+      size,
+      position,
+      "{\"health\":{\"uptimeS\":%lu,\"heap\":{\"free\":%lu,\"min\":%lu,\"largestBlock\":%lu},"
+      "\"stackFree\":{\"sensing\":%lu,\"network\":%lu,\"logger\":%lu},\"queueHighWater\":%lu,\"queueDropped\":%lu,"
+      "\"journalDepth\":%lu,\"reconnects\":%lu,\"logDropped\":%lu,\"timers\":{",
+      (unsigned long)gauges.uptimeS,
+      (unsigned long)gauges.freeHeap,
+      (unsigned long)gauges.minFreeHeap,
+      (unsigned long)gauges.largestFreeBlock,
+      (unsigned long)gauges.sensingStackFree,
+      (unsigned long)gauges.networkStackFree,
+      (unsigned long)gauges.loggerStackFree,
+      (unsigned long)gauges.queueHighWater,
+      (unsigned long)gauges.queueDropped,
+      (unsigned long)gauges.journalDepth,
+      (unsigned long)gauges.reconnects,
+      (unsigned long)gauges.logDropped);
+
+  for (int timer = 0; timer < HEALTH_TIMER_COUNT; timer++)
+  {
+    HealthHistogram histogram = since != NULL ? interval(since->timers[timer], now.timers[timer]) : now.timers[timer];
+    uint32_t count = countOf(histogram);
+    fits = fits
+           && appendf(
+               buffer,
+               size,
+               position,
+               "%s\"%s\":{\"n\":%lu,\"meanUs\":%lu,\"p50Us\":%lu,\"p99Us\":%lu,\"maxUs\":%lu}",
+               timer > 0 ? "," : "",
+               timerNames[timer],
+               (unsigned long)count,
+               (unsigned long)(count > 0 ? histogram.totalUs / count : 0),
+               (unsigned long)healthPercentile(histogram, 50),
+               (unsigned long)healthPercentile(histogram, 99),
+               (unsigned long)histogram.maxUs);
+  }
+
+  fits = fits && appendf(buffer, size, position, "}}}");
+  return fits ? position : 0;
+}
+
+void healthLog(const HealthGauges &gauges)
+{
+  LOG_INFO(
+      "Health: up %lu s; heap %lu free, %lu min, %lu largest block; stack free sensing %lu, network %lu, logger %lu",
+      (unsigned long)gauges.uptimeS,
+      (unsigned long)gauges.freeHeap,
+      (unsigned long)gauges.minFreeHeap,
+      (unsigned long)gauges.largestFreeBlock,
+      (unsigned long)gauges.sensingStackFree,
+      (unsigned long)gauges.networkStackFree,
+      (unsigned long)gauges.loggerStackFree);
+
+  for (int timer = 0; timer < HEALTH_TIMER_COUNT; timer++)
+  {
+    const HealthHistogram &histogram = health.timers[timer];
+    uint32_t count = countOf(histogram);
+    LOG_INFO(
+        "Health %s: %lu, mean %lu us, p50 %lu us, p99 %lu us, max %lu us",
+        timerNames[timer],
+        (unsigned long)count,
+        (unsigned long)(count > 0 ? histogram.totalUs / count : 0),
+        (unsigned long)healthPercentile(histogram, 50),
+        (unsigned long)healthPercentile(histogram, 99),
+        (unsigned long)histogram.maxUs);
+  }
+}
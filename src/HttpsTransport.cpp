@@ -0,0 +1,510 @@
+#include "HttpsTransport.h"
+#include "HealthMetrics.h"
+#include "SerialLogger.h"
+#include <WiFi.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HTTPS_DEFAULT_PORT 443
+#define MAX_RESPONSE_BODY 8192 // More than this is not an Azure Function answer; read no further
+#define CONNECT_RETRY_MS 30000 // After a failed connect, requests wait (and new ones may be dropped)
+
+HttpsTransport::HttpsTransport()
+{
+  this->host[0] = '\0';
+  this->path[0] = '\0';
+  this->port = HTTPS_DEFAULT_PORT;
+  this->timeoutSeconds = 10;
+  this->queueHead = 0;
+  this->queueCount = 0;
+  this->outcomeHead = 0;
+  this->outcomeCount = 0;
+  this->state = IDLE;
+  this->requestStart = 0;
+  this->lineLength = 0;
+  this->status = 0;
+  this->keepAlive = false;
+  this->chunked = false;
+  this->remaining = 0;
+  this->bodyRead = 0;
+  this->received = false;
+  this->reused = false;
+  this->retried = false;
+  this->snippetLength = 0;
+  this->connectFailedAt = 0;
+  this->connectFailed = false;
+  memset(&this->stats, 0, sizeof(this->stats));
+}
+
+// https://host[:port]/path?query
+bool HttpsTransport::Begin(const char* url, const char* caCert, uint16_t timeoutSeconds)
+{
+  const char* scheme = "https://";
+  if (strncmp(url, scheme, strlen(scheme)) != 0)
+  {
+    LOG_ERROR("HTTPS transport needs an https:// URL: %s", url);
+    return false;
+  }
+
+  const char* hostStart = url + strlen(scheme);
+  const char* pathStart = strchr(hostStart, '/');
+  if (pathStart == NULL)
+  {
+    pathStart = hostStart + strlen(hostStart);
+  }
+  const char* portStart = (const char*)memchr(hostStart, ':', pathStart - hostStart);
+  const char* hostEnd = portStart != NULL ? portStart : pathStart;
+
+  if (hostEnd == hostStart || (size_t)(hostEnd - hostStart) >= sizeof(this->host)
+      || strlen(pathStart) + 2 > sizeof(this->path))
+  {
+    LOG_ERROR("HTTPS transport URL too long or without a host: %s", url);
+    return false;
+  }
+
+  memcpy(this->host, hostStart, hostEnd - hostStart);
+  this->host[hostEnd - hostStart] = '\0';
+  this->port = portStart != NULL ? (uint16_t)atoi(portStart + 1) : HTTPS_DEFAULT_PORT;
+  snprintf(this->path, sizeof(this->path), "%s", *pathStart != '\0' ? pathStart : "/");
+  this->timeoutSeconds = timeoutSeconds;
+
+  if (caCert != NULL)
+  {
+    this->client.setCACert(caCert);
+  }
+  else
+  {
+    LOG_WARN("HTTPS transport: no CA certificate, the server certificate is not verified");
+    this->client.setInsecure();
+  }
+  this->client.setHandshakeTimeout(timeoutSeconds);
+
+  return true;
+}
+
+// Called from the network task only, like Loop(), so the queue needs no lock
+bool HttpsTransport::Post(const char* contentType, const char* body, size_t length)
+{
+  return Post(contentType, body, length, NULL);
+}
+
+bool HttpsTransport::Post(const char* contentType, const char* body, size_t length, const char* messageId)
+{
+  if (this->host[0] == '\0')
+  {
+    return false;
+  }
+  if (this->queueCount + this->outcomeCount >= HTTPS_TRANSPORT_QUEUE_SIZE || length > HTTPS_TRANSPORT_BODY_SIZE)
+  {
+    this->stats.dropped++;
+    return false;
+  }
+
+  Request& request = this->queue[(this->queueHead + this->queueCount) % HTTPS_TRANSPORT_QUEUE_SIZE];
+  request.contentType = contentType;
+  snprintf(request.messageId, sizeof(request.messageId), "%s", messageId != NULL ? messageId : "");
+  request.length = length;
+  memcpy(request.body, body, length);
+  this->queueCount++;
+  return true;
+}
+
+bool HttpsTransport::TakeOutcome(bool& delivered)
+{
+  if (this->outcomeCount == 0)
+  {
+    return false;
+  }
+
+  delivered = this->outcomes[this->outcomeHead];
+  this->outcomeHead = (this->outcomeHead + 1) % HTTPS_TRANSPORT_QUEUE_SIZE;
+  this->outcomeCount--;
+  return true;
+}
+
+void HttpsTransport::Loop()
+{
+  if (this->state == IDLE && !this->startRequest())
+  {
+    return;
+  }
+
+  // Take whatever has arrived, never wait for more
+  uint8_t buffer[128];
+  int available;
+  while (this->state != IDLE && (available = this->client.available()) > 0)
+  {
+    int count = this->client.read(buffer, available < (int)sizeof(buffer) ? available : sizeof(buffer));
+    if (count <= 0)
+    {
+      break;
+    }
+
+    this->received = true;
+    for (int i = 0; i < count && this->state != IDLE; i++)
+    {
+      consume(buffer[i]);
+    }
+  }
+
+  if (this->state == IDLE)
+  {
+    return;
+  }
+
+  if (!this->client.connected() && this->client.available() == 0)
+  {
+    if (this->state == BODY && this->remaining < 0)
+    {
+      finish(true); // Body delimited by the server closing the connection
+    }
+    else if (this->reused && !this->received && !this->retried)
+    {
+      // The server dropped the idle connection just as we reused it: send again on a new one
+      LOG_DEBUG("HTTPS keep-alive connection closed by the server, retrying");
+      this->client.stop();
+      this->state = IDLE;
+      this->retried = true;
+    }
+    else
+    {
+      LOG_WARN("HTTPS connection closed before the response was complete");
+      this->keepAlive = false;
+      finish(false);
+    }
+  }
+  else if (millis() - this->requestStart > (unsigned long)this->timeoutSeconds * 1000)
+  {
+    LOG_WARN("HTTPS response timed out after %u s", this->timeoutSeconds);
+    this->keepAlive = false;
+    finish(false);
+  }
+}
+
+void HttpsTransport::Close()
+{
+  this->client.stop();
+  this->state = IDLE;
+}
+
+bool HttpsTransport::IsIdle() const { return this->state == IDLE && this->queueCount == 0; }
+
+bool HttpsTransport::IsReachable() const
+{
+  return !this->connectFailed || millis() - this->connectFailedAt >= CONNECT_RETRY_MS;
+}
+
+int HttpsTransport::GetLastStatus() const { return this->status; }
+
+const HttpsTransportStats& HttpsTransport::GetStats() const { return this->stats; }
+
+// Sends the oldest queued request, on the open connection if there is one
+bool HttpsTransport::startRequest()
+{
+  if (this->queueCount == 0 || WiFi.status() != WL_CONNECTED || !IsReachable())
+  {
+    return false;
+  }
+
+  this->reused = this->client.connected();
+  if (!this->reused && !connect())
+  {
+    this->stats.failures++;
+    this->connectFailed = true;
+    this->connectFailedAt = millis();
+    return false;
+  }
+  this->connectFailed = false;
+
+  this->requestStart = millis();
+  this->state = STATUS_LINE;
+  this->lineLength = 0;
+  this->status = 0;
+  this->keepAlive = false;
+  this->chunked = false;
+  this->remaining = -1;
+  this->bodyRead = 0;
+  this->received = false;
+  this->snippetLength = 0;
+
+  if (!sendRequest(this->queue[this->queueHead]))
+  {
+    this->client.stop();
+    if (this->reused && !this->retried)
+    {
+      this->state = IDLE; // Stale connection, the next Loop() opens a new one
+      this->retried = true;
+    }
+    else
+    {
+      LOG_WARN("HTTPS request could not be written");
+      finish(false);
+    }
+    return false;
+  }
+
+  return true;
+}
+
+// The one blocking step: TCP connect and TLS handshake, both bounded by timeoutSeconds
+bool HttpsTransport::connect()
+{
+  unsigned long start = millis();
+  this->client.stop();
+
+  bool connected = this->client.connect(this->host, this->port, (int32_t)this->timeoutSeconds * 1000);
+  healthRecord(HEALTH_HTTP_CONNECT, (millis() - start) * 1000);
+  if (!connected)
+  {
+    LOG_ERROR("HTTPS connection to %s:%u failed", this->host, this->port);
+    return false;
+  }
+
+  this->stats.connects++;
+  this->stats.connectMs = millis() - start;
+  LOG_INFO("HTTPS connected to %s in %lu ms", this->host, this->stats.connectMs);
+  return true;
+}
+
+bool HttpsTransport::sendRequest(const Request& request)
+{
+  char portSuffix[8] = "";
+  if (this->port != HTTPS_DEFAULT_PORT)
+  {
+    snprintf(portSuffix, sizeof(portSuffix), ":%u", this->port);
+  }
+
+  char messageIdHeader[HTTPS_TRANSPORT_MESSAGE_ID_SIZE + 20] = "";
+  if (request.messageId[0] != '\0')
+  {
+    snprintf(messageIdHeader, sizeof(messageIdHeader), "X-Message-Id: %s\r\n", request.messageId);
+  }
+
+  char header[sizeof(this->path) + sizeof(this->host) + sizeof(messageIdHeader) + 160];
+  int length = snprintf(
+      header,
+      sizeof(header),
+      "POST %s HTTP/1.1\r\n"
+      "Host: %s%s\r\n"
+      "Content-Type: %s\r\n"
+      "Content-Length: %u\r\n"
+      "%s"
+      "Connection: keep-alive\r\n"
+      "\r\n",
+      this->path,
+      this->host,
+      portSuffix,
+      request.contentType,
+      (unsigned int)request.length,
+      messageIdHeader);
+
+  if (length <= 0 || length >= (int)sizeof(header))
+  {
+    return false;
+  }
+
+  return this->client.write((const uint8_t*)header, length) == (size_t)length
+         && this->client.write((const uint8_t*)request.body, request.length) == request.length;
+}
+
+// Feeds one response byte to the parser: line by line for the status, headers and chunk
+// sizes, counted for the body, of which only the first bytes are kept
+void HttpsTransport::consume(uint8_t c)
+{
+  if (this->state == BODY || this->state == CHUNK_DATA)
+  {
+    if (this->snippetLength < sizeof(this->snippet) - 1)
+    {
+      this->snippet[this->snippetLength++] = (char)c;
+    }
+
+    if (++this->bodyRead > MAX_RESPONSE_BODY)
+    {
+      LOG_WARN("HTTPS response body over %d bytes, closing", MAX_RESPONSE_BODY);
+      this->keepAlive = false;
+      finish(true);
+    }
+    else if (this->remaining > 0 && --this->remaining == 0)
+    {
+      if (this->state == BODY)
+      {
+        finish(true);
+      }
+      else
+      {
+        this->state = CHUNK_END;
+      }
+    }
+    return;
+  }
+
+  if (c == '\n')
+  {
+    if (this->lineLength > 0 && this->line[this->lineLength - 1] == '\r')
+    {
+      this->lineLength--;
+    }
+    this->line[this->lineLength] = '\0';
+    this->lineLength = 0;
+    processLine();
+  }
+  else if (this->lineLength < sizeof(this->line) - 1)
+  {
+    this->line[this->lineLength++] = (char)c; // Longer lines are cut, nothing we need is that long
+  }
+}
+
+static bool headerIs(const char* line, const char* name, const char** value)
+{
+  size_t length = strlen(name);
+  if (strncasecmp(line, name, length) != 0 || line[length] != ':')
+  {
+    return false;
+  }
+
+  *value = line + length + 1;
+  while (**value == ' ' || **value == '\t')
+  {
+    (*value)++;
+  }
+  return true;
+}
+
+void HttpsTransport::processLine()
+{
+  const char* value;
+
+  switch (this->state)
+  {
+    case STATUS_LINE:
+    {
+      int minor;
+      if (sscanf(this->line, "HTTP/1.%d %d", &minor, &this->status) != 2)
+      {
+        LOG_WARN("HTTPS response without a status line");
+        this->keepAlive = false;
+        finish(false);
+        return;
+      }
+      this->keepAlive = minor >= 1; // HTTP/1.0 closes unless told otherwise
+      this->state = HEADERS;
+      break;
+    }
+
+    case HEADERS:
+      if (this->line[0] == '\0')
+      {
+        endHeaders();
+      }
+      else if (headerIs(this->line, "Content-Length", &value))
+      {
+        this->remaining = strtol(value, NULL, 10);
+      }
+      else if (headerIs(this->line, "Transfer-Encoding", &value))
+      {
+        this->chunked = strstr(value, "chunked") != NULL;
+      }
+      else if (headerIs(this->line, "Connection", &value))
+      {
+        if (strncasecmp(value, "close", 5) == 0)
+        {
+          this->keepAlive = false;
+        }
+        else if (strncasecmp(value, "keep-alive", 10) == 0)
+        {
+          this->keepAlive = true;
+        }
+      }
+      break;
+
+    case CHUNK_SIZE:
+      this->remaining = strtol(this->line, NULL, 16);
+      this->state = this->remaining > 0 ? CHUNK_DATA : TRAILERS;
+      break;
+
+    case CHUNK_END:
+      this->state = CHUNK_SIZE; // The CRLF after the chunk data
+      break;
+
+    case TRAILERS:
+      if (this->line[0] == '\0')
+      {
+        finish(true);
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+void HttpsTransport::endHeaders()
+{
+  if (this->status >= 100 && this->status < 200)
+  {
+    this->state = STATUS_LINE; // 100 Continue and friends, the real response follows
+    this->remaining = -1;
+    this->chunked = false;
+  }
+  else if (this->status == 204 || this->status == 304 || (!this->chunked && this->remaining == 0))
+  {
+    finish(true);
+  }
+  else if (this->chunked)
+  {
+    this->state = CHUNK_SIZE;
+  }
+  else
+  {
+    if (this->remaining < 0)
+    {
+      this->keepAlive = false; // Neither length nor chunks: the body ends when the server closes
+    }
+    this->state = BODY;
+  }
+}
+
+// Ends the request at the head of the queue; success means a complete response was read.
+// Either way the request is gone and its outcome waits for TakeOutcome().
+void HttpsTransport::finish(bool success)
+{
+  success = success && this->status >= 200 && this->status < 300;
+  unsigned long elapsed = millis() - this->requestStart;
+
+  if (success)
+  {
+    this->stats.requests++;
+    LOG_DEBUG(
+        "HTTPS %d in %lu ms: %.*s", this->status, elapsed, (int)this->snippetLength, this->snippet);
+  }
+  else
+  {
+    this->stats.failures++;
+    if (this->status != 0)
+    {
+      LOG_WARN("HTTPS status %d: %.*s", this->status, (int)this->snippetLength, this->snippet);
+    }
+  }
+
+  if (this->state != IDLE)
+  {
+    healthRecord(HEALTH_HTTP_RESPONSE, elapsed * 1000);
+    this->stats.lastMs = elapsed;
+    if (elapsed > this->stats.maxMs)
+    {
+      this->stats.maxMs = elapsed;
+    }
+  }
+
+  if (!this->keepAlive)
+  {
+    this->client.stop();
+  }
+
+  this->outcomes[(this->outcomeHead + this->outcomeCount) % HTTPS_TRANSPORT_QUEUE_SIZE] = success;
+  this->outcomeCount++;
+  this->queueHead = (this->queueHead + 1) % HTTPS_TRANSPORT_QUEUE_SIZE;
+  this->queueCount--;
+  this->state = IDLE;
+  this->retried = false;
+}
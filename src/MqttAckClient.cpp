@@ -0,0 +1,58 @@
+#include "MqttAckClient.h"
+
+MqttAckClient::MqttAckClient(Client& client, MqttPublisher& publisher) : client(client), publisher(publisher) {}
+
+int MqttAckClient::connect(IPAddress ip, uint16_t port)
+{
+  this->publisher.Reset();
+  return this->client.connect(ip, port);
+}
+
+int MqttAckClient::connect(const char* host, uint16_t port)
+{
+  this->publisher.Reset();
+  return this->client.connect(host, port);
+}
+
+size_t MqttAckClient::write(uint8_t byte) { return this->client.write(byte); }
+
+size_t MqttAckClient::write(const uint8_t* buffer, size_t size) { return this->client.write(buffer, size); }
+
+int MqttAckClient::available() { return this->client.available(); }
+
+int MqttAckClient::read()
+{
+  int byte = this->client.read();
+  if (byte >= 0)
+  {
+    uint8_t value = (uint8_t)byte;
+    this->publisher.Feed(&value, 1, millis());
+  }
+  return byte;
+}
+
+int MqttAckClient::read(uint8_t* buffer, size_t size)
+{
+  int count = this->client.read(buffer, size);
+  if (count > 0)
+  {
+    this->publisher.Feed(buffer, count, millis());
+  }
+  return count;
+}
+
+int MqttAckClient::peek() { return this->client.peek(); }
+
+void MqttAckClient::flush() { this->client.flush(); }
+
+void MqttAckClient::stop() { this->client.stop(); }
+
+uint8_t MqttAckClient::connected() { return this->client.connected(); }
+
+MqttAckClient::operator bool() { return (bool)this->client; }
+
+// One write, so the whole PUBLISH goes out in one TLS record
+bool MqttAckClient::WritePacket(const uint8_t* packet, size_t length)
+{
+  return this->client.write(packet, length) == length;
+}
@@ -0,0 +1,160 @@
+#include "MqttCodec.h"
+#include <string.h>
+
+#define MQTT_MAX_REMAINING_LENGTH 268435455UL // Four length bytes
+
+static size_t remainingLengthSize(size_t length) { return length < 128 ? 1 : length < 16384 ? 2 : length < 2097152 ? 3 : 4; }
+
+static uint8_t *writeRemainingLength(uint8_t *out, size_t length)
+{
+  do
+  {
+    uint8_t digit = length % 128;
+    length /= 128;
+    *out++ = length > 0 ? (digit | 0x80) : digit;
+  } while (length > 0);
+  return out;
+}
+
+static uint8_t *writeUint16(uint8_t *out, uint16_t value)
+{
+  *out++ = value >> 8;
+  *out++ = value & 0xff;
+  return out;
+}
+
+static uint8_t *writeString(uint8_t *out, const char *value, size_t length)
+{
+  out = writeUint16(out, (uint16_t)length);
+  memcpy(out, value, length);
+  return out + length;
+}
+
+size_t mqttEncodeConnect(
+    uint8_t *buffer,
+    size_t size,
+    const char *clientId,
+    const char *username,
+    const char *password,
+    uint16_t keepAliveSeconds)
+{
+  size_t clientIdLength = strlen(clientId);
+  size_t usernameLength = username != NULL ? strlen(username) : 0;
+  size_t passwordLength = password != NULL ? strlen(password) : 0;
+  if (clientIdLength > 0xffff || usernameLength > 0xffff || passwordLength > 0xffff)
+  {
+    return 0;
+  }
+
+  size_t remaining = 10 + 2 + clientIdLength + (username != NULL ? 2 + usernameLength : 0)
+                     + (password != NULL ? 2 + passwordLength : 0);
+  if (1 + remainingLengthSize(remaining) + remaining > size)
+  {
+    return 0;
+  }
+
+  uint8_t flags = 0x02; // Clean session
+  flags |= username != NULL ? 0x80 : 0;
+  flags |= password != NULL ? 0x40 : 0;
+
+  uint8_t *out = buffer;
+  *out++ = MQTT_PACKET_CONNECT;
+  out = writeRemainingLength(out, remaining);
+  out = writeString(out, "MQTT", 4);
+  *out++ = 4; // Protocol level 3.1.1
+  *out++ = flags;
+  out = writeUint16(out, keepAliveSeconds);
+  out = writeString(out, clientId, clientIdLength);
+  if (username != NULL)
+  {
+    out = writeString(out, username, usernameLength);
+  }
+  if (password != NULL)
+  {
+    out = writeString(out, password, passwordLength);
+  }
+  return out - buffer;
+}
+
+size_t mqttEncodePublish(
+    uint8_t *buffer,
+    size_t size,
+    const char *topic,
+    const uint8_t *payload,
+    size_t length,
+    uint16_t packetId)
+{
+  size_t topicLength = strlen(topic);
+  size_t remaining = 2 + topicLength + 2 + length;
+  if (topicLength > 0xffff || packetId == 0 || remaining > MQTT_MAX_REMAINING_LENGTH
+      || 1 + remainingLengthSize(remaining) + remaining > size)
+  {
+    return 0;
+  }
+
+  uint8_t *out = buffer;
+  *out++ = MQTT_PACKET_PUBLISH | MQTT_PUBLISH_QOS1;
+  out = writeRemainingLength(out, remaining);
+  out = writeString(out, topic, topicLength);
+  out = writeUint16(out, packetId);
+  memcpy(out, payload, length);
+  return out + length - buffer;
+}
+
+MqttPacketScanner::MqttPacketScanner() { Reset(); }
+
+void MqttPacketScanner::Reset()
+{
+  this->state = FIXED_HEADER;
+  this->type = 0;
+  this->remaining = 0;
+  this->lengthShift = 0;
+  this->position = 0;
+  this->packetId = 0;
+}
+
+uint16_t MqttPacketScanner::Feed(uint8_t byte)
+{
+  switch (this->state)
+  {
+    case FIXED_HEADER:
+      this->type = byte & 0xf0;
+      this->remaining = 0;
+      this->lengthShift = 0;
+      this->state = REMAINING_LENGTH;
+      return 0;
+
+    case REMAINING_LENGTH:
+      this->remaining |= (uint32_t)(byte & 0x7f) << this->lengthShift;
+      this->lengthShift += 7;
+      if (byte & 0x80)
+      {
+        if (this->lengthShift > 21)
+        {
+          Reset(); // Malformed, more than four length bytes; resynchronizing is all we can do
+        }
+        return 0;
+      }
+
+      this->position = 0;
+      this->packetId = 0;
+      this->state = this->remaining > 0 ? BODY : FIXED_HEADER;
+      return 0;
+
+    case BODY:
+      if (this->position < 2)
+      {
+        this->packetId = (this->packetId << 8) | byte;
+      }
+      this->position++;
+
+      if (this->position < this->remaining)
+      {
+        return 0;
+      }
+
+      this->state = FIXED_HEADER;
+      return this->type == MQTT_PACKET_PUBACK && this->remaining == 2 ? this->packetId : 0;
+  }
+  return 0;
+}
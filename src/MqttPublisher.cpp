@@ -0,0 +1,142 @@
+#include "MqttPublisher.h"
+#include "SerialLogger.h"
+#include <string.h>
+
+// PubSubClient numbers its SUBSCRIBEs from 1 upwards on the same connection; our PUBLISH
+// IDs come from the upper half so that the two never share an ID
+#define FIRST_PACKET_ID 0x8000
+
+MqttPublisher::MqttPublisher()
+{
+  this->writer = NULL;
+  this->window = 1;
+  this->retryTimeoutMs = 10000;
+  this->packetId = FIRST_PACKET_ID;
+  this->wasConnected = false;
+  memset(this->slots, 0, sizeof(this->slots));
+  memset(&this->stats, 0, sizeof(this->stats));
+}
+
+void MqttPublisher::Begin(MqttPacketWriter &writer, uint8_t window, unsigned long retryTimeoutMs)
+{
+  this->writer = &writer;
+  this->window = window < 1 ? 1 : window > MQTT_PUBLISH_WINDOW_MAX ? MQTT_PUBLISH_WINDOW_MAX : window;
+  this->retryTimeoutMs = retryTimeoutMs;
+}
+
+uint16_t MqttPublisher::nextPacketId()
+{
+  uint16_t id = this->packetId;
+  this->packetId = this->packetId == 0xffff ? FIRST_PACKET_ID : this->packetId + 1;
+  return id;
+}
+
+bool MqttPublisher::CanPublish() const { return this->writer != NULL && this->stats.inFlight < this->window; }
+
+bool MqttPublisher::Publish(const char *topic, const uint8_t *payload, size_t length, unsigned long now)
+{
+  if (!CanPublish())
+  {
+    this->stats.windowFull++;
+    return false;
+  }
+
+  Slot *slot = this->slots;
+  while (slot->used)
+  {
+    slot++; // inFlight < window <= MQTT_PUBLISH_WINDOW_MAX, so there is a free one
+  }
+
+  slot->packetId = nextPacketId();
+  slot->length = mqttEncodePublish(slot->packet, sizeof(slot->packet), topic, payload, length, slot->packetId);
+  if (slot->length == 0)
+  {
+    return false;
+  }
+
+  slot->used = true;
+  slot->firstSent = now;
+  this->stats.published++;
+  this->stats.inFlight++;
+  if (this->stats.inFlight > this->stats.maxInFlight)
+  {
+    this->stats.maxInFlight = this->stats.inFlight;
+  }
+
+  send(*slot, now, false); // If this write fails, the retransmit picks it up
+  return true;
+}
+
+void MqttPublisher::send(Slot &slot, unsigned long now, bool again)
+{
+  if (again)
+  {
+    slot.packet[0] |= MQTT_PUBLISH_DUP;
+    this->stats.retransmits++;
+  }
+
+  slot.lastSent = now;
+  this->writer->WritePacket(slot.packet, slot.length);
+}
+
+void MqttPublisher::Feed(const uint8_t *data, size_t length, unsigned long now)
+{
+  for (size_t i = 0; i < length; i++)
+  {
+    uint16_t acked = this->scanner.Feed(data[i]);
+    if (acked != 0)
+    {
+      acknowledge(acked, now);
+    }
+  }
+}
+
+void MqttPublisher::acknowledge(uint16_t packetId, unsigned long now)
+{
+  for (Slot &slot : this->slots)
+  {
+    if (slot.used && slot.packetId == packetId)
+    {
+      unsigned long latency = now - slot.firstSent;
+      slot.used = false;
+      this->stats.inFlight--;
+      this->stats.acked++;
+      this->stats.ackLastMs = latency;
+      this->stats.ackTotalMs += latency;
+      if (latency > this->stats.ackMaxMs)
+      {
+        this->stats.ackMaxMs = latency;
+      }
+      return;
+    }
+  }
+
+  this->stats.unknownAcks++;
+}
+
+void MqttPublisher::Loop(bool connected, unsigned long now)
+{
+  bool reconnected = connected && !this->wasConnected;
+  this->wasConnected = connected;
+  if (!connected || this->stats.inFlight == 0)
+  {
+    return;
+  }
+
+  if (reconnected)
+  {
+    LOG_INFO("MQTT: resending %lu unacknowledged messages", (unsigned long)this->stats.inFlight);
+  }
+
+  for (Slot &slot : this->slots)
+  {
+    if (slot.used && (reconnected || now - slot.lastSent >= this->retryTimeoutMs))
+    {
+      send(slot, now, true);
+    }
+  }
+}
+
+void MqttPublisher::Reset() { this->scanner.Reset(); }
+
+MqttPublisherStats MqttPublisher::GetStats() const { return this->stats; }
@@ -0,0 +1,360 @@
+#include "Occupancy.h"
+#include "Hal.h"
+#include "PirCapture.h"
+#include "SerialLogger.h"
+#include "Telemetry.h"
+#include "TelemetryQueue.h"
+#include <atomic>
+#include <math.h>
+#include <string.h>
+
+unsigned long heartbeatInterval = 0; // Periodic status report while nothing changes, 0 = off
+
+// Settings handed over by occupancyConfigure(), guarded by a sequence number (seqlock): odd
+// while the network side writes them, and a copy only counts if it was taken with the same
+// even number before and after
+static OccupancyConfig nextConfig[HAL_CHANNELS];
+static unsigned long nextHeartbeatInterval = 0;
+static std::atomic<uint32_t> nextVersion(0);
+static uint32_t takenVersion = 0;
+
+// Everything the state machine knows about one channel. The channels sit in one array that
+// checkPIRSensor() walks on every call, so the fields it reads every time come first and a
+// channel's scan touches one cache line; the motion window is only read on a motion.
+struct ChannelState
+{
+  uint64_t lastMotionTime;   // µs, last rising edge (fixed: the one that made the room occupied)
+  uint64_t lowSince;         // µs, last falling edge
+  uint64_t holdUs;           // No-motion time before "free", set at every motion
+  uint64_t lastReportTime;   // µs, last transition or heartbeat queued
+  int pirLevel;              // PIR level after the last consumed edge
+  bool isRoomOccupied;       // Trenutni status zauzetosti
+  bool lastSentState;        // Zadnje poslano stanje (false = slobodno, true = zauzeto)
+  bool busy;
+  uint64_t lastDebounceTime; // µs, vrijeme zadnje registracije pokreta
+
+  // Motions per bucket over the last windowMs; windowBucket is the absolute index of the newest
+  uint64_t windowBucket;
+  uint32_t windowMotions;
+  uint16_t windowCounts[OCCUPANCY_WINDOW_BUCKETS];
+};
+
+// In RTC memory on the ESP32, so that a deep sleep picks up where it left off
+HAL_RETAINED_ATTR static ChannelState channels[HAL_CHANNELS];
+
+static void reportState(uint8_t channel, bool occupied, uint64_t eventTime, bool heartbeat = false)
+{
+  // The transition is stamped with the time of the edge, not with the time we got round to it
+  TelemetryEvent event;
+  event.status = occupied;
+  event.heartbeat = heartbeat;
+  event.timestamp = halTime() - (time_t)((halMicros() - eventTime) / 1000000);
+  event.channel = channel;
+  event.edgeMs = (uint32_t)(eventTime / 1000);
+  channels[channel].lastReportTime = eventTime;
+
+  // Never wait for the network here; the network task picks the event up from the queue
+  if (!telemetryQueuePush(event))
+  {
+    LOG_ERROR("Telemetry queue full, transition dropped");
+  }
+}
+
+static uint64_t holdTime(uint8_t channel)
+{
+  const OccupancyConfig &config = occupancyConfig[channel];
+  return config.estimator == OCCUPANCY_FIXED_TIMEOUT ? (uint64_t)config.minHoldMs * 1000 : channels[channel].holdUs;
+}
+
+static void advanceWindow(ChannelState &state, const OccupancyConfig &config, uint64_t time)
+{
+  uint64_t bucketUs = (uint64_t)config.windowMs * 1000 / OCCUPANCY_WINDOW_BUCKETS;
+  uint64_t bucket = time / (bucketUs > 0 ? bucketUs : 1);
+  if (bucket <= state.windowBucket)
+  {
+    return;
+  }
+
+  uint64_t stale = bucket - state.windowBucket;
+  for (uint64_t i = 1; i <= stale && i <= OCCUPANCY_WINDOW_BUCKETS; i++)
+  {
+    uint16_t &count = state.windowCounts[(state.windowBucket + i) % OCCUPANCY_WINDOW_BUCKETS];
+    state.windowMotions -= count;
+    count = 0;
+  }
+  state.windowBucket = bucket;
+}
+
+// With motion arriving at the window's rate, an occupied room stays still for `hold` only with
+// probability exp(-rate * hold); hold is chosen so that this is missPercent
+static uint64_t adaptiveHold(const ChannelState &state, const OccupancyConfig &config)
+{
+  uint64_t minHold = (uint64_t)config.minHoldMs * 1000;
+  uint64_t maxHold = (uint64_t)config.maxHoldMs * 1000;
+  if (!state.busy || state.windowMotions == 0)
+  {
+    return minHold;
+  }
+
+  float missPercent = config.missPercent > 0 ? config.missPercent : 1;
+  float hold = logf(100.0f / missPercent) * config.windowMs * 1000.0f / state.windowMotions;
+  return hold < minHold ? minHold : hold > maxHold ? maxHold : (uint64_t)hold;
+}
+
+// A rising edge: one more motion in the window, unless it follows the last one within debounceMs
+static void countMotion(uint8_t channel, uint64_t time)
+{
+  ChannelState &state = channels[channel];
+  const OccupancyConfig &config = occupancyConfig[channel];
+
+  state.lastMotionTime = time;
+  if (state.windowMotions > 0 && time - state.lastDebounceTime < (uint64_t)config.debounceMs * 1000)
+  {
+    return;
+  }
+
+  state.lastDebounceTime = time;
+  advanceWindow(state, config, time);
+  state.windowCounts[state.windowBucket % OCCUPANCY_WINDOW_BUCKETS]++;
+  state.windowMotions++;
+
+  // Hysteresis: long holds start at busyEnter motions in the window and end only at busyLeave
+  if (!state.busy && state.windowMotions >= config.busyEnter)
+  {
+    state.busy = true;
+  }
+  else if (state.busy && state.windowMotions <= config.busyLeave)
+  {
+    state.busy = false;
+  }
+  state.holdUs = adaptiveHold(state, config);
+}
+
+static void setOccupied(uint8_t channel, uint64_t eventTime)
+{
+  ChannelState &state = channels[channel];
+  state.isRoomOccupied = true;      // Označi prostoriju kao zauzetu
+  state.lastMotionTime = eventTime; // Pohrani vrijeme zadnjeg pokreta
+
+  halSetOccupancyLed(channel, true); // Crvena LED = zauzeto
+
+  if (!state.lastSentState)
+  { // Pošalji samo ako zadnje poslano stanje nije bilo "zauzeto"
+    LOG_INFO("Pokret detektiran na kanalu %u! Slanje zauzetosti na IoT Hub.", (unsigned)channel);
+    reportState(channel, true, eventTime); // true = zauzeto
+    state.lastSentState = true;            // Oznaka da je zadnje poslano stanje "zauzeto"
+  }
+}
+
+static void setFree(uint8_t channel, uint64_t eventTime)
+{
+  ChannelState &state = channels[channel];
+  state.isRoomOccupied = false; // Označi prostoriju kao slobodnu
+
+  halSetOccupancyLed(channel, false); // Zelena LED = slobodno
+
+  if (state.lastSentState)
+  { // Pošalji samo ako zadnje poslano stanje nije već bilo "slobodno"
+    LOG_INFO(
+        "Nema pokreta na kanalu %u dulje od %lu s. Prostorija sada slobodna.",
+        (unsigned)channel,
+        (unsigned long)(holdTime(channel) / 1000000));
+    reportState(channel, false, eventTime); // false = slobodno
+    state.lastSentState = false;            // Oznaka da je zadnje poslano stanje "slobodno"
+  }
+}
+
+// When the room becomes free if the PIR stays low: the later of the no-motion deadline and
+// the falling edge. 0 while it is free or the PIR is high.
+static uint64_t freeTime(uint8_t channel)
+{
+  const ChannelState &state = channels[channel];
+  if (!state.isRoomOccupied || state.pirLevel != LOW)
+  {
+    return 0;
+  }
+
+  uint64_t deadline = state.lastMotionTime + holdTime(channel);
+  return deadline > state.lowSince ? deadline : state.lowSince;
+}
+
+// Ako nije bilo pokreta dulje od hold time i prostorija je zauzeta, it became free at
+// freeTime() - provided that moment is not after `until`. Channels are freed earliest first,
+// so that their transitions reach the queue in time order.
+static void checkNoMotion(uint64_t until)
+{
+  for (;;)
+  {
+    uint8_t next = HAL_CHANNELS;
+    uint64_t nextFreeAt = 0;
+    for (uint8_t channel = 0; channel < HAL_CHANNELS; channel++)
+    {
+      uint64_t freeAt = freeTime(channel);
+      if (freeAt != 0 && freeAt <= until && (next == HAL_CHANNELS || freeAt < nextFreeAt))
+      {
+        next = channel;
+        nextFreeAt = freeAt;
+      }
+    }
+
+    if (next == HAL_CHANNELS)
+    {
+      return;
+    }
+    setFree(next, nextFreeAt);
+  }
+}
+
+static void applyEdge(uint8_t channel, uint64_t time, int level)
+{
+  checkNoMotion(time); // The timers may have run out before this edge arrived
+
+  ChannelState &state = channels[channel];
+  if (level == state.pirLevel)
+  {
+    return;
+  }
+
+  state.pirLevel = level;
+  if (level == LOW)
+  {
+    state.lowSince = time;
+  }
+  else
+  {
+    if (occupancyConfig[channel].estimator == OCCUPANCY_ADAPTIVE)
+    {
+      countMotion(channel, time);
+    }
+
+    // Ako je detektiran pokret i prostorija je bila slobodna
+    if (!state.isRoomOccupied)
+    {
+      setOccupied(channel, time);
+    }
+  }
+}
+
+void occupancyConfigure(const OccupancyConfig *configs, unsigned long heartbeatMs)
+{
+  uint32_t version = nextVersion.load(std::memory_order_relaxed);
+  nextVersion.store(version + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  memcpy(nextConfig, configs, sizeof(nextConfig));
+  nextHeartbeatInterval = heartbeatMs;
+  nextVersion.store(version + 2, std::memory_order_release);
+}
+
+// Sensing side, between two steps
+static void takeConfig()
+{
+  uint32_t version = nextVersion.load(std::memory_order_acquire);
+  if (version == takenVersion || (version & 1) != 0)
+  {
+    return; // Nothing new, or being written right now: the next step takes it
+  }
+
+  OccupancyConfig configs[HAL_CHANNELS];
+  memcpy(configs, nextConfig, sizeof(configs));
+  unsigned long heartbeat = nextHeartbeatInterval;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (nextVersion.load(std::memory_order_relaxed) != version)
+  {
+    return; // Rewritten while we copied
+  }
+
+  memcpy(occupancyConfig, configs, sizeof(configs));
+  heartbeatInterval = heartbeat;
+  takenVersion = version;
+}
+
+void setupPIRSensor()
+{
+  takeConfig();
+
+  halSetupPins();
+
+  // Only a deep-sleep wake-up continues with the retained state, any other boot starts free
+  if (halWakeCause() == HAL_WAKE_NONE)
+  {
+    memset(channels, 0, sizeof(channels));
+    for (uint8_t channel = 0; channel < HAL_CHANNELS; channel++)
+    {
+      channels[channel].pirLevel = LOW;
+    }
+  }
+
+  // Početno stanje LED
+  for (uint8_t channel = 0; channel < HAL_CHANNELS; channel++)
+  {
+    halSetOccupancyLed(channel, channels[channel].isRoomOccupied);
+  }
+
+  telemetryQueueBegin();
+  pirCaptureBegin();
+
+  uint64_t now = halMicros();
+  for (uint8_t channel = 0; channel < HAL_CHANNELS; channel++)
+  {
+    applyEdge(channel, now, halReadPir(channel)); // PIR may already be high at boot
+  }
+}
+
+void checkPIRSensor()
+{
+  takeConfig();
+  uint64_t now = halMicros(); // Read first: every edge older than this is already queued
+
+  PirEdge edge;
+  while (pirCapturePop(edge))
+  {
+    if (edge.channel < HAL_CHANNELS)
+    {
+      applyEdge(edge.channel, edge.time, edge.level);
+    }
+  }
+
+  // Edges were lost while nobody drained the queue; carry on from the current pin levels
+  if (pirCaptureTakeDropped() > 0)
+  {
+    for (uint8_t channel = 0; channel < HAL_CHANNELS; channel++)
+    {
+      applyEdge(channel, now, halReadPir(channel));
+    }
+  }
+
+  checkNoMotion(now);
+
+  for (uint8_t channel = 0; heartbeatInterval > 0 && channel < HAL_CHANNELS; channel++)
+  {
+    if (now - channels[channel].lastReportTime >= (uint64_t)heartbeatInterval * 1000)
+    {
+      reportState(channel, channels[channel].isRoomOccupied, now, true);
+    }
+  }
+}
+
+OccupancyWake occupancyNextWake()
+{
+  OccupancyWake wake;
+  wake.deadline = 0;
+
+  for (uint8_t channel = 0; channel < HAL_CHANNELS; channel++)
+  {
+    const ChannelState &state = channels[channel];
+    wake.levels[channel] = state.pirLevel == HIGH ? LOW : HIGH;
+
+    uint64_t deadline = freeTime(channel);
+    if (heartbeatInterval > 0)
+    {
+      uint64_t heartbeat = state.lastReportTime + (uint64_t)heartbeatInterval * 1000;
+      deadline = deadline == 0 || heartbeat < deadline ? heartbeat : deadline;
+    }
+    if (deadline != 0 && (wake.deadline == 0 || deadline < wake.deadline))
+    {
+      wake.deadline = deadline;
+    }
+  }
+  return wake;
+}
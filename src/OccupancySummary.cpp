@@ -0,0 +1,374 @@
+#include "OccupancySummary.h"
+#include "Hal.h"
+#include "SerialLogger.h"
+#include "Util.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#define SUMMARY_FILE_MAGIC 0x314d5553 // "SUM1"
+#define SUMMARY_RETRY_MS 30000        // After a failed send, while connected
+#define SECONDS_PER_HOUR 3600
+#define SECONDS_PER_DAY 86400
+
+struct SummaryPeriod
+{
+  uint32_t start; // Unix time (UTC), 0 = no valid time seen yet
+  uint16_t sessions;
+  uint32_t occupiedSeconds;
+  uint32_t longestSeconds;
+};
+
+struct ChannelSummary
+{
+  SummaryPeriod hour;
+  SummaryPeriod day;
+  uint16_t hourly[24];   // Occupied seconds of each hour of the day so far
+  uint32_t sessionStart; // Unix time the open session started, 0 = free
+  uint32_t accounted;    // Occupied time up to here is in hour, day and hourly[]
+};
+
+// The state file is this struct as it is in memory; only the same firmware reads it back,
+// anything else (another HAL_CHANNELS, a corrupted write) fails the size or checksum
+struct SummaryState
+{
+  uint32_t magic;
+  uint32_t size;
+  ChannelSummary channels[HAL_CHANNELS];
+  TelemetrySummary pending[OCCUPANCY_SUMMARY_PENDING]; // Ring, oldest at pendingHead
+  uint8_t pendingHead;
+  uint8_t pendingCount;
+  uint32_t checksum; // FNV-1a of everything before it
+};
+
+static SummaryState state;
+// The channels as they are now; the file has them as of the last period opened or closed. In
+// RTC memory on the ESP32, so that a deep sleep picks up where it left off
+HAL_RETAINED_ATTR static ChannelSummary channels[HAL_CHANNELS];
+HAL_RETAINED_ATTR static bool channelsRetained = false; // channels[] belong to this power cycle
+static OccupancySummaryConfig config = {false, false};
+static OccupancySummaryStats stats;
+static const char *statePath = NULL;
+static char tempPath[128];
+static bool dirty = false; // A period was opened or closed, or the pending ring changed, since the last save
+static unsigned long retryAt = 0;
+static bool retrying = false;
+static uint32_t awaitedTicket = 0; // The head summary went out over HTTP, its outcome is still to come
+
+static bool isEnabled() { return config.hourly || config.daily; }
+
+static uint32_t checksumOf(const SummaryState &summaryState)
+{
+  return fnv1a(&summaryState, offsetof(SummaryState, checksum));
+}
+
+static void save()
+{
+  dirty = false;
+  if (statePath == NULL)
+  {
+    return;
+  }
+
+  state.magic = SUMMARY_FILE_MAGIC;
+  state.size = sizeof(state);
+  memcpy(state.channels, channels, sizeof(channels));
+  state.checksum = checksumOf(state);
+
+  // Never overwrite the only good copy: write it next to it and swap
+  FILE *file = fopen(tempPath, "wb");
+  bool written = file != NULL && fwrite(&state, sizeof(state), 1, file) == 1;
+  if (file != NULL)
+  {
+    written = fclose(file) == 0 && written;
+  }
+  if (!written || rename(tempPath, statePath) != 0)
+  {
+    if (stats.saveFailures++ == 0)
+    {
+      LOG_ERROR("Failed saving occupancy summaries to %s", statePath);
+    }
+  }
+}
+
+// Start of the local hour or day that time falls into
+static uint32_t periodStart(uint32_t time, uint32_t length)
+{
+  return (time + TELEMETRY_LOCAL_OFFSET) / length * length - TELEMETRY_LOCAL_OFFSET;
+}
+
+static void queueSummary(const TelemetrySummary &summary)
+{
+  if (state.pendingCount == OCCUPANCY_SUMMARY_PENDING)
+  {
+    state.pendingHead = (state.pendingHead + 1) % OCCUPANCY_SUMMARY_PENDING;
+    state.pendingCount--;
+    stats.dropped++;
+    awaitedTicket = 0; // If it was in flight, its outcome no longer matters
+  }
+
+  state.pending[(state.pendingHead + state.pendingCount) % OCCUPANCY_SUMMARY_PENDING] = summary;
+  state.pendingCount++;
+  dirty = true;
+}
+
+static void closeHour(uint8_t channel, const ChannelSummary &summary)
+{
+  const SummaryPeriod &hour = summary.hour;
+  if (config.hourly && (hour.sessions > 0 || hour.occupiedSeconds > 0 || hour.longestSeconds > 0))
+  {
+    TelemetrySummary closed = {false, channel, hour.sessions, hour.start, hour.occupiedSeconds, hour.longestSeconds, {0}};
+    queueSummary(closed);
+  }
+}
+
+static void closeDay(uint8_t channel, const ChannelSummary &summary)
+{
+  const SummaryPeriod &day = summary.day;
+  if (config.daily)
+  {
+    TelemetrySummary closed = {true, channel, day.sessions, day.start, day.occupiedSeconds, day.longestSeconds, {0}};
+    memcpy(closed.hourly, summary.hourly, sizeof(closed.hourly));
+    queueSummary(closed);
+  }
+}
+
+// Adds the occupied time from summary.accounted to until, both in the open hour
+static void account(ChannelSummary &summary, uint32_t until)
+{
+  if (summary.sessionStart != 0)
+  {
+    uint32_t seconds = until - summary.accounted;
+    summary.hour.occupiedSeconds += seconds;
+    summary.day.occupiedSeconds += seconds;
+    summary.hourly[(summary.hour.start - summary.day.start) / SECONDS_PER_HOUR] += (uint16_t)seconds;
+  }
+  summary.accounted = until;
+}
+
+// Brings a channel up to now, closing the periods that ended before it. One step per hour
+// only while the room stays occupied; a free room jumps straight to the hour of now.
+static void advance(uint8_t channel, uint32_t now)
+{
+  ChannelSummary &summary = channels[channel];
+  if (summary.hour.start == 0)
+  {
+    summary.hour = {periodStart(now, SECONDS_PER_HOUR), 0, 0, 0};
+    summary.day = {periodStart(now, SECONDS_PER_DAY), 0, 0, 0};
+    summary.accounted = now;
+    dirty = true;
+    return;
+  }
+
+  if (now <= summary.accounted)
+  {
+    return; // Nothing new, or the clock stepped back: wait until it is past again
+  }
+
+  while (now >= summary.hour.start + SECONDS_PER_HOUR)
+  {
+    uint32_t hourEnd = summary.hour.start + SECONDS_PER_HOUR;
+    account(summary, hourEnd);
+    closeHour(channel, summary);
+
+    uint32_t next = summary.sessionStart != 0 ? hourEnd : periodStart(now, SECONDS_PER_HOUR);
+    if (periodStart(next, SECONDS_PER_DAY) != summary.day.start)
+    {
+      closeDay(channel, summary);
+      summary.day = {periodStart(next, SECONDS_PER_DAY), 0, 0, 0};
+      memset(summary.hourly, 0, sizeof(summary.hourly));
+    }
+    summary.hour = {next, 0, 0, 0};
+    summary.accounted = next;
+    dirty = true;
+  }
+
+  account(summary, now);
+}
+
+static void endSession(ChannelSummary &summary)
+{
+  uint32_t length = summary.accounted - summary.sessionStart;
+  if (length > summary.hour.longestSeconds)
+  {
+    summary.hour.longestSeconds = length;
+  }
+  if (length > summary.day.longestSeconds)
+  {
+    summary.day.longestSeconds = length;
+  }
+  summary.sessionStart = 0;
+}
+
+bool occupancySummaryBegin(const char *path, const OccupancySummaryConfig &newConfig)
+{
+  config = newConfig;
+  memset(&state, 0, sizeof(state));
+  statePath = NULL;
+  if (!isEnabled())
+  {
+    channelsRetained = false;
+    return true;
+  }
+
+  if (snprintf(tempPath, sizeof(tempPath), "%s.tmp", path) >= (int)sizeof(tempPath))
+  {
+    return false;
+  }
+  statePath = path;
+
+  FILE *file = fopen(path, "rb");
+  if (file != NULL)
+  {
+    bool valid = fread(&state, sizeof(state), 1, file) == 1 && state.magic == SUMMARY_FILE_MAGIC && state.size == sizeof(state)
+                 && state.checksum == checksumOf(state) && state.pendingHead < OCCUPANCY_SUMMARY_PENDING
+                 && state.pendingCount <= OCCUPANCY_SUMMARY_PENDING;
+    fclose(file);
+
+    if (!valid)
+    {
+      LOG_WARN("Occupancy summary state in %s unreadable, starting over", path);
+      memset(&state, 0, sizeof(state));
+    }
+  }
+
+  // A deep-sleep wake-up goes on from RTC memory, which is newer than the file
+  if (halWakeCause() == HAL_WAKE_NONE || !channelsRetained)
+  {
+    memcpy(channels, state.channels, sizeof(channels));
+  }
+  channelsRetained = true;
+
+  // After a power-on or reset the occupancy state machine starts out free, so must the sessions
+  if (halWakeCause() == HAL_WAKE_NONE)
+  {
+    for (uint8_t channel = 0; channel < HAL_CHANNELS; channel++)
+    {
+      if (channels[channel].sessionStart != 0)
+      {
+        endSession(channels[channel]);
+        dirty = true;
+      }
+    }
+  }
+
+  if (state.pendingCount > 0)
+  {
+    LOG_INFO("%u occupancy summaries from before the restart wait to be sent", (unsigned)state.pendingCount);
+  }
+  if (dirty)
+  {
+    save();
+  }
+  return true;
+}
+
+void occupancySummaryRecord(const TelemetryEvent &event)
+{
+  if (!isEnabled() || event.heartbeat || event.timestamp < HAL_MIN_VALID_TIME || event.channel >= HAL_CHANNELS)
+  {
+    return;
+  }
+
+  advance(event.channel, (uint32_t)event.timestamp);
+
+  ChannelSummary &summary = channels[event.channel];
+  if (event.status && summary.sessionStart == 0)
+  {
+    summary.sessionStart = summary.accounted; // Later than the timestamp only after the clock stepped back
+    summary.hour.sessions++;
+    summary.day.sessions++;
+  }
+  else if (!event.status && summary.sessionStart != 0)
+  {
+    endSession(summary);
+  }
+  if (dirty)
+  {
+    save();
+  }
+}
+
+// The head summary has been delivered
+static void dequeueSent()
+{
+  const TelemetrySummary &summary = state.pending[state.pendingHead];
+  (summary.daily ? stats.daily : stats.hourly)++;
+  state.pendingHead = (state.pendingHead + 1) % OCCUPANCY_SUMMARY_PENDING;
+  state.pendingCount--;
+  dirty = true;
+}
+
+static void retryLater()
+{
+  stats.sendFailures++;
+  retrying = true;
+  retryAt = halMillis() + SUMMARY_RETRY_MS;
+}
+
+void occupancySummaryService(bool connected)
+{
+  if (!isEnabled())
+  {
+    return;
+  }
+
+  time_t now = halTime();
+  if (now >= HAL_MIN_VALID_TIME + OCCUPANCY_SUMMARY_GRACE_S)
+  {
+    for (uint8_t channel = 0; channel < HAL_CHANNELS; channel++)
+    {
+      advance(channel, (uint32_t)(now - OCCUPANCY_SUMMARY_GRACE_S));
+    }
+  }
+
+  if (connected && awaitedTicket == 0 && state.pendingCount > 0 && (!retrying || (long)(halMillis() - retryAt) >= 0))
+  {
+    retrying = false;
+    while (state.pendingCount > 0)
+    {
+      uint32_t ticket;
+      if (!sendTelemetrySummary(state.pending[state.pendingHead], &ticket))
+      {
+        retryLater();
+        break;
+      }
+      if (ticket != 0)
+      {
+        awaitedTicket = ticket; // Stays pending until the Function has answered
+        break;
+      }
+      dequeueSent();
+    }
+  }
+
+  if (dirty)
+  {
+    save();
+  }
+}
+
+void occupancySummaryOutcome(uint32_t ticket, bool delivered)
+{
+  if (ticket == 0 || ticket != awaitedTicket)
+  {
+    return;
+  }
+
+  awaitedTicket = 0;
+  if (delivered)
+  {
+    dequeueSent();
+    save();
+  }
+  else
+  {
+    retryLater();
+  }
+}
+
+OccupancySummaryStats occupancySummaryStats()
+{
+  stats.pending = state.pendingCount;
+  return stats;
+}
@@ -0,0 +1,16 @@
+#include "PirCapture.h"
+#include "Hal.h"
+#include "SpscRing.h"
+
+static SpscRing<PirEdge, PIR_EDGE_QUEUE_SIZE> edges;
+
+static void HAL_ISR_ATTR onPirEdge(uint8_t channel, int level, uint64_t time)
+{
+  edges.Push(PirEdge{time, level, channel});
+}
+
+void pirCaptureBegin() { halAttachPirInterrupt(onPirEdge); }
+
+bool pirCapturePop(PirEdge &edge) { return edges.Pop(edge); }
+
+uint32_t pirCaptureTakeDropped() { return edges.TakeDropped(); }
@@ -0,0 +1,159 @@
+#include "PowerManager.h"
+#include "Hal.h"
+#include "Occupancy.h"
+#include "SerialLogger.h"
+#include <string.h>
+
+static PowerMode mode = POWER_MODE_ACTIVE;
+static PowerProfile profile = POWER_PROFILE_ESP32;
+
+// Accounting, kept across deep sleep
+HAL_RETAINED_ATTR static PowerStats stats;
+HAL_RETAINED_ATTR static uint64_t awakeSince = 0;    // halMicros() of the last wake-up or boot
+HAL_RETAINED_ATTR static uint64_t sleepingSince = 0; // Non-zero from entering a sleep to leaving it
+static uint64_t radioSince = 0;                      // Non-zero while the radio is on
+
+static void addAwake(uint64_t now)
+{
+  stats.awakeUs += now - awakeSince;
+  awakeSince = now;
+}
+
+static void woke()
+{
+  uint64_t now = halMicros();
+  uint64_t slept = now - sleepingSince;
+
+  // After deep sleep halMicros() jumps over the boot, which was spent awake
+  if (mode == POWER_MODE_DEEP)
+  {
+    uint64_t boot = slept < profile.bootUs ? slept : profile.bootUs;
+    slept -= boot;
+    stats.awakeUs += boot;
+  }
+
+  stats.sleepUs += slept;
+  if (halWakeCause() == HAL_WAKE_TIMER)
+  {
+    stats.timerWakeups++;
+  }
+  else
+  {
+    stats.pirWakeups++;
+  }
+
+  sleepingSince = 0;
+  awakeSince = now;
+}
+
+void powerBegin(PowerMode powerMode, const PowerProfile &powerProfile)
+{
+  mode = powerMode;
+  profile = powerProfile;
+  radioSince = 0;
+
+  if (halWakeCause() != HAL_WAKE_NONE && sleepingSince != 0)
+  {
+    woke(); // Back from deep sleep
+    return;
+  }
+
+  // Power-on or any other reset: whatever RTC memory holds is stale
+  memset(&stats, 0, sizeof(stats));
+  sleepingSince = 0;
+  awakeSince = halMicros();
+}
+
+PowerMode powerGetMode() { return mode; }
+
+const char *powerModeName(PowerMode powerMode)
+{
+  switch (powerMode)
+  {
+    case POWER_MODE_LIGHT:
+      return "light";
+    case POWER_MODE_DEEP:
+      return "deep";
+    default:
+      return "active";
+  }
+}
+
+bool powerParseMode(const char *name, PowerMode &powerMode)
+{
+  for (int candidate = POWER_MODE_ACTIVE; candidate <= POWER_MODE_DEEP; candidate++)
+  {
+    if (strcmp(name, powerModeName((PowerMode)candidate)) == 0)
+    {
+      powerMode = (PowerMode)candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool powerSleep()
+{
+  if (mode == POWER_MODE_ACTIVE || radioSince != 0)
+  {
+    return false;
+  }
+
+  OccupancyWake wake = occupancyNextWake();
+  uint64_t now = halMicros();
+  uint64_t timeoutUs = 0;
+  if (wake.deadline != 0)
+  {
+    if (wake.deadline < now + POWER_MIN_SLEEP_US)
+    {
+      return false;
+    }
+    timeoutUs = wake.deadline - now;
+  }
+
+  LOG_DEBUG("Sleeping until a PIR changes or %lu ms", (unsigned long)(timeoutUs / 1000));
+  addAwake(now);
+  stats.sleeps++;
+  sleepingSince = now;
+
+  halSleep(mode == POWER_MODE_DEEP, wake.levels, timeoutUs); // Deep sleep goes on in powerBegin() after the boot
+  woke();
+  return true;
+}
+
+void powerRadioOn()
+{
+  if (radioSince == 0)
+  {
+    radioSince = halMicros();
+    stats.transmissions++;
+  }
+}
+
+void powerRadioOff(uint32_t transitions)
+{
+  if (radioSince != 0)
+  {
+    stats.radioUs += halMicros() - radioSince;
+    stats.transitions += transitions;
+    radioSince = 0;
+  }
+}
+
+PowerStats powerStats()
+{
+  PowerStats current = stats;
+  uint64_t now = halMicros();
+  current.awakeUs += now - awakeSince;
+  if (radioSince != 0)
+  {
+    current.radioUs += now - radioSince;
+  }
+
+  float sleepMa = mode == POWER_MODE_DEEP ? profile.deepSleepMa : profile.lightSleepMa;
+  double activeSeconds = (double)(current.awakeUs - current.radioUs) / 1000000;
+  double radioSeconds = (double)current.radioUs / 1000000;
+  double sleepSeconds = (double)current.sleepUs / 1000000;
+  current.energyMj = (activeSeconds * profile.activeMa + radioSeconds * profile.radioMa + sleepSeconds * sleepMa) * profile.volts;
+  return current;
+}
@@ -0,0 +1,59 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include "SasToken.h"
+#include "SerialLogger.h"
+
+uint32_t getSasTokenExpiration(const char* sasToken)
+{
+  const char SE[] = { '&', 's', 'e', '=' };
+  uint32_t se_as_unix_time = 0;
+
+  int i, j;
+  for (i = 0, j = 0; sasToken[i] != '\0'; i++)
+  {
+    if (sasToken[i] == SE[j])
+    {
+      j++;
+      if (j == sizeof(SE))
+      {
+        // i is still at the '=' position. We must advance it by 1.
+        i++;
+        break;
+      }
+    }
+    else
+    {
+      j = 0;
+    }
+  }
+
+  if (j != sizeof(SE))
+  {
+    LOG_ERROR("Failed finding `se` field in SAS token");
+    return 0;
+  }
+
+  // Digits up to the next field, as az_span_atou32() takes them: no sign, no overflow
+  int k = i;
+  uint64_t value = 0;
+  while (sasToken[k] != '\0' && sasToken[k] != '&')
+  {
+    if (sasToken[k] < '0' || sasToken[k] > '9' || (value = value * 10 + (uint64_t)(sasToken[k] - '0')) > UINT32_MAX)
+    {
+      break;
+    }
+    k++;
+  }
+
+  if (k == i || (sasToken[k] != '\0' && sasToken[k] != '&'))
+  {
+    LOG_ERROR("Failed parsing SAS token expiration timestamp");
+  }
+  else
+  {
+    se_as_unix_time = (uint32_t)value;
+  }
+
+  return se_as_unix_time;
+}
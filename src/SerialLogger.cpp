@@ -2,62 +2,263 @@
 // SPDX-License-Identifier: MIT
 
 #include "SerialLogger.h"
+#include <atomic>
+#include <stdarg.h>
+#include <stdio.h>
 #include <time.h>
 
 #define UNIX_EPOCH_START_YEAR 1900
 
-static void writeTime()
+static_assert(
+    (SERIAL_LOGGER_QUEUE_SIZE & (SERIAL_LOGGER_QUEUE_SIZE - 1)) == 0,
+    "SERIAL_LOGGER_QUEUE_SIZE must be a power of two");
+
+// Bounded multi-producer queue (D. Vyukov's), so any task can log without a lock. Each slot's
+// sequence says whose turn it is: the producer of position p may fill it when the sequence
+// is p, the consumer may read it when it is p + 1. The sequence is stored minus the slot
+// index so that the zero-initialized array starts out right, before any constructor runs.
+struct LogRecord
 {
-  struct tm* ptm;
-  time_t now = time(NULL);
+  std::atomic<uint32_t> sequence;
+  time_t time;
+  uint8_t level;
+  char message[SERIAL_LOGGER_MESSAGE_SIZE];
+};
+
+static LogRecord records[SERIAL_LOGGER_QUEUE_SIZE];
+static std::atomic<uint32_t> enqueuePosition(0);
+static std::atomic<uint32_t> dequeuePosition(0);
+static std::atomic<uint32_t> dropped(0);
+static std::atomic<uint32_t> reportedDropped(0);
+static std::atomic<uint8_t> runtimeLevel(LOG_LEVEL);
+
+static const uint32_t mask = SERIAL_LOGGER_QUEUE_SIZE - 1;
 
-  ptm = gmtime(&now);
+static uint32_t sequenceOf(uint32_t slot) { return records[slot].sequence.load(std::memory_order_acquire) + slot; }
 
-  Serial.print(ptm->tm_year + UNIX_EPOCH_START_YEAR);
-  Serial.print("/");
-  Serial.print(ptm->tm_mon + 1);
-  Serial.print("/");
-  Serial.print(ptm->tm_mday);
-  Serial.print(" ");
+static void setSequence(uint32_t slot, uint32_t sequence)
+{
+  records[slot].sequence.store(sequence - slot, std::memory_order_release);
+}
 
-  if (ptm->tm_hour < 10)
+// Reserves the slot for the next message, NULL if the ring is full
+static LogRecord* claim(uint32_t& position)
+{
+  position = enqueuePosition.load(std::memory_order_relaxed);
+  for (;;)
   {
-    Serial.print(0);
+    int32_t difference = (int32_t)(sequenceOf(position & mask) - position);
+    if (difference == 0)
+    {
+      if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+      {
+        return &records[position & mask];
+      }
+    }
+    else if (difference < 0)
+    {
+      return NULL;
+    }
+    else
+    {
+      position = enqueuePosition.load(std::memory_order_relaxed);
+    }
   }
+}
 
-  Serial.print(ptm->tm_hour);
-  Serial.print(":");
+static void writeLine(const LogRecord& record);
 
-  if (ptm->tm_min < 10)
+// Writes out the oldest message, false if there is none (or it is still being formatted)
+static bool drainOne()
+{
+  uint32_t position = dequeuePosition.load(std::memory_order_relaxed);
+  for (;;)
   {
-    Serial.print(0);
+    int32_t difference = (int32_t)(sequenceOf(position & mask) - (position + 1));
+    if (difference == 0)
+    {
+      if (dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+      {
+        break;
+      }
+    }
+    else if (difference < 0)
+    {
+      return false;
+    }
+    else
+    {
+      position = dequeuePosition.load(std::memory_order_relaxed);
+    }
   }
 
-  Serial.print(ptm->tm_min);
-  Serial.print(":");
+  writeLine(records[position & mask]);
+  setSequence(position & mask, position + SERIAL_LOGGER_QUEUE_SIZE);
+  return true;
+}
 
-  if (ptm->tm_sec < 10)
+static const char* levelName(uint8_t level)
+{
+  switch (level)
   {
-    Serial.print(0);
+    case LOG_LEVEL_ERROR:
+      return "ERROR";
+    case LOG_LEVEL_WARN:
+      return "WARN";
+    case LOG_LEVEL_INFO:
+      return "INFO";
+    default:
+      return "DEBUG";
   }
+}
+
+// "2024/1/1 09:05:00 [INFO] message"
+static int formatLine(const LogRecord& record, char* line, size_t size)
+{
+  struct tm timeinfo;
+  gmtime_r(&record.time, &timeinfo);
+
+  int length = snprintf(
+      line,
+      size,
+      "%d/%d/%d %02d:%02d:%02d [%s] %s\n",
+      timeinfo.tm_year + UNIX_EPOCH_START_YEAR,
+      timeinfo.tm_mon + 1,
+      timeinfo.tm_mday,
+      timeinfo.tm_hour,
+      timeinfo.tm_min,
+      timeinfo.tm_sec,
+      levelName(record.level),
+      record.message);
+  return length < (int)size ? length : (int)size - 1;
+}
+
+// Once the ring has room again, say how many messages did not make it
+static void reportDropped()
+{
+  uint32_t total = dropped.load(std::memory_order_relaxed);
+  uint32_t previous = reportedDropped.load(std::memory_order_relaxed);
+  do
+  {
+    if ((int32_t)(total - previous) <= 0)
+    {
+      return; // Nothing new, or another task reported a later count
+    }
+  } while (!reportedDropped.compare_exchange_weak(previous, total, std::memory_order_relaxed));
 
-  Serial.print(ptm->tm_sec);
+  Logger.Log(LOG_LEVEL_WARN, "%lu log messages dropped", (unsigned long)(total - previous));
+}
+
+#ifdef ARDUINO
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+static const TickType_t drainIdleDelay = pdMS_TO_TICKS(20);
+
+static void writeLine(const LogRecord& record)
+{
+  char line[SERIAL_LOGGER_MESSAGE_SIZE + 40];
+  Serial.write((const uint8_t*)line, formatLine(record, line, sizeof(line)));
+}
+
+static void drainTask(void* parameter)
+{
+  for (;;)
+  {
+    if (!drainOne())
+    {
+      reportDropped();
+      vTaskDelay(drainIdleDelay);
+    }
+  }
 }
 
 SerialLogger::SerialLogger() { Serial.begin(SERIAL_LOGGER_BAUD_RATE); }
 
-void SerialLogger::Info(String message)
+// Lowest priority above idle, on the core that runs the sensing task: sensing preempts it
+// whenever it needs the CPU, and the network task on the other core never waits for it.
+void SerialLogger::Begin()
 {
-  writeTime();
-  Serial.print(" [INFO] ");
-  Serial.println(message);
+  xTaskCreatePinnedToCore(drainTask, "logger", 3072, NULL, tskIDLE_PRIORITY + 1, NULL, ARDUINO_RUNNING_CORE);
 }
 
-void SerialLogger::Error(String message)
+void SerialLogger::Info(String message) { Info(message.c_str()); }
+
+void SerialLogger::Error(String message) { Error(message.c_str()); }
+
+#else // Host build: log to stderr so that stdout stays free for tool output
+
+static void writeLine(const LogRecord& record)
 {
-  writeTime();
-  Serial.print(" [ERROR] ");
-  Serial.println(message);
+  char line[SERIAL_LOGGER_MESSAGE_SIZE + 40];
+  fwrite(line, 1, formatLine(record, line, sizeof(line)), stderr);
+}
+
+SerialLogger::SerialLogger() {}
+
+void SerialLogger::Begin() {}
+
+#endif
+
+void SerialLogger::Log(uint8_t level, const char* format, ...)
+{
+  if (level > runtimeLevel.load(std::memory_order_relaxed))
+  {
+    return;
+  }
+
+  uint32_t position;
+  LogRecord* record = claim(position);
+  if (record == NULL)
+  {
+    dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  record->time = time(NULL);
+  record->level = level;
+
+  va_list arguments;
+  va_start(arguments, format);
+  vsnprintf(record->message, sizeof(record->message), format, arguments);
+  va_end(arguments);
+
+  setSequence(position & mask, position + 1);
+}
+
+void SerialLogger::Flush()
+{
+  while (drainOne())
+  {
+  }
+
+  reportDropped();
+  while (drainOne())
+  {
+  }
+}
+
+uint32_t SerialLogger::GetDropped() { return dropped.load(std::memory_order_relaxed); }
+
+void SerialLogger::SetLevel(uint8_t level) { runtimeLevel.store(level, std::memory_order_relaxed); }
+
+uint8_t SerialLogger::GetLevel() { return runtimeLevel.load(std::memory_order_relaxed); }
+
+void SerialLogger::Info(const char* message)
+{
+  if (LOG_LEVEL >= LOG_LEVEL_INFO)
+  {
+    Log(LOG_LEVEL_INFO, "%s", message);
+  }
+}
+
+void SerialLogger::Error(const char* message)
+{
+  if (LOG_LEVEL >= LOG_LEVEL_ERROR)
+  {
+    Log(LOG_LEVEL_ERROR, "%s", message);
+  }
 }
 
-SerialLogger Logger;
\ No newline at end of file
+SerialLogger Logger;
@@ -0,0 +1,545 @@
+#include "Telemetry.h"
+#include "SerialLogger.h"
+#include "TelemetryTransport.h"
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+// The payloads are written by hand into fixed buffers instead of going through ArduinoJson,
+// so that nothing on the per-event path touches the heap. The JSON output is byte for byte what
+// ArduinoJson 6 produced for the same documents (`--serializer-check` in the replay harness
+// compares the two).
+
+// The firmware's own, see firmwareContext()
+static TelemetryContext firmware = {TELEMETRY_ENCODING_JSON, 0, NULL, {0}, 0};
+
+void telemetryConfigureEncoding(TelemetryEncoding newEncoding, uint16_t newDeviceIndex)
+{
+  firmware.encoding = newEncoding;
+  firmware.deviceIndex = newDeviceIndex;
+}
+
+TelemetryEncoding telemetryGetEncoding() { return firmware.encoding; }
+
+const char *telemetryContentType()
+{
+  return firmware.encoding == TELEMETRY_ENCODING_CBOR ? "application/cbor" : "application/json";
+}
+
+// Appends `text` at `position` if it fits, keeping room for the terminating '\0'
+static bool append(char *buffer, size_t size, size_t &position, const char *text, size_t length)
+{
+  if (position + length >= size)
+  {
+    return false;
+  }
+
+  memcpy(buffer + position, text, length);
+  position += length;
+  buffer[position] = '\0';
+  return true;
+}
+
+template <size_t N>
+static bool appendLiteral(char *buffer, size_t size, size_t &position, const char (&text)[N])
+{
+  return append(buffer, size, position, text, N - 1);
+}
+
+static void writeDigits(char *out, unsigned value, int count)
+{
+  for (int i = count - 1; i >= 0; i--)
+  {
+    out[i] = (char)('0' + value % 10);
+    value /= 10;
+  }
+}
+
+static bool appendNumber(char *buffer, size_t size, size_t &position, uint32_t value)
+{
+  char digits[10];
+  int count = 1;
+  for (uint32_t rest = value / 10; rest > 0; rest /= 10)
+  {
+    count++;
+  }
+  writeDigits(digits, value, count);
+  return append(buffer, size, position, digits, count);
+}
+
+size_t getISO8601Timestamp(time_t timestamp, char *buffer, size_t size)
+{
+  const size_t length = 20; // 2024-01-01T01:00:00Z
+  int64_t now = (int64_t)timestamp + TELEMETRY_LOCAL_OFFSET;
+
+  // Days since the epoch to year/month/day (proleptic Gregorian, http://howardhinnant.github.io/date_algorithms.html).
+  // The device keeps its clock in UTC (configTime(0, 0, ...)), so this is what localtime_r() gave us.
+  int64_t days = now / 86400;
+  int64_t seconds = now % 86400;
+  if (seconds < 0)
+  {
+    seconds += 86400;
+    days--;
+  }
+
+  days += 719468;
+  int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+  unsigned dayOfEra = (unsigned)(days - era * 146097);
+  unsigned yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+  unsigned dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+  unsigned shiftedMonth = (5 * dayOfYear + 2) / 153; // March = 0
+  unsigned day = dayOfYear - (153 * shiftedMonth + 2) / 5 + 1;
+  unsigned month = shiftedMonth < 10 ? shiftedMonth + 3 : shiftedMonth - 9;
+  int64_t year = (int64_t)yearOfEra + era * 400 + (month <= 2 ? 1 : 0);
+
+  if (size <= length || year < 0 || year > 9999)
+  {
+    return 0;
+  }
+
+  writeDigits(buffer, (unsigned)year, 4);
+  buffer[4] = '-';
+  writeDigits(buffer + 5, month, 2);
+  buffer[7] = '-';
+  writeDigits(buffer + 8, day, 2);
+  buffer[10] = 'T';
+  writeDigits(buffer + 11, (unsigned)(seconds / 3600), 2);
+  buffer[13] = ':';
+  writeDigits(buffer + 14, (unsigned)(seconds / 60 % 60), 2);
+  buffer[16] = ':';
+  writeDigits(buffer + 17, (unsigned)(seconds % 60), 2);
+  buffer[19] = 'Z';
+  buffer[20] = '\0';
+  return length; // ISO 8601 format
+}
+
+static char escapeChar(char c)
+{
+  switch (c)
+  {
+  case '"':
+    return '"';
+  case '\\':
+    return '\\';
+  case '\b':
+    return 'b';
+  case '\f':
+    return 'f';
+  case '\n':
+    return 'n';
+  case '\r':
+    return 'r';
+  case '\t':
+    return 't';
+  default:
+    return '\0';
+  }
+}
+
+// {"DeviceID":"<deviceId>", is the same for every message; built once per context
+static size_t buildDeviceIdPrefix(const char *id, char *prefix, size_t size)
+{
+  size_t position = 0;
+  if (id == NULL || !appendLiteral(prefix, size, position, "{\"DeviceID\":\""))
+  {
+    return 0;
+  }
+
+  // Same escaping as ArduinoJson 6
+  for (const char *c = id; *c != '\0'; c++)
+  {
+    char escaped[2] = {'\\', escapeChar(*c)};
+    bool fits = escaped[1] != '\0' ? append(prefix, size, position, escaped, 2) : append(prefix, size, position, c, 1);
+    if (!fits)
+    {
+      return 0;
+    }
+  }
+
+  return appendLiteral(prefix, size, position, "\",") ? position : 0;
+}
+
+void telemetryContextInit(TelemetryContext &context, const char *id, TelemetryEncoding encoding, uint16_t deviceIndex)
+{
+  context.encoding = encoding;
+  context.deviceIndex = deviceIndex;
+  context.deviceId = id;
+  context.deviceIdPrefixLength = buildDeviceIdPrefix(id, context.deviceIdPrefix, sizeof(context.deviceIdPrefix));
+}
+
+// deviceId is a global that the native harness may point elsewhere; the prefix follows it
+static const TelemetryContext &firmwareContext()
+{
+  if (firmware.deviceId != deviceId)
+  {
+    telemetryContextInit(firmware, deviceId, firmware.encoding, firmware.deviceIndex);
+  }
+  return firmware;
+}
+
+// ["Channel":2,]"Status":true,"Timestamp":"2024-01-01T01:00:00Z"
+static bool appendEventFields(char *buffer, size_t size, size_t &position, bool status, time_t eventTime, uint8_t channel)
+{
+  char timestamp[30];
+  size_t length = getISO8601Timestamp(eventTime, timestamp, sizeof(timestamp));
+
+  bool fits = length > 0;
+  if (channel != 0)
+  {
+    fits = fits && appendLiteral(buffer, size, position, "\"Channel\":") && appendNumber(buffer, size, position, channel);
+    fits = fits && appendLiteral(buffer, size, position, ",");
+  }
+  fits = fits && appendLiteral(buffer, size, position, "\"Status\":");
+  fits = fits && (status ? appendLiteral(buffer, size, position, "true") : appendLiteral(buffer, size, position, "false"));
+  fits = fits && appendLiteral(buffer, size, position, ",\"Timestamp\":\"");
+  fits = fits && append(buffer, size, position, timestamp, length);
+  return fits && appendLiteral(buffer, size, position, "\"");
+}
+
+// {"Status":true,"Timestamp":"..."[,"Heartbeat":true]}
+static bool appendBatchEntry(char *buffer, size_t size, size_t &position, const TelemetryEvent &event)
+{
+  bool fits = appendLiteral(buffer, size, position, "{");
+  fits = fits && appendEventFields(buffer, size, position, event.status, event.timestamp, event.channel);
+  if (event.heartbeat)
+  {
+    fits = fits && appendLiteral(buffer, size, position, ",\"Heartbeat\":true");
+  }
+  return fits && appendLiteral(buffer, size, position, "}");
+}
+
+static size_t failed(char *buffer, size_t size)
+{
+  if (size > 0)
+  {
+    buffer[0] = '\0';
+  }
+  return 0;
+}
+
+static size_t getJsonData(const TelemetryContext &context, bool status, time_t eventTime, uint8_t channel, char *buffer, size_t size)
+{
+  size_t position = 0;
+
+  // {"DeviceID":"...","Status":true,"Timestamp":"..."}
+  if (context.deviceIdPrefixLength == 0 || !append(buffer, size, position, context.deviceIdPrefix, context.deviceIdPrefixLength)
+      || !appendEventFields(buffer, size, position, status, eventTime, channel) || !appendLiteral(buffer, size, position, "}"))
+  {
+    return failed(buffer, size);
+  }
+
+  return position;
+}
+
+static size_t getJsonBatch(const TelemetryContext &context, const TelemetryEvent *events, size_t count, char *buffer, size_t size)
+{
+  size_t position = 0;
+
+  if (context.deviceIdPrefixLength == 0 || !append(buffer, size, position, context.deviceIdPrefix, context.deviceIdPrefixLength)
+      || !appendLiteral(buffer, size, position, "\"Batch\":["))
+  {
+    return failed(buffer, size);
+  }
+
+  for (size_t i = 0; i < count; i++)
+  {
+    if ((i > 0 && !appendLiteral(buffer, size, position, ",")) || !appendBatchEntry(buffer, size, position, events[i]))
+    {
+      return failed(buffer, size);
+    }
+  }
+
+  if (!appendLiteral(buffer, size, position, "]}"))
+  {
+    return failed(buffer, size);
+  }
+
+  return position;
+}
+
+static size_t appendJsonBatch(const TelemetryEvent &event, char *buffer, size_t length, size_t size)
+{
+  if (length < 3 || length >= size)
+  {
+    return 0;
+  }
+
+  // Overwrite the closing "]}" and put it back after the new entry
+  size_t position = length - 2;
+  bool empty = buffer[position - 1] == '[';
+  if ((empty || appendLiteral(buffer, size, position, ",")) && appendBatchEntry(buffer, size, position, event)
+      && appendLiteral(buffer, size, position, "]}"))
+  {
+    return position;
+  }
+
+  // Does not fit: leave the batch as it was
+  memcpy(buffer + length - 2, "]}", 3);
+  return 0;
+}
+
+// {"DeviceID":"...",["Channel":2,]"Summary":"hour","Start":"...","Sessions":1,"OccupiedSeconds":600,"LongestSeconds":600[,"Hourly":[...]]}
+static size_t getJsonSummary(const TelemetryContext &context, const TelemetrySummary &summary, char *buffer, size_t size)
+{
+  char start[30];
+  size_t startLength = getISO8601Timestamp((time_t)summary.start, start, sizeof(start));
+  size_t position = 0;
+
+  bool fits = startLength > 0 && context.deviceIdPrefixLength > 0
+              && append(buffer, size, position, context.deviceIdPrefix, context.deviceIdPrefixLength);
+  if (summary.channel != 0)
+  {
+    fits = fits && appendLiteral(buffer, size, position, "\"Channel\":") && appendNumber(buffer, size, position, summary.channel);
+    fits = fits && appendLiteral(buffer, size, position, ",");
+  }
+  fits = fits && (summary.daily ? appendLiteral(buffer, size, position, "\"Summary\":\"day\"")
+                                : appendLiteral(buffer, size, position, "\"Summary\":\"hour\""));
+  fits = fits && appendLiteral(buffer, size, position, ",\"Start\":\"") && append(buffer, size, position, start, startLength);
+  fits = fits && appendLiteral(buffer, size, position, "\",\"Sessions\":") && appendNumber(buffer, size, position, summary.sessions);
+  fits = fits && appendLiteral(buffer, size, position, ",\"OccupiedSeconds\":") && appendNumber(buffer, size, position, summary.occupiedSeconds);
+  fits = fits && appendLiteral(buffer, size, position, ",\"LongestSeconds\":") && appendNumber(buffer, size, position, summary.longestSeconds);
+  if (summary.daily)
+  {
+    fits = fits && appendLiteral(buffer, size, position, ",\"Hourly\":[");
+    for (int hour = 0; hour < 24; hour++)
+    {
+      fits = fits && (hour == 0 || appendLiteral(buffer, size, position, ",")) && appendNumber(buffer, size, position, summary.hourly[hour]);
+    }
+    fits = fits && appendLiteral(buffer, size, position, "]");
+  }
+
+  if (!fits || !appendLiteral(buffer, size, position, "}"))
+  {
+    return failed(buffer, size);
+  }
+  return position;
+}
+
+// CBOR (RFC 8949): [_ deviceIndex, timestamp, flags, offset, flags, ...]. The array has
+// indefinite length so that an event can be appended by overwriting the final break byte.
+// The first event carries Unix seconds (UTC, without the +3600 of the JSON timestamps), the
+// others their offset in seconds from it, which may be negative after a clock step.
+
+static const uint8_t CBOR_NEGATIVE = 0x20;
+static const uint8_t CBOR_ARRAY = 0x80;
+static const uint8_t CBOR_ARRAY_START = 0x9f;
+static const uint8_t CBOR_BREAK = 0xff;
+
+// Initial byte with the major type and the shortest encoding of the argument
+static bool appendCborHead(char *buffer, size_t size, size_t &position, uint8_t major, uint64_t argument)
+{
+  uint8_t head[9];
+  size_t length;
+
+  if (argument < 24)
+  {
+    head[0] = major | (uint8_t)argument;
+    length = 1;
+  }
+  else
+  {
+    size_t bytes = argument <= 0xff ? 1 : argument <= 0xffff ? 2 : argument <= 0xffffffff ? 4 : 8;
+    head[0] = major | (uint8_t)(bytes == 1 ? 24 : bytes == 2 ? 25 : bytes == 4 ? 26 : 27);
+    for (size_t i = 0; i < bytes; i++)
+    {
+      head[bytes - i] = (uint8_t)(argument >> (8 * i)); // Big endian
+    }
+    length = bytes + 1;
+  }
+
+  return append(buffer, size, position, (const char *)head, length);
+}
+
+static bool appendCborInt(char *buffer, size_t size, size_t &position, int64_t value)
+{
+  return value < 0 ? appendCborHead(buffer, size, position, CBOR_NEGATIVE, (uint64_t)(-1 - value))
+                   : appendCborHead(buffer, size, position, 0, (uint64_t)value);
+}
+
+// Reads an integer written by appendCborInt()
+static bool readCborInt(const char *buffer, size_t length, size_t &position, int64_t &value)
+{
+  if (position >= length)
+  {
+    return false;
+  }
+
+  uint8_t initial = (uint8_t)buffer[position++];
+  uint8_t info = initial & 0x1f;
+  uint64_t argument = info;
+  if (info >= 24)
+  {
+    size_t bytes = info == 24 ? 1 : info == 25 ? 2 : info == 26 ? 4 : 8;
+    if (info > 27 || position + bytes > length)
+    {
+      return false;
+    }
+    argument = 0;
+    for (size_t i = 0; i < bytes; i++)
+    {
+      argument = (argument << 8) | (uint8_t)buffer[position++];
+    }
+  }
+
+  value = (initial & 0xe0) == CBOR_NEGATIVE ? -1 - (int64_t)argument : (int64_t)argument;
+  return (initial & 0xe0) <= CBOR_NEGATIVE;
+}
+
+static bool appendCborEvent(char *buffer, size_t size, size_t &position, const TelemetryEvent &event, int64_t time)
+{
+  // Channel 0 leaves the flags as they were; up to channel 5 they still fit the initial byte
+  uint8_t flags = (event.status ? TELEMETRY_CBOR_OCCUPIED : 0) | (event.heartbeat ? TELEMETRY_CBOR_HEARTBEAT : 0)
+                  | (uint8_t)(event.channel << TELEMETRY_CBOR_CHANNEL_SHIFT);
+  return appendCborInt(buffer, size, position, time) && appendCborInt(buffer, size, position, flags);
+}
+
+static size_t getCborBatch(const TelemetryContext &context, const TelemetryEvent *events, size_t count, char *buffer, size_t size)
+{
+  size_t position = 0;
+  const char start = (char)CBOR_ARRAY_START;
+  const char end = (char)CBOR_BREAK;
+
+  if (count == 0 || !append(buffer, size, position, &start, 1) || !appendCborInt(buffer, size, position, context.deviceIndex))
+  {
+    return 0;
+  }
+
+  for (size_t i = 0; i < count; i++)
+  {
+    int64_t time = i == 0 ? (int64_t)events[0].timestamp : (int64_t)events[i].timestamp - (int64_t)events[0].timestamp;
+    if (!appendCborEvent(buffer, size, position, events[i], time))
+    {
+      return 0;
+    }
+  }
+
+  return append(buffer, size, position, &end, 1) ? position : 0;
+}
+
+static size_t appendCborBatch(const TelemetryEvent &event, char *buffer, size_t length, size_t size)
+{
+  // Skip the array start and the device index to find the time of the first event
+  size_t position = 1;
+  int64_t ignored, firstTime;
+  if (length >= size || length < 2 || (uint8_t)buffer[length - 1] != CBOR_BREAK
+      || !readCborInt(buffer, length, position, ignored) || !readCborInt(buffer, length, position, firstTime))
+  {
+    return 0;
+  }
+
+  position = length - 1;
+  const char end = (char)CBOR_BREAK;
+  if (appendCborEvent(buffer, size, position, event, (int64_t)event.timestamp - firstTime) && append(buffer, size, position, &end, 1))
+  {
+    return position;
+  }
+
+  buffer[length - 1] = end; // Does not fit: leave the batch as it was
+  return 0;
+}
+
+// Summaries: [deviceIndex, period, channel, start, sessions, occupiedSeconds, longestSeconds(, [24 x seconds])]
+// with period 0 for an hour and 1 for a day, and start in Unix seconds (UTC) like event
+// timestamps. The definite-length array tells them apart from event batches (0x9f).
+static size_t getCborSummary(const TelemetryContext &context, const TelemetrySummary &summary, char *buffer, size_t size)
+{
+  size_t position = 0;
+  bool fits = appendCborHead(buffer, size, position, CBOR_ARRAY, summary.daily ? 8 : 7);
+  fits = fits && appendCborInt(buffer, size, position, context.deviceIndex);
+  fits = fits && appendCborInt(buffer, size, position, summary.daily ? 1 : 0);
+  fits = fits && appendCborInt(buffer, size, position, summary.channel);
+  fits = fits && appendCborInt(buffer, size, position, summary.start);
+  fits = fits && appendCborInt(buffer, size, position, summary.sessions);
+  fits = fits && appendCborInt(buffer, size, position, summary.occupiedSeconds);
+  fits = fits && appendCborInt(buffer, size, position, summary.longestSeconds);
+  if (summary.daily)
+  {
+    fits = fits && appendCborHead(buffer, size, position, CBOR_ARRAY, 24);
+    for (int hour = 0; hour < 24; hour++)
+    {
+      fits = fits && appendCborInt(buffer, size, position, summary.hourly[hour]);
+    }
+  }
+  return fits ? position : 0;
+}
+
+size_t getTelemetryData(const TelemetryContext &context, bool status, time_t eventTime, char *buffer, size_t size, uint8_t channel)
+{
+  if (context.encoding == TELEMETRY_ENCODING_CBOR)
+  {
+    TelemetryEvent event = {status, false, eventTime, channel, 0};
+    return getCborBatch(context, &event, 1, buffer, size);
+  }
+  return getJsonData(context, status, eventTime, channel, buffer, size);
+}
+
+size_t getTelemetryBatch(const TelemetryContext &context, const TelemetryEvent *events, size_t count, char *buffer, size_t size)
+{
+  return context.encoding == TELEMETRY_ENCODING_CBOR ? getCborBatch(context, events, count, buffer, size)
+                                                     : getJsonBatch(context, events, count, buffer, size);
+}
+
+size_t appendTelemetryBatch(const TelemetryContext &context, const TelemetryEvent &event, char *buffer, size_t length, size_t size)
+{
+  return context.encoding == TELEMETRY_ENCODING_CBOR ? appendCborBatch(event, buffer, length, size)
+                                                     : appendJsonBatch(event, buffer, length, size);
+}
+
+size_t getTelemetrySummary(const TelemetryContext &context, const TelemetrySummary &summary, char *buffer, size_t size)
+{
+  return context.encoding == TELEMETRY_ENCODING_CBOR ? getCborSummary(context, summary, buffer, size)
+                                                     : getJsonSummary(context, summary, buffer, size);
+}
+
+size_t getTelemetryData(bool status, time_t eventTime, char *buffer, size_t size, uint8_t channel)
+{
+  return getTelemetryData(firmwareContext(), status, eventTime, buffer, size, channel);
+}
+
+size_t getTelemetryBatch(const TelemetryEvent *events, size_t count, char *buffer, size_t size)
+{
+  return getTelemetryBatch(firmwareContext(), events, count, buffer, size);
+}
+
+size_t appendTelemetryBatch(const TelemetryEvent &event, char *buffer, size_t length, size_t size)
+{
+  return appendTelemetryBatch(firmwareContext(), event, buffer, length, size);
+}
+
+size_t getTelemetrySummary(const TelemetrySummary &summary, char *buffer, size_t size)
+{
+  return getTelemetrySummary(firmwareContext(), summary, buffer, size);
+}
+
+bool sendTelemetryEvent(const TelemetryEvent &event, uint32_t *ticket)
+{
+  char telemetryData[TELEMETRY_PAYLOAD_SIZE];
+  size_t length = event.heartbeat ? getTelemetryBatch(&event, 1, telemetryData, sizeof(telemetryData))
+                                  : getTelemetryData(event.status, event.timestamp, telemetryData, sizeof(telemetryData), event.channel);
+  if (length == 0)
+  {
+    return false;
+  }
+
+  if (firmware.encoding == TELEMETRY_ENCODING_JSON)
+  {
+    LOG_DEBUG("%s", telemetryData);
+  }
+  return telemetryTransportSend(telemetryData, length, ticket); // IoT Hub and/or the Azure Function
+}
+
+bool sendTelemetrySummary(const TelemetrySummary &summary, uint32_t *ticket)
+{
+  char telemetryData[TELEMETRY_SUMMARY_SIZE];
+  size_t length = getTelemetrySummary(summary, telemetryData, sizeof(telemetryData));
+  if (length == 0)
+  {
+    return false;
+  }
+
+  if (firmware.encoding == TELEMETRY_ENCODING_JSON)
+  {
+    LOG_DEBUG("%s", telemetryData);
+  }
+  return telemetryTransportSend(telemetryData, length, ticket);
+}
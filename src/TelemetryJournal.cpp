@@ -0,0 +1,288 @@
+#include "TelemetryJournal.h"
+#include "SerialLogger.h"
+#include <string.h>
+#include <unistd.h>
+
+// On-flash record format, little endian, never change the size of an existing field
+struct JournalRecord
+{
+  uint32_t sequence;  // 1, 2, 3, ... never 0
+  uint32_t timestamp; // Unix time of the transition
+  uint8_t status;     // 1 = zauzeto, 0 = slobodno
+  uint8_t channel;    // TelemetryEvent::channel, 0 in journals from before multi-channel boards
+  uint8_t flags;      // JOURNAL_FLAG_*
+  uint8_t reserved[3];
+  uint16_t crc; // CRC-16/CCITT of the preceding 14 bytes
+};
+
+#define JOURNAL_FLAG_HEARTBEAT 0x01
+
+static_assert(sizeof(JournalRecord) == 16, "Journal records must stay 16 bytes");
+
+static uint16_t crc16(const uint8_t* data, size_t length)
+{
+  uint16_t crc = 0xFFFF;
+  while (length--)
+  {
+    crc ^= (uint16_t)(*data++) << 8;
+    for (int i = 0; i < 8; i++)
+    {
+      crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+static uint16_t recordCrc(const JournalRecord& record)
+{
+  return crc16((const uint8_t*)&record, offsetof(JournalRecord, crc));
+}
+
+TelemetryJournal::TelemetryJournal()
+{
+  this->file = NULL;
+  this->cursorPath[0] = '\0';
+  this->cursorTempPath[0] = '\0';
+  this->capacity = 0;
+  this->policy = DROP_OLDEST;
+  this->firstPending = 1;
+  this->nextSequence = 1;
+  this->dropped = 0;
+}
+
+TelemetryJournal::~TelemetryJournal()
+{
+  if (this->file != NULL)
+  {
+    fclose(this->file);
+  }
+}
+
+bool TelemetryJournal::Begin(const char* path, uint32_t capacity, OverflowPolicy policy)
+{
+  this->capacity = capacity;
+  this->policy = policy;
+  snprintf(this->cursorPath, sizeof(this->cursorPath), "%s.ack", path);
+  snprintf(this->cursorTempPath, sizeof(this->cursorTempPath), "%s.tmp", this->cursorPath);
+
+  this->file = fopen(path, "r+b");
+  if (this->file == NULL)
+  {
+    this->file = fopen(path, "w+b");
+  }
+  if (this->file == NULL || capacity == 0)
+  {
+    LOG_ERROR("Failed opening telemetry journal");
+    return false;
+  }
+
+  // Recover the write position: the highest valid sequence number in its own slot
+  uint32_t firstSequence = 0;
+  uint32_t lastSequence = 0;
+  JournalRecord record;
+  for (uint32_t slot = 0; slot < capacity && fread(&record, sizeof(record), 1, this->file) == 1; slot++)
+  {
+    if (record.sequence != 0 && record.sequence % capacity == slot && record.crc == recordCrc(record))
+    {
+      lastSequence = record.sequence > lastSequence ? record.sequence : lastSequence;
+      firstSequence = firstSequence == 0 || record.sequence < firstSequence ? record.sequence : firstSequence;
+    }
+  }
+  // An empty journal starts one ring in, so that Requeue() has sequence numbers in front of the
+  // first records too
+  this->nextSequence = lastSequence != 0 ? lastSequence + 1 : capacity + 1;
+
+  FILE* cursor = fopen(this->cursorPath, "rb");
+  if (cursor == NULL || fread(&this->firstPending, sizeof(this->firstPending), 1, cursor) != 1)
+  {
+    this->firstPending = firstSequence != 0 ? firstSequence : this->nextSequence;
+  }
+  if (cursor != NULL)
+  {
+    fclose(cursor);
+  }
+
+  // Anything older than one full ring has been overwritten in the meantime
+  if (this->firstPending > this->nextSequence || this->firstPending == 0)
+  {
+    this->firstPending = this->nextSequence;
+  }
+  if (this->nextSequence - this->firstPending > capacity)
+  {
+    this->firstPending = this->nextSequence - capacity;
+  }
+
+  return true;
+}
+
+bool TelemetryJournal::Append(const TelemetryEvent& event)
+{
+  if (this->file == NULL)
+  {
+    return false;
+  }
+
+  if (GetDepth() >= this->capacity)
+  {
+    this->dropped++;
+    if (this->policy == DROP_NEWEST)
+    {
+      return false;
+    }
+    this->firstPending++; // The slot we are about to write held the oldest unsent record
+  }
+
+  if (!writeRecord(this->nextSequence, event))
+  {
+    return false;
+  }
+  fsync(fileno(this->file)); // Must survive a power cut right after this
+
+  this->nextSequence++;
+  return true;
+}
+
+bool TelemetryJournal::writeRecord(uint32_t sequence, const TelemetryEvent& event)
+{
+  JournalRecord record;
+  memset(&record, 0, sizeof(record));
+  record.sequence = sequence;
+  record.timestamp = (uint32_t)event.timestamp;
+  record.status = event.status ? 1 : 0;
+  record.channel = event.channel;
+  record.flags = event.heartbeat ? JOURNAL_FLAG_HEARTBEAT : 0;
+  record.crc = recordCrc(record);
+
+  if (fseek(this->file, (long)(sequence % this->capacity) * sizeof(record), SEEK_SET) != 0
+      || fwrite(&record, sizeof(record), 1, this->file) != 1 || fflush(this->file) != 0)
+  {
+    LOG_ERROR("Failed writing telemetry journal");
+    return false;
+  }
+  return true;
+}
+
+bool TelemetryJournal::readRecord(uint32_t sequence, TelemetryEvent& event)
+{
+  JournalRecord record;
+  if (fseek(this->file, (long)(sequence % this->capacity) * sizeof(record), SEEK_SET) != 0
+      || fread(&record, sizeof(record), 1, this->file) != 1 || record.sequence != sequence
+      || record.crc != recordCrc(record))
+  {
+    return false;
+  }
+
+  event.status = record.status != 0;
+  event.heartbeat = (record.flags & JOURNAL_FLAG_HEARTBEAT) != 0;
+  event.channel = record.channel;
+  event.timestamp = (time_t)record.timestamp;
+  event.edgeMs = 0;
+  return true;
+}
+
+size_t TelemetryJournal::Peek(TelemetryEvent* events, size_t maxEvents)
+{
+  size_t count = 0;
+
+  for (uint32_t sequence = this->firstPending; count < maxEvents && sequence < this->nextSequence; sequence++)
+  {
+    if (readRecord(sequence, events[count]))
+    {
+      count++;
+    }
+    else if (count == 0)
+    {
+      // Unreadable record at the head of the journal, skip it for good
+      LOG_ERROR("Skipping corrupt telemetry journal record");
+      this->firstPending++;
+      this->dropped++;
+    }
+    else
+    {
+      break; // Returned on the next Peek(), once everything before it is consumed
+    }
+  }
+
+  return count;
+}
+
+void TelemetryJournal::Consume(size_t count)
+{
+  if (count == 0)
+  {
+    return;
+  }
+
+  this->firstPending += (uint32_t)count;
+  if (this->firstPending > this->nextSequence)
+  {
+    this->firstPending = this->nextSequence;
+  }
+  saveCursor();
+}
+
+// Events that were taken off the journal or never in it, sent, and then reported not delivered
+// (an HTTP request that failed) go back in front of the unsent records, into the slots of
+// records already delivered, so that the replay keeps the order in which they happened. Where
+// that is not possible (the journal is empty or the ring would overflow), they are appended.
+size_t TelemetryJournal::Requeue(const TelemetryEvent* events, size_t count)
+{
+  if (this->file == NULL || count == 0)
+  {
+    return 0;
+  }
+
+  if (GetDepth() > 0 && this->firstPending > count && GetDepth() + count <= this->capacity)
+  {
+    uint32_t first = this->firstPending - (uint32_t)count;
+    for (size_t i = 0; i < count; i++)
+    {
+      if (!writeRecord(first + (uint32_t)i, events[i]))
+      {
+        return 0;
+      }
+    }
+    fsync(fileno(this->file));
+
+    this->firstPending = first;
+    saveCursor();
+    return count;
+  }
+
+  if (GetDepth() > 0)
+  {
+    LOG_WARN("No room in front of the telemetry journal, %u undelivered events are replayed out of order", (unsigned)count);
+  }
+  size_t kept = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    if (Append(events[i]))
+    {
+      kept++;
+    }
+  }
+  return kept;
+}
+
+// Never truncates the only copy: a power cut in the middle of rewriting it would leave no cursor,
+// and every record still in the ring would be replayed again
+void TelemetryJournal::saveCursor()
+{
+  FILE* cursor = fopen(this->cursorTempPath, "wb");
+  bool written = cursor != NULL && fwrite(&this->firstPending, sizeof(this->firstPending), 1, cursor) == 1
+                 && fflush(cursor) == 0 && fsync(fileno(cursor)) == 0;
+  if (cursor != NULL)
+  {
+    written = fclose(cursor) == 0 && written;
+  }
+  if (!written || rename(this->cursorTempPath, this->cursorPath) != 0)
+  {
+    LOG_ERROR("Failed saving telemetry journal cursor");
+  }
+}
+
+bool TelemetryJournal::IsOpen() const { return this->file != NULL; }
+
+uint32_t TelemetryJournal::GetDepth() const { return this->nextSequence - this->firstPending; }
+
+uint32_t TelemetryJournal::GetDropped() const { return this->dropped; }
@@ -0,0 +1,85 @@
+#include "TelemetryQueue.h"
+#include <atomic>
+
+static std::atomic<uint32_t> highWater(0);
+static std::atomic<uint32_t> enqueued(0);
+static std::atomic<uint32_t> dropped(0);
+
+static void recordPush(bool accepted, uint32_t depth)
+{
+  if (!accepted)
+  {
+    dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  enqueued.fetch_add(1, std::memory_order_relaxed);
+  if (depth > highWater.load(std::memory_order_relaxed))
+  {
+    highWater.store(depth, std::memory_order_relaxed); // Single producer, no CAS needed
+  }
+}
+
+#ifdef ARDUINO
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+
+static QueueHandle_t queue = NULL;
+
+void telemetryQueueBegin()
+{
+  if (queue == NULL)
+  {
+    queue = xQueueCreate(TELEMETRY_QUEUE_SIZE, sizeof(TelemetryEvent));
+  }
+}
+
+bool telemetryQueuePush(const TelemetryEvent &event)
+{
+  bool accepted = xQueueSend(queue, &event, 0) == pdTRUE;
+  recordPush(accepted, (uint32_t)uxQueueMessagesWaiting(queue));
+  return accepted;
+}
+
+bool telemetryQueuePop(TelemetryEvent &event, uint32_t waitMs)
+{
+  return xQueueReceive(queue, &event, pdMS_TO_TICKS(waitMs)) == pdTRUE;
+}
+
+static uint32_t queueDepth() { return (uint32_t)uxQueueMessagesWaiting(queue); }
+
+#else // Host build: the harness drains the queue itself, nothing ever waits
+
+#include "SpscRing.h"
+
+static SpscRing<TelemetryEvent, TELEMETRY_QUEUE_SIZE> queue;
+
+void telemetryQueueBegin() {}
+
+bool telemetryQueuePush(const TelemetryEvent &event)
+{
+  bool accepted = queue.Push(event);
+  recordPush(accepted, (uint32_t)queue.Size());
+  return accepted;
+}
+
+bool telemetryQueuePop(TelemetryEvent &event, uint32_t waitMs)
+{
+  (void)waitMs;
+  return queue.Pop(event);
+}
+
+static uint32_t queueDepth() { return (uint32_t)queue.Size(); }
+
+#endif
+
+TelemetryQueueStats telemetryQueueStats()
+{
+  TelemetryQueueStats stats;
+  stats.depth = queueDepth();
+  stats.highWater = highWater.load(std::memory_order_relaxed);
+  stats.enqueued = enqueued.load(std::memory_order_relaxed);
+  stats.dropped = dropped.load(std::memory_order_relaxed);
+  return stats;
+}
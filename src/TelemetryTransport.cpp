@@ -0,0 +1,180 @@
+#include "TelemetryTransport.h"
+#include "Hal.h"
+#include "HealthMetrics.h"
+#include <stdio.h>
+#include <string.h>
+
+enum
+{
+  MQTT_BACKEND,
+  HTTP_BACKEND
+};
+
+static TelemetryTransportMode mode = TELEMETRY_TRANSPORT_DUAL;
+static TelemetryBackend *backends[2] = {NULL, NULL};
+static uint32_t bootId = 0;
+static uint32_t sequence = 0;
+static TelemetryTransportStats stats;
+
+// Tickets of the messages on the HTTP backend whose outcome is still to come, in send order;
+// 0 for the copies whose outcome does not matter because MQTT took the message as well
+static uint32_t unconfirmed[TELEMETRY_TRANSPORT_UNCONFIRMED];
+static uint8_t unconfirmedHead = 0;
+static uint8_t unconfirmedCount = 0;
+static uint32_t nextTicket = 0;
+
+void telemetryTransportConfigure(
+    TelemetryTransportMode transportMode,
+    TelemetryBackend *mqtt,
+    TelemetryBackend *http,
+    uint32_t id)
+{
+  mode = transportMode;
+  backends[MQTT_BACKEND] = mqtt;
+  backends[HTTP_BACKEND] = http;
+  bootId = id;
+  sequence = 0;
+  unconfirmedHead = 0;
+  unconfirmedCount = 0;
+  memset(&stats, 0, sizeof(stats));
+}
+
+void telemetryTransportSetMode(TelemetryTransportMode transportMode) { mode = transportMode; }
+
+TelemetryTransportMode telemetryTransportMode() { return mode; }
+
+const char *telemetryTransportModeName(TelemetryTransportMode transportMode)
+{
+  switch (transportMode)
+  {
+    case TELEMETRY_TRANSPORT_MQTT:
+      return "mqtt";
+    case TELEMETRY_TRANSPORT_HTTP:
+      return "http";
+    default:
+      return "dual";
+  }
+}
+
+bool telemetryTransportParseMode(const char *name, TelemetryTransportMode &transportMode)
+{
+  for (int candidate = TELEMETRY_TRANSPORT_MQTT; candidate <= TELEMETRY_TRANSPORT_DUAL; candidate++)
+  {
+    if (strcmp(name, telemetryTransportModeName((TelemetryTransportMode)candidate)) == 0)
+    {
+      transportMode = (TelemetryTransportMode)candidate;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Only the HTTP path reports outcomes (TelemetryBackend::ConfirmsLater())
+static bool confirmsLater(int backend)
+{
+  return backend == HTTP_BACKEND && backends[HTTP_BACKEND] != NULL && backends[HTTP_BACKEND]->ConfirmsLater();
+}
+
+static bool sendOn(int backend, const char *payload, size_t length, const char *messageId)
+{
+  // An outcome with nowhere to go would pair every later one with the wrong message
+  if (confirmsLater(backend) && unconfirmedCount == TELEMETRY_TRANSPORT_UNCONFIRMED)
+  {
+    stats.failed[backend]++;
+    return false;
+  }
+
+  uint64_t start = halMicros();
+  bool sent = backends[backend] != NULL && backends[backend]->Send(payload, length, messageId);
+  healthRecord(backend == MQTT_BACKEND ? HEALTH_MQTT_SEND : HEALTH_HTTP_SEND, (uint32_t)(halMicros() - start));
+  if (!sent)
+  {
+    stats.failed[backend]++;
+    return false;
+  }
+
+  stats.sent[backend]++;
+  stats.bytes[backend] += length;
+  return true;
+}
+
+// Remembers what the outcome of a message just queued on a backend that confirms later is for
+static uint32_t awaitOutcome(bool matters)
+{
+  uint32_t ticket = 0;
+  if (matters)
+  {
+    if (++nextTicket == 0)
+    {
+      nextTicket = 1; // 0 means there is no outcome to wait for
+    }
+    ticket = nextTicket;
+  }
+  unconfirmed[(unconfirmedHead + unconfirmedCount) % TELEMETRY_TRANSPORT_UNCONFIRMED] = ticket;
+  unconfirmedCount++;
+  return ticket;
+}
+
+bool telemetryTransportSend(const char *payload, size_t length, uint32_t *ticket)
+{
+  bool sent;
+  uint32_t awaited = 0;
+  if (mode == TELEMETRY_TRANSPORT_DUAL)
+  {
+    // Both copies carry the same ID; one path failing is fine, the other copy gets stored
+    char messageId[TELEMETRY_MESSAGE_ID_SIZE];
+    snprintf(messageId, sizeof(messageId), "%08lx-%lu", (unsigned long)bootId, (unsigned long)++sequence);
+
+    bool mqttSent = sendOn(MQTT_BACKEND, payload, length, messageId);
+    bool httpSent = sendOn(HTTP_BACKEND, payload, length, messageId);
+    if (httpSent && confirmsLater(HTTP_BACKEND))
+    {
+      awaited = awaitOutcome(!mqttSent);
+    }
+    sent = mqttSent || httpSent;
+  }
+  else
+  {
+    int backend = mode == TELEMETRY_TRANSPORT_HTTP ? HTTP_BACKEND : MQTT_BACKEND;
+    sent = sendOn(backend, payload, length, NULL);
+    if (sent && confirmsLater(backend))
+    {
+      awaited = awaitOutcome(true);
+    }
+  }
+
+  if (ticket != NULL)
+  {
+    *ticket = awaited;
+  }
+  if (sent)
+  {
+    stats.messages++;
+  }
+  else
+  {
+    stats.failures++;
+  }
+  return sent;
+}
+
+bool telemetryTransportTakeOutcome(uint32_t &ticket, bool &delivered)
+{
+  while (unconfirmedCount > 0 && backends[HTTP_BACKEND] != NULL && backends[HTTP_BACKEND]->TakeOutcome(delivered))
+  {
+    ticket = unconfirmed[unconfirmedHead];
+    unconfirmedHead = (unconfirmedHead + 1) % TELEMETRY_TRANSPORT_UNCONFIRMED;
+    unconfirmedCount--;
+    if (ticket != 0)
+    {
+      if (!delivered)
+      {
+        stats.undelivered++;
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+TelemetryTransportStats telemetryTransportStats() { return stats; }
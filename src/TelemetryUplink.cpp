@@ -0,0 +1,378 @@
+#include "TelemetryUplink.h"
+#include "Hal.h"
+#include "HealthMetrics.h"
+#include "OccupancySummary.h"
+#include "SerialLogger.h"
+#include "TelemetryQueue.h"
+#include "TelemetryTransport.h"
+
+static TelemetryJournal journal;
+static TelemetryUplinkStats stats;
+static TelemetryBatchConfig batchConfig = {1, TELEMETRY_BATCH_MAX_SIZE, 0}; // Batching off
+
+// Batch being gathered, already serialized so that its size is known
+static TelemetryEvent pending[TELEMETRY_BATCH_MAX_EVENTS];
+static size_t pendingCount = 0;
+static size_t pendingLength = 0;
+static unsigned long pendingSince = 0;
+static char pendingPayload[TELEMETRY_BATCH_MAX_SIZE + 1];
+
+// Message sent over HTTP whose outcome is still to come; nothing else is sent meanwhile
+static TelemetryEvent unconfirmed[TELEMETRY_BATCH_MAX_EVENTS];
+static size_t unconfirmedCount = 0;
+static uint32_t unconfirmedTicket = 0;
+
+// Events of the last messages MQTT took, each with the number of its message on that path
+// (TelemetryTransportStats::sent), until they are certainly acknowledged or overwritten
+struct RecentEvent
+{
+  TelemetryEvent event;
+  uint32_t message;
+};
+static RecentEvent recent[TELEMETRY_UPLINK_RECENT_EVENTS];
+static size_t recentNext = 0;  // Where the next one goes
+static size_t recentCount = 0;
+
+bool telemetryUplinkBegin(const char *journalPath, TelemetryJournal::OverflowPolicy overflowPolicy)
+{
+  if (!journal.Begin(journalPath, TELEMETRY_JOURNAL_CAPACITY, overflowPolicy))
+  {
+    return false;
+  }
+
+  if (journal.GetDepth() > 0)
+  {
+    LOG_INFO("Telemetry journal holds unsent transitions from before the restart");
+  }
+  return true;
+}
+
+static void flushPending(bool connected);
+
+void telemetryUplinkConfigureBatching(const TelemetryBatchConfig &config)
+{
+  // A batch gathered under the old settings (or encoding) is journaled and replayed with the new ones
+  flushPending(false);
+
+  batchConfig = config;
+  if (batchConfig.maxEvents < 1)
+  {
+    batchConfig.maxEvents = 1;
+  }
+  if (batchConfig.maxEvents > TELEMETRY_BATCH_MAX_EVENTS)
+  {
+    batchConfig.maxEvents = TELEMETRY_BATCH_MAX_EVENTS;
+  }
+  if (batchConfig.maxBytes == 0 || batchConfig.maxBytes > TELEMETRY_BATCH_MAX_SIZE)
+  {
+    batchConfig.maxBytes = TELEMETRY_BATCH_MAX_SIZE;
+  }
+}
+
+static bool isBatching() { return batchConfig.maxEvents > 1; }
+
+// Before the first SNTP answer after a power-on the clock counts from 0, so a transition from
+// that time carries seconds since boot; once the clock is set it's moved onto the wall clock
+static void repairTimestamp(TelemetryEvent &event)
+{
+  time_t now = halTime();
+  if (event.timestamp < HAL_MIN_VALID_TIME && now >= HAL_MIN_VALID_TIME)
+  {
+    event.timestamp += now - (time_t)(halMillis() / 1000);
+    stats.repaired++;
+  }
+}
+
+// PIR edge to transport, for the transitions that came straight from the queue
+static void recordLatency(const TelemetryEvent *events, size_t count)
+{
+  uint32_t nowMs = (uint32_t)(halMicros() / 1000);
+  for (size_t i = 0; i < count; i++)
+  {
+    if (events[i].edgeMs != 0)
+    {
+      uint32_t ms = nowMs - events[i].edgeMs;
+      healthRecord(HEALTH_EDGE_TO_SEND, ms < UINT32_MAX / 1000 ? ms * 1000 : UINT32_MAX);
+    }
+  }
+}
+
+static bool canSend(bool connected) { return connected && unconfirmedCount == 0; }
+
+// A message the transport took: delivered, or with a ticket only queued and kept until its outcome
+static void accepted(uint32_t ticket, const TelemetryEvent *events, size_t count)
+{
+  recordLatency(events, count);
+  if (ticket == 0)
+  {
+    uint32_t message = telemetryTransportStats().sent[TELEMETRY_TRANSPORT_MQTT];
+    for (size_t i = 0; i < count; i++)
+    {
+      recent[recentNext] = {events[i], message};
+      recentNext = (recentNext + 1) % TELEMETRY_UPLINK_RECENT_EVENTS;
+      recentCount += recentCount < TELEMETRY_UPLINK_RECENT_EVENTS ? 1 : 0;
+    }
+    stats.messages++;
+    stats.sent += count;
+    return;
+  }
+
+  for (size_t i = 0; i < count; i++)
+  {
+    unconfirmed[i] = events[i];
+  }
+  unconfirmedCount = count;
+  unconfirmedTicket = ticket;
+}
+
+static bool sendBatch(const char *payload, size_t length, const TelemetryEvent *events, size_t count)
+{
+  uint32_t ticket;
+  if (!telemetryTransportSend(payload, length, &ticket))
+  {
+    stats.sendFailures++;
+    return false;
+  }
+
+  accepted(ticket, events, count);
+  return true;
+}
+
+static bool send(const TelemetryEvent &event)
+{
+  uint32_t ticket;
+  if (!sendTelemetryEvent(event, &ticket))
+  {
+    stats.sendFailures++;
+    return false;
+  }
+
+  accepted(ticket, &event, 1);
+  return true;
+}
+
+static void store(const TelemetryEvent &event)
+{
+  if (journal.Append(event))
+  {
+    stats.journaled++;
+  }
+  else
+  {
+    stats.lost++;
+  }
+}
+
+// The outcomes of HTTP requests: a message that arrived counts as sent, one that did not goes
+// back in front of the journal; the others are summaries'
+static void takeOutcomes()
+{
+  uint32_t ticket;
+  bool delivered;
+  while (telemetryTransportTakeOutcome(ticket, delivered))
+  {
+    if (unconfirmedCount == 0 || ticket != unconfirmedTicket)
+    {
+      occupancySummaryOutcome(ticket, delivered);
+      continue;
+    }
+
+    if (delivered)
+    {
+      stats.messages++;
+      stats.sent += unconfirmedCount;
+    }
+    else
+    {
+      size_t kept = journal.Requeue(unconfirmed, unconfirmedCount);
+      stats.sendFailures++;
+      stats.journaled += kept;
+      stats.lost += unconfirmedCount - kept;
+    }
+    unconfirmedCount = 0;
+  }
+}
+
+// Sends the batch gathered so far, or journals it if that fails
+static void flushPending(bool connected)
+{
+  if (pendingCount == 0)
+  {
+    return;
+  }
+
+  if (!canSend(connected) || !sendBatch(pendingPayload, pendingLength, pending, pendingCount))
+  {
+    for (size_t i = 0; i < pendingCount; i++)
+    {
+      store(pending[i]);
+    }
+  }
+
+  pendingCount = 0;
+}
+
+static void addToBatch(const TelemetryEvent &event, bool connected)
+{
+  if (pendingCount > 0)
+  {
+    size_t length = appendTelemetryBatch(event, pendingPayload, pendingLength, batchConfig.maxBytes + 1);
+    if (length > 0)
+    {
+      pending[pendingCount++] = event;
+      pendingLength = length;
+      if (pendingCount >= batchConfig.maxEvents)
+      {
+        flushPending(connected);
+      }
+      return;
+    }
+
+    // Too big with this event: send what we have and start over with it
+    flushPending(connected);
+  }
+
+  pending[0] = event;
+  pendingCount = 1;
+  pendingLength = getTelemetryBatch(pending, 1, pendingPayload, sizeof(pendingPayload));
+  pendingSince = halMillis();
+}
+
+static size_t drainJournal()
+{
+  TelemetryEvent batch[TELEMETRY_BATCH_MAX_EVENTS];
+  size_t count = journal.Peek(batch, isBatching() ? batchConfig.maxEvents : TELEMETRY_DRAIN_BATCH);
+
+  size_t delivered = 0;
+  if (isBatching())
+  {
+    // As many as fit into one message
+    size_t length = count > 0 ? getTelemetryBatch(batch, 1, pendingPayload, batchConfig.maxBytes + 1) : 0;
+    size_t fitting = length > 0 ? 1 : 0;
+    while (fitting > 0 && fitting < count)
+    {
+      size_t longer = appendTelemetryBatch(batch[fitting], pendingPayload, length, batchConfig.maxBytes + 1);
+      if (longer == 0)
+      {
+        break;
+      }
+      length = longer;
+      fitting++;
+    }
+    if (fitting > 0 && sendBatch(pendingPayload, length, batch, fitting))
+    {
+      delivered = fitting;
+    }
+  }
+  else
+  {
+    while (delivered < count && unconfirmedCount == 0 && send(batch[delivered]))
+    {
+      delivered++;
+    }
+  }
+
+  journal.Consume(delivered);
+  stats.replayed += delivered;
+  return delivered;
+}
+
+void telemetryUplinkService(bool connected, uint32_t waitMs)
+{
+  takeOutcomes();
+
+  // Older transitions are replayed before new ones go out; don't wait for new events
+  // while the replay is making progress
+  if (canSend(connected) && pendingCount == 0 && journal.GetDepth() > 0 && drainJournal() > 0)
+  {
+    waitMs = 0;
+  }
+
+  // Never sit on a gathered batch for longer than maxDelayMs
+  if (pendingCount > 0)
+  {
+    unsigned long age = halMillis() - pendingSince;
+    unsigned long left = age < batchConfig.maxDelayMs ? batchConfig.maxDelayMs - age : 0;
+    if (left < waitMs)
+    {
+      waitMs = left;
+    }
+  }
+
+  TelemetryEvent event;
+  bool haveEvent = telemetryQueuePop(event, waitMs);
+  while (haveEvent)
+  {
+    repairTimestamp(event);
+    occupancySummaryRecord(event);
+    if (!canSend(connected) || journal.GetDepth() > 0)
+    {
+      flushPending(false);
+      store(event);
+    }
+    else if (isBatching())
+    {
+      addToBatch(event, connected);
+    }
+    else if (!send(event))
+    {
+      store(event);
+    }
+    haveEvent = telemetryQueuePop(event, 0);
+  }
+
+  if (pendingCount > 0 && (!connected || halMillis() - pendingSince >= batchConfig.maxDelayMs))
+  {
+    flushPending(connected);
+  }
+
+  occupancySummaryService(connected); // Hours and days that have ended go out next to the transitions
+}
+
+// Requeue() puts events in front of the journal, so the newest go first
+size_t telemetryUplinkRequeueUnsent(uint32_t unacknowledged)
+{
+  size_t count = 0;
+  size_t kept = 0;
+  if (unconfirmedCount > 0)
+  {
+    count += unconfirmedCount;
+    kept += journal.Requeue(unconfirmed, unconfirmedCount);
+    unconfirmedCount = 0;
+  }
+
+  TelemetryEvent events[TELEMETRY_UPLINK_RECENT_EVENTS];
+  size_t inFlight = 0;
+  uint32_t sent = telemetryTransportStats().sent[TELEMETRY_TRANSPORT_MQTT];
+  for (size_t i = recentCount; i > 0; i--)
+  {
+    const RecentEvent &entry = recent[(recentNext + TELEMETRY_UPLINK_RECENT_EVENTS - i) % TELEMETRY_UPLINK_RECENT_EVENTS];
+    if (sent - entry.message < unacknowledged)
+    {
+      events[inFlight++] = entry.event;
+    }
+  }
+  recentCount = 0;
+  if (inFlight > 0)
+  {
+    count += inFlight;
+    kept += journal.Requeue(events, inFlight);
+  }
+
+  stats.journaled += kept;
+  stats.lost += count - kept;
+  if (count > 0)
+  {
+    LOG_WARN("%u events not confirmed delivered, %u went back to the telemetry journal", (unsigned)count, (unsigned)kept);
+  }
+  return kept;
+}
+
+TelemetryUplinkStats telemetryUplinkStats()
+{
+  stats.pending = pendingCount;
+  stats.unconfirmed = unconfirmedCount;
+  stats.journalDepth = journal.GetDepth();
+  stats.journalDropped = journal.GetDropped();
+  return stats;
+}
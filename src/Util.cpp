@@ -0,0 +1,34 @@
+#include "Util.h"
+#include <stdarg.h>
+#include <stdio.h>
+
+bool appendf(char *buffer, size_t size, size_t &position, const char *format, ...)
+{
+  if (position >= size)
+  {
+    return false;
+  }
+
+  va_list arguments;
+  va_start(arguments, format);
+  int written = vsnprintf(buffer + position, size - position, format, arguments);
+  va_end(arguments);
+
+  if (written < 0 || (size_t)written >= size - position)
+  {
+    return false;
+  }
+  position += (size_t)written;
+  return true;
+}
+
+uint32_t fnv1a(const void *data, size_t length)
+{
+  const uint8_t *bytes = (const uint8_t *)data;
+  uint32_t hash = 2166136261UL;
+  for (size_t i = 0; i < length; i++)
+  {
+    hash = (hash ^ bytes[i]) * 16777619UL;
+  }
+  return hash;
+}
@@ -0,0 +1,549 @@
+// Microbenchmarks of the firmware hot paths ([env:bench]).
+//
+// Runs each hot path in batches on the host and reports time per call (median and fastest
+// batch), heap allocations per call and the code size of the functions involved, from this
+// executable's symbol table:
+//
+//   .pio/build/bench/program --json bench.json
+//   .pio/build/bench/program --baseline bench.json --threshold 10
+//
+// --json FILE writes the results, one benchmark per line, to compare later builds against.
+// --baseline FILE compares with such a file and exits with 1 if a benchmark got slower by more
+// than --threshold percent (10 by default), allocates more, or grew. --filter TEXT runs only the
+// benchmarks whose name contains TEXT.
+//
+// Host figures: the code is the firmware's, the compiler and CPU are not. They are for
+// comparing one commit with the next, not for the ESP32's absolute numbers; its code sizes come
+// from the board build (xtensa-esp32-elf-nm -S --size-sort on firmware.elf).
+
+#include "AzIoTSasToken.h"
+#include "Occupancy.h"
+#include "SasToken.h"
+#include "SerialLogger.h"
+#include "Telemetry.h"
+#include "TelemetryQueue.h"
+#include "native/AllocCounter.h"
+#include "native/NativeHal.h"
+#include <algorithm>
+#include <chrono>
+#include <cxxabi.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <functional>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+const char *deviceId = "ESP32-001";
+OccupancyConfig occupancyConfig[HAL_CHANNELS]; // The firmware defaults, set in main()
+
+#define BENCH_BATCHES 15
+#define BENCH_BATCH_NS 10000000 // Batches are grown until one takes at least this long
+#define BENCH_MAX_CALLS (1UL << 24)
+
+static const time_t benchEpoch = 1710945000; // 2024-03-20T14:30:00Z
+static volatile size_t sink;                 // Keeps the results alive
+
+struct Benchmark
+{
+  const char *name;
+  const char *symbols;                 // Functions whose code size is reported, space separated
+  std::function<void(uint32_t)> call;  // Call number i
+  std::function<void()> reset;         // Before each round of calls, not timed; may be empty
+  uint32_t maxBatch;                   // Calls per round at most (ring and queue sizes), 0 = any
+  const char *skipped;                 // Why it cannot run on the host, NULL if it can
+};
+
+struct BenchResult
+{
+  std::string name;
+  double nsPerCall; // Median batch
+  double nsMin;     // Fastest batch
+  double allocsPerCall;
+  unsigned long codeBytes;
+  unsigned long calls; // Per batch
+  const char *skipped;
+};
+
+struct BenchOptions
+{
+  const char *jsonPath = NULL;
+  const char *baselinePath = NULL;
+  const char *filter = NULL;
+  double thresholdPercent = 10;
+};
+
+// Function sizes from the executable's own .symtab, by demangled name without the parameters
+// ("SerialLogger::Log"); local and global symbols alike, so static helpers can be named too
+static std::map<std::string, unsigned long> readSymbolSizes()
+{
+  std::map<std::string, unsigned long> sizes;
+  FILE *file = fopen("/proc/self/exe", "rb");
+  if (file == NULL)
+  {
+    return sizes;
+  }
+
+  std::vector<char> image;
+  char chunk[65536];
+  size_t count;
+  while ((count = fread(chunk, 1, sizeof(chunk), file)) > 0)
+  {
+    image.insert(image.end(), chunk, chunk + count);
+  }
+  fclose(file);
+
+  const Elf64_Ehdr *header = (const Elf64_Ehdr *)image.data();
+  if (image.size() < sizeof(Elf64_Ehdr) || memcmp(header->e_ident, ELFMAG, SELFMAG) != 0 || header->e_ident[EI_CLASS] != ELFCLASS64
+      || header->e_shoff + (size_t)header->e_shnum * sizeof(Elf64_Shdr) > image.size())
+  {
+    return sizes;
+  }
+
+  const Elf64_Shdr *sections = (const Elf64_Shdr *)(image.data() + header->e_shoff);
+  for (int s = 0; s < header->e_shnum; s++)
+  {
+    if (sections[s].sh_type != SHT_SYMTAB || sections[s].sh_link >= header->e_shnum)
+    {
+      continue;
+    }
+
+    const Elf64_Shdr &strings = sections[sections[s].sh_link];
+    const Elf64_Sym *symbols = (const Elf64_Sym *)(image.data() + sections[s].sh_offset);
+    size_t symbolCount = sections[s].sh_size / sizeof(Elf64_Sym);
+    for (size_t i = 0; i < symbolCount; i++)
+    {
+      if (ELF64_ST_TYPE(symbols[i].st_info) != STT_FUNC || symbols[i].st_size == 0 || symbols[i].st_name >= strings.sh_size)
+      {
+        continue;
+      }
+
+      const char *mangled = image.data() + strings.sh_offset + symbols[i].st_name;
+      int status;
+      char *demangled = abi::__cxa_demangle(mangled, NULL, NULL, &status);
+      std::string name = status == 0 ? demangled : mangled;
+      free(demangled);
+      name = name.substr(0, name.find('('));
+      sizes[name] += symbols[i].st_size;
+    }
+  }
+  return sizes;
+}
+
+static unsigned long codeSize(const std::map<std::string, unsigned long> &sizes, const char *symbols)
+{
+  unsigned long total = 0;
+  std::string list = symbols;
+  size_t start = 0;
+  while (start < list.size())
+  {
+    size_t end = list.find(' ', start);
+    end = end == std::string::npos ? list.size() : end;
+    auto found = sizes.find(list.substr(start, end - start));
+    total += found != sizes.end() ? found->second : 0;
+    start = end + 1;
+  }
+  return total;
+}
+
+// calls in rounds of at most maxBatch, each after a reset that is neither timed nor counted;
+// returns the time of the calls alone and adds their heap allocations to allocations
+static double runBatch(const Benchmark &benchmark, uint32_t first, unsigned long calls, unsigned long &allocations)
+{
+  double ns = 0;
+  unsigned long done = 0;
+  while (done < calls)
+  {
+    unsigned long round = benchmark.maxBatch > 0 ? std::min(calls - done, (unsigned long)benchmark.maxBatch) : calls;
+    if (benchmark.reset)
+    {
+      benchmark.reset();
+    }
+    unsigned long allocationsBefore = allocCount();
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned long i = 0; i < round; i++)
+    {
+      benchmark.call(first + (uint32_t)(done + i));
+    }
+    ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    allocations += allocCount() - allocationsBefore;
+    done += round;
+  }
+  return ns;
+}
+
+static BenchResult run(const Benchmark &benchmark, const std::map<std::string, unsigned long> &sizes)
+{
+  BenchResult result = {benchmark.name, 0, 0, 0, codeSize(sizes, benchmark.symbols), 0, benchmark.skipped};
+  if (benchmark.skipped != NULL)
+  {
+    return result;
+  }
+
+  // Warm up, then grow the batch until it is long enough to time
+  unsigned long calls = 1;
+  uint32_t next = 0;
+  unsigned long allocations = 0;
+  while (true)
+  {
+    double ns = runBatch(benchmark, next, calls, allocations);
+    next += (uint32_t)calls;
+    if (ns >= BENCH_BATCH_NS || calls >= BENCH_MAX_CALLS)
+    {
+      break;
+    }
+    calls *= 2;
+  }
+
+  std::vector<double> perCall;
+  perCall.reserve(BENCH_BATCHES);
+  allocations = 0;
+  for (int batch = 0; batch < BENCH_BATCHES; batch++)
+  {
+    double ns = runBatch(benchmark, next, calls, allocations);
+    perCall.push_back(ns / calls);
+    next += (uint32_t)calls;
+  }
+
+  std::sort(perCall.begin(), perCall.end());
+  result.nsPerCall = perCall[perCall.size() / 2];
+  result.nsMin = perCall.front();
+  result.allocsPerCall = (double)allocations / (calls * BENCH_BATCHES);
+  result.calls = calls;
+  return result;
+}
+
+// --- The hot paths --------------------------------------------------------------------------
+
+static char payload[TELEMETRY_BATCH_MAX_SIZE + 1];
+static const char sasToken[] = "SharedAccessSignature sr=classroom-hub.azure-devices.net%2Fdevices%2FESP32-001"
+                               "&sig=Rm9vYmFyQmF6UXV4Q29ycmVjdEhvcnNlQmF0dGVyeVN0YXBsZQ%3D%3D&se=1710948600";
+
+// A made-up device key (bytes 0..31); the hub never sees the tokens
+static az_iot_hub_client hubClient;
+static uint8_t sasSignatureBuffer[256];
+static uint8_t sasTokenBuffer[256];
+static uint8_t nextSasTokenBuffer[256];
+static AzIoTSasToken sasTokenGenerator(&hubClient,
+                                       AZ_SPAN_FROM_STR("AAECAwQFBgcICQoLDA0ODxAREhMUFRYXGBkaGxwdHh8="),
+                                       AZ_SPAN_FROM_BUFFER(sasSignatureBuffer),
+                                       AZ_SPAN_FROM_BUFFER(sasTokenBuffer),
+                                       AZ_SPAN_FROM_BUFFER(nextSasTokenBuffer));
+static int nullOutput = -1; // /dev/null, stands in for stderr while the benchmarks log
+static int savedStderr = -1;
+
+static void toNull()
+{
+  fflush(stderr);
+  savedStderr = dup(STDERR_FILENO);
+  dup2(nullOutput, STDERR_FILENO);
+}
+
+static void fromNull()
+{
+  fflush(stderr);
+  dup2(savedStderr, STDERR_FILENO);
+  close(savedStderr);
+}
+
+static void drainTelemetryQueue()
+{
+  TelemetryEvent event;
+  while (telemetryQueuePop(event, 0))
+  {
+  }
+  Logger.Flush();
+}
+
+static std::vector<Benchmark> benchmarks()
+{
+  static unsigned long pirMillis = 0;
+  static int pirLevel = LOW;
+
+  return {
+      {"getTelemetryData/json",
+       "getTelemetryData getISO8601Timestamp",
+       [](uint32_t i) { sink = getTelemetryData(i & 1, benchEpoch + i, payload, sizeof(payload)); },
+       [] { telemetryConfigureEncoding(TELEMETRY_ENCODING_JSON, 0); },
+       0,
+       NULL},
+      {"getTelemetryData/cbor",
+       "getTelemetryData",
+       [](uint32_t i) { sink = getTelemetryData(i & 1, benchEpoch + i, payload, sizeof(payload)); },
+       [] { telemetryConfigureEncoding(TELEMETRY_ENCODING_CBOR, 42); },
+       0,
+       NULL},
+      {"getISO8601Timestamp",
+       "getISO8601Timestamp",
+       [](uint32_t i) { sink = getISO8601Timestamp(benchEpoch + i * 37, payload, sizeof(payload)); },
+       {},
+       0,
+       NULL},
+      {"getSasTokenExpiration", "getSasTokenExpiration", [](uint32_t) { sink = getSasTokenExpiration(sasToken); }, {}, 0, NULL},
+      // Signing and formatting only: the key is decoded by the first call, before the timing
+      {"AzIoTSasToken::Generate",
+       "AzIoTSasToken::Generate AzIoTSasToken::generateInto generate_sas_token",
+       [](uint32_t) { sink = (size_t)sasTokenGenerator.Generate(60); },
+       [] {
+         az_iot_hub_client_init(&hubClient, AZ_SPAN_FROM_STR("classroom-hub.azure-devices.net"), AZ_SPAN_FROM_STR("ESP32-001"), NULL);
+         sasTokenGenerator.Generate(60);
+       },
+       0,
+       NULL},
+      // Formatting into the ring; the ring is emptied between batches
+      {"SerialLogger::Log",
+       "SerialLogger::Log",
+       [](uint32_t i) { Logger.Log(LOG_LEVEL_INFO, "Pokret detektiran na kanalu %u! Slanje zauzetosti na IoT Hub.", (unsigned)(i & 3)); },
+       [] { Logger.Flush(); },
+       SERIAL_LOGGER_QUEUE_SIZE / 2,
+       NULL},
+      // One message all the way out: formatted, queued, timestamped and written (to /dev/null)
+      {"SerialLogger::Log+Flush",
+       "SerialLogger::Log SerialLogger::Flush",
+       [](uint32_t i) {
+         Logger.Log(LOG_LEVEL_INFO, "Pokret detektiran na kanalu %u! Slanje zauzetosti na IoT Hub.", (unsigned)(i & 3));
+         Logger.Flush();
+       },
+       {},
+       0,
+       NULL},
+      // A loop() pass with nothing to do: no edge, no timer due
+      {"checkPIRSensor/idle",
+       "checkPIRSensor",
+       [](uint32_t) {
+         nativeHalSetMillis(++pirMillis);
+         checkPIRSensor();
+       },
+       [] {
+         nativeHalReset(benchEpoch);
+         pirMillis = 0;
+         setupPIRSensor();
+       },
+       0,
+       NULL},
+      // A pass that consumes one PIR edge: people moving in an occupied room
+      {"checkPIRSensor/edge",
+       "checkPIRSensor",
+       [](uint32_t) {
+         pirMillis += 700;
+         pirLevel = pirLevel == HIGH ? LOW : HIGH;
+         nativeHalSetMillis(pirMillis);
+         nativeHalSetPir(0, pirLevel);
+         checkPIRSensor();
+       },
+       [] {
+         drainTelemetryQueue();
+         nativeHalReset(benchEpoch);
+         pirMillis = 0;
+         pirLevel = LOW;
+         setupPIRSensor();
+         drainTelemetryQueue();
+       },
+       4096,
+       NULL},
+  };
+}
+
+// --- Results --------------------------------------------------------------------------------
+
+static bool writeJson(const char *path, const std::vector<BenchResult> &results)
+{
+  FILE *file = fopen(path, "w");
+  if (file == NULL)
+  {
+    perror(path);
+    return false;
+  }
+
+  fprintf(file, "{\"benchmarks\":[\n");
+  for (size_t i = 0; i < results.size(); i++)
+  {
+    const BenchResult &result = results[i];
+    const char *separator = i + 1 < results.size() ? "," : "";
+    if (result.skipped != NULL)
+    {
+      fprintf(file, "{\"name\":\"%s\",\"skipped\":\"%s\"}%s\n", result.name.c_str(), result.skipped, separator);
+    }
+    else
+    {
+      fprintf(
+          file,
+          "{\"name\":\"%s\",\"nsPerCall\":%.2f,\"nsMin\":%.2f,\"allocsPerCall\":%.3f,\"codeBytes\":%lu,\"calls\":%lu}%s\n",
+          result.name.c_str(),
+          result.nsPerCall,
+          result.nsMin,
+          result.allocsPerCall,
+          result.codeBytes,
+          result.calls,
+          separator);
+    }
+  }
+  fprintf(file, "]}\n");
+
+  fclose(file);
+  return true;
+}
+
+// Reads what writeJson() wrote; lines of skipped benchmarks are left out
+static bool readJson(const char *path, std::map<std::string, BenchResult> &results)
+{
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+  {
+    perror(path);
+    return false;
+  }
+
+  char line[512];
+  while (fgets(line, sizeof(line), file) != NULL)
+  {
+    char name[128];
+    BenchResult result = {};
+    if (sscanf(
+            line,
+            "{\"name\":\"%127[^\"]\",\"nsPerCall\":%lf,\"nsMin\":%lf,\"allocsPerCall\":%lf,\"codeBytes\":%lu",
+            name,
+            &result.nsPerCall,
+            &result.nsMin,
+            &result.allocsPerCall,
+            &result.codeBytes)
+        == 5)
+    {
+      result.name = name;
+      results[name] = result;
+    }
+  }
+
+  fclose(file);
+  return true;
+}
+
+static void usage(const char *program)
+{
+  fprintf(stderr, "usage: %s [--json FILE] [--baseline FILE] [--threshold PERCENT] [--filter TEXT]\n", program);
+}
+
+static bool parseOptions(int argc, char **argv, BenchOptions &options)
+{
+  for (int i = 1; i < argc; i += 2)
+  {
+    const char *arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+    if (value == NULL)
+    {
+      return false;
+    }
+    else if (strcmp(arg, "--json") == 0)
+    {
+      options.jsonPath = value;
+    }
+    else if (strcmp(arg, "--baseline") == 0)
+    {
+      options.baselinePath = value;
+    }
+    else if (strcmp(arg, "--threshold") == 0)
+    {
+      options.thresholdPercent = atof(value);
+    }
+    else if (strcmp(arg, "--filter") == 0)
+    {
+      options.filter = value;
+    }
+    else
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  BenchOptions options;
+  if (!parseOptions(argc, argv, options))
+  {
+    usage(argv[0]);
+    return 2;
+  }
+
+  std::map<std::string, BenchResult> baseline;
+  if (options.baselinePath != NULL && !readJson(options.baselinePath, baseline))
+  {
+    return 1;
+  }
+
+  for (OccupancyConfig &config : occupancyConfig)
+  {
+    config = OccupancyConfig OCCUPANCY_CONFIG_DEFAULT;
+  }
+  nullOutput = open("/dev/null", O_WRONLY);
+  std::map<std::string, unsigned long> sizes = readSymbolSizes();
+  std::vector<BenchResult> results;
+
+  printf("%-26s %12s %12s %12s %10s\n", "benchmark", "ns/call", "fastest", "allocs/call", "code B");
+  for (const Benchmark &benchmark : benchmarks())
+  {
+    if (options.filter != NULL && strstr(benchmark.name, options.filter) == NULL)
+    {
+      continue;
+    }
+
+    toNull();
+    BenchResult result = run(benchmark, sizes);
+    fromNull();
+    results.push_back(result);
+
+    if (result.skipped != NULL)
+    {
+      printf("%-26s skipped: %s\n", benchmark.name, result.skipped);
+    }
+    else
+    {
+      printf("%-26s %12.1f %12.1f %12.3f %10lu\n", benchmark.name, result.nsPerCall, result.nsMin, result.allocsPerCall, result.codeBytes);
+    }
+  }
+
+  if (options.jsonPath != NULL && !writeJson(options.jsonPath, results))
+  {
+    return 1;
+  }
+
+  if (options.baselinePath == NULL)
+  {
+    return 0;
+  }
+
+  // Compared on the fastest batch, which is the least disturbed by the rest of the machine
+  int regressions = 0;
+  printf("\nagainst %s (threshold %.0f %%)\n", options.baselinePath, options.thresholdPercent);
+  for (const BenchResult &result : results)
+  {
+    auto found = baseline.find(result.name);
+    if (result.skipped != NULL || found == baseline.end())
+    {
+      continue;
+    }
+
+    const BenchResult &before = found->second;
+    double change = before.nsMin > 0 ? 100.0 * (result.nsMin - before.nsMin) / before.nsMin : 0.0;
+    bool slower = change > options.thresholdPercent;
+    bool allocates = result.allocsPerCall > before.allocsPerCall + 0.0005;
+    bool grew = result.codeBytes > before.codeBytes;
+    regressions += slower || allocates || grew ? 1 : 0;
+    printf(
+        "%-26s %+7.1f %% time, allocs %.3f -> %.3f, code %lu -> %lu B%s\n",
+        result.name.c_str(),
+        change,
+        before.allocsPerCall,
+        result.allocsPerCall,
+        before.codeBytes,
+        result.codeBytes,
+        slower || allocates || grew ? "  REGRESSION" : "");
+  }
+  return regressions > 0 ? 1 : 0;
+}
@@ -4,12 +4,26 @@
 #include <WiFi.h>
 #include <az_core.h>
 #include <azure_ca.h>
-#include <ctime>
 #include "WiFiClientSecure.h"
 #include "PubSubClient.h"
-#include "ArduinoJson.h"
 #include "secrets.h"
-#include <HTTPClient.h>
+#include <LittleFS.h>
+#include "BootCache.h"
+#include "ConfigStore.h"
+#include "ConnectionManager.h"
+#include "DeviceConfig.h"
+#include "Hal.h"
+#include "HealthMetrics.h"
+#include "HttpsTransport.h"
+#include "MqttAckClient.h"
+#include "MqttPublisher.h"
+#include "Occupancy.h"
+#include "OccupancySummary.h"
+#include "PowerManager.h"
+#include "Telemetry.h"
+#include "TelemetryQueue.h"
+#include "TelemetryTransport.h"
+#include "TelemetryUplink.h"
 
 /* Azure auth data */
 // Device ID as specified in the list of devices on IoT Hub
@@ -19,13 +33,18 @@ const int tokenDuration = 60;
 const char *mqttBroker = iotHubHost;                              // MQTT host = IoT Hub link
 const int mqttPort = AZ_IOT_DEFAULT_MQTT_CONNECT_PORT;            // Secure MQTT port
 const char *mqttC2DTopic = AZ_IOT_HUB_CLIENT_C2D_SUBSCRIBE_TOPIC; // Topic where we can receive cloud to device messages
+const uint16_t mqttSocketTimeout = 5;                             // Upper bound (s) for the blocking TLS + MQTT connect
+const bool reuseWifiLease = false;                                // Static IP from the last DHCP lease on warm boots
+const uint8_t mqttPublishWindow = 4;                              // QoS 1 messages awaiting PUBACK at once, 0 = QoS 0
+const unsigned long mqttAckTimeoutMs = 5000;                      // Resend (DUP) a message not acknowledged by then
 
 // These three are just buffers - actual clientID/username/password is generated
 // using the SDK functions in initIoTHub()
 char mqttClientId[128];
 char mqttUsername[128];
 char mqttPasswordBuffer[200];
-char publishTopic[200];
+char mqttNextPasswordBuffer[200]; // Next SAS token, prepared before the current one expires
+char publishTopic[MQTT_PUBLISH_TOPIC_SIZE];
 
 /* Auth token requirements */
 
@@ -35,327 +54,840 @@ az_iot_hub_client client;
 AzIoTSasToken sasToken(
     &client, az_span_create_from_str(deviceKey),
     AZ_SPAN_FROM_BUFFER(sasSignatureBuffer),
-    AZ_SPAN_FROM_BUFFER(
-        mqttPasswordBuffer)); // Authentication token for our specific device
-
-/* Pin definitions and library instance(s) */
-
-#define PIR_PIN 14   // GPIO za PIR senzor
-#define RED_PIN 18   // GPIO za crvenu LED
-#define GREEN_PIN 19 // GPIO za zelenu LED
+    AZ_SPAN_FROM_BUFFER(mqttPasswordBuffer),
+    AZ_SPAN_FROM_BUFFER(mqttNextPasswordBuffer)); // Authentication token for our specific device
 
 /* WiFi things */
 
 WiFiClientSecure wifiClient;
-PubSubClient mqttClient(wifiClient);
+MqttPublisher mqttPublisher;                            // QoS 1 telemetry, PubSubClient only publishes QoS 0
+MqttAckClient mqttAckClient(wifiClient, mqttPublisher); // Shows the publisher the PUBACKs PubSubClient reads
+PubSubClient mqttClient(mqttAckClient);
+ConnectionManager connection(mqttClient, sasToken, tokenDuration);
 
-void setupWiFi()
-{
-  Logger.Info("Connecting to WiFi");
+/* Azure Function (HTTPS) */
+// One TLS connection kept open between requests; NULL skips certificate verification
+const char *functionCaCert = NULL;
+const uint16_t functionTimeout = 5; // Upper bound (s) for the handshake and for each response
+HttpsTransport functionTransport;
 
-  wifiClient.setCACert((const char *)ca_pem); // We are using TLS to secure the connection, therefore we need to supply a certificate (in the SDK)
+void callback(char *topic, byte *payload, unsigned int length); // Device twin and cloud-to-device messages, below
 
-  WiFi.mode(WIFI_STA);
-  WiFi.begin(ssid, pass);
-
-  short timeoutCounter = 0;
-  while (WiFi.status() != WL_CONNECTED)
-  { // Wait until we connect...
-    Serial.print(".");
-    delay(500);
-
-    timeoutCounter++;
-    if (timeoutCounter >= 20)
-      ESP.restart(); // Or restart if we waited for too long, not much else can you do
-  }
+void setupMQTT()
+{
+  wifiClient.setCACert((const char *)ca_pem); // We are using TLS to secure the connection, therefore we need to supply a certificate (in the SDK)
 
-  Logger.Info("WiFi connected");
+  mqttClient.setBufferSize(2048); // Povećanje buffer-a za stabilnije slanje podataka
+  mqttClient.setServer(mqttBroker, mqttPort);
+  mqttClient.setCallback(callback);
+  mqttPublisher.Begin(mqttAckClient, mqttPublishWindow, mqttAckTimeoutMs);
 }
 
-// Use pool pool.ntp.org to get the current time
-// Define a date on 1.1.2023. and wait until the current time has the same year (by default it's 1.1.1970.)
-void initializeTime()
-{ // MANDATORY or SAS tokens won't generate
-  Logger.Info("Setting time using SNTP");
-  configTime(0, 0, "pool.ntp.org", "time.nist.gov");
-  time_t now = time(NULL);
-  std::tm tm{};
-  tm.tm_year = 2023; // Define a date on 1.1.2023. and wait until the current time has the same year (by default it's 1.1.1970.)
-
-  while (now < std::mktime(&tm)) // Since we are using an Internet clock, it may take a moment for clocks to sychronize
+// The content type (and for JSON the encoding) go into the topic as IoT Hub system properties,
+// so that routing and the backend know how to read the body. Values are URL-encoded in the topic.
+// In dual transport mode the message ID ($.mid) goes there too, for the backend to deduplicate.
+bool buildPublishTopic(char *topic, size_t size, const char *messageId)
+{
+  uint8_t propertiesBuffer[96];
+  az_iot_message_properties properties;
+  bool json = telemetryGetEncoding() == TELEMETRY_ENCODING_JSON;
+
+  if (az_result_failed(az_iot_message_properties_init(&properties, AZ_SPAN_FROM_BUFFER(propertiesBuffer), 0))
+      || az_result_failed(az_iot_message_properties_append(
+          &properties,
+          AZ_SPAN_FROM_STR(AZ_IOT_MESSAGE_PROPERTIES_CONTENT_TYPE),
+          json ? AZ_SPAN_FROM_STR("application%2Fjson") : AZ_SPAN_FROM_STR("application%2Fcbor")))
+      || (json
+          && az_result_failed(az_iot_message_properties_append(
+              &properties, AZ_SPAN_FROM_STR(AZ_IOT_MESSAGE_PROPERTIES_CONTENT_ENCODING), AZ_SPAN_FROM_STR("utf-8"))))
+      || (messageId != NULL
+          && az_result_failed(az_iot_message_properties_append(
+              &properties,
+              AZ_SPAN_FROM_STR(AZ_IOT_MESSAGE_PROPERTIES_MESSAGE_ID),
+              az_span_create((uint8_t *)messageId, strlen(messageId))))))
   {
-    delay(500);
-    Serial.print(".");
-    now = time(NULL);
+    return false;
   }
-}
-
-void setupPIRSensor()
-{
-  pinMode(PIR_PIN, INPUT);
-  pinMode(RED_PIN, OUTPUT);
-  pinMode(GREEN_PIN, OUTPUT);
 
-  // Početno stanje LED
-  digitalWrite(RED_PIN, LOW);
-  digitalWrite(GREEN_PIN, HIGH);
+  return !az_result_failed(az_iot_hub_client_telemetry_get_publish_topic(&client, &properties, topic, size, NULL));
 }
 
-// MQTT is a publish-subscribe based, therefore a callback function is called whenever something is published on a topic that device is subscribed to
-void callback(char *topic, byte *payload, unsigned int length)
-{
-  payload[length] = '\0';                   // It's also a binary-safe protocol, therefore instead of transfering text, bytes are transfered and they aren't null terminated - so we need ot add \0 to terminate the string
-  String message = String((char *)payload); // After it's been terminated, it can be converted to String
-
-  Logger.Info("Callback:" + String(topic) + ": " + message);
-}
+/* Telemetry transport */
 
-void connectMQTT()
+class MqttBackend : public TelemetryBackend
 {
-  mqttClient.setBufferSize(2048); // Povećanje buffer-a za stabilnije slanje podataka
-  mqttClient.setServer(mqttBroker, mqttPort);
-  mqttClient.setCallback(callback);
+public:
+  const char *GetName() const { return "mqtt"; }
 
-  int attempt = 0;
-  const int maxAttempts = 5; // Ograničavamo broj pokušaja
-
-  while (!mqttClient.connected() && attempt < maxAttempts)
+  bool Send(const char *payload, size_t length, const char *messageId)
   {
-    Logger.Info("Attempting MQTT connection... (Attempt " + String(attempt + 1) + "/" + String(maxAttempts) + ")");
+    char messageTopic[sizeof(publishTopic)];
+    const char *topic = publishTopic;
+    if (messageId != NULL)
+    {
+      if (!buildPublishTopic(messageTopic, sizeof(messageTopic), messageId))
+      {
+        return false;
+      }
+      topic = messageTopic;
+    }
 
-    if (sasToken.Generate(tokenDuration) != 0)
+    if (mqttPublishWindow > 0)
     {
-      Logger.Error("Failed generating SAS token");
-      delay(2000); // Kratka pauza prije ponovnog pokušaja
-      attempt++;
-      continue;
+      return mqttPublisher.Publish(topic, (const uint8_t *)payload, length, millis()); // false: window full
     }
 
-    const char *mqttPassword = (const char *)az_span_ptr(sasToken.Get());
-    if (mqttClient.connect(mqttClientId, mqttUsername, mqttPassword))
+    // QoS 0: copied once into PubSubClient's own buffer (setBufferSize), no String in between
+    return mqttClient.publish(topic, (const uint8_t *)payload, length, false);
+  }
+};
+
+class FunctionBackend : public TelemetryBackend
+{
+public:
+  const char *GetName() const { return "http"; }
+
+  // Queued, not yet delivered; refused (and journaled by the uplink) while the Function is unreachable
+  bool Send(const char *payload, size_t length, const char *messageId)
+  {
+    if (!functionTransport.IsReachable())
     {
-      Logger.Info("MQTT connected");
-      mqttClient.subscribe(mqttC2DTopic);
-      break;
+      return false;
     }
-    else
+    if (!functionTransport.Post(telemetryContentType(), payload, length, messageId))
     {
-      Logger.Error("MQTT connection failed, retrying in 5 seconds...");
-      delay(5000);
-      attempt++;
+      LOG_WARN("Azure Function request dropped, %lu so far", (unsigned long)functionTransport.GetStats().dropped);
+      return false;
     }
+    return true;
   }
 
-  if (!mqttClient.connected())
+  // Whether the Function answered with 2xx, for each request as functionTransport.Loop() finishes it
+  bool ConfirmsLater() const { return true; }
+  bool TakeOutcome(bool &delivered) { return functionTransport.TakeOutcome(delivered); }
+};
+
+MqttBackend mqttBackend;
+FunctionBackend functionBackend;
+
+bool initIoTHub()
+{
+  az_iot_hub_client_options options = az_iot_hub_client_options_default();
+
+  if (az_result_failed(az_iot_hub_client_init(
+          &client,
+          az_span_create((uint8_t *)iotHubHost, strlen(iotHubHost)),
+          az_span_create((uint8_t *)deviceId, strlen(deviceId)),
+          &options)))
   {
-    Logger.Error("MQTT connection failed after multiple attempts, restarting ESP32...");
-    ESP.restart(); // Resetiraj ESP ako ne uspije povezivanje
+    LOG_ERROR("Failed initializing Azure IoT Hub client");
+    return false;
   }
-}
 
-String getISO8601Timestamp()
-{
-  time_t now = time(NULL);
-  struct tm timeinfo;
+  size_t client_id_length;
+  if (az_result_failed(az_iot_hub_client_get_client_id(
+          &client, mqttClientId, sizeof(mqttClientId) - 1, &client_id_length)))
+  {
+    LOG_ERROR("Failed getting client ID");
+    return false;
+  }
 
-  now += 3600;
-  localtime_r(&now, &timeinfo);
+  size_t mqttUsernameSize;
+  if (az_result_failed(az_iot_hub_client_get_user_name(
+          &client, mqttUsername, sizeof(mqttUsername), &mqttUsernameSize)))
+  {
+    LOG_ERROR("Failed to get MQTT username ");
+    return false;
+  }
+
+  // The publish topic isn't hardcoded and depends on chosen properties, therefore we need to use az_iot_hub_client_telemetry_get_publish_topic()
+  if (!buildPublishTopic(publishTopic, sizeof(publishTopic), NULL))
+  {
+    LOG_ERROR("Failed to get MQTT publish topic");
+    return false;
+  }
 
-  char buffer[30];
-  strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%SZ", &timeinfo); // ISO 8601 format
-  return String(buffer);
+  LOG_INFO("Successfully initialized Azure IoT Hub");
+  LOG_INFO("Client ID: %s", mqttClientId);
+  LOG_INFO("Username: %s", mqttUsername);
+  LOG_INFO("Publish topic: %s", publishTopic);
+
+  return true;
 }
 
-String getTelemetryData(bool status)
+/* Sensors */
+// One row per room or zone watched by this board (HAL_CHANNELS, -DHAL_CHANNELS=N in
+// platformio.ini); both tables need exactly that many. All channels share one connection, queue
+// and batch, and their telemetry carries the channel number. For deep sleep the PIR pins must
+// be RTC GPIOs (0, 2, 4, 12-15, 25-27, 32-39).
+const HalChannelPins halChannelPins[] = {
+    {PIR_PIN, RED_PIN, GREEN_PIN},
+};
+
+OccupancyConfig occupancyConfig[] = {
+    OCCUPANCY_CONFIG_DEFAULT,
+};
+
+static_assert(sizeof(halChannelPins) / sizeof(halChannelPins[0]) == HAL_CHANNELS, "One row of pins per channel");
+static_assert(sizeof(occupancyConfig) / sizeof(occupancyConfig[0]) == HAL_CHANNELS, "One OccupancyConfig per channel");
+
+/* Tasks */
+// Sensing runs on ARDUINO_RUNNING_CORE at a fixed period, networking on ARDUINO_EVENT_RUNNING_CORE
+// next to the WiFi stack. They only share the telemetry queue, so nothing the network does
+// (TLS handshakes, HTTP, reconnect waits) can stall the PIR state machine or the LEDs.
+
+const uint16_t sensingPeriodMs = 10;
+const uint32_t sensingBudgetUs = 2000;     // Hard budget for one checkPIRSensor() step
+const uint32_t networkPollMs = 10;         // Longest the network task waits on the queue before servicing MQTT
+const unsigned long statsInterval = 60000; // Koliko često ispisati stanje reda
+const unsigned long healthInterval = 300000; // Health as reported properties (HealthMetrics.h), 0 = off; needs MQTT
+
+const char *journalPath = "/littlefs/telemetry.journal";
+const TelemetryJournal::OverflowPolicy journalOverflowPolicy = TelemetryJournal::DROP_OLDEST;
+
+// Batching trades latency for fewer messages; the backend must accept the batch format (README.md)
+// e.g. {16, TELEMETRY_BATCH_MAX_SIZE, 10000} sends at most one message per 10 s per busy room
+const TelemetryBatchConfig batchConfig = {1, TELEMETRY_BATCH_MAX_SIZE, 0}; // Off: one message per transition
+
+// Hourly and daily occupancy summaries next to the transitions, aggregated on the device and
+// kept across restarts; the backend must accept the summary format (README.md)
+const char *summaryPath = "/littlefs/occupancy.summary";
+const OccupancySummaryConfig summaryConfig = {false, false}; // Off; {true, true} sends both
+
+// CBOR cuts a transition from ~80 to ~9 bytes; the backend must decode it (web-app/telemetry-decoder.js)
+const TelemetryEncoding telemetryEncoding = TELEMETRY_ENCODING_JSON;
+const uint16_t deviceIndex = 0; // Stands in for deviceId in CBOR payloads, unique per device
+
+// Both paths end up in the same database: one of them is enough and halves the airtime.
+// Dual (the old behaviour) sends everything twice with a shared message ID for deduplication.
+const TelemetryTransportMode transportMode = TELEMETRY_TRANSPORT_DUAL;
+
+// Battery-powered rooms: sleep between transitions with the radio off (PowerManager.h).
+// No tasks then; loop() senses, delivers a transition within radioTimeoutMs and sleeps again.
+const PowerMode powerMode = POWER_MODE_ACTIVE;
+const PowerProfile powerProfile = POWER_PROFILE_ESP32;
+const unsigned long radioTimeoutMs = 20000; // Whatever is not delivered by then waits in the journal
+
+bool iotHubReady = false; // Credentials usable, the low-power loop may transmit
+
+// Every setting above from heartbeat to log level can be changed at runtime from the device twin
+// or a C2D command (DeviceConfig.h); the last one applied is kept in NVS and used from boot on
+DeviceConfig defaultConfig; // The constants above
+DeviceConfig deviceConfig;  // In use
+volatile TickType_t sensingPeriod = pdMS_TO_TICKS(sensingPeriodMs);
+bool mqttStarted = false;     // Backends brought up at boot; another transport may need others
+bool functionStarted = false;
+bool restartRequested = false; // Restart from the network task once the reply is out
+
+volatile uint32_t sensingMaxStepUs = 0; // Longest checkPIRSensor() step seen
+volatile uint32_t sensingOverruns = 0;  // Steps over sensingBudgetUs
+TaskHandle_t sensingTaskHandle = NULL;  // For the stack high-water mark
+
+void sensingTask(void *parameter)
 {
-  StaticJsonDocument<256> doc;
-  String output;
+  TickType_t lastWake = xTaskGetTickCount();
 
-  doc["DeviceID"] = (String)deviceId;       // Jedinstveni identifikator uređaja
-  doc["Status"] = status;                   // True (zauzeto) ili False (slobodno)
-  doc["Timestamp"] = getISO8601Timestamp(); // Vrijeme promjene statusa
+  for (;;)
+  {
+    uint64_t start = halMicros();
+    checkPIRSensor(); // Provjera PIR senzora
+    uint32_t elapsed = (uint32_t)(halMicros() - start);
+
+    healthRecord(HEALTH_SENSING_STEP, elapsed);
+    if (elapsed > sensingMaxStepUs)
+      sensingMaxStepUs = elapsed;
+    if (elapsed > sensingBudgetUs)
+      sensingOverruns++;
 
-  serializeJson(doc, output);
-  Logger.Info(output);
-  return output;
+    vTaskDelayUntil(&lastWake, sensingPeriod);
+  }
 }
 
-void sendTelemetryData(String telemetryData)
+void logQueueStats()
 {
-  mqttClient.publish(publishTopic, telemetryData.c_str());
+  TelemetryQueueStats stats = telemetryQueueStats();
+  LOG_INFO(
+      "Telemetry queue: depth %lu/%d, high water %lu, enqueued %lu, dropped %lu; sensing max step %lu us, "
+      "overruns %lu; reconnects %lu, last outage %lu ms; token renewals %lu, last %lu ms; log dropped %lu",
+      (unsigned long)stats.depth,
+      TELEMETRY_QUEUE_SIZE,
+      (unsigned long)stats.highWater,
+      (unsigned long)stats.enqueued,
+      (unsigned long)stats.dropped,
+      (unsigned long)sensingMaxStepUs,
+      (unsigned long)sensingOverruns,
+      (unsigned long)connection.GetReconnectCount(),
+      (unsigned long)connection.GetLastOutageMs(),
+      (unsigned long)connection.GetRenewalCount(),
+      (unsigned long)connection.GetLastRenewalMs(),
+      (unsigned long)Logger.GetDropped());
+
+  TelemetryUplinkStats uplink = telemetryUplinkStats();
+  LOG_INFO(
+      "Telemetry uplink: %lu messages, sent %lu, failed %lu, journaled %lu, replayed %lu, lost %lu, "
+      "timestamps repaired %lu; journal depth %lu/%d, dropped %lu",
+      (unsigned long)uplink.messages,
+      (unsigned long)uplink.sent,
+      (unsigned long)uplink.sendFailures,
+      (unsigned long)uplink.journaled,
+      (unsigned long)uplink.replayed,
+      (unsigned long)uplink.lost,
+      (unsigned long)uplink.repaired,
+      (unsigned long)uplink.journalDepth,
+      TELEMETRY_JOURNAL_CAPACITY,
+      (unsigned long)uplink.journalDropped);
+
+  if (summaryConfig.hourly || summaryConfig.daily)
+  {
+    OccupancySummaryStats summaries = occupancySummaryStats();
+    LOG_INFO(
+        "Occupancy summaries: %lu hourly, %lu daily sent, %lu failed, %lu pending, %lu dropped, %lu save failures",
+        (unsigned long)summaries.hourly,
+        (unsigned long)summaries.daily,
+        (unsigned long)summaries.sendFailures,
+        (unsigned long)summaries.pending,
+        (unsigned long)summaries.dropped,
+        (unsigned long)summaries.saveFailures);
+  }
+
+  TelemetryTransportStats transport = telemetryTransportStats();
+  LOG_INFO(
+      "Telemetry transport (%s): MQTT %lu sent, %lu failed, %lu bytes; HTTP %lu sent, %lu failed, %lu bytes, "
+      "%lu undelivered",
+      telemetryTransportModeName(telemetryTransportMode()),
+      (unsigned long)transport.sent[0],
+      (unsigned long)transport.failed[0],
+      transport.bytes[0],
+      (unsigned long)transport.sent[1],
+      (unsigned long)transport.failed[1],
+      transport.bytes[1],
+      (unsigned long)transport.undelivered);
+
+  MqttPublisherStats mqtt = mqttPublisher.GetStats();
+  LOG_INFO(
+      "MQTT QoS 1: %lu published, %lu acked, %lu in flight (max %lu/%u), %lu resent, %lu window full; "
+      "ack last %lu ms, mean %lu ms, max %lu ms",
+      (unsigned long)mqtt.published,
+      (unsigned long)mqtt.acked,
+      (unsigned long)mqtt.inFlight,
+      (unsigned long)mqtt.maxInFlight,
+      (unsigned)mqttPublishWindow,
+      (unsigned long)mqtt.retransmits,
+      (unsigned long)mqtt.windowFull,
+      mqtt.ackLastMs,
+      mqtt.acked ? mqtt.ackTotalMs / mqtt.acked : 0UL,
+      mqtt.ackMaxMs);
+
+  const HttpsTransportStats &https = functionTransport.GetStats();
+  LOG_INFO(
+      "Azure Function: %lu requests, failed %lu, dropped %lu; %lu handshakes, last %lu ms; "
+      "latency last %lu ms, max %lu ms",
+      (unsigned long)https.requests,
+      (unsigned long)https.failures,
+      (unsigned long)https.dropped,
+      (unsigned long)https.connects,
+      https.connectMs,
+      https.lastMs,
+      https.maxMs);
 }
 
-long lastTime, currentTime = 0;
-unsigned long lastMotionTime = 0;
-const unsigned long noMotionDelay = 10000; // Vrijeme neaktivnosti prije povratka u "slobodno" stanje
-const unsigned long debounceDelay = 1000;  // Minimalni razmak između detekcija (debouncing)
-unsigned long lastDebounceTime = 0;        // Vrijeme zadnje registracije pokreta
-unsigned long lastCheckTime = 0;           // Vrijeme zadnje provjere u loop() petlji
-const unsigned long checkInterval = 100;   // Interval između provjera                    // Brojač pokreta                // Indikator za prvu poruku
-bool lastSentState = false;                // Zadnje poslano stanje (false = slobodno, true = zauzeto)
+// Once per boot, as soon as the connection is up: where the time since reset went
+void logBootTimings()
+{
+  const ConnectionBootTimings& timings = connection.GetBootTimings();
+  LOG_INFO(
+      "Boot (%s): WiFi %lu ms (%s), clock %lu ms (%s), connected %lu ms",
+      bootResetReason(),
+      timings.wifiMs,
+      timings.wifiCached ? "cached AP" : "scan",
+      timings.timeMs,
+      timings.timeRetained ? "kept by RTC" : "SNTP",
+      timings.connectedMs);
+}
 
-unsigned long lastInactiveTimeReported = 0; // Dodana varijabla za praćenje posljednje prijavljene sekunde
+/* Health */
+// Heap, stacks and the latency histograms of the hot paths, published as reported properties
+// every healthInterval so that a twin query finds the slow and leaking devices, e.g.
+// SELECT deviceId FROM devices WHERE properties.reported.health.heap.min < 20000
 
-unsigned long startTime = millis(); // Dodana varijabla za praćenje početnog vremena
+// IoT Hub keeps reported properties per device; the connection must be up
+bool publishReported(const char *json, size_t length)
+{
+  static uint8_t requestId = 0;
+  char rid[4];
+  char topic[128];
+  snprintf(rid, sizeof(rid), "%u", (unsigned)++requestId);
+  return length > 0
+         && !az_result_failed(az_iot_hub_client_twin_patch_get_publish_topic(
+             &client, az_span_create_from_str(rid), topic, sizeof(topic), NULL))
+         && mqttClient.publish(topic, (const uint8_t *)json, length, false);
+}
 
-void sendDataToAzureFunction(const String &jsonPayload)
+// Called from the network side: that is the task whose stack is reported as the network's
+HealthGauges readHealthGauges()
 {
-  if (WiFi.status() == WL_CONNECTED)
-  { // Provjera WiFi konekcije
-    HTTPClient http;
+  TelemetryQueueStats queue = telemetryQueueStats();
+  TaskHandle_t loggerTask = xTaskGetHandle("logger");
+
+  HealthGauges gauges;
+  gauges.uptimeS = (uint32_t)(halMicros() / 1000000);
+  gauges.freeHeap = ESP.getFreeHeap();
+  gauges.minFreeHeap = ESP.getMinFreeHeap();
+  gauges.largestFreeBlock = ESP.getMaxAllocHeap();
+  gauges.sensingStackFree = sensingTaskHandle != NULL ? uxTaskGetStackHighWaterMark(sensingTaskHandle) : 0;
+  gauges.networkStackFree = uxTaskGetStackHighWaterMark(NULL);
+  gauges.loggerStackFree = loggerTask != NULL ? uxTaskGetStackHighWaterMark(loggerTask) : 0;
+  gauges.queueHighWater = queue.highWater;
+  gauges.queueDropped = queue.dropped;
+  gauges.journalDepth = telemetryUplinkStats().journalDepth;
+  gauges.reconnects = connection.GetReconnectCount();
+  gauges.logDropped = Logger.GetDropped();
+  return gauges;
+}
 
-    // Postavljanje URL-a funkcije
-    http.begin(functionUrl);
+// Across deep sleep too, so that a battery-powered room reports once per interval as well
+HAL_RETAINED_ATTR uint64_t nextHealthReportUs = 0;
 
-    // Postavljanje HTTP headera za JSON podatke
-    http.addHeader("Content-Type", "application/json");
+void serviceHealth()
+{
+  static HealthTimers reported; // The timers cover the time since the last report
 
-    // Slanje POST zahtjeva
-    int httpResponseCode = http.POST(jsonPayload);
+  if (healthInterval > 0 && mqttStarted && connection.IsConnected() && halMicros() >= nextHealthReportUs)
+  {
+    nextHealthReportUs = halMicros() + (uint64_t)healthInterval * 1000;
 
-    // Provjera odgovora servera
-    if (httpResponseCode > 0)
+    char report[HEALTH_REPORT_SIZE];
+    size_t length = healthReport(readHealthGauges(), &reported, report, sizeof(report));
+    if (!publishReported(report, length))
     {
-      String response = http.getString(); // Odgovor servera
-      Logger.Info("Response: " + response);
+      LOG_WARN("Failed reporting health");
     }
-    else
+  }
+
+  // "health" on the serial console: the same since boot, as log lines
+  static char line[16];
+  static size_t lineLength = 0;
+  while (Serial.available() > 0)
+  {
+    char c = (char)Serial.read();
+    if (c == '\r' || c == '\n')
     {
-      Logger.Error("Error sending data: " + String(httpResponseCode));
+      line[lineLength] = '\0';
+      if (strcmp(line, "health") == 0)
+      {
+        healthLog(readHealthGauges());
+      }
+      lineLength = 0;
+    }
+    else if (lineLength < sizeof(line) - 1)
+    {
+      line[lineLength++] = c;
     }
+  }
+}
+
+// One pass of the network side, waits up to networkPollMs for a transition
+void serviceNetwork()
+{
+  static bool bootLogged = false;
 
-    // Zatvaranje konekcije
-    http.end();
+  connection.Loop(); // WiFi/SNTP/MQTT bring-up and keep-alive, never waits
+  mqttPublisher.Loop(connection.IsConnected(), millis()); // Resends unacknowledged QoS 1 messages
+
+  if (!bootLogged && connection.IsConnected())
+  {
+    bootLogged = true;
+    logBootTimings();
+  }
+
+  // After a power-on the clock is unset until SNTP answers; transitions from that time wait
+  // in the queue (while it has room) so that their timestamps can be corrected
+  if (time(NULL) < HAL_MIN_VALID_TIME && telemetryQueueStats().depth < TELEMETRY_QUEUE_SIZE / 2)
+  {
+    vTaskDelay(pdMS_TO_TICKS(networkPollMs));
   }
   else
   {
-    Logger.Error("WiFi not connected!");
+    // Sends queued transitions, or journals them to flash while disconnected and replays them later
+    telemetryUplinkService(connection.IsConnected(), networkPollMs);
+  }
+
+  functionTransport.Loop(); // Writes queued requests and reads responses as they arrive
+  serviceHealth();
+
+  // Asked for by a command or a transport change; the journal keeps what is not delivered yet
+  if (restartRequested)
+  {
+    telemetryUplinkService(false, 0);
+    LOG_INFO("Restarting");
+    Logger.Flush();
+    ESP.restart();
   }
 }
 
-void checkPIRSensor()
+void networkTask(void *parameter)
 {
-  unsigned long currentTime = millis();
-  static bool isRoomOccupied = false; // Trenutni status zauzetosti
+  unsigned long lastStatsTime = millis();
 
-  // Provjera svakih 100 ms
-  if (currentTime - lastCheckTime >= checkInterval)
+  for (;;)
   {
-    lastCheckTime = currentTime;
+    uint64_t start = halMicros();
+    serviceNetwork();
+    healthRecord(HEALTH_NETWORK_PASS, (uint32_t)(halMicros() - start));
 
-    int motionDetected = digitalRead(PIR_PIN);
-
-    // Ako je detektiran pokret i prostorija je bila slobodna
-    if (motionDetected == HIGH && !isRoomOccupied)
+    if (millis() - lastStatsTime >= statsInterval)
     {
-      isRoomOccupied = true;        // Označi prostoriju kao zauzetu
-      lastMotionTime = currentTime; // Pohrani vrijeme zadnjeg pokreta
-
-      digitalWrite(RED_PIN, HIGH); // Crvena LED = zauzeto
-      digitalWrite(GREEN_PIN, LOW);
-
-      if (!lastSentState)
-      { // Pošalji samo ako zadnje poslano stanje nije bilo "zauzeto"
-        Logger.Info("Pokret detektiran! Slanje zauzetosti na IoT Hub.");
-        String telemetryData = getTelemetryData(true); // true = zauzeto
-        sendTelemetryData(telemetryData);
-        sendDataToAzureFunction(telemetryData); // Slanje na Azure Function
-        lastSentState = true;                   // Oznaka da je zadnje poslano stanje "zauzeto"
-      }
-    }
-    // Ako nije bilo pokreta dulje od noMotionDelay i prostorija je zauzeta
-    else if (motionDetected == LOW && isRoomOccupied && (currentTime - lastMotionTime >= noMotionDelay))
-    {
-      isRoomOccupied = false; // Označi prostoriju kao slobodnu
-
-      digitalWrite(RED_PIN, LOW);
-      digitalWrite(GREEN_PIN, HIGH); // Zelena LED = slobodno
-
-      if (lastSentState)
-      { // Pošalji samo ako zadnje poslano stanje nije već bilo "slobodno"
-        Logger.Info("Nema pokreta dulje od 10 sekundi. Prostorija sada slobodna.");
-        String telemetryData = getTelemetryData(false); // false = slobodno
-        sendTelemetryData(telemetryData);
-        sendDataToAzureFunction(telemetryData); // Slanje na Azure Function
-        lastSentState = false;                  // Oznaka da je zadnje poslano stanje "slobodno"
-      }
+      lastStatsTime = millis();
+      logQueueStats();
     }
   }
 }
 
-void sendTestMessageToIoTHub()
+void logPowerStats()
 {
-  az_result res = az_iot_hub_client_telemetry_get_publish_topic(&client, NULL, publishTopic, 200, NULL); // The receive topic isn't hardcoded and depends on chosen properties, therefore we need to use az_iot_hub_client_telemetry_get_publish_topic()
-  Logger.Info(String(publishTopic));
+  PowerStats power = powerStats();
+  uint64_t total = power.awakeUs + power.sleepUs;
+  LOG_INFO(
+      "Power (%s): duty cycle %.2f %%, radio %.2f %%; %lu sleeps, %lu PIR and %lu timer wake-ups; "
+      "%lu transmissions, %lu transitions; %.1f J, %.1f mJ per transition",
+      powerModeName(powerMode),
+      total > 0 ? 100.0 * power.awakeUs / total : 100.0,
+      total > 0 ? 100.0 * power.radioUs / total : 0.0,
+      (unsigned long)power.sleeps,
+      (unsigned long)power.pirWakeups,
+      (unsigned long)power.timerWakeups,
+      (unsigned long)power.transmissions,
+      (unsigned long)power.transitions,
+      power.energyMj / 1000,
+      power.transitions > 0 ? power.energyMj / power.transitions : 0.0);
+}
 
-  mqttClient.publish(publishTopic, deviceId); // Use https://github.com/Azure/azure-iot-explorer/releases to read the telemetry
+// Everything delivered: nothing queued, batched, journaled, summarized, unacknowledged or unanswered
+bool isDelivered()
+{
+  TelemetryUplinkStats uplink = telemetryUplinkStats();
+  return telemetryQueueStats().depth == 0 && uplink.pending == 0 && uplink.unconfirmed == 0 && uplink.journalDepth == 0
+         && occupancySummaryStats().pending == 0
+         && mqttPublisher.GetStats().inFlight == 0 && functionTransport.IsIdle();
 }
 
-bool initIoTHub()
+// Low-power modes: radio on, deliver what the sensing queued (and the journal), radio off
+void transmit()
 {
-  az_iot_hub_client_options options = az_iot_hub_client_options_default();
+  static bool connectionStarted = false;
 
-  if (az_result_failed(az_iot_hub_client_init(
-          &client,
-          az_span_create((uint8_t *)iotHubHost, strlen(iotHubHost)),
-          az_span_create((uint8_t *)deviceId, strlen(deviceId)),
-          &options)))
+  TelemetryQueueStats queue = telemetryQueueStats();
+  uint32_t enqueuedBefore = queue.enqueued - queue.depth;
+
+  powerRadioOn();
+  if (!connectionStarted)
   {
-    Logger.Error("Failed initializing Azure IoT Hub client");
-    return false;
+    connection.Begin(ssid, pass, mqttClientId, mqttUsername, mqttC2DTopic, mqttSocketTimeout);
+    connectionStarted = true;
+  }
+  else
+  {
+    connection.Resume();
   }
 
-  size_t client_id_length;
-  if (az_result_failed(az_iot_hub_client_get_client_id(
-          &client, mqttClientId, sizeof(mqttClientId) - 1, &client_id_length)))
+  unsigned long start = millis();
+  do
   {
-    Logger.Error("Failed getting client ID");
-    return false;
+    checkPIRSensor(); // Transitions meanwhile go out in the same session
+    serviceNetwork();
+  } while (!(connection.IsConnected() && isDelivered()) && millis() - start < radioTimeoutMs);
+
+  telemetryUplinkService(false, 0); // Journals what is still queued
+  if (powerMode == POWER_MODE_DEEP)
+  {
+    // RAM is lost with deep sleep: what is still waiting for its PUBACK or HTTP answer goes to
+    // the journal and out again after the wake-up
+    telemetryUplinkRequeueUnsent(mqttPublisher.GetStats().inFlight);
   }
 
-  size_t mqttUsernameSize;
-  if (az_result_failed(az_iot_hub_client_get_user_name(
-          &client, mqttUsername, sizeof(mqttUsername), &mqttUsernameSize)))
+  functionTransport.Close();
+  connection.Suspend();
+  powerRadioOff(telemetryQueueStats().enqueued - enqueuedBefore);
+  logPowerStats();
+}
+
+/* Remote configuration */
+// Desired properties of the device twin, read after every connect and pushed when they change,
+// and cloud-to-device commands; both go through DeviceConfig. The outcome and the settings in
+// use are written back as reported properties.
+
+DeviceConfig makeDefaultConfig()
+{
+  DeviceConfig config;
+  memset(&config, 0, sizeof(config)); // Padding included, ConfigStore compares the bytes
+  memcpy(config.occupancy, occupancyConfig, sizeof(config.occupancy));
+  config.heartbeatMs = heartbeatInterval;
+  config.sensingPeriodMs = sensingPeriodMs;
+  config.batch = batchConfig;
+  config.encoding = telemetryEncoding;
+  config.deviceIndex = deviceIndex;
+  config.transport = transportMode;
+  config.tokenDurationMin = tokenDuration;
+  config.logLevel = LOG_LEVEL;
+  return config;
+}
+
+// Hands config to the modules and main's own settings
+void useConfig(const DeviceConfig &config)
+{
+  deviceConfig = config;
+  deviceConfigApply(config);
+  sensingPeriod = pdMS_TO_TICKS(config.sensingPeriodMs);
+  connection.SetTokenDuration(config.tokenDurationMin);
+  if (iotHubReady && !buildPublishTopic(publishTopic, sizeof(publishTopic), NULL)) // Content type follows the encoding
+  {
+    LOG_ERROR("Failed to get MQTT publish topic");
+  }
+}
+
+// A transport whose backends were not brought up at boot: simplest to boot again with it
+bool needsRestart(TelemetryTransportMode transport)
+{
+  return (transport != TELEMETRY_TRANSPORT_HTTP) != mqttStarted || (transport != TELEMETRY_TRANSPORT_MQTT && !functionStarted);
+}
+
+void requestTwin()
+{
+  static uint8_t requestId = 0;
+  char rid[4];
+  char topic[128];
+  snprintf(rid, sizeof(rid), "%u", (unsigned)++requestId);
+  if (az_result_failed(az_iot_hub_client_twin_document_get_publish_topic(
+          &client, az_span_create_from_str(rid), topic, sizeof(topic), NULL))
+      || !mqttClient.publish(topic, NULL, 0, false))
+  {
+    LOG_WARN("Failed requesting the device twin");
+  }
+}
+
+void reportConfig(int status, const char *description)
+{
+  char report[DEVICE_CONFIG_REPORT_SIZE];
+  size_t length = deviceConfigReport(deviceConfig, status, description, report, sizeof(report));
+  if (!publishReported(report, length))
+  {
+    LOG_WARN("Failed reporting the settings");
+  }
+}
+
+// Takes a settings document on top of base (the defaults for a whole twin document), stores
+// and applies it; version is the twin's desired version it comes from
+bool updateConfig(const char *json, size_t length, const DeviceConfig &base, uint32_t version)
+{
+  DeviceConfig next = base;
+  char error[DEVICE_CONFIG_ERROR_SIZE];
+  if (!deviceConfigUpdate(json, length, defaultConfig, next, error, sizeof(error)))
   {
-    Logger.Error("Failed to get MQTT username ");
+    LOG_WARN("Settings refused: %s", error);
+    deviceConfig.desiredVersion = version; // Not tried again at the next connect
+    configStoreSave(deviceConfig);
+    reportConfig(400, error);
     return false;
   }
 
-  Logger.Info("Successfully initialized Azure IoT Hub");
-  Logger.Info("Client ID: " + String(mqttClientId));
-  Logger.Info("Username: " + String(mqttUsername));
+  next.desiredVersion = version;
+  configStoreSave(next);
+  if (needsRestart(next.transport))
+  {
+    LOG_INFO("Restarting for the %s transport", telemetryTransportModeName(next.transport));
+    deviceConfig = next; // Reported as it will be after the restart
+    restartRequested = true;
+    reportConfig(200, "restarting");
+    return true;
+  }
 
+  useConfig(next);
+  LOG_INFO("Settings applied (desired version %lu)", (unsigned long)version);
+  reportConfig(200, "applied");
   return true;
 }
 
-// Funkcija za slanje podataka na Azure Function
+// The twin's $version of a desired properties document, 0 if there is none
+uint32_t desiredVersion(const char *json, size_t length)
+{
+  const char *value;
+  size_t valueLength;
+  return deviceConfigFindMember(json, length, "$version", value, valueLength) ? strtoul(value, NULL, 10) : 0;
+}
+
+bool configureCommand(const char *args, size_t length)
+{
+  return args != NULL && updateConfig(args, length, deviceConfig, deviceConfig.desiredVersion);
+}
+
+bool reportCommand(const char *, size_t)
+{
+  reportConfig(200, "requested");
+  return true;
+}
+
+bool resetCommand(const char *, size_t)
+{
+  configStoreClear();
+  if (needsRestart(defaultConfig.transport))
+  {
+    restartRequested = true;
+    return true;
+  }
+  useConfig(defaultConfig);
+  requestTwin(); // desiredVersion is 0 again, so the twin applies in full
+  return true;
+}
+
+bool rebootCommand(const char *, size_t)
+{
+  restartRequested = true;
+  return true;
+}
+
+const DeviceCommand deviceCommands[] = {
+    {"configure", configureCommand}, // args: settings, as in the twin
+    {"report", reportCommand},       // Reported properties now
+    {"reset", resetCommand},         // Forget the stored settings, firmware defaults then the twin
+    {"reboot", rebootCommand},
+};
+
+// After every MQTT connect: what changed in the twin while the device was away
+void onMqttConnected()
+{
+  mqttClient.subscribe(AZ_IOT_HUB_CLIENT_TWIN_RESPONSE_SUBSCRIBE_TOPIC);
+  mqttClient.subscribe(AZ_IOT_HUB_CLIENT_TWIN_PATCH_SUBSCRIBE_TOPIC);
+  requestTwin();
+}
+
+// MQTT is a publish-subscribe based, therefore a callback function is called whenever something
+// is published on a topic that device is subscribed to. The payload is not null-terminated and
+// is read in place, from PubSubClient's buffer.
+void callback(char *topic, byte *payload, unsigned int length)
+{
+  const char *json = (const char *)payload;
+  az_span topicSpan = az_span_create((uint8_t *)topic, strlen(topic));
+  az_iot_hub_client_twin_response twin;
+
+  if (az_result_succeeded(az_iot_hub_client_twin_parse_received_topic(&client, topicSpan, &twin)))
+  {
+    if (twin.response_type == AZ_IOT_HUB_CLIENT_TWIN_RESPONSE_TYPE_GET && twin.status == AZ_IOT_STATUS_OK)
+    {
+      // The whole twin; a desired version already applied is not applied again, so that a
+      // "configure" command since then stays in effect
+      const char *desired;
+      size_t desiredLength;
+      if (deviceConfigFindMember(json, length, "desired", desired, desiredLength))
+      {
+        uint32_t version = desiredVersion(desired, desiredLength);
+        if (version != deviceConfig.desiredVersion)
+        {
+          updateConfig(desired, desiredLength, defaultConfig, version);
+        }
+      }
+    }
+    else if (twin.response_type == AZ_IOT_HUB_CLIENT_TWIN_RESPONSE_TYPE_DESIRED_PROPERTIES)
+    {
+      updateConfig(json, length, deviceConfig, desiredVersion(json, length)); // Changed members only, null = removed
+    }
+    else if (twin.status >= AZ_IOT_STATUS_BAD_REQUEST)
+    {
+      LOG_WARN("Device twin request failed with status %d", (int)twin.status);
+    }
+    return;
+  }
+
+  az_iot_hub_client_c2d_request request;
+  if (az_result_succeeded(az_iot_hub_client_c2d_parse_received_topic(&client, topicSpan, &request)))
+  {
+    deviceCommandDispatch(deviceCommands, sizeof(deviceCommands) / sizeof(deviceCommands[0]), json, length);
+    return;
+  }
+
+  LOG_INFO("Callback:%s: %u bytes", topic, length);
+}
 
 void setup()
 {
-  setupWiFi();
-  initializeTime();
+  Logger.Begin(); // Serial output from a background task, so logging never blocks sensing
 
-  if (initIoTHub())
+  // Journal of transitions not yet delivered, kept across restarts
+  if (!LittleFS.begin(true) || !telemetryUplinkBegin(journalPath, journalOverflowPolicy))
   {
-    connectMQTT();
+    LOG_ERROR("Telemetry journal unavailable, transitions sent while offline will be lost");
   }
+  telemetryTransportConfigure(transportMode, &mqttBackend, &functionBackend, esp_random()); // Boot ID for message IDs
 
-  sendTestMessageToIoTHub();
+  // Settings from the twin or a command before the last restart win over the constants above
+  defaultConfig = makeDefaultConfig();
+  deviceConfig = defaultConfig;
+  if (configStoreLoad(deviceConfig))
+  {
+    LOG_INFO("Settings from NVS (desired version %lu)", (unsigned long)deviceConfig.desiredVersion);
+  }
+  useConfig(deviceConfig);
+  if (!occupancySummaryBegin(summaryPath, summaryConfig))
+  {
+    LOG_ERROR("Occupancy summaries unavailable");
+  }
 
   setupPIRSensor();
+  powerBegin(powerMode, powerProfile); // After a deep-sleep wake-up this continues where the last cycle slept
+  if (powerMode == POWER_MODE_ACTIVE)
+  {
+    xTaskCreatePinnedToCore(sensingTask, "sensing", 4096, NULL, 3, &sensingTaskHandle, ARDUINO_RUNNING_CORE);
+  }
 
-  Logger.Info("Setup done");
+  // Credentials in secrets.h are unusable if this fails; keep sensing and showing the LEDs anyway
+  if (initIoTHub())
+  {
+    setupMQTT();
+    mqttStarted = deviceConfig.transport != TELEMETRY_TRANSPORT_HTTP; // HTTP-only keeps no IoT Hub connection
+    connection.SetMqttEnabled(mqttStarted);
+    connection.SetReuseIp(reuseWifiLease);
+    connection.SetConnectedCallback(onMqttConnected);
+    functionStarted = deviceConfig.transport != TELEMETRY_TRANSPORT_MQTT;
+    if (functionStarted)
+    {
+      functionTransport.Begin(functionUrl, functionCaCert, functionTimeout);
+    }
+    iotHubReady = true;
+
+    // The low-power modes connect in transmit(), only when there is something to send
+    if (powerMode == POWER_MODE_ACTIVE)
+    {
+      connection.Begin(ssid, pass, mqttClientId, mqttUsername, mqttC2DTopic, mqttSocketTimeout);
+      xTaskCreatePinnedToCore(networkTask, "network", 8192, NULL, 1, NULL, ARDUINO_EVENT_RUNNING_CORE);
+    }
+  }
+
+  LOG_INFO("Setup done");
 }
 
 void loop()
 {
-  if (!mqttClient.connected())
+  if (powerMode == POWER_MODE_ACTIVE)
   {
-    Logger.Error("MQTT connection failed after multiple attempts, waiting 1 min before retry...");
-    delay(60000);  // Pričekaj 60 sekundi prije ponovnog pokušaja
-    connectMQTT(); // Ponovni pokušaj povezivanja
+    vTaskDelete(NULL); // All the work happens in sensingTask and networkTask
   }
 
-  mqttClient.loop(); // Drži MQTT vezu aktivnom
-  checkPIRSensor();  // Provjera PIR senzora
+  checkPIRSensor();
+  if (telemetryQueueStats().depth > 0)
+  {
+    if (iotHubReady)
+    {
+      transmit();
+    }
+    else
+    {
+      telemetryUplinkService(false, 0); // Into the journal, as with no connection
+    }
+  }
+
+  Logger.Flush(); // Deep sleep would lose what the logger task has not written yet
+  Serial.flush();
+  if (!powerSleep())
+  {
+    vTaskDelay(sensingPeriod); // The no-motion timeout is about to run out
+  }
 }
@@ -0,0 +1,9 @@
+#ifndef ALLOCCOUNTER_H
+#define ALLOCCOUNTER_H
+
+// Counts heap allocations made by the harness process: operator new everywhere, and
+// malloc()/calloc()/realloc() as well where the C library lets us wrap them (glibc).
+
+unsigned long allocCount();
+
+#endif // ALLOCCOUNTER_H
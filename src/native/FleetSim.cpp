@@ -0,0 +1,906 @@
+#include "FleetSim.h"
+#include "HealthMetrics.h"
+#include "MqttPublisher.h"
+#include "MqttSocketBackend.h"
+#include "NativeHal.h"
+#include "Occupancy.h"
+#include "SerialLogger.h"
+#include "Telemetry.h"
+#include "TelemetryQueue.h"
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <queue>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+#define FLEET_SERVICE_US 100000   // Retransmits, keep-alives and timeouts are checked this often
+#define FLEET_POLL_MAX_MS 10
+#define FLEET_RESPONSE_SIZE 1024  // An HTTP response, headers included
+#define FLEET_WORST_DEVICES 5
+
+// One message of a device's schedule: events[firstEvent] onwards, sent dueMs into the run
+struct FleetMessage
+{
+  unsigned long dueMs; // Virtual time, the offset of the device included
+  uint32_t firstEvent;
+  uint16_t eventCount;
+};
+
+struct FleetWorker;
+
+// A virtual device and its connection. Belongs to one worker thread once the run starts.
+struct FleetDevice
+{
+  char name[24];
+  char topic[64];
+  uint16_t index; // CBOR deviceIndex
+  TelemetryContext telemetry; // Its ID and the encoding, for the serializer
+  std::vector<TelemetryEvent> events;
+  std::vector<FleetMessage> messages;
+  size_t nextDue;  // First message not yet due
+  size_t nextSend; // First message not yet sent; HTTP sends one at a time, the due ones wait
+  int socket;      // HTTP connection
+  uint64_t lastConnectUs;
+  FleetWorker *worker;
+
+  MqttPublisher publisher;                    // Its clock runs in µs here, for sub-millisecond PUBACK latencies
+  MqttSocketBackend mqtt{publisher, 1000000}; // The MQTT connection, on the same clock
+
+  bool requestOpen; // HTTP request waiting for its response
+  uint64_t requestStartUs;
+  char response[FLEET_RESPONSE_SIZE + 1];
+  size_t responseLength;
+
+  uint32_t sent;
+  uint32_t delivered;      // PUBACK or 2xx response
+  uint32_t failed;         // Could not be sent, refused, or never acknowledged
+  uint32_t connectFailures;
+  uint32_t disconnects;
+  uint32_t retransmits;
+  uint64_t latencyTotalUs;
+  uint32_t latencyMaxUs;
+};
+
+// What all workers share, read-only during the run
+struct FleetRun
+{
+  const FleetOptions *options;
+  struct sockaddr_storage address;
+  socklen_t addressLength;
+  bool batching;
+  TelemetryEncoding encoding;
+};
+
+struct FleetWorker
+{
+  std::vector<FleetDevice *> devices;
+  HealthHistogram latency; // Publish to PUBACK, request to response
+  HealthHistogram connect; // TCP connect to CONNACK, or the TCP connect for HTTP
+  uint64_t bytes;          // Payload bytes sent
+};
+
+static uint64_t nowUs()
+{
+  return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static bool writeAll(int socket, const uint8_t *data, size_t length)
+{
+  while (length > 0)
+  {
+    ssize_t written = send(socket, data, length, MSG_NOSIGNAL);
+    if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      usleep(100); // Socket buffer full, only in long bursts
+      continue;
+    }
+    if (written <= 0)
+    {
+      return false;
+    }
+    data += written;
+    length -= (size_t)written;
+  }
+  return true;
+}
+
+// --- Schedule -------------------------------------------------------------------------------
+
+// Runs the state machine over edges on the virtual clock, jumping from edge to edge and to the
+// no-motion and heartbeat deadlines in between, and collects what it queues with the time it did
+static void runStateMachine(
+    const std::vector<TraceEdge> &edges, unsigned long end, time_t epochStart, std::vector<TelemetryEvent> &events, std::vector<unsigned long> &times)
+{
+  nativeHalReset(epochStart);
+  setupPIRSensor();
+
+  size_t next = 0;
+  unsigned long now = 0;
+  while (true)
+  {
+    OccupancyWake wake = occupancyNextWake();
+    unsigned long deadline = wake.deadline > 0 ? (unsigned long)((wake.deadline + 999) / 1000) : end + 1;
+    deadline = std::max(deadline, now + 1);
+
+    if (next < edges.size() && edges[next].time <= deadline)
+    {
+      now = edges[next].time;
+      nativeHalSetMillis(now);
+      nativeHalSetPir(edges[next].channel, edges[next].level);
+      next++;
+    }
+    else if (deadline <= end)
+    {
+      now = deadline;
+      nativeHalSetMillis(now);
+    }
+    else
+    {
+      break;
+    }
+
+    checkPIRSensor();
+    TelemetryEvent event;
+    while (telemetryQueuePop(event, 0))
+    {
+      events.push_back(event);
+      times.push_back(now);
+    }
+  }
+}
+
+// Messages as TelemetryUplink makes them: one per event, or batches that go out when full, when
+// the next event does not fit, or maxDelayMs after their first event
+static void groupMessages(FleetDevice &device, const std::vector<unsigned long> &times, const TelemetryBatchConfig &batch)
+{
+  if (batch.maxEvents <= 1)
+  {
+    for (uint32_t i = 0; i < device.events.size(); i++)
+    {
+      device.messages.push_back({times[i], i, 1});
+    }
+    return;
+  }
+
+  size_t maxBytes = batch.maxBytes > 0 ? std::min((size_t)batch.maxBytes, (size_t)TELEMETRY_BATCH_MAX_SIZE) : TELEMETRY_BATCH_MAX_SIZE;
+  char payload[TELEMETRY_BATCH_MAX_SIZE + 1];
+  size_t length = 0;
+  bool open = false;
+  unsigned long since = 0;
+
+  for (uint32_t i = 0; i < device.events.size(); i++)
+  {
+    if (open)
+    {
+      size_t longer = times[i] - since < batch.maxDelayMs ? appendTelemetryBatch(device.telemetry, device.events[i], payload, length, maxBytes + 1) : 0;
+      if (longer > 0)
+      {
+        FleetMessage &message = device.messages.back();
+        length = longer;
+        if (++message.eventCount >= batch.maxEvents)
+        {
+          message.dueMs = times[i];
+          open = false;
+        }
+        continue;
+      }
+      if (times[i] - since < batch.maxDelayMs)
+      {
+        device.messages.back().dueMs = times[i]; // Too big with this event, sent as it arrives
+      }
+    }
+
+    device.messages.push_back({times[i] + batch.maxDelayMs, i, 1});
+    length = getTelemetryBatch(device.telemetry, &device.events[i], 1, payload, sizeof(payload));
+    since = times[i];
+    open = true;
+  }
+}
+
+static void buildSchedules(
+    std::vector<FleetDevice> &devices, const FleetOptions &options, const DeviceConfig &config, const std::vector<TraceEdge> *recorded)
+{
+  unsigned long hold = 0;
+  for (const OccupancyConfig &occupancy : config.occupancy)
+  {
+    hold = std::max(hold, (unsigned long)(occupancy.estimator == OCCUPANCY_ADAPTIVE ? occupancy.maxHoldMs : occupancy.minHoldMs));
+  }
+
+  std::mt19937 rng(options.seed);
+  std::uniform_int_distribution<unsigned long> spread(0, options.spreadMs > 0 ? options.spreadMs - 1 : 0);
+  std::vector<TraceEdge> edges;
+  std::vector<Session> sessions;
+  std::vector<unsigned long> times;
+
+  for (size_t number = 0; number < devices.size(); number++)
+  {
+    FleetDevice &device = devices[number];
+    unsigned long offset = spread(rng);
+
+    edges.clear();
+    sessions.clear();
+    if (recorded != NULL)
+    {
+      edges = *recorded;
+    }
+    else
+    {
+      for (uint8_t channel = 0; channel < options.channels; channel++)
+      {
+        generateTrace(options.hours, options.seed + (unsigned int)(number * options.channels) + channel, channel, edges, sessions);
+      }
+      std::stable_sort(edges.begin(), edges.end(), [](const TraceEdge &a, const TraceEdge &b) { return a.time < b.time; });
+    }
+    for (TraceEdge &edge : edges)
+    {
+      edge.time += offset;
+    }
+
+    unsigned long last = recorded != NULL ? (edges.empty() ? offset : edges.back().time) : offset + (unsigned long)(options.hours * 3600 * 1000);
+    times.clear();
+    runStateMachine(edges, last + hold, options.epochStart, device.events, times);
+
+    groupMessages(device, times, config.batch); // Batch sizes depend on the ID
+  }
+}
+
+// --- Connections ----------------------------------------------------------------------------
+
+static bool resolve(const FleetOptions &options, FleetRun &run)
+{
+  char service[8];
+  snprintf(service, sizeof(service), "%u", options.port);
+
+  struct addrinfo hints;
+  struct addrinfo *addresses;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(options.host, service, &hints, &addresses) != 0 || addresses == NULL)
+  {
+    fprintf(stderr, "cannot resolve %s\n", options.host);
+    return false;
+  }
+
+  memcpy(&run.address, addresses->ai_addr, addresses->ai_addrlen);
+  run.addressLength = addresses->ai_addrlen;
+  freeaddrinfo(addresses);
+  return true;
+}
+
+// Thousands of devices need as many sockets
+static void raiseFileLimit(unsigned long devices)
+{
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+  {
+    return;
+  }
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+  if (limit.rlim_cur < devices + 64)
+  {
+    fprintf(stderr, "warning: %lu open files allowed, %lu devices will run out of sockets\n", (unsigned long)limit.rlim_cur, devices);
+  }
+}
+
+static bool isConnected(const FleetDevice &device, bool http) { return http ? device.socket >= 0 : device.mqtt.IsConnected(); }
+
+// HTTP only: MQTT connections are closed by MqttSocketBackend::Poll()
+static void disconnect(FleetDevice &device)
+{
+  close(device.socket);
+  device.socket = -1;
+  device.disconnects++;
+  device.responseLength = 0;
+  if (device.requestOpen)
+  {
+    device.requestOpen = false;
+    device.failed++;
+  }
+}
+
+// TCP, and for MQTT the CONNECT up to its CONNACK. Blocking: a device does nothing else meanwhile.
+static bool connectDevice(FleetDevice &device, FleetWorker &worker, const FleetRun &run)
+{
+  const FleetOptions &options = *run.options;
+  uint64_t start = nowUs();
+  device.lastConnectUs = start;
+
+  if (!options.http)
+  {
+    // Resends what the last connection left unacknowledged
+    if (!device.mqtt.Connect((const struct sockaddr *)&run.address, run.addressLength, device.name, device.topic, options.ackTimeoutMs))
+    {
+      device.connectFailures++;
+      return false;
+    }
+    healthHistogramAdd(worker.connect, (uint32_t)(nowUs() - start));
+    return true;
+  }
+
+  device.socket = ::socket(run.address.ss_family, SOCK_STREAM, 0);
+  if (device.socket >= 0 && connect(device.socket, (const struct sockaddr *)&run.address, run.addressLength) != 0)
+  {
+    close(device.socket);
+    device.socket = -1;
+  }
+  if (device.socket < 0)
+  {
+    device.connectFailures++;
+    return false;
+  }
+
+  int on = 1;
+  setsockopt(device.socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  fcntl(device.socket, F_SETFL, fcntl(device.socket, F_GETFL) | O_NONBLOCK);
+  healthHistogramAdd(worker.connect, (uint32_t)(nowUs() - start));
+  return true;
+}
+
+static void recordDelivery(FleetDevice &device, FleetWorker &worker, uint32_t latencyUs)
+{
+  device.delivered++;
+  device.latencyTotalUs += latencyUs;
+  device.latencyMaxUs = std::max(device.latencyMaxUs, latencyUs);
+  healthHistogramAdd(worker.latency, latencyUs);
+}
+
+// --- Sending --------------------------------------------------------------------------------
+
+// As sendTelemetryEvent() and the uplink's batches do it, with this device's ID
+static size_t serialize(const FleetDevice &device, const FleetMessage &message, const FleetRun &run, char *buffer, size_t size)
+{
+  const TelemetryEvent *events = &device.events[message.firstEvent];
+  if (!run.batching && !events[0].heartbeat)
+  {
+    return getTelemetryData(device.telemetry, events[0].status, events[0].timestamp, buffer, size, events[0].channel);
+  }
+  return getTelemetryBatch(device.telemetry, events, message.eventCount, buffer, size);
+}
+
+static void sendMessage(FleetDevice &device, FleetWorker &worker, const FleetRun &run, const FleetMessage &message)
+{
+  const FleetOptions &options = *run.options;
+  char payload[TELEMETRY_BATCH_MAX_SIZE + 1];
+  size_t length = serialize(device, message, run, payload, sizeof(payload));
+
+  if (length == 0 || (!isConnected(device, options.http) && !connectDevice(device, worker, run)))
+  {
+    device.failed++; // The device would journal it; the backend never sees it in this run
+    return;
+  }
+
+  if (!options.http)
+  {
+    if (!device.mqtt.Send(payload, length, NULL))
+    {
+      device.failed++; // Window full
+      return;
+    }
+  }
+  else
+  {
+    char request[256 + sizeof(payload)];
+    int header = snprintf(
+        request,
+        256,
+        "POST /api/SendTelemetry HTTP/1.1\r\nHost: %s:%u\r\nContent-Type: %s\r\nContent-Length: %zu\r\n\r\n",
+        options.host,
+        options.port,
+        run.encoding == TELEMETRY_ENCODING_CBOR ? "application/cbor" : "application/json",
+        length);
+    memcpy(request + header, payload, length);
+
+    if (!writeAll(device.socket, (const uint8_t *)request, header + length))
+    {
+      disconnect(device);
+      device.failed++;
+      return;
+    }
+    device.requestOpen = true;
+    device.requestStartUs = nowUs();
+  }
+
+  device.sent++;
+  worker.bytes += length;
+}
+
+// Sends what is due, HTTP one request at a time
+static void pump(FleetDevice &device, FleetWorker &worker, const FleetRun &run)
+{
+  while (device.nextSend < device.nextDue && !(run.options->http && device.requestOpen))
+  {
+    sendMessage(device, worker, run, device.messages[device.nextSend++]);
+  }
+}
+
+// Length of the complete HTTP response at the start of data (null-terminated), 0 if more is
+// needed. Takes a Content-Length body or a chunked one, as Node sends when it is not told the length.
+static size_t parseResponse(const char *data, size_t length, int &status)
+{
+  const char *end = strstr(data, "\r\n\r\n");
+  if (end == NULL)
+  {
+    return 0;
+  }
+
+  size_t header = (size_t)(end - data) + 4;
+  if (sscanf(data, "HTTP/1.%*d %d", &status) != 1)
+  {
+    status = 0;
+  }
+
+  size_t body = 0;
+  bool chunked = false;
+  for (const char *line = strstr(data, "\r\n"); line != NULL && line < end; line = strstr(line + 2, "\r\n"))
+  {
+    if (strncasecmp(line + 2, "Content-Length:", 15) == 0)
+    {
+      body = strtoul(line + 17, NULL, 10);
+    }
+    else if (strncasecmp(line + 2, "Transfer-Encoding: chunked", 26) == 0)
+    {
+      chunked = true;
+    }
+  }
+  if (!chunked)
+  {
+    return header + body <= length ? header + body : 0;
+  }
+
+  // <hex size>\r\n<data>\r\n ... 0\r\n\r\n (no trailers from the stand-in)
+  size_t position = header;
+  while (position < length)
+  {
+    const char *lineEnd = strstr(data + position, "\r\n");
+    if (lineEnd == NULL)
+    {
+      return 0;
+    }
+    size_t chunk = strtoul(data + position, NULL, 16);
+    position = (size_t)(lineEnd - data) + 2 + chunk + 2;
+    if (chunk == 0)
+    {
+      return position <= length ? position : 0;
+    }
+  }
+  return 0;
+}
+
+// Every PUBACK as it is read, with its latency in µs
+static void acknowledged(void *context, unsigned long latencyUs)
+{
+  FleetDevice &device = *(FleetDevice *)context;
+  recordDelivery(device, *device.worker, (uint32_t)latencyUs);
+}
+
+// MQTT PUBACKs (through acknowledged()), or HTTP responses
+static void receive(FleetDevice &device, FleetWorker &worker, const FleetRun &run)
+{
+  if (!run.options->http)
+  {
+    if (device.mqtt.IsConnected() && !device.mqtt.Poll())
+    {
+      device.disconnects++;
+    }
+    return;
+  }
+
+  char buffer[512];
+  ssize_t count;
+  while (device.socket >= 0 && (count = recv(device.socket, buffer, sizeof(buffer), 0)) > 0)
+  {
+    uint64_t now = nowUs();
+    if (device.responseLength + (size_t)count > FLEET_RESPONSE_SIZE)
+    {
+      disconnect(device); // Not the stand-in's answer
+      return;
+    }
+    memcpy(device.response + device.responseLength, buffer, (size_t)count);
+    device.responseLength += (size_t)count;
+    device.response[device.responseLength] = '\0';
+
+    int status;
+    size_t length;
+    while (device.requestOpen && (length = parseResponse(device.response, device.responseLength, status)) > 0)
+    {
+      device.requestOpen = false;
+      if (status >= 200 && status < 300)
+      {
+        recordDelivery(device, worker, (uint32_t)(now - device.requestStartUs));
+      }
+      else
+      {
+        device.failed++;
+      }
+      memmove(device.response, device.response + length, device.responseLength - length + 1);
+      device.responseLength -= length;
+      pump(device, worker, run);
+    }
+  }
+
+  if (device.socket >= 0 && (count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)))
+  {
+    disconnect(device);
+  }
+}
+
+// Retransmits and keep-alives for MQTT, response timeouts for HTTP
+static void service(FleetDevice &device, FleetWorker &worker, const FleetRun &run, uint64_t now)
+{
+  const FleetOptions &options = *run.options;
+  if (options.http)
+  {
+    if (device.requestOpen && now >= device.requestStartUs + options.ackTimeoutMs * 1000)
+    {
+      disconnect(device); // Counts the request as failed
+      pump(device, worker, run);
+    }
+    return;
+  }
+
+  if (!device.mqtt.IsConnected())
+  {
+    if (device.publisher.GetStats().inFlight > 0 && now >= device.lastConnectUs + options.ackTimeoutMs * 1000)
+    {
+      connectDevice(device, worker, run);
+    }
+    return;
+  }
+  if (!device.mqtt.Poll())
+  {
+    device.disconnects++;
+  }
+}
+
+static bool idle(const FleetDevice &device, bool http)
+{
+  return device.nextSend == device.messages.size() && (http ? !device.requestOpen : device.publisher.GetStats().inFlight == 0);
+}
+
+static void connectAll(FleetWorker &worker, const FleetRun &run)
+{
+  for (FleetDevice *device : worker.devices)
+  {
+    connectDevice(*device, worker, run);
+  }
+}
+
+static void runWorker(FleetWorker &worker, const FleetRun &run, uint64_t startUs)
+{
+  const FleetOptions &options = *run.options;
+  typedef std::pair<uint64_t, size_t> Due; // Real time, device
+  std::priority_queue<Due, std::vector<Due>, std::greater<Due>> due;
+  auto dueAt = [&](const FleetMessage &message) { return startUs + (uint64_t)(message.dueMs * 1000.0 / options.speed); };
+
+  for (size_t i = 0; i < worker.devices.size(); i++)
+  {
+    if (!worker.devices[i]->messages.empty())
+    {
+      due.push({dueAt(worker.devices[i]->messages[0]), i});
+    }
+  }
+
+  std::vector<struct pollfd> descriptors(worker.devices.size());
+  uint64_t lastService = startUs;
+  uint64_t drainEnd = 0;
+
+  while (true)
+  {
+    uint64_t now = nowUs();
+    while (!due.empty() && due.top().first <= now)
+    {
+      size_t index = due.top().second;
+      FleetDevice &device = *worker.devices[index];
+      due.pop();
+      if (++device.nextDue < device.messages.size())
+      {
+        due.push({dueAt(device.messages[device.nextDue]), index});
+      }
+      pump(device, worker, run);
+    }
+
+    if (now >= lastService + FLEET_SERVICE_US)
+    {
+      lastService = now;
+      for (FleetDevice *device : worker.devices)
+      {
+        service(*device, worker, run, nowUs()); // Sends above may be younger than now
+      }
+    }
+
+    if (due.empty())
+    {
+      bool done = std::all_of(worker.devices.begin(), worker.devices.end(), [&](const FleetDevice *device) { return idle(*device, options.http); });
+      drainEnd = drainEnd != 0 ? drainEnd : now + options.ackTimeoutMs * 3000;
+      if (done || now >= drainEnd)
+      {
+        break;
+      }
+    }
+
+    int timeout = FLEET_POLL_MAX_MS;
+    if (!due.empty())
+    {
+      timeout = (int)std::min((uint64_t)FLEET_POLL_MAX_MS, due.top().first > now ? (due.top().first - now) / 1000 : 0);
+    }
+    for (size_t i = 0; i < worker.devices.size(); i++)
+    {
+      const FleetDevice &device = *worker.devices[i];
+      descriptors[i].fd = options.http ? device.socket : device.mqtt.GetSocket(); // Negative ones are skipped
+      descriptors[i].events = POLLIN;
+      descriptors[i].revents = 0;
+    }
+    if (poll(descriptors.data(), descriptors.size(), timeout) <= 0)
+    {
+      continue;
+    }
+    for (size_t i = 0; i < worker.devices.size(); i++)
+    {
+      if (descriptors[i].revents != 0)
+      {
+        receive(*worker.devices[i], worker, run);
+      }
+    }
+  }
+
+  for (FleetDevice *device : worker.devices)
+  {
+    MqttPublisherStats stats = device->publisher.GetStats();
+    device->failed += (uint32_t)(device->messages.size() - device->nextSend) + (options.http ? device->requestOpen : stats.inFlight);
+    device->retransmits = stats.retransmits;
+    device->mqtt.Close();
+    if (device->socket >= 0)
+    {
+      close(device->socket);
+      device->socket = -1;
+    }
+  }
+}
+
+// --- Report ---------------------------------------------------------------------------------
+
+static void merge(HealthHistogram &into, const HealthHistogram &histogram)
+{
+  for (int bucket = 0; bucket < HEALTH_BUCKETS; bucket++)
+  {
+    into.counts[bucket] += histogram.counts[bucket];
+  }
+  into.totalUs += histogram.totalUs;
+  into.maxUs = std::max(into.maxUs, histogram.maxUs);
+}
+
+static void printLatency(const char *label, const HealthHistogram &histogram, uint32_t count)
+{
+  printf(
+      "%-20s %lu, mean %lu us, p50 %lu us, p90 %lu us, p99 %lu us, max %lu us\n",
+      label,
+      (unsigned long)count,
+      (unsigned long)(count > 0 ? histogram.totalUs / count : 0),
+      (unsigned long)healthPercentile(histogram, 50),
+      (unsigned long)healthPercentile(histogram, 90),
+      (unsigned long)healthPercentile(histogram, 99),
+      (unsigned long)histogram.maxUs);
+}
+
+static double errorRate(const FleetDevice &device)
+{
+  return device.messages.empty() ? 0.0 : 100.0 * device.failed / device.messages.size();
+}
+
+static bool writeCsv(const char *path, const std::vector<FleetDevice> &devices)
+{
+  FILE *file = fopen(path, "w");
+  if (file == NULL)
+  {
+    perror(path);
+    return false;
+  }
+
+  fprintf(file, "device,messages,events,sent,delivered,failed,error_percent,connect_failures,disconnects,retransmits,mean_latency_us,max_latency_us\n");
+  for (const FleetDevice &device : devices)
+  {
+    fprintf(
+        file,
+        "%s,%zu,%zu,%lu,%lu,%lu,%.3f,%lu,%lu,%lu,%lu,%lu\n",
+        device.name,
+        device.messages.size(),
+        device.events.size(),
+        (unsigned long)device.sent,
+        (unsigned long)device.delivered,
+        (unsigned long)device.failed,
+        errorRate(device),
+        (unsigned long)device.connectFailures,
+        (unsigned long)device.disconnects,
+        (unsigned long)device.retransmits,
+        (unsigned long)(device.delivered > 0 ? device.latencyTotalUs / device.delivered : 0),
+        (unsigned long)device.latencyMaxUs);
+  }
+
+  fclose(file);
+  return true;
+}
+
+int runFleet(const FleetOptions &options, const DeviceConfig &config, const std::vector<TraceEdge> *recorded)
+{
+  FleetRun run;
+  run.options = &options;
+  run.batching = config.batch.maxEvents > 1;
+  run.encoding = config.encoding;
+  if (!resolve(options, run))
+  {
+    return 1;
+  }
+  raiseFileLimit(options.devices);
+
+  std::vector<FleetDevice> devices(options.devices); // Never resized, the publishers point into it
+  for (size_t number = 0; number < devices.size(); number++)
+  {
+    FleetDevice &device = devices[number];
+    snprintf(device.name, sizeof(device.name), "fleet-%05zu", number);
+    snprintf(device.topic, sizeof(device.topic), "devices/%s/messages/events/", device.name);
+    device.index = (uint16_t)(config.deviceIndex + number);
+    telemetryContextInit(device.telemetry, device.name, run.encoding, device.index);
+    device.socket = -1;
+    device.publisher.Begin(device.mqtt, options.mqttWindow, options.ackTimeoutMs * 1000);
+    device.mqtt.SetAckHook(acknowledged, &device);
+  }
+
+  // The state machine logs every transition; a fleet's worth would only fill the ring
+  deviceConfigApply(config);
+  uint8_t logLevel = Logger.GetLevel();
+  Logger.SetLevel(LOG_LEVEL_WARN);
+  auto buildStart = std::chrono::steady_clock::now();
+  buildSchedules(devices, options, config, recorded);
+  double buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStart).count();
+  Logger.SetLevel(logLevel);
+  Logger.Flush();
+
+  size_t messages = 0, events = 0;
+  unsigned long span = 0;
+  for (const FleetDevice &device : devices)
+  {
+    messages += device.messages.size();
+    events += device.events.size();
+    span = device.messages.empty() ? span : std::max(span, device.messages.back().dueMs);
+  }
+
+  printf(
+      "fleet                %lu devices (%u channel%s each), %u threads, %s to %s:%u\n",
+      options.devices,
+      (unsigned)options.channels,
+      options.channels == 1 ? "" : "s",
+      options.threads,
+      options.http ? "http" : "mqtt",
+      options.host,
+      (unsigned)options.port);
+  printf(
+      "schedule             %zu messages (%zu events) over %.1f h virtual, %.1f s real at %gx, built in %.2f s\n",
+      messages,
+      events,
+      span / 3600000.0,
+      span / 1000.0 / options.speed,
+      options.speed,
+      buildSeconds);
+  fflush(stdout);
+
+  std::vector<FleetWorker> workers(options.threads);
+  for (size_t number = 0; number < devices.size(); number++)
+  {
+    workers[number % options.threads].devices.push_back(&devices[number]);
+    devices[number].worker = &workers[number % options.threads];
+  }
+
+  // Every device connects before the first message is due, as a fleet that has been up for a while
+  std::vector<std::thread> threads;
+  auto connectStart = std::chrono::steady_clock::now();
+  if (!options.http)
+  {
+    for (FleetWorker &worker : workers)
+    {
+      threads.emplace_back(connectAll, std::ref(worker), std::cref(run));
+    }
+    for (std::thread &thread : threads)
+    {
+      thread.join();
+    }
+    threads.clear();
+  }
+  double connectSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - connectStart).count();
+
+  uint64_t start = nowUs();
+  for (FleetWorker &worker : workers)
+  {
+    threads.emplace_back(runWorker, std::ref(worker), std::cref(run), start);
+  }
+  for (std::thread &thread : threads)
+  {
+    thread.join();
+  }
+  double seconds = (nowUs() - start) / 1e6;
+
+  HealthHistogram latency = {}, connect = {};
+  uint64_t bytes = 0;
+  for (const FleetWorker &worker : workers)
+  {
+    merge(latency, worker.latency);
+    merge(connect, worker.connect);
+    bytes += worker.bytes;
+  }
+
+  unsigned long sent = 0, delivered = 0, failed = 0, connectFailures = 0, disconnects = 0, retransmits = 0, failing = 0;
+  std::vector<const FleetDevice *> worst;
+  for (const FleetDevice &device : devices)
+  {
+    sent += device.sent;
+    delivered += device.delivered;
+    failed += device.failed;
+    connectFailures += device.connectFailures;
+    disconnects += device.disconnects;
+    retransmits += device.retransmits;
+    if (device.failed > 0)
+    {
+      failing++;
+      worst.push_back(&device);
+    }
+  }
+  uint32_t connects = 0;
+  for (uint32_t count : connect.counts)
+  {
+    connects += count;
+  }
+
+  if (!options.http)
+  {
+    printf("connect phase        %.2f s\n", connectSeconds);
+  }
+  printLatency("connects", connect, connects);
+  printf("wall time            %.2f s\n", seconds);
+  printf(
+      "throughput           %.1f messages/s delivered (%.1f events/s, %.1f KB/s payload)\n",
+      delivered / seconds,
+      messages > 0 ? events * ((double)delivered / messages) / seconds : 0.0,
+      bytes / 1024.0 / seconds);
+  printf("messages             %zu scheduled, %lu sent, %lu delivered, %lu failed (%.3f %%)\n", messages, sent, delivered, failed, messages > 0 ? 100.0 * failed / messages : 0.0);
+  printLatency(options.http ? "request to response" : "publish to puback", latency, (uint32_t)delivered);
+  printf(
+      "errors               %lu connect failures, %lu disconnects, %lu resent; %lu of %lu devices lost messages\n",
+      connectFailures,
+      disconnects,
+      retransmits,
+      failing,
+      options.devices);
+
+  std::sort(worst.begin(), worst.end(), [](const FleetDevice *a, const FleetDevice *b) { return errorRate(*a) > errorRate(*b); });
+  for (size_t i = 0; i < worst.size() && i < FLEET_WORST_DEVICES; i++)
+  {
+    printf(
+        "  %-18s %.2f %% failed (%lu of %zu), %lu connect failures, %lu disconnects\n",
+        worst[i]->name,
+        errorRate(*worst[i]),
+        (unsigned long)worst[i]->failed,
+        worst[i]->messages.size(),
+        (unsigned long)worst[i]->connectFailures,
+        (unsigned long)worst[i]->disconnects);
+  }
+
+  if (options.csvPath != NULL && !writeCsv(options.csvPath, devices))
+  {
+    return 1;
+  }
+  return failed > 0 ? 1 : 0;
+}
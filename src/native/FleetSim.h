@@ -0,0 +1,46 @@
+#ifndef FLEETSIM_H
+#define FLEETSIM_H
+
+#include "DeviceConfig.h"
+#include "PirTrace.h"
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+
+// Load test of the ingestion backend with a fleet of virtual devices (--fleet in [env:native]).
+//
+// First every device runs its own PIR trace through the real occupancy state machine on the
+// virtual clock, one device after the other (the state machine is a singleton), and its
+// transitions are grouped into messages as the uplink would batch them. That schedule is then
+// played on the real clock, `speed` times faster, by worker threads that each own a share of the
+// devices, every device on its own connection: MQTT QoS 1 through the device's MqttPublisher to a
+// broker (MqttSocketBackend, as in the replay), or HTTP POSTs with keep-alive to the Azure
+// Function stand-in. Payloads come from the device's serializer, each with the device's own ID.
+//
+// Plain TCP only: the host build has neither TLS nor the Azure SDK that AzIoTSasToken needs, so
+// the brokers and stubs it talks to must accept devices without credentials (a local Mosquitto,
+// node web-app/function-standin.js --plain).
+struct FleetOptions
+{
+  unsigned long devices;
+  unsigned int threads;
+  double speed;           // Virtual time per real time
+  unsigned long spreadMs; // Each device's trace starts at a random offset below this
+  double hours;           // Length of the synthetic traces
+  unsigned int seed;
+  uint8_t channels;       // Rooms per device
+  bool http;              // HTTP POSTs instead of MQTT
+  const char *host;
+  uint16_t port;
+  uint8_t mqttWindow;
+  unsigned long ackTimeoutMs; // MQTT retransmit timeout, HTTP response timeout
+  const char *csvPath;        // Per-device figures, optional
+  time_t epochStart;
+};
+
+// recorded is one trace that every device replays from its offset, NULL for a synthetic trace
+// of each device's own (seed + device * channels + channel, so device 0 replays what the
+// single-device harness does). Returns the process exit code, 1 if any message was lost.
+int runFleet(const FleetOptions &options, const DeviceConfig &config, const std::vector<TraceEdge> *recorded);
+
+#endif // FLEETSIM_H
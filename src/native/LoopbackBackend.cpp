@@ -0,0 +1,89 @@
+#include "LoopbackBackend.h"
+#include "Telemetry.h"
+
+LoopbackBackend::LoopbackBackend(const char *name)
+{
+  this->name = name;
+  this->hook = NULL;
+  this->output = NULL;
+  this->available = true;
+  this->confirmLater = false;
+  this->failEvery = 0;
+  this->queued = 0;
+}
+
+const char *LoopbackBackend::GetName() const { return this->name; }
+
+bool LoopbackBackend::Send(const char *payload, size_t length, const char *messageId)
+{
+  if (!this->available)
+  {
+    return false;
+  }
+  if (!this->confirmLater)
+  {
+    return deliver(payload, length, messageId);
+  }
+
+  this->queue.push_back({std::string(payload, length), messageId != NULL ? messageId : ""});
+  this->queued++;
+  return true;
+}
+
+bool LoopbackBackend::ConfirmsLater() const { return this->confirmLater; }
+
+bool LoopbackBackend::TakeOutcome(bool &delivered)
+{
+  if (this->queue.empty())
+  {
+    return false;
+  }
+
+  const Message &message = this->queue.front();
+  unsigned long number = this->queued - this->queue.size() + 1;
+  delivered = !(this->failEvery > 0 && number % this->failEvery == 0)
+              && deliver(
+                  message.payload.data(),
+                  message.payload.size(),
+                  message.messageId.empty() ? NULL : message.messageId.c_str());
+  this->queue.pop_front();
+  return true;
+}
+
+bool LoopbackBackend::deliver(const char *payload, size_t length, const char *messageId)
+{
+  if (this->hook != NULL && !this->hook(payload, length))
+  {
+    return false;
+  }
+
+  if (this->output != NULL)
+  {
+    fprintf(this->output, "%s %s ", this->name, messageId != NULL ? messageId : "-");
+    if (telemetryGetEncoding() == TELEMETRY_ENCODING_CBOR)
+    {
+      for (size_t i = 0; i < length; i++)
+      {
+        fprintf(this->output, "%02x", (unsigned char)payload[i]);
+      }
+    }
+    else
+    {
+      fwrite(payload, 1, length, this->output);
+    }
+    fputc('\n', this->output);
+  }
+  return true;
+}
+
+void LoopbackBackend::SetHook(LoopbackHook hook) { this->hook = hook; }
+
+void LoopbackBackend::SetOutput(FILE *file) { this->output = file; }
+
+void LoopbackBackend::SetAvailable(bool available) { this->available = available; }
+
+void LoopbackBackend::SetConfirmLater(unsigned failEvery)
+{
+  this->confirmLater = true;
+  this->failEvery = failEvery;
+}
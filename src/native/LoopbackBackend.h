@@ -0,0 +1,55 @@
+#ifndef LOOPBACKBACKEND_H
+#define LOOPBACKBACKEND_H
+
+#include "TelemetryTransport.h"
+#include <deque>
+#include <stdio.h>
+#include <string>
+
+typedef bool (*LoopbackHook)(const char *payload, size_t length); // false refuses the message
+
+// In-process stand-in for one network path ([env:native]), so the whole pipeline from
+// checkPIRSensor() to the transport can run and be load-tested without IoT Hub. With an
+// output file, every message is written as one line:
+//
+//   <backend> <message ID or -> <payload>
+//
+// JSON payloads as they are, CBOR payloads hex-encoded.
+//
+// SetConfirmLater() makes it behave like the HTTPS transport: Send() only queues the message,
+// and it is delivered (hook, output) when the transport asks for its outcome, except that
+// every failEvery-th message fails there, as a request that timed out would.
+class LoopbackBackend : public TelemetryBackend
+{
+public:
+  explicit LoopbackBackend(const char *name);
+  const char *GetName() const;
+  bool Send(const char *payload, size_t length, const char *messageId);
+  bool ConfirmsLater() const;
+  bool TakeOutcome(bool &delivered);
+
+  void SetHook(LoopbackHook hook);  // Optional, by default every message is accepted
+  void SetOutput(FILE *file);       // Optional, NULL to stop writing
+  void SetAvailable(bool available); // false refuses everything, as if this path were down
+  void SetConfirmLater(unsigned failEvery); // 0: every queued message arrives
+
+private:
+  struct Message
+  {
+    std::string payload;
+    std::string messageId; // Empty: none
+  };
+
+  bool deliver(const char *payload, size_t length, const char *messageId);
+
+  const char *name;
+  LoopbackHook hook;
+  FILE *output;
+  bool available;
+  bool confirmLater;
+  unsigned failEvery;
+  unsigned long queued; // Messages Send() has queued
+  std::deque<Message> queue;
+};
+
+#endif // LOOPBACKBACKEND_H
@@ -0,0 +1,252 @@
+#include "MqttSocketBackend.h"
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define KEEP_ALIVE_S 60 // As PubSubClient's default on the board
+
+MqttSocketBackend::MqttSocketBackend(MqttPublisher &publisher, unsigned long ticksPerSecond) : publisher(publisher)
+{
+  this->ticksPerSecond = ticksPerSecond;
+  this->hook = NULL;
+  this->ackHook = NULL;
+  this->ackContext = NULL;
+  this->acked = 0;
+  this->topic = NULL;
+  this->socket = -1;
+  this->lastWrite = 0;
+}
+
+MqttSocketBackend::~MqttSocketBackend()
+{
+  if (this->socket >= 0)
+  {
+    close(this->socket);
+  }
+}
+
+unsigned long MqttSocketBackend::Now() const
+{
+  uint64_t us = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch())
+                    .count();
+  return (unsigned long)(us / (1000000 / this->ticksPerSecond));
+}
+
+bool MqttSocketBackend::Connect(const char *host, uint16_t port, const char *clientId, const char *topic, unsigned long timeoutMs)
+{
+  Close();
+
+  char service[8];
+  snprintf(service, sizeof(service), "%u", port);
+
+  struct addrinfo hints;
+  struct addrinfo *addresses;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, service, &hints, &addresses) != 0)
+  {
+    fprintf(stderr, "cannot resolve %s\n", host);
+    return false;
+  }
+
+  for (struct addrinfo *address = addresses; address != NULL && this->socket < 0; address = address->ai_next)
+  {
+    open(address->ai_addr, address->ai_addrlen);
+  }
+  freeaddrinfo(addresses);
+
+  if (this->socket < 0)
+  {
+    fprintf(stderr, "cannot connect to MQTT broker %s:%u\n", host, port);
+    return false;
+  }
+  if (!handshake(clientId, topic, timeoutMs))
+  {
+    fprintf(stderr, "MQTT broker %s:%u refused the connection\n", host, port);
+    return false;
+  }
+  return true;
+}
+
+bool MqttSocketBackend::Connect(const struct sockaddr *address, socklen_t addressLength, const char *clientId, const char *topic, unsigned long timeoutMs)
+{
+  Close();
+  return open(address, addressLength) && handshake(clientId, topic, timeoutMs);
+}
+
+bool MqttSocketBackend::open(const struct sockaddr *address, socklen_t addressLength)
+{
+  this->socket = ::socket(address->sa_family, SOCK_STREAM, 0);
+  if (this->socket >= 0 && connect(this->socket, address, addressLength) != 0)
+  {
+    close(this->socket);
+    this->socket = -1;
+  }
+  if (this->socket < 0)
+  {
+    return false;
+  }
+
+  int on = 1;
+  setsockopt(this->socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  return true;
+}
+
+// CONNECT up to its CONNACK, blocking; closes the socket if the broker does not accept it
+bool MqttSocketBackend::handshake(const char *clientId, const char *topic, unsigned long timeoutMs)
+{
+  uint8_t packet[256];
+  size_t length = mqttEncodeConnect(packet, sizeof(packet), clientId, NULL, NULL, KEEP_ALIVE_S);
+  struct timeval timeout = {(time_t)(timeoutMs / 1000), (suseconds_t)(timeoutMs % 1000 * 1000)};
+  setsockopt(this->socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  uint8_t connack[4];
+  if (length == 0 || !WritePacket(packet, length) || recv(this->socket, connack, sizeof(connack), MSG_WAITALL) != 4
+      || connack[0] != MQTT_PACKET_CONNACK || connack[3] != 0)
+  {
+    Close();
+    return false;
+  }
+
+  fcntl(this->socket, F_SETFL, fcntl(this->socket, F_GETFL) | O_NONBLOCK);
+  this->topic = topic;
+  this->publisher.Reset();
+  this->publisher.Loop(true, Now()); // Resends what the last connection left unacknowledged
+  return true;
+}
+
+void MqttSocketBackend::Close()
+{
+  if (this->socket < 0)
+  {
+    return;
+  }
+  close(this->socket);
+  this->socket = -1;
+  this->publisher.Loop(false, Now()); // In-flight messages go again after the reconnect
+}
+
+void MqttSocketBackend::feed(const uint8_t *data, size_t length)
+{
+  if (this->ackHook == NULL)
+  {
+    this->publisher.Feed(data, length, Now());
+    return;
+  }
+
+  // A byte at a time, so that every PUBACK gets its own latency
+  unsigned long now = Now();
+  for (size_t i = 0; i < length; i++)
+  {
+    this->publisher.Feed(&data[i], 1, now);
+    MqttPublisherStats stats = this->publisher.GetStats();
+    if (stats.acked != this->acked)
+    {
+      this->acked = stats.acked;
+      this->ackHook(this->ackContext, stats.ackLastMs);
+    }
+  }
+}
+
+bool MqttSocketBackend::Poll()
+{
+  if (this->socket < 0)
+  {
+    return false;
+  }
+
+  uint8_t buffer[512];
+  ssize_t count;
+  while ((count = recv(this->socket, buffer, sizeof(buffer), 0)) > 0)
+  {
+    feed(buffer, (size_t)count);
+  }
+  if (count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+  {
+    Close(); // Closed by the broker, or the connection failed
+    return false;
+  }
+
+  unsigned long now = Now();
+  this->publisher.Loop(true, now);
+  if (this->socket >= 0 && now - this->lastWrite >= KEEP_ALIVE_S * this->ticksPerSecond / 2)
+  {
+    static const uint8_t pingreq[] = {0xC0, 0x00};
+    WritePacket(pingreq, sizeof(pingreq));
+  }
+  return true;
+}
+
+bool MqttSocketBackend::Drain(unsigned long timeoutMs)
+{
+  unsigned long start = Now();
+  while (this->publisher.GetStats().inFlight > 0 && Now() - start < timeoutMs * (this->ticksPerSecond / 1000) && Poll())
+  {
+    usleep(1000);
+  }
+  return this->publisher.GetStats().inFlight == 0;
+}
+
+bool MqttSocketBackend::IsConnected() const { return this->socket >= 0; }
+
+int MqttSocketBackend::GetSocket() const { return this->socket; }
+
+void MqttSocketBackend::SetHook(LoopbackHook hook) { this->hook = hook; }
+
+void MqttSocketBackend::SetAckHook(MqttAckHook hook, void *context)
+{
+  this->ackHook = hook;
+  this->ackContext = context;
+  this->acked = this->publisher.GetStats().acked;
+}
+
+const char *MqttSocketBackend::GetName() const { return "mqtt"; }
+
+bool MqttSocketBackend::Send(const char *payload, size_t length, const char *messageId)
+{
+  (void)messageId; // No properties in MQTT 3.1.1, see the header
+
+  // A full window refuses the message, the uplink journals it and replays it later
+  if (this->socket < 0 || !this->publisher.Publish(this->topic, (const uint8_t *)payload, length, Now()))
+  {
+    return false;
+  }
+
+  if (this->hook != NULL)
+  {
+    this->hook(payload, length);
+  }
+  return true;
+}
+
+bool MqttSocketBackend::WritePacket(const uint8_t *packet, size_t length)
+{
+  if (this->socket < 0)
+  {
+    return false;
+  }
+  while (length > 0)
+  {
+    ssize_t written = send(this->socket, packet, length, MSG_NOSIGNAL);
+    if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      usleep(100); // Socket buffer full, only in long bursts
+      continue;
+    }
+    if (written <= 0)
+    {
+      return false;
+    }
+    packet += written;
+    length -= (size_t)written;
+  }
+  this->lastWrite = Now();
+  return true;
+}
@@ -0,0 +1,61 @@
+#ifndef MQTTSOCKETBACKEND_H
+#define MQTTSOCKETBACKEND_H
+
+#include "LoopbackBackend.h"
+#include "MqttPublisher.h"
+#include "TelemetryTransport.h"
+#include <sys/socket.h>
+
+#define MQTT_SOCKET_CONNECT_TIMEOUT_MS 5000 // TCP connect to CONNACK, by default
+
+// Sees each PUBACK as it is read, with its latency in the backend's ticks
+typedef void (*MqttAckHook)(void *context, unsigned long latency);
+
+// The MQTT path of the host build over a plain TCP connection to a real broker (a local
+// Mosquitto), through the same MqttPublisher as on the device: QoS 1, in-flight window,
+// PUBACK matching and retransmits, timed on the real clock. MQTT 3.1.1 has no message
+// properties, so dual mode's message IDs do not reach the broker.
+//
+// The replay harness uses one, the fleet simulator one per virtual device. ticksPerSecond is
+// the unit of every time the publisher sees (its retry timeout included): 1000 for ms, or
+// 1000000 for µs where sub-millisecond PUBACK latencies matter. Once the broker closes the
+// connection or it fails, Poll() returns false and Send() refuses messages until the next
+// Connect(); the messages in flight go again after it.
+class MqttSocketBackend : public TelemetryBackend, public MqttPacketWriter
+{
+public:
+  explicit MqttSocketBackend(MqttPublisher &publisher, unsigned long ticksPerSecond = 1000);
+  ~MqttSocketBackend();
+  // Both wait for the CONNACK, at most timeoutMs
+  bool Connect(const char *host, uint16_t port, const char *clientId, const char *topic, unsigned long timeoutMs = MQTT_SOCKET_CONNECT_TIMEOUT_MS);
+  bool Connect(const struct sockaddr *address, socklen_t addressLength, const char *clientId, const char *topic, unsigned long timeoutMs);
+  bool Poll();                          // Reads PUBACKs, resends timed out messages, keeps alive; false if disconnected
+  bool Drain(unsigned long timeoutMs);  // Polls until nothing is in flight
+  void Close();
+  bool IsConnected() const;
+  int GetSocket() const;                // For poll(), -1 while disconnected
+  void SetHook(LoopbackHook hook);      // Optional, sees every message published
+  void SetAckHook(MqttAckHook hook, void *context); // Optional, reads the broker's bytes one at a time
+  unsigned long Now() const;            // Real clock, in ticks
+
+  const char *GetName() const;
+  bool Send(const char *payload, size_t length, const char *messageId);
+  bool WritePacket(const uint8_t *packet, size_t length);
+
+private:
+  bool open(const struct sockaddr *address, socklen_t addressLength);
+  bool handshake(const char *clientId, const char *topic, unsigned long timeoutMs);
+  void feed(const uint8_t *data, size_t length);
+
+  MqttPublisher &publisher;
+  unsigned long ticksPerSecond;
+  LoopbackHook hook;
+  MqttAckHook ackHook;
+  void *ackContext;
+  uint32_t acked; // The publisher's count at the last PUBACK the ack hook saw
+  const char *topic;
+  int socket;
+  unsigned long lastWrite;
+};
+
+#endif // MQTTSOCKETBACKEND_H
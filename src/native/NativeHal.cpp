@@ -0,0 +1,78 @@
+#include "NativeHal.h"
+#include <string.h>
+
+static unsigned long virtualMillis = 0;
+static time_t virtualEpochStart = 0;
+static int pirLevels[HAL_CHANNELS];
+static HalEdgeHandler pirEdgeHandler = NULL;
+static NativeSleepHandler sleepHandler = NULL;
+static HalWakeCause wakeCause = HAL_WAKE_NONE;
+static NativeHalStats stats;
+
+void nativeHalReset(time_t epochStart)
+{
+  virtualMillis = 0;
+  virtualEpochStart = epochStart;
+  memset(pirLevels, 0, sizeof(pirLevels));
+  memset(&stats, 0, sizeof(stats));
+  pirEdgeHandler = NULL;
+  sleepHandler = NULL;
+  wakeCause = HAL_WAKE_NONE;
+}
+
+void nativeHalSetMillis(unsigned long now) { virtualMillis = now; }
+
+void nativeHalSetPir(uint8_t channel, int level)
+{
+  if (channel >= HAL_CHANNELS || pirLevels[channel] == level)
+  {
+    return;
+  }
+
+  pirLevels[channel] = level;
+  if (pirEdgeHandler != NULL)
+  {
+    pirEdgeHandler(channel, level, halMicros()); // What the edge interrupt would do on the board
+  }
+}
+
+void nativeHalSetSleepHandler(NativeSleepHandler handler) { sleepHandler = handler; }
+
+const NativeHalStats &nativeHalStats() { return stats; }
+
+void halSetupPins() {}
+
+unsigned long halMillis() { return virtualMillis; }
+
+uint64_t halMicros() { return (uint64_t)virtualMillis * 1000; }
+
+time_t halTime() { return virtualEpochStart + (time_t)(virtualMillis / 1000); }
+
+int halReadPir(uint8_t channel) { return channel < HAL_CHANNELS ? pirLevels[channel] : LOW; }
+
+void halAttachPirInterrupt(HalEdgeHandler handler) { pirEdgeHandler = handler; }
+
+void halSetOccupancyLed(uint8_t channel, bool occupied)
+{
+  if (channel < HAL_CHANNELS && occupied != stats.ledOccupied[channel])
+  {
+    stats.ledOccupied[channel] = occupied;
+    stats.ledChanges++;
+  }
+}
+
+HalWakeCause halSleep(bool deep, const int *wakeLevels, uint64_t timeoutUs)
+{
+  if (sleepHandler != NULL)
+  {
+    wakeCause = sleepHandler(deep, wakeLevels, timeoutUs);
+  }
+  else
+  {
+    virtualMillis += (unsigned long)((timeoutUs + 999) / 1000);
+    wakeCause = HAL_WAKE_TIMER;
+  }
+  return wakeCause;
+}
+
+HalWakeCause halWakeCause() { return wakeCause; }
@@ -0,0 +1,26 @@
+#ifndef NATIVEHAL_H
+#define NATIVEHAL_H
+
+#include "Hal.h"
+
+// Host implementation of Hal.h: a virtual clock that only moves when the harness
+// advances it, settable PIR levels per channel (with edge "interrupts") and counters in place
+// of the LEDs.
+// halSleep() hands over to the harness, which moves the clock to the wake-up and sets the pin.
+// Telemetry leaves through TelemetryTransport, on the host into LoopbackBackend.
+
+struct NativeHalStats
+{
+  unsigned long ledChanges; // Occupancy transitions shown on the LEDs, all channels
+  bool ledOccupied[HAL_CHANNELS];
+};
+
+typedef HalWakeCause (*NativeSleepHandler)(bool deep, const int *wakeLevels, uint64_t timeoutUs);
+
+void nativeHalReset(time_t epochStart);
+void nativeHalSetMillis(unsigned long now);
+void nativeHalSetPir(uint8_t channel, int level); // Fires the PIR edge handler on a change
+void nativeHalSetSleepHandler(NativeSleepHandler handler); // Without one a sleep is just the timeout
+const NativeHalStats &nativeHalStats();
+
+#endif // NATIVEHAL_H
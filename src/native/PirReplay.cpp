@@ -0,0 +1,1132 @@
+// PIR trace replay harness ([env:native]).
+//
+// Feeds a recorded or synthetic PIR trace through the real occupancy state machine
+// (checkPIRSensor() and getTelemetryData()) on a virtual clock, much faster than real
+// time, and reports what the firmware would have done with it.
+//
+//   .pio/build/native/program --trace lecture.trace --no-motion-delay 30000 --tick 250
+//   .pio/build/native/program --synthetic 24 --seed 7 --dump-trace day.trace
+//   .pio/build/native/program --synthetic 24 --outage 3600:1800 --outage 40000:600
+//
+// Trace format: one edge per line, "<milliseconds since start> <0|1> [channel]", in time order.
+// Lines starting with '#' are ignored.
+//
+// --outage START:LENGTH (seconds, repeatable) takes the network down for a while, so that
+// transitions go through the store-and-forward journal (--journal, recreated every run).
+//
+// --transport mqtt|http|dual picks the path(s) as on the device; both end in an in-process
+// loopback backend, and --loopback FILE writes every message they accept to a file. The HTTP
+// loopback answers each message one service call later, as the Function does, and with
+// --http-fail N every Nth of them fails, so the uplink has to journal and resend it.
+// --mqtt-broker HOST:PORT sends the MQTT path to a real broker (e.g. a local Mosquitto)
+// instead, at QoS 1 with a window of --mqtt-window messages in flight.
+//
+// --power light|deep sleeps between transitions as the low-power modes do: the virtual clock
+// jumps to the next PIR edge that wakes the device or to the no-motion deadline, and every
+// transition keeps the "radio" on for --radio-ms. Reports the duty cycle and the energy
+// estimate per transition (PowerManager.h).
+//
+// --channels N replays N rooms on one board (up to HAL_CHANNELS, 4 in [env:native]): each
+// channel gets its own synthetic trace (seed + channel), and all of them share the queue,
+// the batches and the connection. Recorded traces give the channel in an optional third
+// column. The accuracy figures add up over all channels.
+//
+// --summary hour|day|both aggregates the transitions on the "device" (OccupancySummary.h) and
+// sends the summaries as the firmware does; every summary the backend receives is compared with
+// what the transitions give for the same period.
+//
+// --config FILE takes a settings document as the device twin or a "configure" command would send
+// it (DeviceConfig.h) on top of the options above, and replays with what the device would apply.
+//
+// --fleet DEVICES load-tests a backend instead of replaying one device: every virtual device
+// runs its own synthetic trace (or the --trace, started --spread S seconds apart at random)
+// through the state machine, and --threads worker threads send the messages on the real clock,
+// --speed times faster, each device on its own connection to --mqtt-broker or, with --transport
+// http, --http-server (FleetSim.h). Reports throughput, latency percentiles and per-device
+// errors; --csv FILE writes the figures of every device.
+//
+// --serializer-check EVENTS skips the replay and checks the telemetry serializer against
+// ArduinoJson instead: identical output, and no heap allocations per event. --self-check runs
+// the table-driven checks of the MQTT packet codec, the device settings parser and the
+// journal's recovery after a reboot (SelfCheck.h) instead.
+//
+// The exit status is 1 if the backend would have got telemetry wrong or not at all: events
+// out of order, malformed payloads, a telemetry queue overflow, events lost or dropped from
+// the journal, summaries that do not match the transitions, or QoS 1 messages never acked.
+
+#include "DeviceConfig.h"
+#include "FleetSim.h"
+#include "HealthMetrics.h"
+#include "LoopbackBackend.h"
+#include "MqttSocketBackend.h"
+#include "NativeHal.h"
+#include "Occupancy.h"
+#include "OccupancySummary.h"
+#include "PirTrace.h"
+#include "PowerManager.h"
+#include "SerialLogger.h"
+#include "SelfCheck.h"
+#include "SerializerCheck.h"
+#include "Telemetry.h"
+#include "TelemetryQueue.h"
+#include "TelemetryTransport.h"
+#include "TelemetryUplink.h"
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+const char *deviceId = "replay-device";
+OccupancyConfig occupancyConfig[HAL_CHANNELS]; // Filled from the options
+
+struct Transition
+{
+  unsigned long time; // ms, when the state machine made it
+  bool occupied;
+};
+
+struct Outage
+{
+  unsigned long start; // ms since the start of the trace
+  unsigned long end;
+};
+
+struct ReplayOptions
+{
+  OccupancyConfig occupancy = OCCUPANCY_CONFIG_DEFAULT; // Every channel's
+  uint8_t channels = 1;
+  TelemetryBatchConfig batch = {1, TELEMETRY_BATCH_MAX_SIZE, 0};
+  TelemetryEncoding encoding = TELEMETRY_ENCODING_JSON;
+  TelemetryTransportMode transport = TELEMETRY_TRANSPORT_DUAL;
+  const char *loopbackPath = NULL;
+  unsigned httpFailEvery = 0;
+  const char *mqttHost = NULL;
+  uint16_t mqttPort = 1883;
+  uint8_t mqttWindow = 4;
+  unsigned long mqttAckTimeoutMs = 5000;
+  PowerMode power = POWER_MODE_ACTIVE;
+  unsigned long radioMs = 3000; // Cached-AP connect, TLS and MQTT connect, publish and PUBACK
+  const char *tracePath = NULL;
+  const char *journalPath = "replay.journal";
+  OccupancySummaryConfig summary = {false, false};
+  const char *summaryPath = "replay.summary";
+  const char *configPath = NULL;
+  std::vector<Outage> outages;
+  const char *dumpPath = NULL;
+  double syntheticHours = 0;
+  unsigned long serializerEvents = 0;
+  bool selfCheck = false;
+  unsigned long fleetDevices = 0;
+  unsigned int fleetThreads = 4;
+  double fleetSpeed = 1;
+  unsigned long fleetSpreadMs = 0;
+  const char *fleetCsvPath = NULL;
+  const char *httpHost = NULL;
+  uint16_t httpPort = 7071; // The Functions host's local port
+  unsigned int seed = 1;
+  unsigned long flapMs = 60000;   // Free periods shorter than this count as flapping
+  unsigned long tick = 1;         // Virtual time between two loop() iterations, raise it to model a blocked loop()
+  time_t epochStart = 1704067200; // 2024-01-01T00:00:00Z
+};
+
+static void usage(const char *program)
+{
+  fprintf(
+      stderr,
+      "usage: %s (--trace FILE | --synthetic HOURS) [--seed N] [--dump-trace FILE]\n"
+      "          [--no-motion-delay MS] [--heartbeat MS] [--batch EVENTS:BYTES:DELAY_MS]\n"
+      "          [--tick MS] [--outage START_S:LENGTH_S]... [--journal FILE] [--encoding json|cbor]\n"
+      "          [--transport mqtt|http|dual] [--loopback FILE] [--http-fail N]\n"
+      "          [--mqtt-broker HOST:PORT] [--mqtt-window N] [--mqtt-ack-timeout MS]\n"
+      "          [--power active|light|deep] [--radio-ms MS]\n"
+      "          [--estimator fixed|adaptive] [--hold MIN_MS:MAX_MS] [--window MS] [--busy ENTER:LEAVE]\n"
+      "          [--miss PERCENT] [--debounce MS] [--flap MS] [--channels N] [--summary hour|day|both]\n"
+      "          [--config FILE]\n"
+      "       %s --fleet DEVICES (--trace FILE | --synthetic HOURS) [--threads N] [--speed X] [--spread S]\n"
+      "          [--transport mqtt --mqtt-broker HOST:PORT | --transport http --http-server HOST:PORT]\n"
+      "          [--csv FILE] [the replay options above]\n"
+      "       %s --serializer-check EVENTS [--seed N]\n"
+      "       %s --self-check\n",
+      program,
+      program,
+      program,
+      program);
+}
+
+static void printCosts(const char *label, std::vector<double> &costs)
+{
+  if (costs.empty())
+  {
+    return;
+  }
+
+  std::sort(costs.begin(), costs.end());
+  double sum = 0;
+  for (double cost : costs)
+  {
+    sum += cost;
+  }
+
+  printf(
+      "%-20s mean %.0f ns, p50 %.0f ns, p99 %.0f ns, max %.0f ns\n",
+      label,
+      sum / costs.size(),
+      costs[costs.size() / 2],
+      costs[costs.size() * 99 / 100],
+      costs.back());
+}
+
+// Flapping for any trace; against the true sessions of a synthetic one also frees in the
+// middle of a session and how long after the start and the end the state machine noticed.
+// Per channel, added up over all of them.
+static void printAccuracy(
+    const std::vector<std::vector<Transition>> &channelTransitions, const std::vector<std::vector<Session>> &channelSessions, unsigned long flapMs)
+{
+  unsigned long flaps = 0;
+  size_t sessionCount = 0;
+  unsigned long spurious = 0, merged = 0, released = 0;
+  double detectTotal = 0, releaseTotal = 0;
+  unsigned long detectMax = 0, releaseMax = 0;
+
+  for (size_t channel = 0; channel < channelTransitions.size(); channel++)
+  {
+    const std::vector<Transition> &transitions = channelTransitions[channel];
+    const std::vector<Session> &sessions = channelSessions[channel];
+
+    for (size_t i = 1; i < transitions.size(); i++)
+    {
+      if (transitions[i].occupied && !transitions[i - 1].occupied && transitions[i].time - transitions[i - 1].time < flapMs)
+      {
+        flaps++;
+      }
+    }
+
+    size_t next = 0; // First transition not before the current session's start
+    bool occupied = false;
+    sessionCount += sessions.size();
+
+    for (size_t s = 0; s < sessions.size(); s++)
+    {
+      const Session &session = sessions[s];
+      unsigned long nextStart = s + 1 < sessions.size() ? sessions[s + 1].start : (unsigned long)-1;
+
+      while (next < transitions.size() && transitions[next].time < session.start)
+      {
+        occupied = transitions[next++].occupied;
+      }
+
+      // Occupied from the start (still held from the last session) or at the first transition
+      unsigned long detect = 0;
+      size_t i = next;
+      if (!occupied && i < transitions.size() && transitions[i].occupied)
+      {
+        detect = transitions[i].time - session.start;
+      }
+      detectTotal += detect;
+      detectMax = std::max(detectMax, detect);
+
+      for (; i < transitions.size() && transitions[i].time < session.end; i++)
+      {
+        spurious += transitions[i].occupied ? 0 : 1;
+      }
+
+      // Released once the last transition before the next session says free
+      size_t last = i;
+      while (last < transitions.size() && transitions[last].time < nextStart && transitions[last].occupied)
+      {
+        last++;
+      }
+      if (last < transitions.size() && transitions[last].time < nextStart)
+      {
+        unsigned long release = transitions[last].time - session.end;
+        releaseTotal += release;
+        releaseMax = std::max(releaseMax, release);
+        released++;
+      }
+      else
+      {
+        merged++;
+      }
+    }
+  }
+
+  printf("flapping             %lu free periods shorter than %lu ms\n", flaps, flapMs);
+  if (sessionCount == 0)
+  {
+    return;
+  }
+
+  printf(
+      "sessions             %zu true: %lu frees inside one, detection mean %.0f ms (max %lu), "
+      "release mean %.0f ms (max %lu), %lu held into the next\n",
+      sessionCount,
+      spurious,
+      detectTotal / sessionCount,
+      detectMax,
+      released ? releaseTotal / released : 0.0,
+      releaseMax,
+      merged);
+}
+
+static std::vector<TelemetrySummary> summariesSent; // As the backend received them
+
+// Every summary received against the occupied time and the sessions that the transitions
+// give for its period; they differ by the rounding of transition times to whole seconds, at
+// most a second per transition in the period. Returns the summaries that differ by more.
+static unsigned long printSummaries(
+    const std::vector<std::vector<Transition>> &channelTransitions, time_t epochStart, unsigned long end)
+{
+  OccupancySummaryStats stats = occupancySummaryStats();
+  unsigned long sessionsOff = 0;
+  unsigned long mismatched = 0;
+  double occupiedOff = 0;
+
+  for (const TelemetrySummary &summary : summariesSent)
+  {
+    double start = summary.start;
+    double periodEnd = start + (summary.daily ? 86400 : 3600);
+    double occupied = 0;
+    unsigned long started = 0;
+    unsigned long inPeriod = 0;
+
+    const std::vector<Transition> &transitions = channelTransitions[summary.channel % HAL_CHANNELS];
+    for (size_t i = 0; i < transitions.size(); i++)
+    {
+      double at = epochStart + transitions[i].time / 1000.0;
+      inPeriod += at >= start && at < periodEnd ? 1 : 0;
+      if (!transitions[i].occupied)
+      {
+        continue;
+      }
+
+      double from = epochStart + transitions[i].time / 1000.0;
+      double to = epochStart + (i + 1 < transitions.size() ? transitions[i + 1].time : end) / 1000.0;
+      started += from >= start && from < periodEnd ? 1 : 0;
+      occupied += std::max(0.0, std::min(to, periodEnd) - std::max(from, start));
+    }
+
+    double off = fabs(summary.occupiedSeconds - occupied);
+    occupiedOff = std::max(occupiedOff, off);
+    sessionsOff += summary.sessions != started ? 1 : 0;
+    mismatched += summary.sessions != started || off > inPeriod + 1.0 ? 1 : 0;
+  }
+
+  printf(
+      "summaries            %lu hourly, %lu daily sent, %lu pending, %lu dropped; occupied time within %.1f s "
+      "of the transitions, session count differs in %lu, %lu mismatched\n",
+      (unsigned long)stats.hourly,
+      (unsigned long)stats.daily,
+      (unsigned long)stats.pending,
+      (unsigned long)stats.dropped,
+      occupiedOff,
+      sessionsOff,
+      mismatched);
+  return mismatched;
+}
+
+static bool isConnected(const ReplayOptions &options, unsigned long now)
+{
+  for (const Outage &outage : options.outages)
+  {
+    if (now >= outage.start && now < outage.end)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Counts events whose Timestamp is older than the one sent before them, batches included
+static unsigned long outOfOrder = 0;
+static unsigned long eventsSent = 0;
+static unsigned long malformed = 0;
+
+static void checkTimestamp(const char *timestamp)
+{
+  static char lastTimestamp[32] = "";
+  if (strncmp(timestamp, lastTimestamp, 20) < 0)
+  {
+    outOfOrder++;
+  }
+  strncpy(lastTimestamp, timestamp, 20);
+  eventsSent++;
+}
+
+static bool checkOrder(const char *payload, size_t length)
+{
+  uint16_t summaryDevice;
+  TelemetrySummary summary;
+  if (decodeTelemetrySummary(payload, length, summaryDevice, summary))
+  {
+    summariesSent.push_back(summary); // Not events, checked against the transitions at the end
+    return true;
+  }
+
+  if (telemetryGetEncoding() == TELEMETRY_ENCODING_CBOR)
+  {
+    uint16_t deviceIndex;
+    std::vector<TelemetryEvent> events;
+    if (!decodeTelemetryCbor(payload, length, deviceIndex, events))
+    {
+      fprintf(stderr, "malformed CBOR payload (%zu bytes)\n", length);
+      malformed++;
+    }
+
+    char timestamp[32];
+    for (const TelemetryEvent &event : events)
+    {
+      getISO8601Timestamp(event.timestamp, timestamp, sizeof(timestamp));
+      checkTimestamp(timestamp);
+    }
+    return true;
+  }
+
+  const char *field = payload;
+  while ((field = strstr(field, "\"Timestamp\":\"")) != NULL)
+  {
+    field += strlen("\"Timestamp\":\"");
+    checkTimestamp(field);
+  }
+  return true;
+}
+
+// Simulated sleep: nothing runs until the first edge of the trace that brings a channel's PIR
+// to its wake level, or the timeout. The edge is delivered as the device sees it on waking up.
+static const std::vector<TraceEdge> *sleepTrace = NULL;
+static size_t *sleepNextEdge = NULL;
+static unsigned long sleepEnd = 0;
+
+static HalWakeCause sleepUntilWake(bool deep, const int *wakeLevels, uint64_t timeoutUs)
+{
+  (void)deep; // Retained state is all the occupancy logic has in either case
+  unsigned long now = halMillis();
+  unsigned long until = timeoutUs > 0 ? now + (unsigned long)((timeoutUs + 999) / 1000) : sleepEnd;
+  until = std::min(until, sleepEnd);
+
+  const std::vector<TraceEdge> &edges = *sleepTrace;
+  size_t &next = *sleepNextEdge;
+  while (next < edges.size() && edges[next].time <= until)
+  {
+    nativeHalSetMillis(std::max(now, edges[next].time));
+    nativeHalSetPir(edges[next].channel, edges[next].level);
+    uint8_t channel = edges[next++].channel;
+    if (halReadPir(channel) == wakeLevels[channel])
+    {
+      return HAL_WAKE_PIR;
+    }
+  }
+
+  nativeHalSetMillis(until);
+  return HAL_WAKE_TIMER;
+}
+
+static bool parseOptions(int argc, char **argv, ReplayOptions &options)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    const char *arg = argv[i];
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+    if (strcmp(arg, "--self-check") == 0)
+    {
+      options.selfCheck = true; // The one option without a value
+      continue;
+    }
+    if (value == NULL)
+    {
+      return false;
+    }
+    else if (strcmp(arg, "--trace") == 0)
+    {
+      options.tracePath = value;
+    }
+    else if (strcmp(arg, "--synthetic") == 0)
+    {
+      options.syntheticHours = atof(value);
+    }
+    else if (strcmp(arg, "--seed") == 0)
+    {
+      options.seed = (unsigned int)strtoul(value, NULL, 10);
+    }
+    else if (strcmp(arg, "--dump-trace") == 0)
+    {
+      options.dumpPath = value;
+    }
+    else if (strcmp(arg, "--no-motion-delay") == 0)
+    {
+      options.occupancy.minHoldMs = strtoul(value, NULL, 10);
+    }
+    else if (strcmp(arg, "--heartbeat") == 0)
+    {
+      heartbeatInterval = strtoul(value, NULL, 10);
+    }
+    else if (strcmp(arg, "--batch") == 0)
+    {
+      unsigned int events, bytes;
+      unsigned long delay;
+      if (sscanf(value, "%u:%u:%lu", &events, &bytes, &delay) != 3)
+      {
+        return false;
+      }
+      options.batch = {(uint8_t)std::min(events, 255u), (uint16_t)std::min(bytes, 65535u), (uint32_t)delay};
+    }
+    else if (strcmp(arg, "--outage") == 0)
+    {
+      unsigned long start, length;
+      if (sscanf(value, "%lu:%lu", &start, &length) != 2)
+      {
+        return false;
+      }
+      options.outages.push_back({start * 1000, (start + length) * 1000});
+    }
+    else if (strcmp(arg, "--summary") == 0)
+    {
+      bool hourly = strcmp(value, "hour") == 0 || strcmp(value, "both") == 0;
+      bool daily = strcmp(value, "day") == 0 || strcmp(value, "both") == 0;
+      if (!hourly && !daily)
+      {
+        return false;
+      }
+      options.summary = {hourly, daily};
+    }
+    else if (strcmp(arg, "--config") == 0)
+    {
+      options.configPath = value;
+    }
+    else if (strcmp(arg, "--journal") == 0)
+    {
+      options.journalPath = value;
+    }
+    else if (strcmp(arg, "--encoding") == 0)
+    {
+      if (strcmp(value, "json") != 0 && strcmp(value, "cbor") != 0)
+      {
+        return false;
+      }
+      options.encoding = strcmp(value, "cbor") == 0 ? TELEMETRY_ENCODING_CBOR : TELEMETRY_ENCODING_JSON;
+    }
+    else if (strcmp(arg, "--transport") == 0)
+    {
+      if (!telemetryTransportParseMode(value, options.transport))
+      {
+        return false;
+      }
+    }
+    else if (strcmp(arg, "--loopback") == 0)
+    {
+      options.loopbackPath = value;
+    }
+    else if (strcmp(arg, "--http-fail") == 0)
+    {
+      options.httpFailEvery = (unsigned)atoi(value);
+    }
+    else if (strcmp(arg, "--mqtt-broker") == 0)
+    {
+      static char host[128];
+      unsigned int port;
+      if (sscanf(value, "%127[^:]:%u", host, &port) != 2)
+      {
+        return false;
+      }
+      options.mqttHost = host;
+      options.mqttPort = (uint16_t)port;
+    }
+    else if (strcmp(arg, "--mqtt-window") == 0)
+    {
+      options.mqttWindow = (uint8_t)std::min(strtoul(value, NULL, 10), (unsigned long)MQTT_PUBLISH_WINDOW_MAX);
+    }
+    else if (strcmp(arg, "--mqtt-ack-timeout") == 0)
+    {
+      options.mqttAckTimeoutMs = strtoul(value, NULL, 10);
+    }
+    else if (strcmp(arg, "--power") == 0)
+    {
+      if (!powerParseMode(value, options.power))
+      {
+        return false;
+      }
+    }
+    else if (strcmp(arg, "--radio-ms") == 0)
+    {
+      options.radioMs = strtoul(value, NULL, 10);
+    }
+    else if (strcmp(arg, "--estimator") == 0)
+    {
+      if (strcmp(value, "fixed") != 0 && strcmp(value, "adaptive") != 0)
+      {
+        return false;
+      }
+      options.occupancy.estimator = strcmp(value, "fixed") == 0 ? OCCUPANCY_FIXED_TIMEOUT : OCCUPANCY_ADAPTIVE;
+    }
+    else if (strcmp(arg, "--hold") == 0)
+    {
+      unsigned long minHold, maxHold;
+      if (sscanf(value, "%lu:%lu", &minHold, &maxHold) != 2 || maxHold < minHold)
+      {
+        return false;
+      }
+      options.occupancy.minHoldMs = (uint32_t)minHold;
+      options.occupancy.maxHoldMs = (uint32_t)maxHold;
+    }
+    else if (strcmp(arg, "--window") == 0)
+    {
+      options.occupancy.windowMs = (uint32_t)strtoul(value, NULL, 10);
+    }
+    else if (strcmp(arg, "--busy") == 0)
+    {
+      unsigned int enter, leave;
+      if (sscanf(value, "%u:%u", &enter, &leave) != 2 || leave >= enter)
+      {
+        return false;
+      }
+      options.occupancy.busyEnter = (uint16_t)enter;
+      options.occupancy.busyLeave = (uint16_t)leave;
+    }
+    else if (strcmp(arg, "--miss") == 0)
+    {
+      options.occupancy.missPercent = (uint8_t)std::min(std::max(strtoul(value, NULL, 10), 1UL), 99UL);
+    }
+    else if (strcmp(arg, "--debounce") == 0)
+    {
+      options.occupancy.debounceMs = (uint32_t)strtoul(value, NULL, 10);
+    }
+    else if (strcmp(arg, "--channels") == 0)
+    {
+      unsigned long channels = strtoul(value, NULL, 10);
+      if (channels < 1 || channels > HAL_CHANNELS)
+      {
+        return false;
+      }
+      options.channels = (uint8_t)channels;
+    }
+    else if (strcmp(arg, "--flap") == 0)
+    {
+      options.flapMs = strtoul(value, NULL, 10);
+    }
+    else if (strcmp(arg, "--serializer-check") == 0)
+    {
+      options.serializerEvents = strtoul(value, NULL, 10);
+    }
+    else if (strcmp(arg, "--fleet") == 0)
+    {
+      options.fleetDevices = strtoul(value, NULL, 10);
+    }
+    else if (strcmp(arg, "--threads") == 0)
+    {
+      options.fleetThreads = (unsigned int)std::max(1UL, strtoul(value, NULL, 10));
+    }
+    else if (strcmp(arg, "--speed") == 0)
+    {
+      options.fleetSpeed = atof(value);
+      if (options.fleetSpeed <= 0)
+      {
+        return false;
+      }
+    }
+    else if (strcmp(arg, "--spread") == 0)
+    {
+      options.fleetSpreadMs = strtoul(value, NULL, 10) * 1000;
+    }
+    else if (strcmp(arg, "--csv") == 0)
+    {
+      options.fleetCsvPath = value;
+    }
+    else if (strcmp(arg, "--http-server") == 0)
+    {
+      static char host[128];
+      unsigned int port;
+      if (sscanf(value, "%127[^:]:%u", host, &port) != 2)
+      {
+        return false;
+      }
+      options.httpHost = host;
+      options.httpPort = (uint16_t)port;
+    }
+    else if (strcmp(arg, "--tick") == 0)
+    {
+      options.tick = std::max(1UL, strtoul(value, NULL, 10));
+    }
+    else
+    {
+      return false;
+    }
+    i++;
+  }
+
+  return options.tracePath != NULL || options.syntheticHours > 0 || options.serializerEvents > 0 || options.selfCheck;
+}
+
+// The options as device settings, with the --config document on top
+static bool loadConfig(ReplayOptions &options, DeviceConfig &config)
+{
+  DeviceConfig defaults;
+  memset(&defaults, 0, sizeof(defaults));
+  for (OccupancyConfig &occupancy : defaults.occupancy)
+  {
+    occupancy = options.occupancy;
+  }
+  defaults.heartbeatMs = heartbeatInterval;
+  defaults.sensingPeriodMs = 10;
+  defaults.batch = options.batch;
+  defaults.encoding = options.encoding;
+  defaults.deviceIndex = 1;
+  defaults.transport = options.transport;
+  defaults.tokenDurationMin = 60;
+  defaults.logLevel = LOG_LEVEL;
+  config = defaults;
+  if (options.configPath == NULL)
+  {
+    return true;
+  }
+
+  FILE *file = fopen(options.configPath, "rb");
+  if (file == NULL)
+  {
+    perror(options.configPath);
+    return false;
+  }
+  std::vector<char> json;
+  char chunk[512];
+  size_t length;
+  while ((length = fread(chunk, 1, sizeof(chunk), file)) > 0)
+  {
+    json.insert(json.end(), chunk, chunk + length);
+  }
+  fclose(file);
+
+  char error[DEVICE_CONFIG_ERROR_SIZE];
+  if (!deviceConfigUpdate(json.data(), json.size(), defaults, config, error, sizeof(error)))
+  {
+    fprintf(stderr, "%s: %s\n", options.configPath, error);
+    return false;
+  }
+
+  options.occupancy = config.occupancy[0]; // For the report
+  options.batch = config.batch;
+  options.encoding = config.encoding;
+  options.transport = config.transport;
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  atexit([] { Logger.Flush(); });
+
+  ReplayOptions options;
+  if (!parseOptions(argc, argv, options))
+  {
+    usage(argv[0]);
+    return 2;
+  }
+
+  if (options.serializerEvents > 0)
+  {
+    return runSerializerCheck(options.serializerEvents, options.seed);
+  }
+  if (options.selfCheck)
+  {
+    return runSelfCheck();
+  }
+
+  DeviceConfig config;
+  if (!loadConfig(options, config))
+  {
+    return 1;
+  }
+
+  std::vector<TraceEdge> edges;
+  std::vector<std::vector<Session>> sessions(HAL_CHANNELS); // Known only for synthetic traces
+  if (options.tracePath != NULL)
+  {
+    if (!loadTrace(options.tracePath, edges))
+    {
+      return 1;
+    }
+    for (const TraceEdge &edge : edges)
+    {
+      options.channels = std::max(options.channels, (uint8_t)(edge.channel + 1));
+    }
+  }
+  else
+  {
+    for (uint8_t channel = 0; channel < options.channels; channel++)
+    {
+      generateTrace(options.syntheticHours, options.seed + channel, channel, edges, sessions[channel]);
+    }
+    std::stable_sort(edges.begin(), edges.end(), [](const TraceEdge &a, const TraceEdge &b) { return a.time < b.time; });
+  }
+
+  if (options.dumpPath != NULL && !dumpTrace(options.dumpPath, edges))
+  {
+    return 1;
+  }
+
+  if (options.fleetDevices > 0)
+  {
+    FleetOptions fleet;
+    fleet.devices = options.fleetDevices;
+    fleet.threads = (unsigned int)std::min((unsigned long)options.fleetThreads, options.fleetDevices);
+    fleet.speed = options.fleetSpeed;
+    fleet.spreadMs = options.fleetSpreadMs;
+    fleet.hours = options.syntheticHours;
+    fleet.seed = options.seed;
+    fleet.channels = options.channels;
+    fleet.http = config.transport == TELEMETRY_TRANSPORT_HTTP;
+    fleet.host = fleet.http ? options.httpHost : options.mqttHost;
+    fleet.port = fleet.http ? options.httpPort : options.mqttPort;
+    fleet.mqttWindow = options.mqttWindow;
+    fleet.ackTimeoutMs = options.mqttAckTimeoutMs;
+    fleet.csvPath = options.fleetCsvPath;
+    fleet.epochStart = options.epochStart;
+    if (fleet.host == NULL)
+    {
+      fprintf(stderr, "--fleet needs --mqtt-broker, or --http-server with --transport http\n");
+      return 2;
+    }
+    return runFleet(fleet, config, options.tracePath != NULL ? &edges : NULL);
+  }
+
+  // Run one maximum hold past the last edge (or outage) so that the final "free" transition is seen.
+  unsigned long last = edges.empty() ? 0 : edges.back().time;
+  for (const Outage &outage : options.outages)
+  {
+    last = std::max(last, outage.end);
+  }
+  unsigned long hold = 0;
+  for (const OccupancyConfig &occupancy : config.occupancy)
+  {
+    hold = std::max(hold, (unsigned long)(occupancy.estimator == OCCUPANCY_ADAPTIVE ? occupancy.maxHoldMs : occupancy.minHoldMs));
+  }
+  const unsigned long end = last + hold + options.batch.maxDelayMs + options.tick;
+
+  nativeHalReset(options.epochStart);
+
+  // Both paths end in the loopback, or MQTT in a real broker; the order check watches the
+  // path every message takes
+  LoopbackBackend mqttLoopback("mqtt");
+  LoopbackBackend httpLoopback("http");
+  static MqttPublisher mqttPublisher;
+  MqttSocketBackend mqttSocket(mqttPublisher);
+  TelemetryBackend *mqttBackend = &mqttLoopback;
+  const char *mqttTopic = "devices/replay-device/messages/events/";
+  unsigned long mqttReconnects = 0;
+  unsigned long mqttFailedAt = 0;
+  bool mqttFailed = false;
+
+  // As the network task does once the broker dropped the connection; after a failed attempt,
+  // the next one waits an ack timeout (real time)
+  auto reconnect = [&]() {
+    if (options.mqttHost != NULL && !mqttSocket.IsConnected() && (!mqttFailed || mqttSocket.Now() - mqttFailedAt >= options.mqttAckTimeoutMs))
+    {
+      mqttFailed = !mqttSocket.Connect(options.mqttHost, options.mqttPort, deviceId, mqttTopic);
+      mqttFailedAt = mqttSocket.Now();
+      mqttReconnects += mqttFailed ? 0 : 1;
+    }
+    return options.mqttHost == NULL || mqttSocket.IsConnected();
+  };
+
+  if (options.mqttHost != NULL)
+  {
+    mqttPublisher.Begin(mqttSocket, options.mqttWindow, options.mqttAckTimeoutMs);
+    if (!mqttSocket.Connect(options.mqttHost, options.mqttPort, deviceId, mqttTopic))
+    {
+      return 1;
+    }
+    mqttBackend = &mqttSocket;
+  }
+
+  if (options.transport == TELEMETRY_TRANSPORT_HTTP)
+  {
+    httpLoopback.SetHook(checkOrder);
+  }
+  else if (options.mqttHost != NULL)
+  {
+    mqttSocket.SetHook(checkOrder);
+  }
+  else
+  {
+    mqttLoopback.SetHook(checkOrder);
+  }
+  httpLoopback.SetConfirmLater(options.httpFailEvery);
+  telemetryTransportConfigure(options.transport, mqttBackend, &httpLoopback, options.seed);
+
+  FILE *loopbackFile = NULL;
+  if (options.loopbackPath != NULL)
+  {
+    loopbackFile = fopen(options.loopbackPath, "w");
+    if (loopbackFile == NULL)
+    {
+      perror(options.loopbackPath);
+      return 1;
+    }
+    mqttLoopback.SetOutput(loopbackFile);
+    httpLoopback.SetOutput(loopbackFile);
+  }
+
+  char cursorPath[256];
+  snprintf(cursorPath, sizeof(cursorPath), "%s.ack", options.journalPath);
+  remove(options.journalPath);
+  remove(cursorPath);
+  if (!telemetryUplinkBegin(options.journalPath, TelemetryJournal::DROP_OLDEST))
+  {
+    return 1;
+  }
+
+  snprintf(cursorPath, sizeof(cursorPath), "%s.tmp", options.summaryPath);
+  remove(options.summaryPath);
+  remove(cursorPath);
+  if (!occupancySummaryBegin(options.summaryPath, options.summary))
+  {
+    return 1;
+  }
+
+  deviceConfigApply(config); // Occupancy, heartbeat, batching, encoding, as on the device
+  setupPIRSensor();
+  const PowerProfile powerProfile = POWER_PROFILE_ESP32;
+  powerBegin(options.power, powerProfile);
+
+  std::vector<double> sensingCosts; // ns spent in checkPIRSensor() calls that queued a transition
+  std::vector<double> networkCosts; // ns spent in uplink service calls that sent a message
+  double totalCost = 0;
+  unsigned long steps = 0;
+  size_t nextEdge = 0;
+
+  sleepTrace = &edges;
+  sleepNextEdge = &nextEdge;
+  sleepEnd = end;
+  nativeHalSetSleepHandler(sleepUntilWake);
+  unsigned long radioOffAt = 0; // Low-power modes: radio on until then, 0 = off
+  uint32_t radioEnqueued = 0;
+  std::vector<std::vector<Transition>> transitions(HAL_CHANNELS);
+
+  auto wallStart = std::chrono::steady_clock::now();
+
+  for (unsigned long now = 0; now <= end; now += options.tick)
+  {
+    // The edge "interrupt" fires at the exact edge time, even if loop() only runs every tick
+    while (nextEdge < edges.size() && edges[nextEdge].time <= now)
+    {
+      nativeHalSetMillis(edges[nextEdge].time);
+      nativeHalSetPir(edges[nextEdge].channel, edges[nextEdge].level);
+      nextEdge++;
+    }
+    nativeHalSetMillis(now);
+
+    // Sensing task
+    uint32_t queuedBefore = telemetryQueueStats().enqueued;
+    auto stepStart = std::chrono::steady_clock::now();
+    checkPIRSensor();
+    double cost = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - stepStart).count();
+
+    totalCost += cost;
+    steps++;
+    if (telemetryQueueStats().enqueued != queuedBefore)
+    {
+      sensingCosts.push_back(cost);
+    }
+    for (uint8_t channel = 0; channel < options.channels; channel++)
+    {
+      bool occupied = nativeHalStats().ledOccupied[channel];
+      if (occupied != (!transitions[channel].empty() && transitions[channel].back().occupied))
+      {
+        transitions[channel].push_back({now, occupied});
+      }
+    }
+
+    // Low-power modes switch the radio on for a transition and off radioMs later
+    bool radioOn = true;
+    if (options.power != POWER_MODE_ACTIVE)
+    {
+      TelemetryQueueStats queue = telemetryQueueStats();
+      if (radioOffAt == 0 && queue.depth > 0)
+      {
+        powerRadioOn();
+        radioOffAt = now + options.radioMs;
+        radioEnqueued = queue.enqueued - queue.depth;
+      }
+      radioOn = radioOffAt != 0;
+    }
+
+    // Network task
+    uint32_t sentBefore = telemetryUplinkStats().messages;
+    auto serviceStart = std::chrono::steady_clock::now();
+    bool brokerConnected = reconnect();
+    telemetryUplinkService(radioOn && brokerConnected && isConnected(options, now), 0);
+    cost = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - serviceStart).count();
+
+    if (telemetryUplinkStats().messages != sentBefore)
+    {
+      networkCosts.push_back(cost);
+    }
+
+    if (options.mqttHost != NULL && mqttPublisher.GetStats().inFlight > 0)
+    {
+      mqttSocket.Poll(); // PUBACKs and retransmits, as the network task's loop does
+    }
+
+    Logger.Flush(); // What the logger task does on the board, outside the measured steps
+
+    if (radioOffAt != 0 && now >= radioOffAt)
+    {
+      telemetryUplinkService(false, 0); // Journals what the radio window did not deliver
+      powerRadioOff(telemetryQueueStats().enqueued - radioEnqueued);
+      radioOffAt = 0;
+    }
+
+    // The clock moves to the wake-up; the next iteration picks up from there. A sleep cut
+    // short by the end of the trace does not move it, the loop still has to.
+    if (radioOffAt == 0 && powerSleep())
+    {
+      now = std::max(halMillis(), now + options.tick) - options.tick;
+    }
+  }
+
+  bool drained = options.mqttHost == NULL || mqttSocket.Drain(options.mqttAckTimeoutMs * 3);
+  if (!drained && !mqttSocket.IsConnected())
+  {
+    mqttFailed = false;
+    drained = reconnect() && mqttSocket.Drain(options.mqttAckTimeoutMs * 3);
+  }
+
+  double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+  const NativeHalStats &stats = nativeHalStats();
+  TelemetryQueueStats queueStats = telemetryQueueStats();
+  TelemetryUplinkStats uplink = telemetryUplinkStats();
+  TelemetryTransportStats transport = telemetryTransportStats();
+
+  if (loopbackFile != NULL)
+  {
+    fclose(loopbackFile);
+  }
+
+  printf("trace edges          %zu (%u channels)\n", edges.size(), (unsigned)options.channels);
+  printf("virtual time         %.1f s\n", end / 1000.0);
+  printf("wall time            %.3f s (%.0fx real time)\n", wallSeconds, end / 1000.0 / wallSeconds);
+  if (options.occupancy.estimator == OCCUPANCY_FIXED_TIMEOUT)
+  {
+    printf("estimator            fixed, %lu ms\n", (unsigned long)options.occupancy.minHoldMs);
+  }
+  else
+  {
+    printf(
+        "estimator            adaptive, hold %lu-%lu ms, window %lu ms, busy %u/%u, miss %u %%, debounce %lu ms\n",
+        (unsigned long)options.occupancy.minHoldMs,
+        (unsigned long)options.occupancy.maxHoldMs,
+        (unsigned long)options.occupancy.windowMs,
+        (unsigned)options.occupancy.busyEnter,
+        (unsigned)options.occupancy.busyLeave,
+        (unsigned)options.occupancy.missPercent,
+        (unsigned long)options.occupancy.debounceMs);
+  }
+  printf("loop() period        %lu ms\n", options.tick);
+  printf("loop() iterations    %lu (mean %.1f ns)\n", steps, steps ? totalCost / steps : 0.0);
+  printf("transitions emitted  %lu\n", stats.ledChanges);
+  printf("messages sent        %lu (%lu events)\n", (unsigned long)transport.messages, eventsSent);
+  printf(
+      "transport            %s: mqtt %lu messages (%lu bytes), http %lu messages (%lu bytes, %lu undelivered)\n",
+      telemetryTransportModeName(options.transport),
+      (unsigned long)transport.sent[0],
+      transport.bytes[0],
+      (unsigned long)transport.sent[1],
+      transport.bytes[1],
+      (unsigned long)transport.undelivered);
+  const HealthHistogram &edgeToSend = healthHistogram(HEALTH_EDGE_TO_SEND);
+  printf(
+      "edge to send         p50 %lu ms, p99 %lu ms, max %lu ms (HealthMetrics histogram, journaled excluded)\n",
+      (unsigned long)healthPercentile(edgeToSend, 50) / 1000,
+      (unsigned long)healthPercentile(edgeToSend, 99) / 1000,
+      (unsigned long)edgeToSend.maxUs / 1000);
+
+  if (options.mqttHost != NULL)
+  {
+    MqttPublisherStats mqtt = mqttPublisher.GetStats();
+    printf(
+        "mqtt qos 1           %lu published, %lu acked, %lu unacked%s, %lu resent, max %lu/%u in flight, %lu window full, %lu reconnects\n",
+        (unsigned long)mqtt.published,
+        (unsigned long)mqtt.acked,
+        (unsigned long)mqtt.inFlight,
+        drained ? "" : " (timed out)",
+        (unsigned long)mqtt.retransmits,
+        (unsigned long)mqtt.maxInFlight,
+        (unsigned)options.mqttWindow,
+        (unsigned long)mqtt.windowFull,
+        mqttReconnects);
+    printf(
+        "mqtt ack latency     mean %.2f ms, max %lu ms (real time)\n",
+        mqtt.acked ? (double)mqtt.ackTotalMs / mqtt.acked : 0.0,
+        mqtt.ackMaxMs);
+  }
+
+  printAccuracy(transitions, sessions, options.flapMs);
+  printf("reordered events     %lu\n", outOfOrder);
+  printf("queue high water     %lu, dropped %lu\n", (unsigned long)queueStats.highWater, (unsigned long)queueStats.dropped);
+  printf(
+      "journal              %lu journaled, %lu replayed, %lu lost, %lu dropped, %lu left\n",
+      (unsigned long)uplink.journaled,
+      (unsigned long)uplink.replayed,
+      (unsigned long)uplink.lost,
+      (unsigned long)uplink.journalDropped,
+      (unsigned long)uplink.journalDepth);
+  unsigned long summaryMismatches = 0;
+  if (options.summary.hourly || options.summary.daily)
+  {
+    summaryMismatches = printSummaries(transitions, options.epochStart, end);
+  }
+  if (options.power != POWER_MODE_ACTIVE)
+  {
+    PowerStats power = powerStats();
+    double total = (double)(power.awakeUs + power.sleepUs);
+    printf(
+        "power                %s: duty cycle %.3f %%, radio %.3f %%, %lu sleeps (%lu PIR, %lu timer wake-ups)\n",
+        powerModeName(options.power),
+        total > 0 ? 100.0 * power.awakeUs / total : 100.0,
+        total > 0 ? 100.0 * power.radioUs / total : 0.0,
+        (unsigned long)power.sleeps,
+        (unsigned long)power.pirWakeups,
+        (unsigned long)power.timerWakeups);
+    printf(
+        "energy (estimate)    %.1f J, %.1f mJ per transition, %.2f mA average, %lu transmissions\n",
+        power.energyMj / 1000,
+        power.transitions > 0 ? power.energyMj / power.transitions : 0.0,
+        total > 0 ? power.energyMj / powerProfile.volts / (total / 1000000) : 0.0,
+        (unsigned long)power.transmissions);
+  }
+  printCosts("sensing cost/event", sensingCosts);
+  printCosts("network cost/message", networkCosts);
+
+  // Exit status for scripts and CI: telemetry the backend would have got wrong or not at all
+  const char *failure = NULL;
+  if (outOfOrder > 0)
+  {
+    failure = "events out of order";
+  }
+  else if (malformed > 0)
+  {
+    failure = "malformed payloads";
+  }
+  else if (queueStats.dropped > 0)
+  {
+    failure = "telemetry queue overflowed";
+  }
+  else if (uplink.lost > 0 || uplink.journalDropped > 0)
+  {
+    failure = "events lost, or dropped from the journal";
+  }
+  else if (summaryMismatches > 0)
+  {
+    failure = "summaries that do not match the transitions";
+  }
+  else if (!drained)
+  {
+    failure = "QoS 1 messages left unacknowledged";
+  }
+  if (failure != NULL)
+  {
+    fprintf(stderr, "replay failed: %s\n", failure);
+    return 1;
+  }
+  return 0;
+}
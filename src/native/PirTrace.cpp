@@ -0,0 +1,101 @@
+#include "PirTrace.h"
+#include <random>
+#include <stdio.h>
+
+bool loadTrace(const char *path, std::vector<TraceEdge> &edges)
+{
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+  {
+    perror(path);
+    return false;
+  }
+
+  char line[128];
+  unsigned long lineNumber = 0;
+  while (fgets(line, sizeof(line), file) != NULL)
+  {
+    lineNumber++;
+    if (line[0] == '#' || line[0] == '\n')
+    {
+      continue;
+    }
+
+    TraceEdge edge;
+    unsigned int channel = 0;
+    int fields = sscanf(line, "%lu %d %u", &edge.time, &edge.level, &channel);
+    if (fields < 2 || channel >= HAL_CHANNELS || (!edges.empty() && edge.time < edges.back().time))
+    {
+      fprintf(stderr, "%s:%lu: malformed or out of order edge\n", path, lineNumber);
+      fclose(file);
+      return false;
+    }
+
+    edge.level = edge.level ? HIGH : LOW;
+    edge.channel = (uint8_t)channel;
+    edges.push_back(edge);
+  }
+
+  fclose(file);
+  return true;
+}
+
+// Alternating free and occupied periods. While occupied, people trigger the PIR in
+// short pulses separated by mostly short, occasionally long quiet gaps (sitting still).
+void generateTrace(double hours, unsigned int seed, uint8_t channel, std::vector<TraceEdge> &edges, std::vector<Session> &sessions)
+{
+  std::mt19937 rng(seed);
+  std::exponential_distribution<double> freePeriod(1.0 / (20 * 60 * 1000.0));
+  std::exponential_distribution<double> occupiedPeriod(1.0 / (50 * 60 * 1000.0));
+  std::exponential_distribution<double> quietGap(1.0 / 8000.0);
+  std::exponential_distribution<double> stillGap(1.0 / 45000.0);
+  std::uniform_real_distribution<double> pulse(1500, 3500);
+  std::bernoulli_distribution sittingStill(0.15);
+
+  const unsigned long end = (unsigned long)(hours * 3600 * 1000);
+  unsigned long now = (unsigned long)freePeriod(rng);
+
+  while (now < end)
+  {
+    unsigned long sessionEnd = now + (unsigned long)occupiedPeriod(rng);
+    Session session = {now, now};
+
+    while (now < sessionEnd && now < end)
+    {
+      edges.push_back({now, HIGH, channel});
+      now += (unsigned long)pulse(rng);
+      edges.push_back({now, LOW, channel});
+      session.end = now;
+      now += (unsigned long)(sittingStill(rng) ? stillGap(rng) : quietGap(rng)) + 1;
+    }
+    sessions.push_back(session);
+
+    now += (unsigned long)freePeriod(rng);
+  }
+}
+
+bool dumpTrace(const char *path, const std::vector<TraceEdge> &edges)
+{
+  FILE *file = fopen(path, "w");
+  if (file == NULL)
+  {
+    perror(path);
+    return false;
+  }
+
+  fprintf(file, "# <ms since start> <level> [channel]\n");
+  for (const TraceEdge &edge : edges)
+  {
+    if (edge.channel != 0)
+    {
+      fprintf(file, "%lu %d %u\n", edge.time, edge.level, (unsigned)edge.channel);
+    }
+    else
+    {
+      fprintf(file, "%lu %d\n", edge.time, edge.level);
+    }
+  }
+
+  fclose(file);
+  return true;
+}
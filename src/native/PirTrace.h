@@ -0,0 +1,32 @@
+#ifndef PIRTRACE_H
+#define PIRTRACE_H
+
+#include "Hal.h"
+#include <stdint.h>
+#include <vector>
+
+// PIR traces for the host harnesses: recorded ones from a file, synthetic ones from a simple
+// model of a classroom. Format: one edge per line, "<milliseconds since start> <0|1> [channel]",
+// in time order; lines starting with '#' are ignored.
+
+struct TraceEdge
+{
+  unsigned long time; // ms since the start of the trace
+  int level;          // HIGH or LOW
+  uint8_t channel;
+};
+
+// A true occupied period of a synthetic trace, from its first rising to its last falling edge
+struct Session
+{
+  unsigned long start;
+  unsigned long end;
+};
+
+bool loadTrace(const char *path, std::vector<TraceEdge> &edges);
+bool dumpTrace(const char *path, const std::vector<TraceEdge> &edges);
+
+// Appends `hours` of one channel's edges (and its true sessions); the same seed gives the same trace
+void generateTrace(double hours, unsigned int seed, uint8_t channel, std::vector<TraceEdge> &edges, std::vector<Session> &sessions);
+
+#endif // PIRTRACE_H
@@ -0,0 +1,617 @@
+#include "SelfCheck.h"
+#include "DeviceConfig.h"
+#include "MqttCodec.h"
+#include "SerialLogger.h"
+#include "TelemetryJournal.h"
+#include <memory>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+static unsigned long cases = 0;
+static unsigned long failures = 0;
+
+static void expect(bool passed, const char *table, const char *name)
+{
+  cases++;
+  if (!passed)
+  {
+    failures++;
+    printf("FAIL %s: %s\n", table, name);
+  }
+}
+
+/* MqttPacketScanner, MqttEncode* */
+
+struct ScannerCase
+{
+  const char *name;
+  std::vector<uint8_t> bytes;    // From the broker, fed one at a time
+  std::vector<uint16_t> pubacks; // Packet IDs Feed() must report, in order
+};
+
+static const ScannerCase scannerCases[] = {
+    {"PUBACK", {0x40, 0x02, 0x00, 0x01}, {1}},
+    {"PUBACK, big-endian ID", {0x40, 0x02, 0x12, 0x34}, {0x1234}},
+    {"CONNACK, then PUBACK", {0x20, 0x02, 0x00, 0x00, 0x40, 0x02, 0x00, 0x07}, {7}},
+    {"PINGRESP without a body", {0xd0, 0x00, 0x40, 0x02, 0xab, 0xcd}, {0xabcd}},
+    {"two PUBACKs back to back", {0x40, 0x02, 0x00, 0x01, 0x40, 0x02, 0x00, 0x02}, {1, 2}},
+    {"PUBLISH whose body looks like a PUBACK",
+     {0x30, 0x07, 0x00, 0x01, 't', 0x40, 0x02, 0x00, 0x05, 0x40, 0x02, 0x00, 0x06},
+     {6}},
+    {"PUBACK of the wrong length", {0x40, 0x03, 0x00, 0x01, 0x00, 0x40, 0x02, 0x00, 0x02}, {2}},
+    {"SUBACK", {0x90, 0x03, 0x00, 0x01, 0x00}, {}},
+    {"five length bytes, resynchronized", {0x30, 0x80, 0x80, 0x80, 0x80, 0x40, 0x02, 0x00, 0x03}, {3}},
+};
+
+// Body of remaining length 200: two length bytes
+static ScannerCase longPublish()
+{
+  ScannerCase longCase = {"PUBLISH with a two-byte remaining length", {0x30, 0xc8, 0x01}, {9}};
+  longCase.bytes.insert(longCase.bytes.end(), 200, 0x40);
+  longCase.bytes.insert(longCase.bytes.end(), {0x40, 0x02, 0x00, 0x09});
+  return longCase;
+}
+
+static void checkScanner(const ScannerCase &scannerCase)
+{
+  MqttPacketScanner scanner;
+  std::vector<uint16_t> pubacks;
+  for (uint8_t byte : scannerCase.bytes)
+  {
+    uint16_t packetId = scanner.Feed(byte);
+    if (packetId != 0)
+    {
+      pubacks.push_back(packetId);
+    }
+  }
+  expect(pubacks == scannerCase.pubacks, "MqttPacketScanner", scannerCase.name);
+}
+
+static void checkMqttCodec()
+{
+  for (const ScannerCase &scannerCase : scannerCases)
+  {
+    checkScanner(scannerCase);
+  }
+  checkScanner(longPublish());
+
+  uint8_t buffer[512];
+  const uint8_t publish[] = {0x32, 0x06, 0x00, 0x01, 't', 0x01, 0x02, 'x'};
+  size_t length = mqttEncodePublish(buffer, sizeof(buffer), "t", (const uint8_t *)"x", 1, 0x0102);
+  expect(length == sizeof(publish) && memcmp(buffer, publish, length) == 0, "mqttEncodePublish", "QoS 1 PUBLISH");
+  expect(
+      mqttEncodePublish(buffer, sizeof(publish) - 1, "t", (const uint8_t *)"x", 1, 1) == 0,
+      "mqttEncodePublish",
+      "refuses a buffer one byte short");
+  expect(mqttEncodePublish(buffer, sizeof(buffer), "t", (const uint8_t *)"x", 1, 0) == 0, "mqttEncodePublish", "refuses packet ID 0");
+
+  std::vector<uint8_t> payload(300, 'p');
+  length = mqttEncodePublish(buffer, sizeof(buffer), "t", payload.data(), payload.size(), 1);
+  expect(length == 3 + 305 && buffer[1] == (305 % 128 | 0x80) && buffer[2] == 305 / 128, "mqttEncodePublish", "two-byte length");
+
+  const uint8_t connect[] = {0x10, 0x15, 0x00, 0x04, 'M', 'Q', 'T', 'T', 0x04, 0xc2, 0x00, 0x3c,
+                             0x00, 0x02, 'i', 'd', 0x00, 0x01, 'u', 0x00, 0x02, 'p', 'w'};
+  length = mqttEncodeConnect(buffer, sizeof(buffer), "id", "u", "pw", 60);
+  expect(length == sizeof(connect) && memcmp(buffer, connect, length) == 0, "mqttEncodeConnect", "with username and password");
+  length = mqttEncodeConnect(buffer, sizeof(buffer), "id", NULL, NULL, 60);
+  expect(length == 16 && buffer[1] == 14 && buffer[9] == 0x02, "mqttEncodeConnect", "clean session only");
+
+  // A broker echoing our own PUBLISH (a subscription to the same topic), then acking it
+  ScannerCase echo = {"own PUBLISH, then its PUBACK", {}, {0x4002}};
+  length = mqttEncodePublish(buffer, sizeof(buffer), "devices/x/messages/events/", payload.data(), payload.size(), 0x4002);
+  echo.bytes.assign(buffer, buffer + length);
+  echo.bytes.insert(echo.bytes.end(), {0x40, 0x02, 0x40, 0x02});
+  checkScanner(echo);
+}
+
+/* deviceConfigUpdate, deviceConfigFindMember */
+
+struct ConfigCase
+{
+  const char *name;
+  const char *json;
+  const char *error;                       // NULL if the document must be taken
+  bool (*check)(const DeviceConfig &next); // What it must have changed, if taken
+};
+
+static DeviceConfig configDefaults()
+{
+  DeviceConfig defaults;
+  memset(&defaults, 0, sizeof(defaults));
+  for (OccupancyConfig &occupancy : defaults.occupancy)
+  {
+    occupancy = OCCUPANCY_CONFIG_DEFAULT;
+  }
+  defaults.heartbeatMs = 600000;
+  defaults.sensingPeriodMs = 10;
+  defaults.batch = {1, 1536, 0};
+  defaults.encoding = TELEMETRY_ENCODING_JSON;
+  defaults.deviceIndex = 1;
+  defaults.transport = TELEMETRY_TRANSPORT_DUAL;
+  defaults.tokenDurationMin = 60;
+  defaults.logLevel = LOG_LEVEL_INFO;
+  return defaults;
+}
+
+// What the device holds when the document arrives: not the defaults, so that null shows
+static DeviceConfig configCurrent()
+{
+  DeviceConfig current = configDefaults();
+  for (OccupancyConfig &occupancy : current.occupancy)
+  {
+    occupancy.minHoldMs = 20000;
+  }
+  current.heartbeatMs = 5000;
+  current.logLevel = LOG_LEVEL_DEBUG;
+  current.desiredVersion = 3;
+  return current;
+}
+
+static bool sameOccupancy(const OccupancyConfig &a, const OccupancyConfig &b)
+{
+  return a.estimator == b.estimator && a.minHoldMs == b.minHoldMs && a.maxHoldMs == b.maxHoldMs && a.windowMs == b.windowMs
+         && a.busyEnter == b.busyEnter && a.busyLeave == b.busyLeave && a.missPercent == b.missPercent && a.debounceMs == b.debounceMs;
+}
+
+// Member by member: padding is not part of the settings
+static bool sameConfig(const DeviceConfig &a, const DeviceConfig &b)
+{
+  for (uint8_t channel = 0; channel < HAL_CHANNELS; channel++)
+  {
+    if (!sameOccupancy(a.occupancy[channel], b.occupancy[channel]))
+    {
+      return false;
+    }
+  }
+  return a.heartbeatMs == b.heartbeatMs && a.sensingPeriodMs == b.sensingPeriodMs && a.batch.maxEvents == b.batch.maxEvents
+         && a.batch.maxBytes == b.batch.maxBytes && a.batch.maxDelayMs == b.batch.maxDelayMs && a.encoding == b.encoding
+         && a.deviceIndex == b.deviceIndex && a.transport == b.transport && a.tokenDurationMin == b.tokenDurationMin
+         && a.logLevel == b.logLevel && a.desiredVersion == b.desiredVersion;
+}
+
+// The current settings with one change made by hand
+template <typename Change>
+static bool changedOnly(const DeviceConfig &next, Change change)
+{
+  DeviceConfig expected = configCurrent();
+  change(expected);
+  return sameConfig(next, expected);
+}
+
+static const ConfigCase configCases[] = {
+    {"empty document", "{}", NULL, [](const DeviceConfig &next) { return sameConfig(next, configCurrent()); }},
+    {"whitespace around everything",
+     " {\n\t\"logLevel\" : 2 ,\r\n \"heartbeatMs\":0 } ",
+     NULL,
+     [](const DeviceConfig &next) {
+       return changedOnly(next, [](DeviceConfig &expected) {
+         expected.logLevel = 2;
+         expected.heartbeatMs = 0;
+       });
+     }},
+    {"occupancy for every channel",
+     "{\"occupancy\":{\"estimator\":\"fixed\",\"minHoldMs\":15000}}",
+     NULL,
+     [](const DeviceConfig &next) {
+       return changedOnly(next, [](DeviceConfig &expected) {
+         for (OccupancyConfig &occupancy : expected.occupancy)
+         {
+           occupancy.estimator = OCCUPANCY_FIXED_TIMEOUT;
+           occupancy.minHoldMs = 15000;
+         }
+       });
+     }},
+    {"one channel",
+     "{\"channels\":{\"2\":{\"maxHoldMs\":600000,\"busyEnter\":6}}}",
+     NULL,
+     [](const DeviceConfig &next) {
+       return changedOnly(next, [](DeviceConfig &expected) {
+         expected.occupancy[2].maxHoldMs = 600000;
+         expected.occupancy[2].busyEnter = 6;
+       });
+     }},
+    {"every channel, then one",
+     "{\"occupancy\":{\"debounceMs\":500},\"channels\":{\"0\":{\"debounceMs\":0}}}",
+     NULL,
+     [](const DeviceConfig &next) {
+       return changedOnly(next, [](DeviceConfig &expected) {
+         for (OccupancyConfig &occupancy : expected.occupancy)
+         {
+           occupancy.debounceMs = 500;
+         }
+         expected.occupancy[0].debounceMs = 0;
+       });
+     }},
+    {"null puts the default back",
+     "{\"heartbeatMs\":null,\"occupancy\":{\"minHoldMs\":null},\"logLevel\":null}",
+     NULL,
+     [](const DeviceConfig &next) {
+       return changedOnly(next, [](DeviceConfig &expected) {
+         expected.heartbeatMs = configDefaults().heartbeatMs;
+         expected.logLevel = configDefaults().logLevel;
+         for (OccupancyConfig &occupancy : expected.occupancy)
+         {
+           occupancy.minHoldMs = configDefaults().occupancy[0].minHoldMs;
+         }
+       });
+     }},
+    {"batch, encoding and transport",
+     "{\"batch\":{\"maxEvents\":16,\"maxBytes\":1024,\"maxDelayMs\":10000},\"encoding\":\"cbor\",\"transport\":\"http\"}",
+     NULL,
+     [](const DeviceConfig &next) {
+       return changedOnly(next, [](DeviceConfig &expected) {
+         expected.batch = {16, 1024, 10000};
+         expected.encoding = TELEMETRY_ENCODING_CBOR;
+         expected.transport = TELEMETRY_TRANSPORT_HTTP;
+       });
+     }},
+    {"twin version",
+     "{\"$version\":7}",
+     NULL,
+     [](const DeviceConfig &next) { return changedOnly(next, [](DeviceConfig &expected) { expected.desiredVersion = 7; }); }},
+    {"unknown members skipped",
+     "{\"future\":{\"a\":[1,{\"b\":\"}\"}],\"c\":null},\"occupancy\":{\"newer\":[true,false]},"
+     "\"batch\":{\"newer\":-1.5e3},\"$metadata\":{\"$lastUpdated\":\"2024-01-01T00:00:00Z\"},\"heartbeatMs\":0}",
+     NULL,
+     [](const DeviceConfig &next) { return changedOnly(next, [](DeviceConfig &expected) { expected.heartbeatMs = 0; }); }},
+    {"escaped quote in a skipped string",
+     "{\"note\":\"a \\\"quoted\\\" } value\",\"logLevel\":1}",
+     NULL,
+     [](const DeviceConfig &next) { return changedOnly(next, [](DeviceConfig &expected) { expected.logLevel = 1; }); }},
+    {"out of range", "{\"heartbeatMs\":86400001}", "heartbeatMs must be 0..86400000", NULL},
+    {"below range", "{\"tokenDurationMin\":4}", "tokenDurationMin must be 5..1440", NULL},
+    {"taken whole or not at all", "{\"logLevel\":1,\"heartbeatMs\":-1}", "heartbeatMs must be", NULL},
+    {"fraction", "{\"sensingPeriodMs\":1.5}", "sensingPeriodMs must be", NULL},
+    {"exponent", "{\"deviceIndex\":1e3}", "deviceIndex must be", NULL},
+    {"above 32 bits", "{\"heartbeatMs\":4294967296}", "heartbeatMs must be", NULL},
+    {"string for a number", "{\"logLevel\":\"3\"}", "logLevel must be", NULL},
+    {"unknown estimator", "{\"occupancy\":{\"estimator\":\"psychic\"}}", "unknown estimator", NULL},
+    {"unknown transport", "{\"transport\":\"carrier pigeon\"}", "unknown transport", NULL},
+    {"channel not on this board", "{\"channels\":{\"4\":{\"minHoldMs\":1000}}}", "no channel 4 on this board", NULL},
+    {"channel that is not a number", "{\"channels\":{\"x1\":{}}}", "no channel x1 on this board", NULL},
+    {"minHoldMs above maxHoldMs", "{\"channels\":{\"1\":{\"minHoldMs\":400000}}}", "channel 1: minHoldMs above maxHoldMs", NULL},
+    {"busyLeave at busyEnter", "{\"occupancy\":{\"busyEnter\":2,\"busyLeave\":2}}", "channel 0: busyLeave must be below busyEnter", NULL},
+    {"malformed $version", "{\"$version\":\"7\"}", "malformed $version", NULL},
+    {"truncated", "{\"logLevel\":1", "malformed JSON", NULL},
+    {"missing colon", "{\"logLevel\" 1}", "malformed JSON", NULL},
+    {"trailing comma", "{\"logLevel\":1,}", "malformed JSON", NULL},
+    {"not an object", "[{\"logLevel\":1}]", "malformed JSON", NULL},
+    {"unterminated string", "{\"note\":\"abc}", "malformed JSON", NULL},
+    {"nested too deep", "{\"future\":[[[[[[[[[[1]]]]]]]]]],\"logLevel\":1}", "malformed JSON", NULL},
+};
+
+static void checkConfigCase(const ConfigCase &configCase)
+{
+  const DeviceConfig defaults = configDefaults();
+  DeviceConfig config = configCurrent();
+  char error[DEVICE_CONFIG_ERROR_SIZE];
+  bool taken = deviceConfigUpdate(configCase.json, strlen(configCase.json), defaults, config, error, sizeof(error));
+
+  if (configCase.error == NULL)
+  {
+    expect(taken && configCase.check(config), "deviceConfigUpdate", configCase.name);
+  }
+  else
+  {
+    expect(!taken && strstr(error, configCase.error) == error && sameConfig(config, configCurrent()), "deviceConfigUpdate", configCase.name);
+  }
+}
+
+struct MemberCase
+{
+  const char *name;
+  const char *json;
+  const char *member;
+  const char *value; // NULL if it must not be found
+};
+
+static const MemberCase memberCases[] = {
+    {"first member", "{\"desired\":{\"a\":1},\"reported\":{}}", "desired", "{\"a\":1}"},
+    {"last member", "{\"desired\":{\"a\":1},\"reported\":{ }}", "reported", "{ }"},
+    {"missing member", "{\"desired\":{}}", "reported", NULL},
+    {"empty object", "{}", "desired", NULL},
+    {"only top-level members", "{\"properties\":{\"desired\":1}}", "desired", NULL},
+    {"first of duplicates", "{\"a\":1,\"a\":2}", "a", "1"},
+    {"after braces in a string", "{\"a\":\"}{\",\"b\":2}", "b", "2"},
+    {"after an escaped quote", "{\"a\":\"x\\\"y\",\"b\":true}", "b", "true"},
+    {"after nested arrays", "{\"a\":[1,[2,{}],[]],\"b\":null}", "b", "null"},
+    {"string value, quotes included", "{\"b\":\"text\"}", "b", "\"text\""},
+    {"whitespace around the value", "{ \"b\" :\t-12.5e1 \n}", "b", "-12.5e1"},
+    {"malformed after the member", "{\"desired\":1,", "desired", NULL},
+    {"malformed value", "{\"desired\":}", "desired", NULL},
+    {"nested too deep", "{\"a\":[[[[[[[[[[1]]]]]]]]]],\"b\":1}", "b", NULL},
+    {"not an object", "[\"desired\"]", "desired", NULL},
+};
+
+static void checkFindMember(const MemberCase &memberCase)
+{
+  const char *value = NULL;
+  size_t length = 0;
+  bool found = deviceConfigFindMember(memberCase.json, strlen(memberCase.json), memberCase.member, value, length);
+  bool passed = memberCase.value == NULL
+                    ? !found
+                    : found && length == strlen(memberCase.value) && memcmp(value, memberCase.value, length) == 0;
+  expect(passed, "deviceConfigFindMember", memberCase.name);
+}
+
+static void checkDeviceConfig()
+{
+  for (const ConfigCase &configCase : configCases)
+  {
+    checkConfigCase(configCase);
+  }
+  for (const MemberCase &memberCase : memberCases)
+  {
+    checkFindMember(memberCase);
+  }
+}
+
+/* TelemetryJournal */
+
+enum JournalAction
+{
+  JOURNAL_APPEND,        // Events first..first + count - 1, by timestamp
+  JOURNAL_DELIVER,       // Peek() up to count events and Consume() them
+  JOURNAL_REQUEUE,       // Requeue() events first..first + count - 1
+  JOURNAL_RESTART,       // A reboot: a new TelemetryJournal on the same files
+  JOURNAL_CORRUPT,       // Flip a bit of the first-th record appended to the journal
+  JOURNAL_SET_CURSOR,    // Point the cursor file at the first-th record appended (0 writes 0)
+  JOURNAL_SHORT_CURSOR,  // A cursor file cut short
+  JOURNAL_REMOVE_CURSOR, // No cursor file
+};
+
+struct JournalStep
+{
+  JournalAction action;
+  uint32_t first;
+  uint32_t count;
+};
+
+struct JournalCase
+{
+  const char *name;
+  uint32_t capacity;
+  TelemetryJournal::OverflowPolicy policy;
+  std::vector<JournalStep> steps;
+  std::vector<uint32_t> pending; // Timestamps the journal must replay, in order
+  uint32_t dropped;              // Since the last restart, replay included
+};
+
+static const TelemetryJournal::OverflowPolicy DROP_OLDEST = TelemetryJournal::DROP_OLDEST;
+static const TelemetryJournal::OverflowPolicy DROP_NEWEST = TelemetryJournal::DROP_NEWEST;
+
+static const JournalCase journalCases[] = {
+    {"replayed after a restart", 8, DROP_OLDEST, {{JOURNAL_APPEND, 1, 3}, {JOURNAL_RESTART, 0, 0}}, {1, 2, 3}, 0},
+    {"delivered records stay delivered",
+     8,
+     DROP_OLDEST,
+     {{JOURNAL_APPEND, 1, 5}, {JOURNAL_DELIVER, 0, 2}, {JOURNAL_RESTART, 0, 0}},
+     {3, 4, 5},
+     0},
+    {"appending continues after the highest sequence",
+     8,
+     DROP_OLDEST,
+     {{JOURNAL_APPEND, 1, 3}, {JOURNAL_DELIVER, 0, 3}, {JOURNAL_RESTART, 0, 0}, {JOURNAL_APPEND, 10, 2}},
+     {10, 11},
+     0},
+    {"ring wrap",
+     4,
+     DROP_OLDEST,
+     {{JOURNAL_APPEND, 1, 3}, {JOURNAL_DELIVER, 0, 3}, {JOURNAL_APPEND, 4, 4}, {JOURNAL_RESTART, 0, 0}},
+     {4, 5, 6, 7},
+     0},
+    {"DROP_OLDEST", 4, DROP_OLDEST, {{JOURNAL_APPEND, 1, 6}}, {3, 4, 5, 6}, 2},
+    {"DROP_OLDEST, then a restart", 4, DROP_OLDEST, {{JOURNAL_APPEND, 1, 6}, {JOURNAL_RESTART, 0, 0}}, {3, 4, 5, 6}, 0},
+    {"DROP_NEWEST", 4, DROP_NEWEST, {{JOURNAL_APPEND, 1, 6}}, {1, 2, 3, 4}, 2},
+    {"DROP_NEWEST, room again once delivered",
+     4,
+     DROP_NEWEST,
+     {{JOURNAL_APPEND, 1, 5}, {JOURNAL_DELIVER, 0, 2}, {JOURNAL_APPEND, 6, 2}},
+     {3, 4, 6, 7},
+     1},
+    {"corrupt record at the head skipped", 8, DROP_OLDEST, {{JOURNAL_APPEND, 1, 3}, {JOURNAL_CORRUPT, 1, 0}}, {2, 3}, 1},
+    {"corrupt record in the middle skipped", 8, DROP_OLDEST, {{JOURNAL_APPEND, 1, 3}, {JOURNAL_CORRUPT, 2, 0}}, {1, 3}, 1},
+    {"torn last record written over after a restart",
+     8,
+     DROP_OLDEST,
+     {{JOURNAL_APPEND, 1, 3}, {JOURNAL_CORRUPT, 3, 0}, {JOURNAL_RESTART, 0, 0}, {JOURNAL_APPEND, 10, 1}},
+     {1, 2, 10},
+     0},
+    {"no cursor file: the whole ring again",
+     8,
+     DROP_OLDEST,
+     {{JOURNAL_APPEND, 1, 3}, {JOURNAL_DELIVER, 0, 2}, {JOURNAL_REMOVE_CURSOR, 0, 0}, {JOURNAL_RESTART, 0, 0}},
+     {1, 2, 3},
+     0},
+    {"cursor file cut short",
+     8,
+     DROP_OLDEST,
+     {{JOURNAL_APPEND, 1, 3}, {JOURNAL_DELIVER, 0, 2}, {JOURNAL_SHORT_CURSOR, 0, 0}, {JOURNAL_RESTART, 0, 0}},
+     {1, 2, 3},
+     0},
+    {"cursor past the last record",
+     8,
+     DROP_OLDEST,
+     {{JOURNAL_APPEND, 1, 3}, {JOURNAL_SET_CURSOR, 50, 0}, {JOURNAL_RESTART, 0, 0}, {JOURNAL_APPEND, 10, 1}},
+     {10},
+     0},
+    {"cursor 0", 8, DROP_OLDEST, {{JOURNAL_APPEND, 1, 3}, {JOURNAL_SET_CURSOR, 0, 0}, {JOURNAL_RESTART, 0, 0}}, {}, 0},
+    {"cursor older than the ring",
+     4,
+     DROP_OLDEST,
+     {{JOURNAL_APPEND, 1, 6}, {JOURNAL_SET_CURSOR, 1, 0}, {JOURNAL_RESTART, 0, 0}},
+     {3, 4, 5, 6},
+     0},
+    {"Requeue in front of the unsent records",
+     8,
+     DROP_OLDEST,
+     {{JOURNAL_APPEND, 1, 4}, {JOURNAL_DELIVER, 0, 2}, {JOURNAL_REQUEUE, 1, 2}},
+     {1, 2, 3, 4},
+     0},
+    {"Requeue, then a restart",
+     8,
+     DROP_OLDEST,
+     {{JOURNAL_APPEND, 1, 4}, {JOURNAL_DELIVER, 0, 2}, {JOURNAL_REQUEUE, 1, 2}, {JOURNAL_RESTART, 0, 0}},
+     {1, 2, 3, 4},
+     0},
+    {"Requeue across the ring wrap",
+     4,
+     DROP_OLDEST,
+     {{JOURNAL_APPEND, 1, 4}, {JOURNAL_DELIVER, 0, 3}, {JOURNAL_APPEND, 5, 1}, {JOURNAL_REQUEUE, 2, 2}, {JOURNAL_RESTART, 0, 0}},
+     {2, 3, 4, 5},
+     0},
+    {"Requeue into an empty journal", 8, DROP_OLDEST, {{JOURNAL_REQUEUE, 1, 2}, {JOURNAL_APPEND, 3, 1}}, {1, 2, 3}, 0},
+    {"Requeue with nothing delivered before, then a restart",
+     8,
+     DROP_OLDEST,
+     {{JOURNAL_APPEND, 3, 2}, {JOURNAL_REQUEUE, 1, 2}, {JOURNAL_RESTART, 0, 0}},
+     {1, 2, 3, 4},
+     0},
+    {"Requeue into a full ring: appended",
+     4,
+     DROP_OLDEST,
+     {{JOURNAL_APPEND, 2, 4}, {JOURNAL_DELIVER, 0, 1}, {JOURNAL_APPEND, 6, 1}, {JOURNAL_REQUEUE, 1, 1}},
+     {4, 5, 6, 1},
+     1},
+};
+
+// Every field of the record round trips, so they differ from one event to the next
+static TelemetryEvent journalEvent(uint32_t timestamp)
+{
+  TelemetryEvent event;
+  memset(&event, 0, sizeof(event));
+  event.status = timestamp % 2 == 1;
+  event.heartbeat = timestamp % 5 == 0;
+  event.timestamp = (time_t)timestamp;
+  event.channel = (uint8_t)(timestamp % HAL_CHANNELS);
+  return event;
+}
+
+static void writeCursor(const char *cursorPath, uint32_t firstPending, size_t size)
+{
+  FILE *cursor = fopen(cursorPath, "wb");
+  if (cursor != NULL)
+  {
+    fwrite(&firstPending, size, 1, cursor);
+    fclose(cursor);
+  }
+}
+
+static void corruptRecord(const char *path, uint32_t capacity, uint32_t sequence)
+{
+  FILE *file = fopen(path, "r+b");
+  if (file == NULL)
+  {
+    return;
+  }
+  long offset = (long)(sequence % capacity) * 16 + 4; // The record's timestamp
+  int byte = fseek(file, offset, SEEK_SET) == 0 ? fgetc(file) : EOF;
+  if (byte != EOF && fseek(file, offset, SEEK_SET) == 0)
+  {
+    fputc(byte ^ 0x01, file);
+  }
+  fclose(file);
+}
+
+static void checkJournalCase(const JournalCase &journalCase)
+{
+  char path[] = "/tmp/journal-check-XXXXXX";
+  int descriptor = mkstemp(path);
+  if (descriptor < 0)
+  {
+    expect(false, "TelemetryJournal", journalCase.name);
+    return;
+  }
+  close(descriptor);
+  char cursorPath[sizeof(path) + 8];
+  snprintf(cursorPath, sizeof(cursorPath), "%s.ack", path);
+
+  std::unique_ptr<TelemetryJournal> journal(new TelemetryJournal());
+  bool passed = journal->Begin(path, journalCase.capacity, journalCase.policy);
+  std::vector<TelemetryEvent> events(journalCase.capacity + 8);
+
+  for (const JournalStep &step : journalCase.steps)
+  {
+    switch (step.action)
+    {
+    case JOURNAL_APPEND:
+      for (uint32_t i = 0; i < step.count; i++)
+      {
+        journal->Append(journalEvent(step.first + i));
+      }
+      break;
+    case JOURNAL_DELIVER:
+      journal->Consume(journal->Peek(events.data(), step.count));
+      break;
+    case JOURNAL_REQUEUE:
+      for (uint32_t i = 0; i < step.count; i++)
+      {
+        events[i] = journalEvent(step.first + i);
+      }
+      passed = journal->Requeue(events.data(), step.count) == step.count && passed;
+      break;
+    case JOURNAL_RESTART:
+      journal.reset(new TelemetryJournal());
+      passed = journal->Begin(path, journalCase.capacity, journalCase.policy) && passed;
+      break;
+    case JOURNAL_CORRUPT:
+      corruptRecord(path, journalCase.capacity, journalCase.capacity + step.first); // Sequences start one ring in
+      break;
+    case JOURNAL_SET_CURSOR:
+      writeCursor(cursorPath, step.first != 0 ? journalCase.capacity + step.first : 0, sizeof(uint32_t));
+      break;
+    case JOURNAL_SHORT_CURSOR:
+      writeCursor(cursorPath, step.first, 2);
+      break;
+    case JOURNAL_REMOVE_CURSOR:
+      remove(cursorPath);
+      break;
+    }
+  }
+
+  // Replayed as the uplink does: a Peek() stops at a corrupt record that is not the first
+  std::vector<TelemetryEvent> replayed;
+  size_t count;
+  while ((count = journal->Peek(events.data(), events.size())) > 0)
+  {
+    replayed.insert(replayed.end(), events.begin(), events.begin() + count);
+    journal->Consume(count);
+  }
+
+  passed = passed && replayed.size() == journalCase.pending.size() && journal->GetDepth() == 0
+           && journal->GetDropped() == journalCase.dropped;
+  for (size_t i = 0; passed && i < replayed.size(); i++)
+  {
+    TelemetryEvent expected = journalEvent(journalCase.pending[i]);
+    passed = replayed[i].timestamp == expected.timestamp && replayed[i].status == expected.status
+             && replayed[i].heartbeat == expected.heartbeat && replayed[i].channel == expected.channel;
+  }
+  expect(passed, "TelemetryJournal", journalCase.name);
+
+  journal.reset();
+  remove(path);
+  remove(cursorPath);
+}
+
+static void checkJournal()
+{
+  for (const JournalCase &journalCase : journalCases)
+  {
+    checkJournalCase(journalCase);
+  }
+}
+
+int runSelfCheck()
+{
+  checkMqttCodec();
+  checkDeviceConfig();
+  checkJournal();
+
+  printf("self-check cases     %lu\n", cases);
+  printf("failures             %lu\n", failures);
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,9 @@
+#ifndef SELFCHECK_H
+#define SELFCHECK_H
+
+// Table-driven checks of the firmware's parsers and encoders on the host, next to
+// --serializer-check: every case is an input and the result it must give, and each one that
+// gives something else is printed. Returns the process exit code, 1 if any case failed.
+int runSelfCheck();
+
+#endif // SELFCHECK_H
@@ -0,0 +1,525 @@
+#include "SerializerCheck.h"
+#include "AllocCounter.h"
+#include "Telemetry.h"
+#include "ArduinoJson.h"
+#include "TelemetryUplink.h"
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <time.h>
+#include <vector>
+
+// The serializers as they were before Telemetry.cpp stopped using ArduinoJson
+
+static size_t referenceTimestamp(time_t timestamp, char *buffer, size_t size)
+{
+  time_t now = timestamp;
+  struct tm timeinfo;
+
+  now += 3600;
+  localtime_r(&now, &timeinfo);
+
+  return strftime(buffer, size, "%Y-%m-%dT%H:%M:%SZ", &timeinfo);
+}
+
+static size_t referenceData(bool status, time_t eventTime, uint8_t channel, char *buffer, size_t size)
+{
+  StaticJsonDocument<256> doc;
+  char timestamp[30];
+
+  referenceTimestamp(eventTime, timestamp, sizeof(timestamp));
+
+  doc["DeviceID"] = deviceId;
+  if (channel != 0)
+  {
+    doc["Channel"] = channel; // Multi-channel boards only
+  }
+  doc["Status"] = status;
+  doc["Timestamp"] = timestamp;
+
+  return serializeJson(doc, buffer, size);
+}
+
+static size_t referenceBatch(const TelemetryEvent *events, size_t count, char *buffer, size_t size)
+{
+  StaticJsonDocument<128> doc;
+  char entry[TELEMETRY_PAYLOAD_SIZE];
+  char timestamp[30];
+
+  doc.set(deviceId);
+  serializeJson(doc, entry, sizeof(entry));
+
+  std::string json = std::string("{\"DeviceID\":") + entry + ",\"Batch\":[";
+  for (size_t i = 0; i < count; i++)
+  {
+    referenceTimestamp(events[i].timestamp, timestamp, sizeof(timestamp));
+
+    doc.clear();
+    if (events[i].channel != 0)
+    {
+      doc["Channel"] = events[i].channel;
+    }
+    doc["Status"] = events[i].status;
+    doc["Timestamp"] = timestamp;
+    if (events[i].heartbeat)
+    {
+      doc["Heartbeat"] = true;
+    }
+
+    serializeJson(doc, entry, sizeof(entry));
+    json += (i > 0 ? "," : "");
+    json += entry;
+  }
+  json += "]}";
+
+  if (json.size() >= size)
+  {
+    return 0;
+  }
+  memcpy(buffer, json.c_str(), json.size() + 1);
+  return json.size();
+}
+
+static size_t referenceSummary(const TelemetrySummary &summary, char *buffer, size_t size)
+{
+  StaticJsonDocument<1024> doc;
+  char start[30];
+
+  referenceTimestamp((time_t)summary.start, start, sizeof(start));
+
+  doc["DeviceID"] = deviceId;
+  if (summary.channel != 0)
+  {
+    doc["Channel"] = summary.channel;
+  }
+  doc["Summary"] = summary.daily ? "day" : "hour";
+  doc["Start"] = start;
+  doc["Sessions"] = summary.sessions;
+  doc["OccupiedSeconds"] = summary.occupiedSeconds;
+  doc["LongestSeconds"] = summary.longestSeconds;
+  if (summary.daily)
+  {
+    JsonArray hourly = doc.createNestedArray("Hourly");
+    for (int hour = 0; hour < 24; hour++)
+    {
+      hourly.add(summary.hourly[hour]);
+    }
+  }
+
+  return serializeJson(doc, buffer, size);
+}
+
+static bool readInt(const uint8_t *bytes, size_t length, size_t &position, int64_t &value)
+{
+  if (position >= length || (bytes[position] >> 5) > 1 || (bytes[position] & 0x1f) > 27)
+  {
+    return false;
+  }
+
+  bool negative = (bytes[position] >> 5) == 1;
+  uint8_t info = bytes[position++] & 0x1f;
+  uint64_t argument = info;
+  if (info >= 24)
+  {
+    size_t size = (size_t)1 << (info - 24);
+    if (position + size > length)
+    {
+      return false;
+    }
+    argument = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+      argument = (argument << 8) | bytes[position++];
+    }
+  }
+
+  value = negative ? -1 - (int64_t)argument : (int64_t)argument;
+  return true;
+}
+
+bool decodeTelemetryCbor(const char *payload, size_t length, uint16_t &deviceIndex, std::vector<TelemetryEvent> &events)
+{
+  const uint8_t *bytes = (const uint8_t *)payload;
+  if (length < 2 || bytes[0] != 0x9f || bytes[length - 1] != 0xff)
+  {
+    return false;
+  }
+
+  size_t position = 1;
+  int64_t index, firstTime = 0, time, flags;
+  if (!readInt(bytes, length - 1, position, index))
+  {
+    return false;
+  }
+  deviceIndex = (uint16_t)index;
+
+  for (size_t count = 0; position < length - 1; count++)
+  {
+    if (!readInt(bytes, length - 1, position, time) || !readInt(bytes, length - 1, position, flags))
+    {
+      return false;
+    }
+
+    firstTime = count == 0 ? time : firstTime;
+    TelemetryEvent event;
+    event.status = (flags & TELEMETRY_CBOR_OCCUPIED) != 0;
+    event.heartbeat = (flags & TELEMETRY_CBOR_HEARTBEAT) != 0;
+    event.channel = (uint8_t)(flags >> TELEMETRY_CBOR_CHANNEL_SHIFT);
+    event.timestamp = (time_t)(count == 0 ? time : firstTime + time);
+    event.edgeMs = 0;
+    events.push_back(event);
+  }
+
+  return true;
+}
+
+// "2024-01-01T01:00:00Z" as getISO8601Timestamp() writes it, back to Unix time
+static bool parseTimestamp(const char *text, uint32_t &time)
+{
+  int year, month, day, hour, minute, second;
+  if (text == NULL || sscanf(text, "%4d-%2d-%2dT%2d:%2d:%2dZ", &year, &month, &day, &hour, &minute, &second) != 6)
+  {
+    return false;
+  }
+
+  // http://howardhinnant.github.io/date_algorithms.html, days_from_civil()
+  year -= month <= 2 ? 1 : 0;
+  int64_t era = year / 400;
+  unsigned yearOfEra = (unsigned)(year - era * 400);
+  unsigned dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+  unsigned dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+  int64_t days = era * 146097 + dayOfEra - 719468;
+  time = (uint32_t)(days * 86400 + hour * 3600 + minute * 60 + second - TELEMETRY_LOCAL_OFFSET);
+  return true;
+}
+
+static bool decodeSummaryCbor(const char *payload, size_t length, uint16_t &deviceIndex, TelemetrySummary &summary)
+{
+  const uint8_t *bytes = (const uint8_t *)payload;
+  if (length < 8 || (bytes[0] != 0x87 && bytes[0] != 0x88))
+  {
+    return false;
+  }
+
+  int64_t fields[7];
+  size_t position = 1;
+  for (int64_t &field : fields)
+  {
+    if (!readInt(bytes, length, position, field))
+    {
+      return false;
+    }
+  }
+
+  deviceIndex = (uint16_t)fields[0];
+  summary = {fields[1] == 1, (uint8_t)fields[2], (uint16_t)fields[4], (uint32_t)fields[3], (uint32_t)fields[5], (uint32_t)fields[6], {0}};
+  if (bytes[0] == 0x87)
+  {
+    return !summary.daily && position == length;
+  }
+
+  if (!summary.daily || position + 2 > length || bytes[position] != 0x98 || bytes[position + 1] != 24)
+  {
+    return false;
+  }
+  position += 2;
+  for (uint16_t &seconds : summary.hourly)
+  {
+    int64_t value;
+    if (!readInt(bytes, length, position, value))
+    {
+      return false;
+    }
+    seconds = (uint16_t)value;
+  }
+  return position == length;
+}
+
+bool decodeTelemetrySummary(const char *payload, size_t length, uint16_t &deviceIndex, TelemetrySummary &summary)
+{
+  if (telemetryGetEncoding() == TELEMETRY_ENCODING_CBOR)
+  {
+    return decodeSummaryCbor(payload, length, deviceIndex, summary);
+  }
+
+  // {"DeviceID":"...",["Channel":N,]"Summary":"hour","Start":"...","Sessions":N,...}, fields in that order
+  std::string json(payload, length);
+  const char *summaryField = strstr(json.c_str(), "\"Summary\":\"");
+  const char *channelField = strstr(json.c_str(), "\"Channel\":");
+  const char *startField = strstr(json.c_str(), "\"Start\":\"");
+  const char *sessionsField = strstr(json.c_str(), "\"Sessions\":");
+  const char *occupiedField = strstr(json.c_str(), "\"OccupiedSeconds\":");
+  const char *longestField = strstr(json.c_str(), "\"LongestSeconds\":");
+  const char *hourlyField = strstr(json.c_str(), "\"Hourly\":[");
+  if (summaryField == NULL || startField == NULL || sessionsField == NULL || occupiedField == NULL || longestField == NULL)
+  {
+    return false;
+  }
+
+  deviceIndex = 0;
+  summary = {strncmp(summaryField + 11, "day\"", 4) == 0,
+             (uint8_t)(channelField != NULL && channelField < summaryField ? strtoul(channelField + 10, NULL, 10) : 0),
+             (uint16_t)strtoul(sessionsField + 11, NULL, 10),
+             0,
+             (uint32_t)strtoul(occupiedField + 18, NULL, 10),
+             (uint32_t)strtoul(longestField + 17, NULL, 10),
+             {0}};
+
+  if (summary.daily != (hourlyField != NULL))
+  {
+    return false;
+  }
+  const char *hour = summary.daily ? hourlyField + 10 : NULL;
+  for (int i = 0; hour != NULL && i < 24; i++)
+  {
+    char *next;
+    summary.hourly[i] = (uint16_t)strtoul(hour, &next, 10);
+    if (next == hour || *next != (i < 23 ? ',' : ']'))
+    {
+      return false;
+    }
+    hour = next + 1;
+  }
+  return parseTimestamp(startField + 9, summary.start);
+}
+
+static unsigned long mismatches = 0;
+
+static void compare(const char *what, const char *actual, size_t actualLength, const char *expected, size_t expectedLength)
+{
+  if (actualLength == expectedLength && memcmp(actual, expected, actualLength) == 0)
+  {
+    return;
+  }
+
+  if (mismatches++ < 5)
+  {
+    fprintf(stderr, "%s differs:\n  got      %s\n  expected %s\n", what, actual, expected);
+  }
+}
+
+static std::vector<TelemetryEvent> randomEvents(unsigned long count, unsigned int seed)
+{
+  std::mt19937 rng(seed);
+  std::uniform_int_distribution<int64_t> timestamp(0, 0x7fffffff - 3600); // Anything a 32-bit time_t can hold
+  std::bernoulli_distribution status(0.5);
+  std::bernoulli_distribution heartbeat(0.1);
+  std::bernoulli_distribution otherChannel(0.2);
+  std::uniform_int_distribution<int> channel(1, 62); // All a CBOR flags byte has room for
+
+  // Leap days, year and century boundaries, the epoch; one- and two-digit channels
+  std::vector<TelemetryEvent> events = {
+      {true, false, 0, 0, 0},          {false, false, 951782399, 9, 0},  {true, false, 951782400, 10, 0},
+      {false, true, 1709164800, 0, 0}, {true, false, 1735685999, 62, 0}, {false, false, 1735686000, 0, 0},
+      {true, true, 1582934400, 1, 0},  {false, false, 0x7fffffff - 3600, 0, 0},
+  };
+  while (events.size() < count)
+  {
+    TelemetryEvent event = {status(rng), heartbeat(rng), (time_t)timestamp(rng), 0, 0};
+    event.channel = otherChannel(rng) ? (uint8_t)channel(rng) : 0;
+    events.push_back(event);
+  }
+  return events;
+}
+
+// Every event on its own and appended to batches of TELEMETRY_BATCH_MAX_SIZE
+static void checkEvents(const std::vector<TelemetryEvent> &events)
+{
+  char actual[TELEMETRY_BATCH_MAX_SIZE + 1];
+  char expected[TELEMETRY_BATCH_MAX_SIZE + 1];
+  char batch[TELEMETRY_BATCH_MAX_SIZE + 1];
+  size_t batchStart = 0;
+  size_t batchLength = getTelemetryBatch(&events[0], 1, batch, sizeof(batch));
+
+  for (size_t i = 0; i < events.size(); i++)
+  {
+    const TelemetryEvent &event = events[i];
+    size_t length = getTelemetryData(event.status, event.timestamp, actual, TELEMETRY_PAYLOAD_SIZE, event.channel);
+    compare("event", actual, length, expected, referenceData(event.status, event.timestamp, event.channel, expected, TELEMETRY_PAYLOAD_SIZE));
+
+    length = getTelemetryBatch(&events[i], 1, actual, TELEMETRY_PAYLOAD_SIZE);
+    compare("batch of one", actual, length, expected, referenceBatch(&events[i], 1, expected, TELEMETRY_PAYLOAD_SIZE));
+
+    if (i == 0)
+    {
+      continue;
+    }
+
+    size_t longer = appendTelemetryBatch(events[i], batch, batchLength, sizeof(batch));
+    if (longer > 0)
+    {
+      batchLength = longer;
+      continue;
+    }
+
+    // Full: the batch must be exactly what a single serialization of the same events gives
+    size_t count = i - batchStart;
+    compare("batch", batch, batchLength, expected, referenceBatch(&events[batchStart], count, expected, sizeof(expected)));
+    length = getTelemetryBatch(&events[batchStart], count, actual, sizeof(actual));
+    compare("rebuilt batch", actual, length, batch, batchLength);
+
+    batchStart = i;
+    batchLength = getTelemetryBatch(&events[i], 1, batch, sizeof(batch));
+  }
+}
+
+static void compareDecoded(const char *what, const char *payload, size_t length, const TelemetryEvent *expected, size_t count)
+{
+  uint16_t index = 0xffff;
+  std::vector<TelemetryEvent> decoded;
+  bool same = decodeTelemetryCbor(payload, length, index, decoded) && index == 42 && decoded.size() == count;
+  for (size_t i = 0; same && i < count; i++)
+  {
+    same = decoded[i].status == expected[i].status && decoded[i].heartbeat == expected[i].heartbeat
+           && decoded[i].timestamp == expected[i].timestamp && decoded[i].channel == expected[i].channel;
+  }
+
+  if (!same && mismatches++ < 5)
+  {
+    fprintf(stderr, "%s does not decode to what was encoded (%zu events, %zu bytes)\n", what, count, length);
+  }
+}
+
+// CBOR has no reference encoder to compare with; check that it decodes back to the events
+static void checkCborEvents(const std::vector<TelemetryEvent> &events)
+{
+  char payload[TELEMETRY_PAYLOAD_SIZE];
+  char batch[TELEMETRY_BATCH_MAX_SIZE + 1];
+  char rebuilt[TELEMETRY_BATCH_MAX_SIZE + 1];
+
+  for (const TelemetryEvent &event : events)
+  {
+    TelemetryEvent transition = {event.status, false, event.timestamp, event.channel, 0};
+    size_t length = getTelemetryData(event.status, event.timestamp, payload, sizeof(payload), event.channel);
+    compareDecoded("CBOR event", payload, length, &transition, 1);
+  }
+
+  for (size_t start = 0; start < events.size(); start += TELEMETRY_BATCH_MAX_EVENTS)
+  {
+    size_t count = std::min(events.size() - start, (size_t)TELEMETRY_BATCH_MAX_EVENTS);
+    size_t length = getTelemetryBatch(&events[start], 1, batch, sizeof(batch));
+    for (size_t i = 1; i < count && length > 0; i++)
+    {
+      length = appendTelemetryBatch(events[start + i], batch, length, sizeof(batch));
+    }
+
+    compareDecoded("CBOR batch", batch, length, &events[start], count);
+    compare("rebuilt CBOR batch", rebuilt, getTelemetryBatch(&events[start], count, rebuilt, sizeof(rebuilt)), batch, length);
+  }
+}
+
+// Summaries made up from the random events: JSON against ArduinoJson, both encodings decoded back
+static void checkSummaries(const std::vector<TelemetryEvent> &events, TelemetryEncoding summaryEncoding)
+{
+  char actual[TELEMETRY_SUMMARY_SIZE];
+  char expected[TELEMETRY_SUMMARY_SIZE];
+  std::mt19937 rng(events.size());
+  std::uniform_int_distribution<uint32_t> seconds(0, 86400);
+
+  for (size_t i = 0; i < events.size(); i++)
+  {
+    const TelemetryEvent &event = events[i];
+    TelemetrySummary summary = {i % 2 == 1, event.channel, (uint16_t)seconds(rng), (uint32_t)event.timestamp, seconds(rng), seconds(rng), {0}};
+    for (uint16_t &hour : summary.hourly)
+    {
+      hour = summary.daily ? (uint16_t)(seconds(rng) % 3601) : 0;
+    }
+
+    size_t length = getTelemetrySummary(summary, actual, sizeof(actual));
+    if (summaryEncoding == TELEMETRY_ENCODING_JSON)
+    {
+      compare("summary", actual, length, expected, referenceSummary(summary, expected, sizeof(expected)));
+    }
+
+    uint16_t index = 0xffff;
+    TelemetrySummary decoded;
+    bool same = decodeTelemetrySummary(actual, length, index, decoded) && index == (summaryEncoding == TELEMETRY_ENCODING_CBOR ? 42 : 0)
+                && decoded.daily == summary.daily && decoded.channel == summary.channel && decoded.sessions == summary.sessions
+                && decoded.start == summary.start && decoded.occupiedSeconds == summary.occupiedSeconds
+                && decoded.longestSeconds == summary.longestSeconds && memcmp(decoded.hourly, summary.hourly, sizeof(summary.hourly)) == 0;
+    if (!same && mismatches++ < 5)
+    {
+      fprintf(stderr, "summary does not decode to what was encoded (%zu bytes)\n", length);
+    }
+  }
+}
+
+// What the network task does per event: one payload, or one more entry in a batch.
+// Returns the heap allocations made; cost and size are per single-event payload.
+static unsigned long measureWriter(const std::vector<TelemetryEvent> &events, double &ns, double &bytes)
+{
+  char payload[TELEMETRY_PAYLOAD_SIZE];
+  char batch[TELEMETRY_BATCH_MAX_SIZE + 1];
+  size_t batchLength = getTelemetryBatch(&events[0], 1, batch, sizeof(batch));
+  size_t total = 0;
+
+  unsigned long allocationsBefore = allocCount();
+  auto start = std::chrono::steady_clock::now();
+  for (const TelemetryEvent &event : events)
+  {
+    total += getTelemetryData(event.status, event.timestamp, payload, sizeof(payload), event.channel);
+  }
+  ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / events.size();
+  bytes = (double)total / events.size();
+
+  for (const TelemetryEvent &event : events)
+  {
+    size_t longer = appendTelemetryBatch(event, batch, batchLength, sizeof(batch));
+    batchLength = longer > 0 ? longer : getTelemetryBatch(&event, 1, batch, sizeof(batch));
+  }
+  return allocCount() - allocationsBefore;
+}
+
+int runSerializerCheck(unsigned long count, unsigned int seed)
+{
+  setenv("TZ", "UTC0", 1); // What configTime(0, 0, ...) leaves the device with
+  tzset();
+
+  std::vector<TelemetryEvent> events = randomEvents(count < 8 ? 8 : count, seed);
+  const char *configuredId = deviceId;
+
+  telemetryConfigureEncoding(TELEMETRY_ENCODING_JSON, 0);
+  deviceId = "lab \"B1\"\\north\t#2";
+  checkEvents(events);
+  checkSummaries(events, TELEMETRY_ENCODING_JSON);
+  deviceId = configuredId;
+  checkEvents(events);
+  checkSummaries(events, TELEMETRY_ENCODING_JSON);
+
+  double jsonNs, jsonBytes;
+  unsigned long jsonAllocations = measureWriter(events, jsonNs, jsonBytes);
+
+  char payload[TELEMETRY_PAYLOAD_SIZE];
+  unsigned long allocationsBefore = allocCount();
+  auto start = std::chrono::steady_clock::now();
+  for (const TelemetryEvent &event : events)
+  {
+    referenceData(event.status, event.timestamp, event.channel, payload, sizeof(payload));
+  }
+  double referenceNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / events.size();
+  unsigned long referenceAllocations = allocCount() - allocationsBefore;
+
+  telemetryConfigureEncoding(TELEMETRY_ENCODING_CBOR, 42);
+  checkCborEvents(events);
+  checkSummaries(events, TELEMETRY_ENCODING_CBOR);
+
+  double cborNs, cborBytes;
+  unsigned long cborAllocations = measureWriter(events, cborNs, cborBytes);
+  telemetryConfigureEncoding(TELEMETRY_ENCODING_JSON, 0);
+
+  printf("serializer events    %zu (x2 device IDs), as many summaries per encoding\n", events.size());
+  printf("mismatches           %lu\n", mismatches);
+  printf(
+      "allocations/event    JSON %.3f, CBOR %.3f (ArduinoJson + strftime: %.3f)\n",
+      (double)jsonAllocations / events.size(),
+      (double)cborAllocations / events.size(),
+      (double)referenceAllocations / events.size());
+  printf("serialize cost/event JSON %.0f ns, CBOR %.0f ns (ArduinoJson + strftime: %.0f ns)\n", jsonNs, cborNs, referenceNs);
+  printf("payload size/event   JSON %.1f bytes, CBOR %.1f bytes\n", jsonBytes, cborBytes);
+
+  return mismatches == 0 && jsonAllocations == 0 && cborAllocations == 0 ? 0 : 1;
+}
@@ -0,0 +1,19 @@
+#ifndef SERIALIZERCHECK_H
+#define SERIALIZERCHECK_H
+
+#include "Telemetry.h"
+#include <vector>
+
+// Compares the hand-written telemetry serializer (Telemetry.cpp) with ArduinoJson on random
+// events and counts the heap allocations it makes. Returns the process exit code.
+int runSerializerCheck(unsigned long events, unsigned int seed);
+
+// Host-side decoder of TELEMETRY_ENCODING_CBOR payloads (web-app/telemetry-decoder.js is the
+// one for the backend). Appends the events to `events`, false if the payload is malformed.
+bool decodeTelemetryCbor(const char *payload, size_t length, uint16_t &deviceIndex, std::vector<TelemetryEvent> &events);
+
+// Either encoding of a getTelemetrySummary() payload, in the encoding configured now. false if
+// the payload is not a summary (an event or a batch) or malformed.
+bool decodeTelemetrySummary(const char *payload, size_t length, uint16_t &deviceIndex, TelemetrySummary &summary);
+
+#endif // SERIALIZERCHECK_H
@@ -0,0 +1,93 @@
+// Local HTTPS stand-in for the Azure Function, to measure what the device's keep-alive buys.
+// Answers every POST with 200 and decodes the body like the function would, and per TLS
+// connection counts the requests served and whether the session was resumed.
+//
+//   openssl req -x509 -newkey rsa:2048 -nodes -subj /CN=localhost -keyout key.pem -out cert.pem
+//   node function-standin.js --key key.pem --cert cert.pem [--port 8443] [--keep-alive-timeout 60]
+//
+// then point functionUrl in secrets.h at https://<this machine>:8443/api/SendTelemetry.
+// Ctrl+C (or SIGTERM) prints the summary.
+//
+// --plain true serves plain HTTP instead, without key and certificate, for the host fleet
+// simulator (.pio/build/native/program --fleet N --transport http --http-server localhost:8443).
+
+const fs = require('fs');
+const http = require('http');
+const https = require('https');
+const { decodeTelemetry } = require('./telemetry-decoder');
+
+function parseArgs(argv) {
+    const options = { key: 'key.pem', cert: 'cert.pem', port: 8443, keepAliveTimeout: 60, plain: false };
+    for (let i = 2; i < argv.length; i += 2) {
+        const name = argv[i].replace(/^--/, '').replace(/-([a-z])/g, (_, c) => c.toUpperCase());
+        if (!(name in options) || i + 1 >= argv.length) {
+            console.error(`Unknown or incomplete option ${argv[i]}`);
+            process.exit(2);
+        }
+        const value = argv[i + 1];
+        options[name] = typeof options[name] === 'number' ? Number(value)
+            : typeof options[name] === 'boolean' ? value === 'true' : value;
+    }
+    return options;
+}
+
+const options = parseArgs(process.argv);
+const totals = { connections: 0, resumed: 0, requests: 0, events: 0, summaries: 0, errors: 0 };
+
+function handleRequest(req, res) {
+    const chunks = [];
+    req.on('data', chunk => chunks.push(chunk));
+    req.on('end', () => {
+        req.socket.requests++;
+        totals.requests++;
+
+        try {
+            const telemetry = decodeTelemetry(Buffer.concat(chunks), req.headers['content-type']);
+            totals.events += telemetry.events.length;
+            totals.summaries += telemetry.summaries.length;
+            res.writeHead(200, { 'Content-Type': 'text/plain' });
+            res.end(`Stored ${telemetry.events.length} event(s), ${telemetry.summaries.length} summary(ies)`);
+        } catch (err) {
+            totals.errors++;
+            res.writeHead(400, { 'Content-Type': 'text/plain' });
+            res.end(err.message);
+        }
+    });
+}
+
+const server = options.plain ? http.createServer(handleRequest) : https.createServer({
+    key: fs.readFileSync(options.key),
+    cert: fs.readFileSync(options.cert)
+}, handleRequest);
+
+// Node keeps HTTP/1.1 connections open and issues TLS session tickets by default; the idle
+// timeout decides how long the device can keep using one connection between events.
+server.keepAliveTimeout = options.keepAliveTimeout * 1000;
+
+server.on(options.plain ? 'connection' : 'secureConnection', socket => {
+    const resumed = !options.plain && socket.isSessionReused();
+    const opened = Date.now();
+    const address = socket.remoteAddress;
+    socket.requests = 0;
+    totals.connections++;
+    totals.resumed += resumed ? 1 : 0;
+
+    socket.on('close', () => {
+        console.log(`${address}: ${socket.requests} request(s) on one connection, ` +
+            `${resumed ? 'resumed' : 'full'} handshake, open ${((Date.now() - opened) / 1000).toFixed(1)} s`);
+    });
+});
+
+server.listen(options.port, () => {
+    console.log(`Azure Function stand-in listening on ${options.plain ? 'http' : 'https'}://localhost:${options.port}`);
+});
+
+function printSummary() {
+    const perConnection = totals.connections ? (totals.requests / totals.connections).toFixed(1) : '0';
+    console.log(`\n${totals.requests} requests (${totals.events} events, ${totals.summaries} summaries, ${totals.errors} rejected) over ` +
+        `${totals.connections} ${options.plain ? 'plain' : 'TLS'} connections, ${totals.resumed} resumed; ${perConnection} requests per handshake`);
+    process.exit(0);
+}
+
+process.on('SIGINT', printSummary);
+process.on('SIGTERM', printSummary);
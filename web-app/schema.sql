@@ -0,0 +1,324 @@
+-- Azure SQL schema for the occupancy telemetry.
+--
+-- Telemetry keeps every transition as it arrived. The ingestion function records each one with
+-- RecordTransition, which also keeps the derived tables up to date in the same transaction:
+--
+--   RoomState           where each room (DeviceID, Channel) stands, and its lifetime session totals;
+--                       Version changes with every update, so the API reads only the rooms that did
+--   OccupancySession    one row per occupied period, EndTime NULL while it lasts
+--   OccupancyHourly     sessions started and occupied seconds per room and hour
+--   OccupancyDaily      the same per room and day, plus the sessions that ended that day
+--   OccupancyHourOfDay  sessions started per room and hour of the day (0-23), over all time
+--
+-- OccupancySummary keeps the hour and day summaries that devices with on-device aggregation
+-- send, stored with RecordSummary. Where a room has them, the API reads them instead of the
+-- rollups: the device counts occupied time as it passes, the rollups only once a session ends.
+--
+-- Room, filled by hand, puts rooms in buildings. The derived tables are keyed by room first and
+-- Telemetry is indexed on (DeviceID, Timestamp), so the API's per-device and per-building
+-- queries seek instead of scanning.
+--
+-- A transition costs a few index seeks, and a session adds one row per hour it spans, so the
+-- dashboard reads stay the same size however long the history gets. Occupied time counts once
+-- a session has ended. Timestamps are stored as the device sends them (UTC + 1 h), and hours and
+-- days follow them, as on the device.
+--
+-- The script can be run again: it creates only what is missing. The last batch fills the
+-- derived tables from the Telemetry rows stored before them.
+
+IF OBJECT_ID('Telemetry') IS NULL
+    CREATE TABLE Telemetry (
+        ID INT IDENTITY(1,1),
+        DeviceID NVARCHAR(64) NOT NULL,
+        Channel TINYINT NOT NULL DEFAULT 0,
+        Status BIT,
+        Timestamp DATETIME,
+        PRIMARY KEY (ID)
+    );
+GO
+
+IF COL_LENGTH('Telemetry', 'DeviceID') IS NULL
+    ALTER TABLE Telemetry ADD DeviceID NVARCHAR(64) NOT NULL DEFAULT '';
+IF COL_LENGTH('Telemetry', 'Channel') IS NULL
+    ALTER TABLE Telemetry ADD Channel TINYINT NOT NULL DEFAULT 0;
+GO
+
+-- A device's history in time order, for the export API and the backfill below
+IF NOT EXISTS (SELECT 1 FROM sys.indexes WHERE name = 'IX_Telemetry_Device')
+    CREATE INDEX IX_Telemetry_Device ON Telemetry (DeviceID, Timestamp) INCLUDE (Channel, Status);
+
+-- Which building each room is in, for the per-building API; filled by hand, e.g.
+-- INSERT INTO Room (DeviceID, Channel, Building, Name) VALUES ('ESP32-001', 0, 'FOI-1', 'D1')
+IF OBJECT_ID('Room') IS NULL
+BEGIN
+    CREATE TABLE Room (
+        DeviceID NVARCHAR(64) NOT NULL,
+        Channel TINYINT NOT NULL DEFAULT 0,
+        Building NVARCHAR(64) NOT NULL,
+        Name NVARCHAR(128) NULL,
+        PRIMARY KEY (DeviceID, Channel)
+    );
+    CREATE INDEX IX_Room_Building ON Room (Building);
+END
+GO
+
+IF OBJECT_ID('RoomState') IS NULL
+    CREATE TABLE RoomState (
+        DeviceID NVARCHAR(64) NOT NULL,
+        Channel TINYINT NOT NULL,
+        Status BIT NOT NULL,
+        Since DATETIME NOT NULL,           -- Time of the last transition
+        OpenSessionID INT NULL,            -- The OccupancySession in progress while occupied
+        SessionCount INT NOT NULL DEFAULT 0,
+        SessionSeconds BIGINT NOT NULL DEFAULT 0, -- Total length of the ended sessions
+        Version ROWVERSION,                -- For the API's status cache to read only what changed
+        PRIMARY KEY (DeviceID, Channel)
+    );
+GO
+
+IF COL_LENGTH('RoomState', 'Version') IS NULL
+    ALTER TABLE RoomState ADD Version ROWVERSION;
+GO
+
+IF NOT EXISTS (SELECT 1 FROM sys.indexes WHERE name = 'IX_RoomState_Version')
+    CREATE INDEX IX_RoomState_Version ON RoomState (Version);
+GO
+
+IF OBJECT_ID('OccupancySession') IS NULL
+BEGIN
+    CREATE TABLE OccupancySession (
+        ID INT IDENTITY(1,1),
+        DeviceID NVARCHAR(64) NOT NULL,
+        Channel TINYINT NOT NULL,
+        StartTime DATETIME NOT NULL,
+        EndTime DATETIME NULL,
+        PRIMARY KEY (ID)
+    );
+    CREATE INDEX IX_OccupancySession_Room ON OccupancySession (DeviceID, Channel, StartTime);
+    CREATE INDEX IX_OccupancySession_Start ON OccupancySession (StartTime);
+END
+
+IF OBJECT_ID('OccupancyHourly') IS NULL
+BEGIN
+    CREATE TABLE OccupancyHourly (
+        DeviceID NVARCHAR(64) NOT NULL,
+        Channel TINYINT NOT NULL,
+        HourStart DATETIME NOT NULL,
+        Sessions INT NOT NULL DEFAULT 0,   -- Started in the hour
+        OccupiedSeconds INT NOT NULL DEFAULT 0,
+        PRIMARY KEY (DeviceID, Channel, HourStart)
+    );
+    CREATE INDEX IX_OccupancyHourly_Hour ON OccupancyHourly (HourStart) INCLUDE (Sessions, OccupiedSeconds);
+END
+
+IF OBJECT_ID('OccupancyDaily') IS NULL
+BEGIN
+    CREATE TABLE OccupancyDaily (
+        DeviceID NVARCHAR(64) NOT NULL,
+        Channel TINYINT NOT NULL,
+        Day DATE NOT NULL,
+        Sessions INT NOT NULL DEFAULT 0,   -- Started in the day
+        OccupiedSeconds INT NOT NULL DEFAULT 0,
+        EndedSessions INT NOT NULL DEFAULT 0,
+        EndedSeconds BIGINT NOT NULL DEFAULT 0, -- Total length of the sessions that ended in the day
+        PRIMARY KEY (DeviceID, Channel, Day)
+    );
+    CREATE INDEX IX_OccupancyDaily_Day ON OccupancyDaily (Day) INCLUDE (Sessions, OccupiedSeconds);
+END
+
+IF OBJECT_ID('OccupancyHourOfDay') IS NULL
+    CREATE TABLE OccupancyHourOfDay (
+        DeviceID NVARCHAR(64) NOT NULL,
+        Channel TINYINT NOT NULL,
+        Hour TINYINT NOT NULL,
+        Sessions INT NOT NULL DEFAULT 0,
+        PRIMARY KEY (DeviceID, Channel, Hour)
+    );
+GO
+
+IF OBJECT_ID('OccupancySummary') IS NULL
+BEGIN
+    CREATE TABLE OccupancySummary (
+        DeviceID NVARCHAR(64) NOT NULL,
+        Channel TINYINT NOT NULL,
+        Daily BIT NOT NULL,                -- 0 = an hour, 1 = a day
+        Start DATETIME NOT NULL,           -- First second of the period, as the device sends it
+        Sessions INT NOT NULL,             -- Started in the period
+        OccupiedSeconds INT NOT NULL,
+        LongestSeconds INT NOT NULL,       -- Longest session that ended in the period
+        Hourly NVARCHAR(400) NULL,         -- Days only: the JSON array of occupied seconds per hour
+        PRIMARY KEY (DeviceID, Channel, Daily, Start)
+    );
+    CREATE INDEX IX_OccupancySummary_Start ON OccupancySummary (Daily, Start) INCLUDE (Sessions, OccupiedSeconds);
+END
+GO
+
+-- Adds one transition of a room to the derived tables, without storing it in Telemetry.
+-- A transition to the status the room is already in (a retried or duplicated message) and one
+-- older than the room's last transition change nothing.
+CREATE OR ALTER PROCEDURE ApplyTransition
+    @DeviceID NVARCHAR(64),
+    @Channel TINYINT,
+    @Status BIT,
+    @Timestamp DATETIME
+AS
+BEGIN
+    SET NOCOUNT ON;
+    SET XACT_ABORT ON;
+    BEGIN TRANSACTION;
+
+    DECLARE @current BIT, @since DATETIME, @sessionID INT;
+    SELECT @current = Status, @since = Since, @sessionID = OpenSessionID
+    FROM RoomState WITH (UPDLOCK, HOLDLOCK)
+    WHERE DeviceID = @DeviceID AND Channel = @Channel;
+
+    IF @current IS NULL
+    BEGIN
+        INSERT INTO RoomState (DeviceID, Channel, Status, Since) VALUES (@DeviceID, @Channel, 0, @Timestamp);
+        SELECT @current = 0, @since = @Timestamp;
+    END
+
+    IF @Status = @current OR @Timestamp < @since
+    BEGIN
+        COMMIT;
+        RETURN;
+    END
+
+    DECLARE @hour DATETIME = DATEADD(HOUR, DATEDIFF(HOUR, 0, @Timestamp), 0);
+    DECLARE @day DATE = CAST(@Timestamp AS DATE);
+
+    IF @Status = 1
+    BEGIN
+        INSERT INTO OccupancySession (DeviceID, Channel, StartTime) VALUES (@DeviceID, @Channel, @Timestamp);
+        SET @sessionID = SCOPE_IDENTITY();
+
+        UPDATE OccupancyHourly SET Sessions = Sessions + 1
+        WHERE DeviceID = @DeviceID AND Channel = @Channel AND HourStart = @hour;
+        IF @@ROWCOUNT = 0
+            INSERT INTO OccupancyHourly (DeviceID, Channel, HourStart, Sessions) VALUES (@DeviceID, @Channel, @hour, 1);
+
+        UPDATE OccupancyDaily SET Sessions = Sessions + 1
+        WHERE DeviceID = @DeviceID AND Channel = @Channel AND Day = @day;
+        IF @@ROWCOUNT = 0
+            INSERT INTO OccupancyDaily (DeviceID, Channel, Day, Sessions) VALUES (@DeviceID, @Channel, @day, 1);
+
+        UPDATE OccupancyHourOfDay SET Sessions = Sessions + 1
+        WHERE DeviceID = @DeviceID AND Channel = @Channel AND Hour = DATEPART(HOUR, @Timestamp);
+        IF @@ROWCOUNT = 0
+            INSERT INTO OccupancyHourOfDay (DeviceID, Channel, Hour, Sessions)
+            VALUES (@DeviceID, @Channel, DATEPART(HOUR, @Timestamp), 1);
+
+        UPDATE RoomState SET Status = 1, Since = @Timestamp, OpenSessionID = @sessionID
+        WHERE DeviceID = @DeviceID AND Channel = @Channel;
+    END
+    ELSE
+    BEGIN
+        DECLARE @seconds INT = DATEDIFF(SECOND, @since, @Timestamp);
+        UPDATE OccupancySession SET EndTime = @Timestamp WHERE ID = @sessionID;
+
+        -- The occupied time goes to every hour and day the session touched
+        DECLARE @from DATETIME = @since, @to DATETIME, @slice INT;
+        WHILE @from < @Timestamp
+        BEGIN
+            SET @hour = DATEADD(HOUR, DATEDIFF(HOUR, 0, @from), 0);
+            SET @to = DATEADD(HOUR, 1, @hour);
+            IF @to > @Timestamp
+                SET @to = @Timestamp;
+            SET @slice = DATEDIFF(SECOND, @from, @to);
+            SET @day = CAST(@hour AS DATE);
+
+            UPDATE OccupancyHourly SET OccupiedSeconds = OccupiedSeconds + @slice
+            WHERE DeviceID = @DeviceID AND Channel = @Channel AND HourStart = @hour;
+            IF @@ROWCOUNT = 0
+                INSERT INTO OccupancyHourly (DeviceID, Channel, HourStart, OccupiedSeconds)
+                VALUES (@DeviceID, @Channel, @hour, @slice);
+
+            UPDATE OccupancyDaily SET OccupiedSeconds = OccupiedSeconds + @slice
+            WHERE DeviceID = @DeviceID AND Channel = @Channel AND Day = @day;
+            IF @@ROWCOUNT = 0
+                INSERT INTO OccupancyDaily (DeviceID, Channel, Day, OccupiedSeconds) VALUES (@DeviceID, @Channel, @day, @slice);
+
+            SET @from = @to;
+        END
+
+        SET @day = CAST(@Timestamp AS DATE);
+        UPDATE OccupancyDaily SET EndedSessions = EndedSessions + 1, EndedSeconds = EndedSeconds + @seconds
+        WHERE DeviceID = @DeviceID AND Channel = @Channel AND Day = @day;
+        IF @@ROWCOUNT = 0
+            INSERT INTO OccupancyDaily (DeviceID, Channel, Day, EndedSessions, EndedSeconds)
+            VALUES (@DeviceID, @Channel, @day, 1, @seconds);
+
+        UPDATE RoomState
+        SET Status = 0, Since = @Timestamp, OpenSessionID = NULL,
+            SessionCount = SessionCount + 1, SessionSeconds = SessionSeconds + @seconds
+        WHERE DeviceID = @DeviceID AND Channel = @Channel;
+    END
+
+    COMMIT;
+END
+GO
+
+-- Stores one transition and updates the derived tables, all or nothing. The ingestion function
+-- calls it once per event that is not a heartbeat, in the order of the message.
+CREATE OR ALTER PROCEDURE RecordTransition
+    @DeviceID NVARCHAR(64),
+    @Channel TINYINT,
+    @Status BIT,
+    @Timestamp DATETIME
+AS
+BEGIN
+    SET NOCOUNT ON;
+    SET XACT_ABORT ON;
+    BEGIN TRANSACTION;
+    INSERT INTO Telemetry (DeviceID, Channel, Status, Timestamp) VALUES (@DeviceID, @Channel, @Status, @Timestamp);
+    EXEC ApplyTransition @DeviceID, @Channel, @Status, @Timestamp;
+    COMMIT;
+END
+GO
+
+-- Stores one summary; one sent again (its delivery was not confirmed) replaces the first copy
+CREATE OR ALTER PROCEDURE RecordSummary
+    @DeviceID NVARCHAR(64),
+    @Channel TINYINT,
+    @Daily BIT,
+    @Start DATETIME,
+    @Sessions INT,
+    @OccupiedSeconds INT,
+    @LongestSeconds INT,
+    @Hourly NVARCHAR(400)
+AS
+BEGIN
+    SET NOCOUNT ON;
+    SET XACT_ABORT ON;
+    BEGIN TRANSACTION;
+    UPDATE OccupancySummary WITH (UPDLOCK, HOLDLOCK)
+    SET Sessions = @Sessions, OccupiedSeconds = @OccupiedSeconds, LongestSeconds = @LongestSeconds, Hourly = @Hourly
+    WHERE DeviceID = @DeviceID AND Channel = @Channel AND Daily = @Daily AND Start = @Start;
+    IF @@ROWCOUNT = 0
+        INSERT INTO OccupancySummary (DeviceID, Channel, Daily, Start, Sessions, OccupiedSeconds, LongestSeconds, Hourly)
+        VALUES (@DeviceID, @Channel, @Daily, @Start, @Sessions, @OccupiedSeconds, @LongestSeconds, @Hourly);
+    COMMIT;
+END
+GO
+
+-- Backfill: the transitions stored before the derived tables existed, room by room in order.
+-- Runs only while RoomState is empty.
+IF NOT EXISTS (SELECT 1 FROM RoomState)
+BEGIN
+    DECLARE @DeviceID NVARCHAR(64), @Channel TINYINT, @Status BIT, @Timestamp DATETIME;
+    DECLARE transitions CURSOR LOCAL FAST_FORWARD FOR
+        SELECT DeviceID, Channel, Status, Timestamp
+        FROM Telemetry
+        WHERE Status IS NOT NULL AND Timestamp IS NOT NULL
+        ORDER BY DeviceID, Channel, Timestamp, ID;
+    OPEN transitions;
+    FETCH NEXT FROM transitions INTO @DeviceID, @Channel, @Status, @Timestamp;
+    WHILE @@FETCH_STATUS = 0
+    BEGIN
+        EXEC ApplyTransition @DeviceID, @Channel, @Status, @Timestamp;
+        FETCH NEXT FROM transitions INTO @DeviceID, @Channel, @Status, @Timestamp;
+    END
+    CLOSE transitions;
+    DEALLOCATE transitions;
+END
+GO
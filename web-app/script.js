@@ -1,70 +1,87 @@
+// Status of the room, how long it has been occupied (occupiedSince, a Date, null when it is
+// free) and the average occupancy duration in seconds (null when unknown)
+function renderRoomStatus(occupied, occupiedSince, averageSeconds) {
+    const statusBox = document.getElementById("status-box");
+    const averageOccupancyDurationBox = document.getElementById("average-occupancy-duration");
+    const occupancyDurationBox = document.getElementById("occupancy-duration");
+
+    if (statusBox) {
+        if (occupied) {
+            statusBox.innerHTML = 'Current status: <strong style="color: red;">Occupied</strong>';
+            statusBox.style.backgroundColor = "rgba(248, 215, 218, 1)";
+            statusBox.style.borderColor = "rgb(231, 130, 140)";
+
+            if (occupiedSince) {
+                const currentTime = new Date();
+                console.log("Last Occupied (UTC):", occupiedSince.toISOString());
+                console.log("Current Time (Local):", currentTime.toISOString());
+                const timeDifference = currentTime - occupiedSince;
+
+                const minutesOccupied = Math.floor(timeDifference / (1000 * 60));
+                occupancyDurationBox.innerText = `Room has been occupied for: ${minutesOccupied} min`;
+
+                if (timeDifference / (1000 * 60 * 60) >= 5 && !popupShown) {
+                    popupShown = true;
+                    document.getElementById("popup").style.display = "flex";
+                }
+            } else {
+                occupancyDurationBox.innerText = `Error calculating occupancy duration.`;
+            }
+        } else {
+            statusBox.innerHTML = 'Current status: <strong style="color: green;">Available</strong>';
+            statusBox.style.backgroundColor = "rgba(212, 237, 218, 1)";
+            statusBox.style.borderColor = "rgb(156, 212, 169)";
+            occupancyDurationBox.innerText = "";
+        }
+    }
+
+    if (averageOccupancyDurationBox) {
+        if (averageSeconds) {
+            const avgTimeMinutes = Math.round(averageSeconds / 60);
+            averageOccupancyDurationBox.innerText = `Average Occupancy Duration: ${avgTimeMinutes} min`;
+        } else {
+            averageOccupancyDurationBox.innerText = `Average Occupancy Duration: N/A`;
+        }
+    }
+}
+
+let popupShown = false; // The 5-hour warning, once per page
+
+function setupPopup() {
+    const popup = document.getElementById("popup");
+    const closePopup = document.querySelector(".close-btn");
+
+    closePopup.addEventListener("click", function () {
+        popup.style.display = "none";
+    });
+
+    window.addEventListener("click", function (event) {
+        if (event.target === popup) {
+            popup.style.display = "none";
+        }
+    });
+}
+
+// Without server-sent events: the state when the page loads, from three queries
 async function fetchRoomStatus() {
     try {
         const response = await fetch('/api/last-status');
         const data = await response.json();
 
-        const statusBox = document.getElementById("status-box");
-        const averageOccupancyDurationBox = document.getElementById("average-occupancy-duration");
-        const occupancyDurationBox = document.getElementById("occupancy-duration");
-
-        if (statusBox) {
-            if (data.occupied) {
-                statusBox.innerHTML = 'Current status: <strong style="color: red;">Occupied</strong>';
-                statusBox.style.backgroundColor = "rgba(248, 215, 218, 1)";
-                statusBox.style.borderColor = "rgb(231, 130, 140)";
-
-                const occupiedTimeResponse = await fetch('/api/last-occupied-time');
-                const occupiedTimeData = await occupiedTimeResponse.json();
-                
-                if (occupiedTimeData.lastOccupiedTime) {
-                    const lastOccupiedTime = new Date(occupiedTimeData.lastOccupiedTime);
-                    const currentTime = new Date();
-                    console.log("Last Occupied (UTC):", lastOccupiedTime.toISOString());
-                    console.log("Current Time (Local):", currentTime.toISOString());
-                    const timeDifference = currentTime - lastOccupiedTime;
-                    
-                    const minutesOccupied = Math.floor(timeDifference / (1000 * 60));
-                    occupancyDurationBox.innerText = `Room has been occupied for: ${minutesOccupied} min`;
-                    
-                    if (timeDifference / (1000 * 60 * 60) >= 5) { 
-                        const popup = document.getElementById("popup");
-                        const closePopup = document.querySelector(".close-btn");
-                        popup.style.display = "flex";
-                    
-                        closePopup.addEventListener("click", function () {
-                            popup.style.display = "none";
-                        });
-                    
-                        window.addEventListener("click", function (event) {
-                            if (event.target === popup) {
-                                popup.style.display = "none";
-                            }
-                        });
-                    }
-                } else {
-                    occupancyDurationBox.innerText = `Error calculating occupancy duration.`;
-                }
-            } else {
-                statusBox.innerHTML = 'Current status: <strong style="color: green;">Available</strong>';
-                statusBox.style.backgroundColor = "rgba(212, 237, 218, 1)";
-                statusBox.style.borderColor = "rgb(156, 212, 169)";
-                occupancyDurationBox.innerText = "";
-            }
+        let occupiedSince = null;
+        if (data.occupied) {
+            const occupiedTimeResponse = await fetch('/api/last-occupied-time');
+            const occupiedTimeData = await occupiedTimeResponse.json();
+            occupiedSince = occupiedTimeData.lastOccupiedTime ? new Date(occupiedTimeData.lastOccupiedTime) : null;
         }
 
         const averageOccupancyResponse = await fetch('/api/average-occupancy');
         const averageOccupancyData = await averageOccupancyResponse.json();
 
-        if (averageOccupancyDurationBox) {
-            if (averageOccupancyData.avg_time_seconds) {
-                const avgTimeMinutes = Math.round(averageOccupancyData.avg_time_seconds / 60);
-                averageOccupancyDurationBox.innerText = `Average Occupancy Duration: ${avgTimeMinutes} min`;
-            } else {
-                averageOccupancyDurationBox.innerText = `Average Occupancy Duration: N/A`;
-            }
-        }
+        renderRoomStatus(data.occupied, occupiedSince, averageOccupancyData.avg_time_seconds);
     } catch (error) {
         console.error("Error fetching room status:", error);
+        const statusBox = document.getElementById("status-box");
         if (statusBox) {
             statusBox.innerHTML = "Error loading status.";
             statusBox.style.backgroundColor = "rgba(255, 255, 0, 0.2)";
@@ -72,6 +89,42 @@ async function fetchRoomStatus() {
     }
 }
 
+// Live status: the server sends every room once, then each room that changes status. The page
+// shows the room with the latest transition, as /api/last-status does.
+function watchRoomStatus() {
+    const rooms = new Map();
+    let averageSeconds = null;
+
+    function show() {
+        let latest = null;
+        rooms.forEach(room => {
+            if (!latest || room.since > latest.since) {
+                latest = room;
+            }
+        });
+        // Times are stored in the device's local time; read them as local, like /api/last-occupied-time
+        const occupiedSince = latest?.occupied ? new Date(latest.since.slice(0, 19)) : null;
+        renderRoomStatus(latest?.occupied ?? false, occupiedSince, averageSeconds);
+    }
+
+    const source = new EventSource('/api/status-stream');
+    source.addEventListener("snapshot", event => {
+        const data = JSON.parse(event.data);
+        rooms.clear();
+        data.rooms.forEach(room => rooms.set(room.room, room));
+        averageSeconds = data.averageSeconds;
+        show();
+    });
+    source.addEventListener("room", event => {
+        const room = JSON.parse(event.data);
+        rooms.set(room.room, room);
+        averageSeconds = room.averageSeconds;
+        show();
+    });
+
+    setInterval(show, 60 * 1000); // The minutes occupied count on between messages
+}
+
 let peakTimeChart;
 
 async function fetchPeakTime() {
@@ -172,7 +225,12 @@ async function fetchDailySummary() {
 
 window.onload = function () {
     if (document.getElementById("status-box")) {
-        fetchRoomStatus();
+        setupPopup();
+        if (window.EventSource) {
+            watchRoomStatus();
+        } else {
+            fetchRoomStatus();
+        }
     }
     if (document.getElementById("peak-time-chart")) {
         fetchPeakTime();
@@ -1,9 +1,16 @@
 require('dotenv').config();
 
+const crypto = require('crypto');
 const express = require('express');
 const sql = require('mssql');
+const { createStatusCache } = require('./status-cache');
+const { decodeTelemetry, roomId } = require('./telemetry-decoder');
 const server = express();
 const port = 4000;
+const statusPollMs = Number(process.env.STATUS_POLL_MS) || 1000;
+const statusKeepAliveMs = 30000;
+const historyPageDefault = 500;
+const historyPageMax = 5000;
 
 const dbConfig = {
     user: process.env.DB_USER,
@@ -27,14 +34,213 @@ const poolPromise = new sql.ConnectionPool(dbConfig)
         process.exit(1); // Ako se ne uspije povezati, zaustavi aplikaciju
     });
 
+// Room status for every dashboard from memory (status-cache.js): one RoomState query per
+// statusPollMs in all, plus the messages the ingestion function forwards to /api/ingest
+const statusCache = createStatusCache();
+
+async function pollRoomState() {
+    try {
+        await statusCache.refresh(await poolPromise);
+    } catch (error) {
+        console.error("Error refreshing room state:", error);
+    }
+    setTimeout(pollRoomState, statusPollMs);
+}
+pollRoomState();
+
+function validIngestKey(key) {
+    const expected = process.env.INGEST_KEY;
+    return Boolean(expected) && typeof key === 'string' && key.length === expected.length
+        && crypto.timingSafeEqual(Buffer.from(key), Buffer.from(expected));
+}
+
+// The device message as stored, with its Content-Type and the X-Ingest-Key header set to
+// INGEST_KEY (off without it). Before the body parsers below, which would turn JSON into objects.
+server.post('/api/ingest', express.raw({ type: () => true, limit: '16kb' }), (req, res) => {
+    if (!validIngestKey(req.get('X-Ingest-Key'))) {
+        return res.status(403).json({ error: 'Invalid ingest key' });
+    }
+
+    try {
+        statusCache.applyTelemetry(decodeTelemetry(req.body, req.get('Content-Type')));
+        res.status(204).end();
+    } catch (error) {
+        res.status(400).json({ error: 'Invalid telemetry', details: error.message });
+    }
+});
+
 server.use(express.urlencoded({ extended: true }));
 server.use(express.json());
 server.use(express.static(__dirname));
 
+// The rooms a request is about, as conditions on the DeviceID and Channel columns of table:
+// ?device=ID (every channel of that board, or only ?channel=N), ?building=NAME (the rooms the
+// Room table puts there), or every room without either. Answers 400 and returns null if a
+// parameter is invalid.
+function roomConditions(req, res, request, table) {
+    const { device, channel, building } = req.query;
+    const conditions = [];
+    if ([device, channel, building].some(value => value !== undefined && typeof value !== 'string')) {
+        res.status(400).json({ error: "device, channel and building can be given once each" });
+        return null;
+    }
+
+    if (device !== undefined) {
+        request.input('device', sql.NVarChar(64), device);
+        conditions.push(`${table}.DeviceID = @device`);
+    }
+    if (channel !== undefined) {
+        const number = Number(channel);
+        if (device === undefined || !/^\d+$/.test(channel) || number > 255) {
+            res.status(400).json({ error: "channel must be 0-255 and needs device" });
+            return null;
+        }
+        request.input('channel', sql.TinyInt, number);
+        conditions.push(`${table}.Channel = @channel`);
+    }
+    if (building !== undefined) {
+        request.input('building', sql.NVarChar(64), building);
+        conditions.push(`EXISTS (SELECT 1 FROM Room WHERE Room.DeviceID = ${table}.DeviceID `
+            + `AND Room.Channel = ${table}.Channel AND Room.Building = @building)`);
+    }
+    return conditions;
+}
+
+function whereClause(conditions) {
+    return conditions.length ? `WHERE ${conditions.join(' AND ')}` : '';
+}
+
+// Every room as it is now, in one query: ?device= and ?building= narrow it down
+server.get('/api/rooms', async (req, res) => {
+    try {
+        const pool = await poolPromise;
+        const request = pool.request();
+        const conditions = roomConditions(req, res, request, 'RoomState');
+        if (!conditions) {
+            return;
+        }
+
+        const result = await request.query(`
+            SELECT RoomState.DeviceID, RoomState.Channel, Room.Building, Room.Name, RoomState.Status,
+                CONVERT(VARCHAR, RoomState.Since, 126) AS Since, RoomState.SessionCount,
+                CAST(RoomState.SessionSeconds / NULLIF(RoomState.SessionCount, 0) AS INT) AS AvgTimeSeconds
+            FROM RoomState
+            LEFT JOIN Room ON Room.DeviceID = RoomState.DeviceID AND Room.Channel = RoomState.Channel
+            ${whereClause(conditions)}
+            ORDER BY RoomState.DeviceID, RoomState.Channel
+        `);
+
+        res.json(result.recordset.map(row => ({
+            room: roomId(row.DeviceID, row.Channel),
+            deviceId: row.DeviceID,
+            channel: row.Channel,
+            building: row.Building,
+            name: row.Name,
+            occupied: row.Status,
+            since: row.Since,
+            sessions: row.SessionCount,
+            avg_time_seconds: row.AvgTimeSeconds
+        })));
+    } catch (error) {
+        console.error("Error fetching rooms:", error);
+        res.status(500).json({
+            error: 'Error fetching rooms',
+            details: error.message
+        });
+    }
+});
+
+// A device's transitions in time order, a page at a time: ?device=ID (required), ?channel=N,
+// ?from= and ?to= (timestamps as stored, to exclusive), ?limit= rows per page. Each page
+// ends with the cursor for the next one (null after the last); pass it back as ?cursor=.
+server.get('/api/history', async (req, res) => {
+    const { from, to, cursor } = req.query;
+    const limit = req.query.limit === undefined ? historyPageDefault : Number(req.query.limit);
+    if (typeof req.query.device !== 'string') {
+        return res.status(400).json({ error: "device parameter is required" });
+    }
+    if (!Number.isInteger(limit) || limit < 1 || limit > historyPageMax) {
+        return res.status(400).json({ error: `limit must be 1-${historyPageMax}` });
+    }
+
+    try {
+        const pool = await poolPromise;
+        const request = pool.request();
+        const conditions = roomConditions(req, res, request, 'Telemetry');
+        if (!conditions) {
+            return;
+        }
+        conditions.push('Telemetry.Timestamp IS NOT NULL');
+
+        const times = { from, to };
+        for (const name of Object.keys(times)) {
+            if (times[name] === undefined) {
+                continue;
+            }
+            const time = new Date(times[name]);
+            if (typeof times[name] !== 'string' || isNaN(time)) {
+                return res.status(400).json({ error: `${name} must be a date or timestamp` });
+            }
+            request.input(name, sql.DateTime, time);
+            conditions.push(`Telemetry.Timestamp ${name === 'from' ? '>=' : '<'} @${name}`);
+        }
+
+        if (cursor !== undefined) {
+            // The last row of the previous page: its Timestamp and ID, the order of the index
+            let after;
+            try {
+                after = JSON.parse(Buffer.from(String(cursor), 'base64url').toString('utf8'));
+            } catch (error) {
+                after = null;
+            }
+            if (!Array.isArray(after) || isNaN(new Date(after[0])) || !Number.isInteger(after[1])) {
+                return res.status(400).json({ error: "Invalid cursor" });
+            }
+            request.input('afterTime', sql.DateTime, new Date(after[0]));
+            request.input('afterId', sql.Int, after[1]);
+            conditions.push(`(Telemetry.Timestamp > @afterTime OR (Telemetry.Timestamp = @afterTime AND Telemetry.ID > @afterId))`);
+        }
+
+        request.input('limit', sql.Int, limit + 1); // One more tells whether there is a next page
+        const result = await request.query(`
+            SELECT TOP (@limit) ID, DeviceID, Channel, Status, Timestamp
+            FROM Telemetry
+            ${whereClause(conditions)}
+            ORDER BY Timestamp, ID
+        `);
+
+        const rows = result.recordset.slice(0, limit);
+        const last = rows[rows.length - 1];
+        res.json({
+            rows: rows.map(row => ({
+                id: row.ID,
+                deviceId: row.DeviceID,
+                channel: row.Channel,
+                status: row.Status,
+                timestamp: row.Timestamp.toISOString()
+            })),
+            cursor: result.recordset.length > limit
+                ? Buffer.from(JSON.stringify([last.Timestamp.toISOString(), last.ID])).toString('base64url')
+                : null
+        });
+    } catch (error) {
+        console.error("Error fetching history:", error);
+        res.status(500).json({
+            error: 'Error fetching history',
+            details: error.message
+        });
+    }
+});
+
 server.get('/api/last-status', async (req, res) => {
     try {
         const pool = await poolPromise;
-        const result = await pool.request().query(`SELECT TOP 1 Status FROM Telemetry ORDER BY ID DESC`);
+        const request = pool.request();
+        const conditions = roomConditions(req, res, request, 'RoomState');
+        if (!conditions) {
+            return;
+        }
+        const result = await request.query(`SELECT TOP 1 Status FROM RoomState ${whereClause(conditions)} ORDER BY Since DESC`);
         
         console.log("DB Result:", result.recordset);
         res.json({ occupied: result.recordset[0]?.Status ?? null });
@@ -47,14 +253,36 @@ server.get('/api/last-status', async (req, res) => {
     }
 });
 
+// Server-sent events: a snapshot of every room, then each room that changes status
+server.get('/api/status-stream', (req, res) => {
+    res.writeHead(200, {
+        'Content-Type': 'text/event-stream',
+        'Cache-Control': 'no-cache',
+        'Connection': 'keep-alive'
+    });
+    res.write(`retry: 2000\nevent: snapshot\ndata: ${JSON.stringify(statusCache.snapshot())}\n\n`);
+
+    const unsubscribe = statusCache.subscribe(change => res.write(`event: room\ndata: ${JSON.stringify(change)}\n\n`));
+    const keepAlive = setInterval(() => res.write(': keep-alive\n\n'), statusKeepAliveMs); // For proxies that close idle connections
+    req.on('close', () => {
+        unsubscribe();
+        clearInterval(keepAlive);
+    });
+});
+
 server.get('/api/last-occupied-time', async (req, res) => {
     try {
         const pool = await poolPromise;  // Koristi connection pool
-        const result = await pool.request().query(`
-            SELECT TOP 1 CONVERT(VARCHAR, Timestamp, 126) AS LastOccupiedTimeUTC
-            FROM Telemetry
-            WHERE Status = 1
-            ORDER BY Timestamp DESC
+        const request = pool.request();
+        const conditions = roomConditions(req, res, request, 'OccupancySession');
+        if (!conditions) {
+            return;
+        }
+        const result = await request.query(`
+            SELECT TOP 1 CONVERT(VARCHAR, StartTime, 126) AS LastOccupiedTimeUTC
+            FROM OccupancySession
+            ${whereClause(conditions)}
+            ORDER BY StartTime DESC
         `);
         
         res.json({ lastOccupiedTime: result.recordset[0]?.LastOccupiedTimeUTC ?? null });
@@ -67,11 +295,29 @@ server.get('/api/last-occupied-time', async (req, res) => {
 server.get('/api/peak-time', async (req, res) => {
     try {
         const pool = await poolPromise;
-        const result = await pool.request().query(`
-            SELECT DATEPART(HOUR, Timestamp) AS Hour, COUNT(*) AS Count
-            FROM Telemetry 
-            WHERE Status = 0
-            GROUP BY DATEPART(HOUR, Timestamp)
+        const request = pool.request();
+        const conditions = roomConditions(req, res, request, 'Hours');
+        if (!conditions) {
+            return;
+        }
+        // Rooms that send hour summaries are counted from them, the others from the rollup
+        const result = await request.query(`
+            SELECT Hour, SUM(Sessions) AS Count
+            FROM (
+                SELECT DeviceID, Channel, DATEPART(HOUR, Start) AS Hour, Sessions
+                FROM OccupancySummary
+                WHERE Daily = 0
+                UNION ALL
+                SELECT DeviceID, Channel, Hour, Sessions
+                FROM OccupancyHourOfDay
+                WHERE NOT EXISTS (SELECT 1 FROM OccupancySummary
+                                  WHERE OccupancySummary.DeviceID = OccupancyHourOfDay.DeviceID
+                                  AND OccupancySummary.Channel = OccupancyHourOfDay.Channel
+                                  AND OccupancySummary.Daily = 0)
+            ) AS Hours
+            ${whereClause(conditions)}
+            GROUP BY Hour
+            HAVING SUM(Sessions) > 0
             ORDER BY Hour ASC
         `);
         res.json(result.recordset);
@@ -87,20 +333,15 @@ server.get('/api/peak-time', async (req, res) => {
 server.get('/api/average-occupancy', async (req, res) => {
     try {
         const pool = await poolPromise;
-        const result = await pool.request().query(`
-            WITH CTE AS (
-                SELECT 
-                    t1.Timestamp AS StartTime,
-                    MIN(t2.Timestamp) AS EndTime
-                FROM Telemetry t1
-                JOIN Telemetry t2 
-                    ON t1.ID < t2.ID 
-                    AND t1.Status = 1 
-                    AND t2.Status = 0
-                    AND t2.Timestamp > t1.Timestamp
-                GROUP BY t1.Timestamp
-            )
-            SELECT AVG(DATEDIFF(SECOND, StartTime, EndTime)) AS AvgTimeSeconds FROM CTE;
+        const request = pool.request();
+        const conditions = roomConditions(req, res, request, 'RoomState');
+        if (!conditions) {
+            return;
+        }
+        const result = await request.query(`
+            SELECT CAST(SUM(SessionSeconds) / NULLIF(SUM(SessionCount), 0) AS INT) AS AvgTimeSeconds
+            FROM RoomState
+            ${whereClause(conditions)}
         `);
         res.json({ avg_time_seconds: result.recordset[0]?.AvgTimeSeconds ?? "N/A" });
     } catch (error) {
@@ -121,21 +362,28 @@ server.get('/api/daily-summary', async (req, res) => {
     try {
         const pool = await poolPromise;  // Koristi connection pool
         const request = pool.request();
+        const conditions = roomConditions(req, res, request, 'Days');
+        if (!conditions) {
+            return;
+        }
         request.input('date', sql.Date, date);
 
+        // A room's day summary where the device sent one, otherwise the rollup
         const result = await request.query(`
-            WITH Occupancy AS (
-                SELECT 
-                    Timestamp,
-                    Status,
-                    LEAD(Timestamp) OVER (ORDER BY Timestamp) AS NextTimestamp
-                FROM Telemetry
-                WHERE CAST(Timestamp AS DATE) = @date
-            )
-            SELECT 
-                SUM(DATEDIFF(MINUTE, Timestamp, NextTimestamp)) AS TotalOccupiedMinutes
-            FROM Occupancy
-            WHERE Status = 0
+            SELECT SUM(OccupiedSeconds) / 60 AS TotalOccupiedMinutes
+            FROM (
+                SELECT DeviceID, Channel, OccupiedSeconds
+                FROM OccupancySummary
+                WHERE Daily = 1 AND Start = @date
+                UNION ALL
+                SELECT DeviceID, Channel, OccupiedSeconds
+                FROM OccupancyDaily
+                WHERE Day = @date AND NOT EXISTS (SELECT 1 FROM OccupancySummary
+                                                  WHERE OccupancySummary.DeviceID = OccupancyDaily.DeviceID
+                                                  AND OccupancySummary.Channel = OccupancyDaily.Channel
+                                                  AND OccupancySummary.Daily = 1 AND OccupancySummary.Start = @date)
+            ) AS Days
+            ${whereClause(conditions)}
         `);
 
         res.json({ totalOccupiedMinutes: result.recordset[0]?.TotalOccupiedMinutes ?? 0 });
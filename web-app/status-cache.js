@@ -0,0 +1,123 @@
+// Current state of every room, kept in memory and shared by all dashboard viewers, so that
+// their number does not change the database load.
+//
+// Two sources keep it up to date:
+// - applyTelemetry() takes each message as it is ingested (POST /api/ingest), for status
+//   changes that show up as soon as the device sends them;
+// - refresh() reads the RoomState rows changed since the last read, one indexed query however
+//   many viewers there are. It catches whatever did not come through the ingest hook.
+//
+// Both follow the rules of ApplyTransition in schema.sql: a transition to the status a room is
+// already in, or one older than its last transition, changes nothing. Listeners get each room
+// that changed status, with the average session length over all rooms.
+
+const sql = require('mssql');
+const { roomId } = require('./telemetry-decoder');
+
+function createStatusCache() {
+    const rooms = new Map(); // roomId -> { room, deviceId, channel, occupied, since, sessionCount, sessionSeconds }
+    const listeners = new Set();
+    const totals = { sessionCount: 0, sessionSeconds: 0 };
+    let version = null; // Highest RoomState.Version read
+
+    function averageSeconds() {
+        return totals.sessionCount ? Math.floor(totals.sessionSeconds / totals.sessionCount) : null;
+    }
+
+    function view(state) {
+        return {
+            room: state.room,
+            deviceId: state.deviceId,
+            channel: state.channel,
+            occupied: state.occupied,
+            since: state.since.toISOString()
+        };
+    }
+
+    function setTotals(state, sessionCount, sessionSeconds) {
+        totals.sessionCount += sessionCount - state.sessionCount;
+        totals.sessionSeconds += sessionSeconds - state.sessionSeconds;
+        state.sessionCount = sessionCount;
+        state.sessionSeconds = sessionSeconds;
+    }
+
+    function roomState(deviceId, channel, since) {
+        const room = roomId(deviceId, channel);
+        let state = rooms.get(room);
+        if (!state) {
+            state = { room, deviceId, channel, occupied: false, since, sessionCount: 0, sessionSeconds: 0 };
+            rooms.set(room, state);
+        }
+        return state;
+    }
+
+    function notify(state) {
+        const change = { ...view(state), averageSeconds: averageSeconds() };
+        listeners.forEach(listener => listener(change));
+    }
+
+    // One transition of a room, as the device sent it
+    function applyTransition(deviceId, channel, occupied, timestamp) {
+        const state = roomState(deviceId, channel, timestamp);
+        if (occupied === state.occupied || timestamp < state.since) {
+            return;
+        }
+        if (!occupied) {
+            const seconds = Math.floor((timestamp - state.since) / 1000);
+            setTotals(state, state.sessionCount + 1, state.sessionSeconds + seconds);
+        }
+        state.occupied = occupied;
+        state.since = timestamp;
+        notify(state);
+    }
+
+    // telemetry: what decodeTelemetry() returns. CBOR messages of devices it has no DeviceID for
+    // are left to refresh().
+    function applyTelemetry(telemetry) {
+        if (!telemetry.deviceId) {
+            return;
+        }
+        telemetry.events
+            .filter(event => !event.Heartbeat)
+            .forEach(event => applyTransition(telemetry.deviceId, event.Channel, event.Status, new Date(event.Timestamp)));
+    }
+
+    // The RoomState rows written since the last call, all of them the first time
+    async function refresh(pool) {
+        const request = pool.request();
+        let query = `SELECT DeviceID, Channel, Status, Since, SessionCount, SessionSeconds, Version FROM RoomState`;
+        if (version) {
+            request.input('version', sql.Binary(8), version);
+            query += ` WHERE Version > @version`;
+        }
+        const result = await request.query(query);
+
+        result.recordset.forEach(row => {
+            if (!version || Buffer.compare(row.Version, version) > 0) {
+                version = row.Version;
+            }
+            const state = roomState(row.DeviceID, row.Channel, row.Since);
+            setTotals(state, row.SessionCount, Number(row.SessionSeconds));
+            if (row.Since < state.since || (row.Since.getTime() === state.since.getTime() && row.Status === state.occupied)) {
+                return; // Already known from the ingest hook
+            }
+            state.occupied = row.Status;
+            state.since = row.Since;
+            notify(state);
+        });
+    }
+
+    function snapshot() {
+        return { rooms: Array.from(rooms.values(), view), averageSeconds: averageSeconds() };
+    }
+
+    // Returns the function that unsubscribes
+    function subscribe(listener) {
+        listeners.add(listener);
+        return () => listeners.delete(listener);
+    }
+
+    return { applyTelemetry, refresh, snapshot, subscribe };
+}
+
+module.exports = { createStatusCache };
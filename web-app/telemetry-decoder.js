@@ -0,0 +1,165 @@
+// Reference decoder for the telemetry the ESP32 sends, in either encoding (see "Telemetry
+// encodings" in README.md). Both come out in the same shape:
+//
+//   { deviceId, deviceIndex, events: [{ Channel, Status, Heartbeat, Timestamp }],
+//     summaries: [{ Channel, Summary, Start, Sessions, OccupiedSeconds, LongestSeconds, Hourly }] }
+//
+// A message holds either events or one occupancy summary (Summary "hour" or "day", Hourly
+// only for days), the other array is empty.
+//
+// Channel is the room or zone on a multi-sensor board (0 on single-sensor boards, whose
+// payloads do not mention it); roomId() gives each channel its own ID to store rows under.
+//
+// Timestamp is the ISO string the JSON firmware sends (UTC + 1 h, written with a "Z"), so rows
+// stored from CBOR and from JSON payloads stay comparable. Heartbeats are not transitions and
+// must not be stored as Telemetry rows.
+
+const CBOR_OCCUPIED = 0x01;
+const CBOR_HEARTBEAT = 0x02;
+const CBOR_CHANNEL_SHIFT = 2; // The flags above the two bits carry the channel
+const TIMESTAMP_SHIFT_SECONDS = 3600; // Same shift as getISO8601Timestamp() on the device
+
+function formatTimestamp(epochSeconds) {
+    return new Date((epochSeconds + TIMESTAMP_SHIFT_SECONDS) * 1000).toISOString().replace('.000Z', 'Z');
+}
+
+// Reads one integer (major type 0 or 1) at offset, returns [value, next offset]
+function readInt(bytes, offset) {
+    if (offset >= bytes.length) {
+        throw new Error('Truncated CBOR payload');
+    }
+
+    const initial = bytes[offset++];
+    const major = initial >> 5;
+    const info = initial & 0x1f;
+    if (major > 1 || info > 27) {
+        throw new Error(`Unexpected CBOR item 0x${initial.toString(16)}`);
+    }
+
+    let argument = info;
+    if (info >= 24) {
+        const length = 1 << (info - 24);
+        if (offset + length > bytes.length) {
+            throw new Error('Truncated CBOR payload');
+        }
+        argument = 0;
+        for (let i = 0; i < length; i++) {
+            argument = argument * 256 + bytes[offset++];
+        }
+    }
+
+    return [major === 1 ? -1 - argument : argument, offset];
+}
+
+// [deviceIndex, period, channel, start, sessions, occupiedSeconds, longestSeconds(, [24 x seconds])]
+function decodeCborSummary(bytes, deviceIds) {
+    const items = bytes[0] & 0x1f;
+    if (items !== 7 && items !== 8) {
+        throw new Error('Not a telemetry CBOR payload');
+    }
+
+    let offset = 1;
+    const fields = [];
+    for (let i = 0; i < 7; i++) {
+        let value;
+        [value, offset] = readInt(bytes, offset);
+        fields.push(value);
+    }
+    const [deviceIndex, period, channel, start, sessions, occupiedSeconds, longestSeconds] = fields;
+
+    let hourly;
+    if (items === 8) {
+        if (bytes[offset] !== 0x98 || bytes[offset + 1] !== 24) {
+            throw new Error('Malformed hourly figures in CBOR summary');
+        }
+        offset += 2;
+        hourly = [];
+        for (let hour = 0; hour < 24; hour++) {
+            let seconds;
+            [seconds, offset] = readInt(bytes, offset);
+            hourly.push(seconds);
+        }
+    }
+
+    const summary = {
+        Channel: channel,
+        Summary: period === 1 ? 'day' : 'hour',
+        Start: formatTimestamp(start),
+        Sessions: sessions,
+        OccupiedSeconds: occupiedSeconds,
+        LongestSeconds: longestSeconds
+    };
+    if (hourly) {
+        summary.Hourly = hourly;
+    }
+    return { deviceId: deviceIds[deviceIndex] ?? null, deviceIndex, events: [], summaries: [summary] };
+}
+
+// [_ deviceIndex, timestamp, flags, offset, flags, ...], or a summary (definite-length array)
+function decodeCbor(bytes, deviceIds) {
+    if (bytes.length > 0 && bytes[0] >> 5 === 4 && bytes[0] !== 0x9f) {
+        return decodeCborSummary(bytes, deviceIds);
+    }
+    if (bytes.length < 2 || bytes[0] !== 0x9f || bytes[bytes.length - 1] !== 0xff) {
+        throw new Error('Not a telemetry CBOR payload');
+    }
+
+    let offset = 1;
+    let deviceIndex, firstTime, time, flags;
+    [deviceIndex, offset] = readInt(bytes, offset);
+
+    const events = [];
+    while (offset < bytes.length - 1) {
+        [time, offset] = readInt(bytes, offset);
+        [flags, offset] = readInt(bytes, offset);
+
+        firstTime = events.length === 0 ? time : firstTime;
+        events.push({
+            Channel: flags >> CBOR_CHANNEL_SHIFT,
+            Status: (flags & CBOR_OCCUPIED) !== 0,
+            Heartbeat: (flags & CBOR_HEARTBEAT) !== 0,
+            Timestamp: formatTimestamp(events.length === 0 ? time : firstTime + time)
+        });
+    }
+
+    return { deviceId: deviceIds[deviceIndex] ?? null, deviceIndex, events, summaries: [] };
+}
+
+function decodeJson(text) {
+    const data = JSON.parse(text);
+    if (typeof data.Summary === 'string') {
+        const { DeviceID, ...summary } = data;
+        summary.Channel = Number.isInteger(data.Channel) ? data.Channel : 0;
+        return { deviceId: DeviceID, deviceIndex: null, events: [], summaries: [summary] };
+    }
+
+    const entries = Array.isArray(data.Batch) ? data.Batch : [data];
+
+    return {
+        deviceId: data.DeviceID,
+        deviceIndex: null,
+        events: entries.map(entry => ({
+            Channel: Number.isInteger(entry.Channel) ? entry.Channel : 0,
+            Status: entry.Status === true,
+            Heartbeat: entry.Heartbeat === true,
+            Timestamp: entry.Timestamp
+        })),
+        summaries: []
+    };
+}
+
+// body: Buffer with the message, contentType: the $.ct property (or HTTP Content-Type),
+// deviceIds: deviceIndex -> DeviceID for CBOR payloads
+function decodeTelemetry(body, contentType, deviceIds = {}) {
+    if ((contentType || '').startsWith('application/cbor')) {
+        return decodeCbor(body, deviceIds);
+    }
+    return decodeJson(body.toString('utf8'));
+}
+
+// Channel 0 keeps the device's own ID, so single-sensor rooms stay what they were
+function roomId(deviceId, channel) {
+    return channel ? `${deviceId}/${channel}` : deviceId;
+}
+
+module.exports = { decodeTelemetry, roomId };